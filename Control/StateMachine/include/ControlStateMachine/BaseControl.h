@@ -4,9 +4,12 @@
 #include <atomic>
 #include <memory>
 
+#include "ControlStateMachine/CommandEnvelope.h"
+
 class RuntimeControlledObjectPrivate;
 class ControlStateMachine;
 class Directory;
+class DirectoryConfig;
 
 
 // Implementation of a typical O2 control state machine
@@ -19,10 +22,13 @@ class Directory;
 // - iterateRunning() is called continuously in a loop in the state 'running'. It should return briefly (<1second).
 // - iterateCheck() is called periodically in all states, in order to allow
 //   self-triggered state change to error. If an exception is thrown, the object goes to 'error'.
+//   It is disabled by default: objects needing it set the interval with setCheckInterval().
 // - getState / setState allow to retrieve and change the current object state.
 //   The new state is actually propagated only when the execute* or iterate* method returns.
 // - getName: get the name of the object. Needed to uniquely identify the instance, so that it can
 //   configure accordingly.
+// - getCommand: the command being executed, with its parameters when sent as a CommandEnvelope
+//   (e.g. "start" with an event size). Valid only in the execute*() methods.
 
 
 // passive class, to be activated in a state machine engine
@@ -40,6 +46,8 @@ class RuntimeControlledObject {
   const std::string getName();
   
   t_State getState();
+  
+  const CommandView &getCommand();  // command being executed, with its parameters. Valid in execute*() methods.
    
   virtual int executePrepare(); // to go from standby to ready
   virtual int executeReset();   // to go from ready/error to standby
@@ -49,7 +57,9 @@ class RuntimeControlledObject {
   virtual int executeResume();  // to go from paused to running
   
   virtual int iterateRunning();  // called continuously in state 'running'
-  virtual int iterateCheck();    // called periodically in any state
+  virtual int iterateCheck();    // called periodically in any state, if enabled with setCheckInterval()
+  
+  void setCheckInterval(int milliseconds);  // interval between iterateCheck() calls (0: never, the default). To be set before registration to the engine.
   
   private:
   RuntimeControlledObjectPrivate *dPtr;
@@ -60,10 +70,13 @@ class RuntimeControlledObject {
 
 class RuntimeControlEngine {
   public:
-  RuntimeControlEngine();
+  RuntimeControlEngine();                             // use default directory (zookeeper on localhost)
+  RuntimeControlEngine(const DirectoryConfig &cfg, int nThreads=0);   // use given directory, and given number of worker threads (0: one per CPU core)
   ~RuntimeControlEngine();
 
-  int registerObject(RuntimeControlledObject *o);
+  // add an object to the engine. Objects are executed in parallel by the engine thread pool,
+  // or if ownThread set by a thread dedicated to this object.
+  int registerObject(RuntimeControlledObject *o, bool ownThread=false);
   
   private:
   class Impl;
@@ -0,0 +1,313 @@
+/// \file  CommandEnvelope.h
+/// \brief Binary command payload: command name, sequence, deadline, correlation id, and typed key/value parameters.
+///
+/// Commands are sent through the directory as node values (c.f. ControlClient::sendCommand).
+/// A plain string is a command without parameters. A CommandEnvelope allows to send parameters
+/// together with the command (e.g. "start" with an event size), in a single node.
+///
+/// - CommandEnvelope: build and encode a command (sender side).
+/// - CommandView: decode a command in place, without copy or allocation (receiver side).
+///   Strings returned point into the buffer given, which must stay valid while the view is used.
+///
+/// Encoding (integers little-endian, strings followed by a NUL byte not counted in their length):
+///   magic          4 bytes  0x00 'C' 'E' version
+///   sequence       8 bytes  set by sender, e.g. to match replies
+///   deadline       8 bytes  microseconds since epoch after which command should not be executed (0: none)
+///   command        2 bytes length + string
+///   correlationId  2 bytes length + string (empty: none)
+///   nParameters    2 bytes
+///   parameters     type (1 byte) + key (2 bytes length + string) + value
+///                  value: int64 and double 8 bytes, string 4 bytes length + string
+/// The first byte being 0, an envelope can not be confused with a plain string command.
+///
+/// Example:
+///   CommandEnvelope c("start");
+///   c.addParameter("eventSize",(int64_t)1024);
+///   client.sendCommand(c);
+///   ...
+///   CommandView v(value);
+///   int64_t eventSize;
+///   if ((v.isValid())&&(v.getParameter("eventSize",eventSize)==0)) { ... }
+
+#ifndef CONTROL_STATEMACHINE_COMMANDENVELOPE_H
+#define CONTROL_STATEMACHINE_COMMANDENVELOPE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+
+const uint8_t kCommandEnvelopeVersion=1;
+
+
+/// build a binary command
+class CommandEnvelope {
+  public:
+  enum ParameterType {typeInt=1, typeDouble=2, typeString=3};
+
+  CommandEnvelope(const std::string command="") {
+    mCommand=command;
+    mSequence=0;
+    mDeadline=0;
+    mNumberOfParameters=0;
+  }
+
+  void setCommand(const std::string &command) {mCommand=command;}
+  void setSequence(uint64_t sequence) {mSequence=sequence;}
+  void setDeadline(uint64_t deadline) {mDeadline=deadline;}   ///< microseconds since epoch (0: none)
+  void setCorrelationId(const std::string &id) {mCorrelationId=id;}
+
+  void addParameter(const std::string &key, int64_t value) {
+    putHeader(typeInt,key);
+    putInt(value,8);
+  }
+  void addParameter(const std::string &key, double value) {
+    uint64_t v;
+    memcpy(&v,&value,sizeof(v));
+    putHeader(typeDouble,key);
+    putInt(v,8);
+  }
+  void addParameter(const std::string &key, const std::string &value) {
+    putHeader(typeString,key);
+    putInt(value.length(),4);
+    mParameters.append(value);
+    mParameters.push_back(0);
+  }
+
+  /// encode command in given buffer
+  void encode(std::string &buffer) const {
+    buffer.clear();
+    buffer.reserve(32+mCommand.length()+mCorrelationId.length()+mParameters.length());
+    buffer.push_back(0);
+    buffer.push_back('C');
+    buffer.push_back('E');
+    buffer.push_back((char)kCommandEnvelopeVersion);
+    appendInt(buffer,mSequence,8);
+    appendInt(buffer,mDeadline,8);
+    appendInt(buffer,mCommand.length(),2);
+    buffer.append(mCommand);
+    buffer.push_back(0);
+    appendInt(buffer,mCorrelationId.length(),2);
+    buffer.append(mCorrelationId);
+    buffer.push_back(0);
+    appendInt(buffer,mNumberOfParameters,2);
+    buffer.append(mParameters);
+  }
+
+  std::string encode() const {
+    std::string buffer;
+    encode(buffer);
+    return buffer;
+  }
+
+  private:
+  std::string mCommand;
+  uint64_t mSequence;
+  uint64_t mDeadline;
+  std::string mCorrelationId;
+  int mNumberOfParameters;
+  std::string mParameters;    // parameters, already encoded
+
+  static void appendInt(std::string &buffer, uint64_t v, int nBytes) {
+    for (int i=0;i<nBytes;i++) {
+      buffer.push_back((char)((v>>(8*i))&0xFF));
+    }
+  }
+  void putInt(uint64_t v, int nBytes) {
+    appendInt(mParameters,v,nBytes);
+  }
+  void putHeader(ParameterType type, const std::string &key) {
+    mParameters.push_back((char)type);
+    putInt(key.length(),2);
+    mParameters.append(key);
+    mParameters.push_back(0);
+    mNumberOfParameters++;
+  }
+};
+
+
+/// decode a command in place
+class CommandView {
+  public:
+  CommandView() {
+    clear();
+  }
+  CommandView(const char *data, size_t size) {
+    parse(data,size);
+  }
+  CommandView(const std::string &data) {
+    parse(data);
+  }
+
+  /// decode given string. Returns 0 on success.
+  int parse(const std::string &data) {
+    return parse(data.data(),data.size(),true);
+  }
+
+  /// decode given buffer. Returns 0 on success.
+  /// A buffer which is not an envelope is a plain command, without parameters.
+  /// isTerminated: set if data[size] is a NUL byte (e.g. data of std::string), so that a plain command may use the whole buffer.
+  int parse(const char *data, size_t size, bool isTerminated=false) {
+    clear();
+    if (data==NULL) {return -1;}
+    if ((size<4)||(data[0]!=0)||(data[1]!='C')||(data[2]!='E')) {
+      // plain string
+      mCommand=data;
+      mCommandLength=strnlen(data,size);
+      if ((mCommandLength==size)&&(!isTerminated)) {
+        // not NUL-terminated: can not be returned in place
+        mCommand=NULL;
+        mCommandLength=0;
+        return -1;
+      }
+      mValid=true;
+      return 0;
+    }
+    if ((uint8_t)data[3]!=kCommandEnvelopeVersion) {return -1;}
+    const char *p=data+4;
+    const char *end=data+size;
+    uint64_t nParameters;
+    if ((getInt(p,end,8,mSequence))||(getInt(p,end,8,mDeadline))) {return -1;}
+    if ((getString(p,end,2,mCommand,mCommandLength))||(getString(p,end,2,mCorrelationId,mCorrelationIdLength))) {return -1;}
+    if (getInt(p,end,2,nParameters)) {return -1;}
+    // check parameters are well formed, so that accessors don't have to
+    mParameters=p;
+    for (uint64_t i=0;i<nParameters;i++) {
+      const char *key;
+      size_t keyLength;
+      if (skipParameter(p,end,key,keyLength)<0) {return -1;}
+    }
+    mParametersEnd=p;
+    mNumberOfParameters=(int)nParameters;
+    mValid=true;
+    return 0;
+  }
+
+  bool isValid() const {return mValid;}
+  const char *getCommand() const {return mValid?mCommand:"";}                  ///< command name (NUL-terminated, in place)
+  uint64_t getSequence() const {return mSequence;}
+  uint64_t getDeadline() const {return mDeadline;}                              ///< microseconds since epoch (0: none)
+  const char *getCorrelationId() const {return (mCorrelationId!=NULL)?mCorrelationId:"";}   ///< empty if none
+  int getNumberOfParameters() const {return mNumberOfParameters;}
+
+  /// forget current command (view becomes invalid)
+  void clear() {
+    mValid=false;
+    mCommand=NULL;
+    mCommandLength=0;
+    mSequence=0;
+    mDeadline=0;
+    mCorrelationId=NULL;
+    mCorrelationIdLength=0;
+    mNumberOfParameters=0;
+    mParameters=NULL;
+    mParametersEnd=NULL;
+  }
+
+  /// typed accessors: return 0 and set value if parameter exists with this type, -1 otherwise
+  int getParameter(const char *key, int64_t &value) const {
+    const char *p=findParameter(key,CommandEnvelope::typeInt);
+    uint64_t v;
+    if ((p==NULL)||(getInt(p,mParametersEnd,8,v))) {return -1;}
+    value=(int64_t)v;
+    return 0;
+  }
+  int getParameter(const char *key, double &value) const {
+    const char *p=findParameter(key,CommandEnvelope::typeDouble);
+    uint64_t v;
+    if ((p==NULL)||(getInt(p,mParametersEnd,8,v))) {return -1;}
+    memcpy(&value,&v,sizeof(value));
+    return 0;
+  }
+  int getParameter(const char *key, std::string &value) const {
+    const char *s=getString(key);
+    if (s==NULL) {return -1;}
+    value=s;
+    return 0;
+  }
+  /// string parameter (NUL-terminated, in place), or NULL if not found
+  const char *getString(const char *key) const {
+    const char *p=findParameter(key,CommandEnvelope::typeString);
+    const char *s;
+    size_t l;
+    if ((p==NULL)||(getString(p,mParametersEnd,4,s,l))) {return NULL;}
+    return s;
+  }
+
+  private:
+  bool mValid;
+  const char *mCommand;
+  size_t mCommandLength;
+  uint64_t mSequence;
+  uint64_t mDeadline;
+  const char *mCorrelationId;
+  size_t mCorrelationIdLength;
+  int mNumberOfParameters;
+  const char *mParameters;      // first parameter
+  const char *mParametersEnd;   // end of last parameter
+
+  // read a little-endian integer, and advance p. Returns 0 on success.
+  static int getInt(const char *&p, const char *end, int nBytes, uint64_t &v) {
+    if (end-p<nBytes) {return -1;}
+    v=0;
+    for (int i=0;i<nBytes;i++) {
+      v|=((uint64_t)(uint8_t)p[i])<<(8*i);
+    }
+    p+=nBytes;
+    return 0;
+  }
+
+  // read a string with a length of given size followed by NUL, and advance p. Returns 0 on success.
+  static int getString(const char *&p, const char *end, int lengthBytes, const char *&s, size_t &length) {
+    uint64_t l;
+    if (getInt(p,end,lengthBytes,l)) {return -1;}
+    if ((uint64_t)(end-p)<l+1) {return -1;}
+    if (p[l]!=0) {return -1;}
+    s=p;
+    length=l;
+    p+=l+1;
+    return 0;
+  }
+
+  // go to next parameter. Returns parameter type and key, or -1 on error.
+  static int skipParameter(const char *&p, const char *end, const char *&key, size_t &keyLength) {
+    if (p>=end) {return -1;}
+    int type=(uint8_t)*(p++);
+    if (getString(p,end,2,key,keyLength)) {return -1;}
+    uint64_t v;
+    const char *s;
+    size_t l;
+    switch (type) {
+      case CommandEnvelope::typeInt:
+      case CommandEnvelope::typeDouble:
+        if (getInt(p,end,8,v)) {return -1;}
+        break;
+      case CommandEnvelope::typeString:
+        if (getString(p,end,4,s,l)) {return -1;}
+        break;
+      default:
+        return -1;
+    }
+    return type;
+  }
+
+  // returns pointer to value of given parameter, or NULL if not found with given type
+  const char *findParameter(const char *key, int type) const {
+    if ((!mValid)||(key==NULL)) {return NULL;}
+    const char *p=mParameters;
+    for (int i=0;i<mNumberOfParameters;i++) {
+      const char *k;
+      size_t kl;
+      const char *start=p;
+      int t=skipParameter(p,mParametersEnd,k,kl);
+      if (t<0) {return NULL;}
+      if ((t==type)&&(!strcmp(k,key))) {
+        // value follows type, key length, key and NUL
+        return start+1+2+kl+1;
+      }
+    }
+    return NULL;
+  }
+};
+
+#endif
@@ -0,0 +1,61 @@
+/// \file  DirectoryBackend.h
+/// \brief Interface of the storage used by the Directory class, and available implementations
+///
+/// The backend is selected by the connection string of DirectoryConfig:
+/// - "inproc://" : directory stored in memory, shared by all the Directory instances of the process.
+/// - "unix://path" : directory stored by a local server (c.f. directoryServer), reached through unix socket at given path.
+/// - anything else : comma-separated list of zookeeper hostname:port pairs.
+///
+/// All backends provide the same semantics:
+/// - ephemeral nodes are deleted when the backend instance which created them is destroyed (or disconnected).
+/// - sequence nodes get a unique 10-digit counter appended to their name, and are ephemeral.
+/// - subscription callbacks are executed by a separate thread. Once unsubscribe() returns, the callback is not being and will not be executed.
+
+#ifndef CONTROL_STATEMACHINE_DIRECTORYBACKEND_H
+#define CONTROL_STATEMACHINE_DIRECTORYBACKEND_H
+
+#include "ControlStateMachine/StateMachine.h"
+#include <string>
+
+
+/// interface of a directory storage
+class DirectoryBackend {
+  public:
+  virtual ~DirectoryBackend() {}
+
+  virtual int createNode(const std::string &node, const std::string &value, int options)=0;   // create a node. options: Directory::NodeOption flags. Returns 0 on success.
+  virtual int setValue(const std::string &node, const std::string &value)=0;                 // set value of existing node. Returns 0 on success.
+  virtual int getValue(const std::string &node, std::string &value)=0;                       // get value of a node. Returns 0 on success.
+  virtual int deleteNode(const std::string &node)=0;                                         // delete a node. Returns 0 on success.
+
+  virtual int subscribeNode(const std::string &node, NodeCallback *callback)=0;              // callback on node created/destroyed/updated. Initial value is notified (NodeUpdated) if the node exists.
+  virtual int subscribeNewChild(const std::string &node, int purge, NodeCallback *callback)=0;  // consume children created below node: callback (NodeCreated) with child value, then child is deleted. If purge set, delete existing children first.
+  virtual int unsubscribe(NodeCallback *callback)=0;                                         // cancel all subscriptions made with given callback
+};
+
+
+/// create a backend according to connection string (see above). Throws an error string on failure.
+DirectoryBackend *createDirectoryBackend(const std::string &connection);
+
+DirectoryBackend *createDirectoryBackendZookeeper(const std::string &servers);  ///< zookeeper servers
+DirectoryBackend *createDirectoryBackendInproc();                               ///< in-process directory
+DirectoryBackend *createDirectoryBackendUnix(const std::string &socketPath);    ///< local directory server
+
+
+class DirectoryServerPrivate;
+
+/// a server giving access to an in-process directory through a unix socket.
+/// Each client connection is a separate backend instance: its ephemeral nodes are deleted on disconnection.
+class DirectoryServer {
+  public:
+  DirectoryServer(const std::string socketPath);   ///< create server listening on given socket path. Throws an error string on failure.
+  ~DirectoryServer();
+
+  int run();    ///< serve clients, until stop() is called
+  void stop();  ///< request run() to return
+
+  private:
+  DirectoryServerPrivate *dPtr;
+};
+
+#endif
@@ -3,6 +3,10 @@
 ///
 ///
 /// \author Sylvain Chapeland, CERN
+
+#ifndef CONTROL_STATEMACHINE_STATEMACHINE_H
+#define CONTROL_STATEMACHINE_STATEMACHINE_H
+
 #include <string>
 
 
@@ -10,6 +14,9 @@
 /// class for private data in Directory class
 class DirectoryPrivate;
 
+/// binary command with parameters, c.f. CommandEnvelope.h
+class CommandEnvelope;
+
 
 
 /// configuration parameters for central directory access
@@ -17,7 +24,9 @@ class DirectoryConfig {
   public:
 
   /// constructor.
-  /// \param zookeeperServer : zookeeper connection string, as accepted by zookeeper_init(), i.e. comma-separated list of hostname:port pairs
+  /// \param zookeeperServer : zookeeper connection string, as accepted by zookeeper_init(), i.e. comma-separated list of hostname:port pairs.
+  ///                          Other backends may be used instead of zookeeper: "inproc://" for a directory in process memory,
+  ///                          or "unix://path" for a local directory server, c.f. DirectoryBackend.h
   DirectoryConfig(
     const char* zookeeperServer = ""
   );
@@ -30,7 +39,7 @@ class DirectoryConfig {
 
   friend class DirectoryPrivate;
   protected:
-  std::string zookeeperServer;  ///< path to the server(s), c.f. zookeeper_init() 1st parameter
+  std::string zookeeperServer;  ///< path to the server(s), c.f. zookeeper_init() 1st parameter, or other backend
 };
 
 
@@ -45,6 +54,8 @@ public:
 };
 
 /// creates an access to the central directory
+/// The underlying connection is shared by all the Directory instances of the process using the same server.
+/// Each instance keeps track of its subscriptions and ephemeral nodes, which are removed when it is destroyed.
 class Directory {
   public:
   /// constructor
@@ -54,17 +65,20 @@ class Directory {
   ~Directory();
   
   enum NodeOption {
-    ephemeral=1, sequence=2
+    ephemeral=1, sequence=2, async=4    // async: return without waiting for the node creation to complete
   };
 
   
   int CreateNode(const std::string node, const std::string value, int options=0);            // create a node in the directory tree (permanent by default, or persistent until process disconnects if isEphemeral set). node is assigned an initial value.
   int SubscribeNewChild(const std::string node, int purge=0, NodeCallback *callback=NULL);   // subsribe to new child nodes created below given node. If purge set, delete existing sub-nodes. If callback set, function will be called accordingly
   int SubscribeNode(const std::string node, NodeCallback *callback=NULL);                    // subscribe to node value update.
+  int Unsubscribe(NodeCallback *callback);                                                   // cancel subscriptions made with given callback. On return, it is not being and will not be called anymore.
     
    
   int SetValue(const std::string node, const std::string value);                         // set value of a node
-  int GetValue(const std::string node, std::string &value);                              // get value of a node
+  int GetValue(const std::string node, std::string &value);                              // get value of a node. Returns 0 on success. Values are cached locally after the first read, and kept up to date by subscription: changes made through other Directory instances are seen once notified.
+  int DeleteNode(const std::string node);                                                // delete a node
+  int GetCacheStats(unsigned long &hits, unsigned long &misses);                         // number of GetValue() calls served from the local cache (hits), or from the directory storage (misses)
   
   private:
   DirectoryPrivate *dPtr; ///< private class data
@@ -80,7 +94,7 @@ class ControlObject {
   ControlObject(const std::string objectName, Directory * dir);     /// create a control object with given name, using given directory
   virtual ~ControlObject();                                         /// destroy a control object
   
-  virtual void executeCommand(const std::string command);
+  virtual void executeCommand(const std::string command);   // command received: plain string, or binary envelope (decode with CommandView, c.f. CommandEnvelope.h)
   int getState(std::string &currentState);
   int setState(const std::string newState);
   
@@ -98,6 +112,7 @@ class ControlClient {
   ~ControlClient();
   
   int sendCommand(const std::string command);
+  int sendCommand(const CommandEnvelope &command);    // send a command with parameters
   int getState(std::string &currentState);
 
   virtual void objectCreatedCallback();
@@ -109,3 +124,4 @@ class ControlClient {
   ControlPrivate *dPtr; ///< private class data
 };
 
+#endif
@@ -0,0 +1,99 @@
+/// \file  TransitionTable.h
+/// \brief Compile-time tables for state machines: state/command names, and state transitions.
+///
+/// States and commands are enums with consecutive values starting at 0.
+/// - EnumNames: conversion between enum values and their names. Names are looked up once
+///   (e.g. when a command is received), the enum value is used afterwards.
+/// - TransitionTable: next state for a given (state, command) pair, built at compile time
+///   from a list of transitions. Lookup is a single array access.
+///
+/// Example:
+///   enum class myState {undefined, idle, busy};
+///   enum class myCommand {undefined, go, done};
+///   constexpr EnumNames<myState,3> myStateNames({"UNDEFINED","IDLE","BUSY"});
+///   constexpr Transition<myState,myCommand> myTransitions[]={
+///     {myState::idle, myCommand::go, myState::busy},
+///     {myState::busy, myCommand::done, myState::idle},
+///   };
+///   constexpr TransitionTable<myState,myCommand,3,3> myTable(myTransitions,myState::undefined);
+///   static_assert(myTable.next(myState::idle,myCommand::go)==myState::busy,"");
+///
+/// This header has no dependency, and is used by both StateMachine and Zdaq modules.
+
+#ifndef CONTROL_STATEMACHINE_TRANSITIONTABLE_H
+#define CONTROL_STATEMACHINE_TRANSITIONTABLE_H
+
+#include <stddef.h>
+#include <string.h>
+
+
+/// names of the values of an enum with N consecutive values starting at 0
+template <typename E, size_t N> class EnumNames {
+  public:
+  constexpr EnumNames(const char *const (&names)[N]):mNames() {
+    for (size_t i=0;i<N;i++) {
+      mNames[i]=names[i];
+    }
+  }
+
+  /// name of given value (precomputed, no allocation). Returns the name of value 0 if out of range.
+  constexpr const char *getName(E e) const {
+    return ((size_t)e<N)?mNames[(size_t)e]:mNames[0];
+  }
+
+  /// value corresponding to given name. Returns value 0 if not found.
+  E getId(const char *name) const {
+    if (name!=NULL) {
+      for (size_t i=0;i<N;i++) {
+        if (!strcmp(name,mNames[i])) {
+          return (E)i;
+        }
+      }
+    }
+    return (E)0;
+  }
+
+  private:
+  const char *mNames[N];
+};
+
+
+/// a state transition: when command received in state 'from', go to state 'to'
+template <typename S, typename C> struct Transition {
+  S from;
+  C command;
+  S to;
+};
+
+
+/// state transition table, for nStates states and nCommands commands
+template <typename S, typename C, size_t nStates, size_t nCommands> class TransitionTable {
+  public:
+  /// build table from list of transitions. Pairs (state, command) not listed lead to 'invalid'.
+  template <size_t N> constexpr TransitionTable(const Transition<S,C> (&transitions)[N], S invalid):mTable(),mInvalid(invalid) {
+    for (size_t i=0;i<nStates;i++) {
+      for (size_t j=0;j<nCommands;j++) {
+        mTable[i][j]=invalid;
+      }
+    }
+    for (size_t k=0;k<N;k++) {
+      mTable[(size_t)transitions[k].from][(size_t)transitions[k].command]=transitions[k].to;
+    }
+  }
+
+  /// state reached when command received in given state, or 'invalid' if command not allowed
+  constexpr S next(S state, C command) const {
+    return (((size_t)state<nStates)&&((size_t)command<nCommands))?mTable[(size_t)state][(size_t)command]:mInvalid;
+  }
+
+  /// returns true if command allowed in given state
+  constexpr bool isValid(S state, C command) const {
+    return next(state,command)!=mInvalid;
+  }
+
+  private:
+  S mTable[nStates][nCommands];
+  S mInvalid;
+};
+
+#endif
@@ -2,16 +2,25 @@
 #include <Common/Fifo.h>
 
 #include <vector>
+#include <deque>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
 #include <stdio.h>
 #include <unistd.h>
 #include <boost/thread/mutex.hpp>
 
 #include "ControlStateMachine/BaseControl.h"
+#include "ControlStateMachine/TransitionTable.h"
 
 typedef Directory* t_ControlSystemHandle ;
 
+const int kCommandQueueDepth=64;      // maximum number of pending commands per object
+const int kCommandPayloadSize=256;    // space preallocated for each pending command (larger commands with parameters are allocated on reception)
+
 
 
 
@@ -22,6 +31,7 @@ class RuntimeControlledObjectPrivate {
   RuntimeControlledObjectPrivate(const std::string objectName) {
     mCurrentState=t_State::undefined;
     mName=objectName;
+    mCheckIntervalMs=0;
   }
   
   ~RuntimeControlledObjectPrivate() {
@@ -33,6 +43,8 @@ class RuntimeControlledObjectPrivate {
   private:
      t_State mCurrentState;
      std::string mName;
+     CommandView mCommand;    // command being executed (decoded in place from the command request)
+     int mCheckIntervalMs;    // interval between iterateCheck() calls, 0 if disabled
      int getState(t_State &currentState) {
        currentState=mCurrentState;
        return 0;
@@ -70,6 +82,10 @@ const std::string RuntimeControlledObject::getName() {
   return dPtr->mName;
 }
 
+const CommandView &RuntimeControlledObject::getCommand() {
+  return dPtr->mCommand;
+}
+
 
 int RuntimeControlledObject::executePrepare() {
   return 0;
@@ -106,43 +122,50 @@ int RuntimeControlledObject::iterateCheck() {
   return 0;
 }
 
-
-t_State getStateFromString(const std::string s) {
-  if (s=="STANDBY") {
-    return t_State::standby;
-  } else if (s=="READY") {
-    return t_State::ready;
-  } else if (s=="RUNNING") {
-    return t_State::running;
-  } else if (s=="PAUSED") {
-    return t_State::paused;
-  } else if (s=="ERROR") {
-    return t_State::error;
+void RuntimeControlledObject::setCheckInterval(int milliseconds) {
+  if (milliseconds<0) {
+    milliseconds=0;
   }
-  return t_State::undefined;
+  dPtr->mCheckIntervalMs=milliseconds;
 }
-const std::string getStringFromState(t_State s) {
-  if (s==t_State::standby) {
-    return "STANDBY";
-  } else if (s==t_State::ready) {
-    return "READY";
-  } else if (s==t_State::running) {
-    return "RUNNING";
-  } else if (s==t_State::paused) {
-    return "PAUSED";
-  } else if (s==t_State::error) {
-    return "ERROR";
-  }
-  return "UNDEFINED";
+
+
+// current time in milliseconds, from a monotonic clock
+static int64_t getTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 
+// commands accepted by ControlStateMachine
+enum class t_Command {undefined,prepare,start,stop,pause,resume,reset};
+
+// names of states and commands, as published / received through the directory
+constexpr EnumNames<t_State,6> stateNames({"UNDEFINED","STANDBY","READY","RUNNING","PAUSED","ERROR"});
+constexpr EnumNames<t_Command,7> commandNames({"undefined","prepare","start","stop","pause","resume","reset"});
+
+// state reached on successful command execution
+// if command fails, state is error
+constexpr Transition<t_State,t_Command> controlTransitions[]={
+  {t_State::standby, t_Command::prepare, t_State::ready},
+  {t_State::ready,   t_Command::start,   t_State::running},
+  {t_State::ready,   t_Command::reset,   t_State::standby},
+  {t_State::running, t_Command::stop,    t_State::ready},
+  {t_State::running, t_Command::pause,   t_State::paused},
+  {t_State::paused,  t_Command::resume,  t_State::running},
+  {t_State::paused,  t_Command::stop,    t_State::ready},
+  {t_State::error,   t_Command::reset,   t_State::standby},
+};
+constexpr TransitionTable<t_State,t_Command,6,7> controlTable(controlTransitions,t_State::undefined);
+
+
 
 // structure to hold a command execution request
+// (preallocated by each state machine, c.f. ControlStateMachine::mCommandPool)
 class CommandRequest {
   public:
   ControlStateMachine *stateMachine;
-  std::string command;
+  t_Command command;
+  std::string payload;    // command as received, with parameters (c.f. CommandEnvelope)
 };
 
 // todo: handle exceptions (what types?) of RuntimeControlledObject
@@ -150,11 +173,26 @@ class CommandRequest {
 class ControlStateMachine:public ControlObject {
   public:
 
-  ControlStateMachine(RuntimeControlledObject *objectPtr, Directory * dir ):ControlObject(objectPtr->getName(),dir) {
+  // wakeup: function called when a new command is queued, to get the object processed
+  ControlStateMachine(RuntimeControlledObject *objectPtr, Directory * dir, std::function<void(ControlStateMachine *)> wakeup):ControlObject(objectPtr->getName(),dir) {
     mObject=objectPtr;
+    mBusy=0;
+    mOwnThread=nullptr;
+    mWakeup=wakeup;
+    mNextCheck=0;
+
+    // command requests are preallocated: queue operations don't allocate memory
+    // free requests are returned by the executing thread, and taken by the thread receiving commands
+    mCommandPool.resize(kCommandQueueDepth);
+    pendingCommands=std::make_unique<AliceO2::Common::Fifo<CommandRequest*>>(kCommandQueueDepth);
+    freeCommands=std::make_unique<AliceO2::Common::Fifo<CommandRequest*>>(kCommandQueueDepth);
+    for (auto &c : mCommandPool) {
+      c.stateMachine=this;
+      c.payload.reserve(kCommandPayloadSize);
+      freeCommands->push(&c);
+    }
+
     updateState(t_State::standby);
-    
-    pendingCommands=std::make_unique<AliceO2::Common::Fifo<CommandRequest*>>(1);
   };
   
   ~ControlStateMachine() {
@@ -162,148 +200,148 @@ class ControlStateMachine:public ControlObject {
   
   // this is the callback triggered by the ControlObject
   void executeCommand(const std::string command){
-    printf("command received: %s\n",command.c_str());
-    //processStateTransition(command);
+    // command may be a plain string, or a binary envelope with parameters
+    CommandView view(command);
+    printf("command received: %s\n",view.getCommand());
+    
+    // command name converted once here, only its id is used afterwards
+    t_Command commandId=commandNames.getId(view.getCommand());
+    if (commandId==t_Command::undefined) {
+      printf("Object: %s - unknown command %s\n",mObject->getName().c_str(),view.getCommand());
+      return;
+    }
     
     //push to command queue
-    CommandRequest *newCommand=new CommandRequest();
-    newCommand->stateMachine=this;
-    newCommand->command=command;
-    if (pendingCommands->push(newCommand)) {
-      printf("%s - already busy with %d pending command(s)",mObject->getName().c_str(),pendingCommands->getNumberOfUsedSlots());
-      CommandRequest *currentCommand=nullptr;
-      pendingCommands->front(currentCommand);
-      if (currentCommand!=nullptr) {
-        printf("= %s",currentCommand->command.c_str());
-      }
-      printf("\n");
-      delete newCommand;
+    CommandRequest *newCommand=nullptr;
+    if (freeCommands->pop(newCommand)) {
+      printf("%s - command %s dropped, already %d pending command(s)\n",mObject->getName().c_str(),view.getCommand(),pendingCommands->getNumberOfUsedSlots());
+      return;
+    }
+    newCommand->command=commandId;
+    newCommand->payload=command;
+    pendingCommands->push(newCommand);
+    if (mWakeup) {
+      mWakeup(this);
     }
   }
   
-  // this is the actual method for command execution,
-  // which is called later by a dedicated execution thread
-  // todo: make sure another command not being executed already  
-  // todo: push command to a pool of "execute threads" to parallelize actions
-  void processStateTransition(const std::string command){
-    int err=0;
-    int invalidCommand=0;
+  // returns true if the object has something to execute now (pending command, or running iteration)
+  bool hasWork() {
+    return (!pendingCommands->isEmpty())||(mObject->getState()==t_State::running);
+  }
+  
+  // execute pending actions for this object: pending command, periodic actions.
+  // Called by one thread at a time (engine thread pool worker, or object own thread).
+  // Returns 1 if a command was processed, 0 otherwise.
+  int runStep() {
+    int isActive=0;
+
+    // check for commands in queue
+    CommandRequest *newCommand=nullptr;
+    pendingCommands->front(newCommand);
+    if (newCommand!=nullptr) {
+      printf("starting processing %s : %s\n",mObject->getName().c_str(),commandNames.getName(newCommand->command));        
+      newCommand->stateMachine->processStateTransition(newCommand);
+      printf("done processing %s : %s\n",mObject->getName().c_str(),commandNames.getName(newCommand->command));        
+      pendingCommands->pop(newCommand);
+      freeCommands->push(newCommand);
+      isActive=1;
+    }
+      
+    // execute periodic actions, as defined for corresponding state
+    if (mObject->getState()==t_State::running) {
+      int err=mObject->iterateRunning();
+      if (err) {
+        updateState(t_State::error);
+      }
+    }
+      
+    // execute object periodic check, in any state, when due
+    if (getCheckInterval()>0) {
+      int64_t now=getTimeMs();
+      if (now>=mNextCheck) {
+        mNextCheck=now+getCheckInterval();
+        int err=mObject->iterateCheck();
+        if (err) {
+          updateState(t_State::error);
+        }
+      }
+    }
     
+    return isActive;
+  }
+
+  // interval between object periodic checks, in milliseconds (0: no check)
+  int getCheckInterval() {
+    return mObject->dPtr->mCheckIntervalMs;
+  }
+
+  // this is the actual method for command execution,
+  // which is called later by an execution thread (c.f. runStep)
+  void processStateTransition(CommandRequest *request){
+    t_Command command=request->command;
     t_State currentState=mObject->getState();
-    t_State newState=currentState;
+    t_State newState=controlTable.next(currentState,command);
     
-    printf("Object: %s - executing command %s in state %s\n",mObject->getName().c_str(),command.c_str(),getStringFromState(currentState).c_str());
+    printf("Object: %s - executing command %s in state %s\n",mObject->getName().c_str(),commandNames.getName(command),stateNames.getName(currentState));
     
-    // STANDBY
-    if (currentState==t_State::standby) {
-      if (command=="prepare") {
-        err=mObject->executePrepare();
-        if (!err) {
-          newState=t_State::ready;
-        } else {
-          newState=t_State::error;
-        }
-      } else {
-        invalidCommand=1;
-      }        
-
-    // READY
-    } else if (currentState==t_State::ready) {
-      if (command=="start") {
-        err=mObject->executeStart();
-        if (!err) {
-          newState=t_State::running;
-        } else {
-          newState=t_State::error;
-        }
-      } else if (command=="reset") {
-        err=mObject->executeReset();
-        if (!err) {
-          newState=t_State::standby;
-        } else {
-          newState=t_State::error;
-        }
-      } else {
-        invalidCommand=1;
-      }                
-    
-    // RUNNING
-    } else if (currentState==t_State::running) {
-      if (command=="stop") {
-        err=mObject->executeStop();
-        if (!err) {
-          newState=t_State::ready;
-        } else {
-          newState=t_State::error;
-        }
-      } else if (command=="pause") {
-        err=mObject->executePause();
-        if (!err) {
-          newState=t_State::paused;
-        } else {
-          newState=t_State::error;
-        }
-      } else {
-        invalidCommand=1;
-      }                
-
-    // PAUSED
-    } else if (currentState==t_State::paused) {
-      if (command=="resume") {
-        err=mObject->executeResume();
-        if (!err) {
-          newState=t_State::running;
-        } else {
-          newState=t_State::error;
-        }
-      } else if (command=="stop") {
-        err=mObject->executeStop();
-        if (!err) {
-          newState=t_State::ready;
-        } else {
-          newState=t_State::error;
-        }
-      } else {
-        invalidCommand=1;
-      }                
-
-    // ERROR
-    } else if (currentState==t_State::error) {
-      if (command=="reset") {
-        err=mObject->executeReset();
-        if (!err) {
-          newState=t_State::standby;
-        } else {
-          newState=t_State::error;
-        }
-      } else {
-        invalidCommand=1;
+    if (newState==t_State::undefined) {
+      printf("Object: %s - invalid command %s received in state %s\n",mObject->getName().c_str(),commandNames.getName(command),stateNames.getName(currentState));
+      return;
+    }
+
+    // parameters decoded in place, available to the object with getCommand()
+    CommandView &view=mObject->dPtr->mCommand;
+    view.parse(request->payload);
+    if (view.getDeadline()!=0) {
+      uint64_t now=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      if (now>view.getDeadline()) {
+        printf("Object: %s - command %s expired (%.3fs late), ignored\n",mObject->getName().c_str(),commandNames.getName(command),(now-view.getDeadline())/1000000.0);
+        view.clear();
+        return;
       }
-    
-    // other
-    } else {
-      invalidCommand=1;
     }
-    
-    if (invalidCommand) {
-      printf("Object: %s - invalid command %s received in state %s\n",mObject->getName().c_str(),command.c_str(),getStringFromState(currentState).c_str());
-    } else {
-      printf("Object: %s - command %s executed in state %s. New state: %s\n",mObject->getName().c_str(),command.c_str(),getStringFromState(currentState).c_str(),getStringFromState(newState).c_str());
-      updateState(newState);
+
+    int err=0;
+    switch (command) {
+      case t_Command::prepare: err=mObject->executePrepare(); break;
+      case t_Command::start:   err=mObject->executeStart(); break;
+      case t_Command::stop:    err=mObject->executeStop(); break;
+      case t_Command::pause:   err=mObject->executePause(); break;
+      case t_Command::resume:  err=mObject->executeResume(); break;
+      case t_Command::reset:   err=mObject->executeReset(); break;
+      case t_Command::undefined: break;
     }
+    if (err) {
+      newState=t_State::error;
+    }
+    
+    view.clear();
+    
+    printf("Object: %s - command %s executed in state %s. New state: %s\n",mObject->getName().c_str(),commandNames.getName(command),stateNames.getName(currentState),stateNames.getName(newState));
+    updateState(newState);
   };
   
   private:
     RuntimeControlledObject *mObject;  // stores pointer to instance of object implementing the commands
     
     void updateState(t_State s) {
-      setState(getStringFromState(s));
+      setState(stateNames.getName(s));
       // todo: check if error
       mObject->dPtr->setState(s);
-      printf("Object: %s - updating state = %s\n",mObject->getName().c_str(),getStringFromState(s).c_str());
+      printf("Object: %s - updating state = %s\n",mObject->getName().c_str(),stateNames.getName(s));
     }
     
-    std::unique_ptr<AliceO2::Common::Fifo<CommandRequest*>> pendingCommands;
+    std::vector<CommandRequest> mCommandPool;                                // preallocated command requests
+    std::unique_ptr<AliceO2::Common::Fifo<CommandRequest*>> pendingCommands; // commands to be executed
+    std::unique_ptr<AliceO2::Common::Fifo<CommandRequest*>> freeCommands;    // unused items of mCommandPool
+    std::function<void(ControlStateMachine *)> mWakeup;
+    
+    std::atomic<int> mBusy;                   // set while object queued or being processed by the engine thread pool
+    std::atomic<int64_t> mNextCheck;          // time of next iterateCheck() call (c.f. getTimeMs)
+    std::unique_ptr<std::thread> mOwnThread;  // dedicated thread, if object not handled by the engine thread pool
+    std::mutex mOwnThreadMutex;               // to wake up dedicated thread
+    std::condition_variable mOwnThreadCond;   // signaled when a command is queued, or on exit
 
   friend class RuntimeControlEngine;
 };
@@ -313,7 +351,10 @@ class ControlStateMachine:public ControlObject {
 // A state machine engine to control/activate the RuntimeControlledObject instances at runtime
 // instead of having a single 'control thread' per object, there is a single engine to control them in
 // parallel: trigger action on commands and advertise state
-// Can be implemented by a pool of threads.
+// Objects are executed by a pool of worker threads, so that objects progress in parallel.
+// A given object is processed by one worker at a time. Objects may also be run by their own thread.
+// Objects are queued for execution as soon as a command is received, and kept in the queue while running.
+// The engine thread queues idle objects for iterateCheck(), only those which enabled it: otherwise, it just waits for exit.
 
 // Can itself advertise a "master" control object through which one can control all sub-objects
 
@@ -334,47 +375,170 @@ class RuntimeControlEngine::Impl {
   
   boost::mutex mMutex;
   
+  // thread pool executing ControlStateMachine::runStep()
+  std::vector<std::thread> mWorkers;
+  std::deque<ControlStateMachine *> mWorkQueue;   // objects to be processed
+  std::mutex mWorkMutex;                          // protects mWorkQueue
+  std::condition_variable mWorkCond;              // signaled when mWorkQueue filled, or on exit
+  void schedule(ControlStateMachine *sm);         // queue object for execution, unless already queued
+  void workerLoop();
+  static void ownThreadLoop(RuntimeControlEngine::Impl *engine, ControlStateMachine *sm);
+  static void wakeupOwnThread(ControlStateMachine *sm);
+  
+  std::mutex mExitMutex;                          // to wake up engine thread on exit, or on registration of an object with periodic check
+  std::condition_variable mExitCond;
+  bool mCheckListChanged;                         // set on registration of an object with periodic check (protected by mExitMutex)
 };
 
 
+void RuntimeControlEngine::Impl::schedule(ControlStateMachine *sm) {
+  if (sm->mBusy.exchange(1)) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mWorkMutex);
+    mWorkQueue.push_back(sm);
+  }
+  mWorkCond.notify_one();
+}
+
+
+void RuntimeControlEngine::Impl::workerLoop() {
+  for(;;) {
+    ControlStateMachine *sm=nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mWorkMutex);
+      mWorkCond.wait(lock,[&]{return (exitRequest!=0)||(!mWorkQueue.empty());});
+      if (exitRequest) {break;}
+      sm=mWorkQueue.front();
+      mWorkQueue.pop_front();
+    }
+    sm->runStep();
+    // release object before checking for more work, so that a command received meanwhile is not missed
+    sm->mBusy=0;
+    if (sm->hasWork()) {
+      schedule(sm);
+    }
+  }
+}
+
+
+void RuntimeControlEngine::Impl::ownThreadLoop(RuntimeControlEngine::Impl *engine, ControlStateMachine *sm) {
+  while (!engine->exitRequest) {
+    sm->runStep();
+    if (!sm->hasWork()) {
+      // wait next command, or next periodic check if enabled
+      auto wakeup=[&]{return (engine->exitRequest!=0)||(!sm->pendingCommands->isEmpty());};
+      std::unique_lock<std::mutex> lock(sm->mOwnThreadMutex);
+      if (sm->getCheckInterval()>0) {
+        int64_t delay=sm->mNextCheck-getTimeMs();
+        if (delay>0) {
+          sm->mOwnThreadCond.wait_for(lock,std::chrono::milliseconds(delay),wakeup);
+        }
+      } else {
+        sm->mOwnThreadCond.wait(lock,wakeup);
+      }
+    }
+  }
+}
+
+
+void RuntimeControlEngine::Impl::wakeupOwnThread(ControlStateMachine *sm) {
+  {
+    std::unique_lock<std::mutex> lock(sm->mOwnThreadMutex);
+  }
+  sm->mOwnThreadCond.notify_one();
+}
+
 
 
 
 
 
 
-RuntimeControlEngine::RuntimeControlEngine() {
+
+RuntimeControlEngine::RuntimeControlEngine():RuntimeControlEngine(DirectoryConfig("localhost:2181")) {
+}
+
+RuntimeControlEngine::RuntimeControlEngine(const DirectoryConfig &cfg, int nThreads) {
   pImpl=std::make_unique<RuntimeControlEngine::Impl>();
   
   pImpl->mEngineThread=nullptr;
 //  pImpl->pendingCommands=nullptr;
   pImpl->mDirectory=nullptr;
   
+  // directory created first, so that it is available when engine thread starts
+  pImpl->mDirectory=new Directory(cfg);
   
   pImpl->exitRequest=0;
-  pImpl->mEngineThread=std::make_unique<std::thread>(RuntimeControlEngine::Impl::startThread,this);
+  pImpl->mCheckListChanged=false;
 
-  DirectoryConfig dCfg("localhost:2181");
-  pImpl->mDirectory=new Directory(dCfg);
+  if (nThreads<=0) {
+    nThreads=std::thread::hardware_concurrency();
+    if (nThreads<=0) {
+      nThreads=4;
+    }
+  }
+  for (int i=0;i<nThreads;i++) {
+    pImpl->mWorkers.push_back(std::thread(&RuntimeControlEngine::Impl::workerLoop,pImpl.get()));
+  }
+  
+  pImpl->mEngineThread=std::make_unique<std::thread>(RuntimeControlEngine::Impl::startThread,this);
 }
 
 RuntimeControlEngine::~RuntimeControlEngine() {
   pImpl->exitRequest=1;
+  {
+    std::unique_lock<std::mutex> lock(pImpl->mExitMutex);
+    pImpl->mExitCond.notify_all();
+  }
   pImpl->mEngineThread->join();
+  {
+    std::unique_lock<std::mutex> lock(pImpl->mWorkMutex);
+    pImpl->mWorkCond.notify_all();
+  }
+  for (auto &w : pImpl->mWorkers) {
+    w.join();
+  }
+  for (auto &sm : pImpl->mStateMachines) {
+    if (sm->mOwnThread!=nullptr) {
+      RuntimeControlEngine::Impl::wakeupOwnThread(sm.get());
+      sm->mOwnThread->join();
+    }
+  }
+  // state machines use the directory: destroy them first
+  pImpl->mStateMachines.clear();
   delete pImpl->mDirectory;
 }
 
-int RuntimeControlEngine::registerObject(RuntimeControlledObject *o) {
-
-  // TODO: lock ! can not register before running
-  // or allow registerObj only when not running, before starting engine
+int RuntimeControlEngine::registerObject(RuntimeControlledObject *o, bool ownThread) {
+
+  std::unique_ptr<ControlStateMachine> sm;
+  if (ownThread) {
+    sm=std::make_unique<ControlStateMachine>(o, pImpl->mDirectory, RuntimeControlEngine::Impl::wakeupOwnThread);
+    // not dispatched by engine
+    sm->mBusy=1;
+    sm->mOwnThread=std::make_unique<std::thread>(RuntimeControlEngine::Impl::ownThreadLoop,pImpl.get(),sm.get());
+  } else {
+    RuntimeControlEngine::Impl *engine=pImpl.get();
+    sm=std::make_unique<ControlStateMachine>(o, pImpl->mDirectory, [engine](ControlStateMachine *s) {engine->schedule(s);});
+  }
+  ControlStateMachine *smPtr=sm.get();
   
   pImpl->mMutex.lock();
-  pImpl->mStateMachines.push_back(std::make_unique<ControlStateMachine>(o, pImpl->mDirectory));
+  pImpl->mStateMachines.push_back(std::move(sm));
   pImpl->mMutex.unlock();
   
-  // TODO: one thread per object?
-  
+  // in case commands were received before registration completed
+  if (!ownThread) {
+    pImpl->schedule(smPtr);
+    if (smPtr->getCheckInterval()>0) {
+      // engine thread to take it into account for periodic checks
+      std::unique_lock<std::mutex> lock(pImpl->mExitMutex);
+      pImpl->mCheckListChanged=true;
+      pImpl->mExitCond.notify_all();
+    }
+  }
   
   return 0;
 }
@@ -385,52 +549,41 @@ void RuntimeControlEngine::Impl::startThread(void *arg) {
   RuntimeControlEngine *dPtr;
   dPtr=(RuntimeControlEngine *)arg;
   
-  int isActive=0;
-  
   for(;;) {
-    isActive=0;
-    
+    // queue objects with a periodic check due, and find when next one is due
+    // (objects with a command pending or running are queued already)
+    int64_t now=getTimeMs();
+    int64_t nextCheck=-1;
     dPtr->pImpl->mMutex.lock();
-    
-    // process pending commands    
     for (auto& ctrlObj : dPtr->pImpl->mStateMachines) {
-
-      // check for commands in queue
-      CommandRequest *newCommand=nullptr;
-      ctrlObj->pendingCommands->front(newCommand);
-      if (newCommand!=nullptr) {
-        printf("starting processing %s : %s\n",ctrlObj->mObject->getName().c_str(),newCommand->command.c_str());        
-        newCommand->stateMachine->processStateTransition(newCommand->command);
-        printf("done processing %s : %s\n",ctrlObj->mObject->getName().c_str(),newCommand->command.c_str());        
-        ctrlObj->pendingCommands->pop(newCommand);
-        delete newCommand;
-        isActive=1;
+      int interval=ctrlObj->getCheckInterval();
+      if ((ctrlObj->mOwnThread!=nullptr)||(interval==0)) {
+        continue;
       }
-      
-      // execute periodic actions, as defined for corresponding state
-      if (ctrlObj->mObject->getState()==t_State::running) {
-        int err=ctrlObj->mObject->iterateRunning();
-        if (err) {
-          ctrlObj->updateState(t_State::error);
-        }
+      int64_t t=ctrlObj->mNextCheck;
+      if (t<=now) {
+        dPtr->pImpl->schedule(ctrlObj.get());
+        // updated when check done: look again one interval later at most
+        t=now+interval;
       }
-      
-      
-      // execute object periodic check, in any state
-      int err=ctrlObj->mObject->iterateCheck();
-      if (err) {
-        ctrlObj->updateState(t_State::error);
+      if ((nextCheck<0)||(t<nextCheck)) {
+        nextCheck=t;
       }
-      
     }
-
     dPtr->pImpl->mMutex.unlock();
 
-   
-    if (!isActive) {
-      usleep(1000);
+    // wait until next check, or exit: without periodic checks, nothing to do until then
+    {
+      std::unique_lock<std::mutex> lock(dPtr->pImpl->mExitMutex);
+      auto wakeup=[&]{return (dPtr->pImpl->exitRequest!=0)||(dPtr->pImpl->mCheckListChanged);};
+      if (nextCheck<0) {
+        dPtr->pImpl->mExitCond.wait(lock,wakeup);
+      } else {
+        dPtr->pImpl->mExitCond.wait_for(lock,std::chrono::milliseconds(nextCheck-now),wakeup);
+      }
+      dPtr->pImpl->mCheckListChanged=false;
     }
-    if (dPtr->pImpl->exitRequest) {break;}    
+    if (dPtr->pImpl->exitRequest) {break;}
   }
 }
 
@@ -460,9 +613,3 @@ int main(int argc, char **argv) {
   return 0;
 }
 */
-/*
-// TODO
-
-specify if controlled object uses self-thread or can use a pool of thread
-
-*/
@@ -0,0 +1,455 @@
+/// \file  DirectoryInproc.cxx
+/// \brief Directory backend storing data in process memory
+///
+/// The tree is shared by all the backend instances of the process. It is split in shards, each with its own lock,
+/// so that concurrent accesses to different parts of the tree do not contend. A node is stored in the shard of its parent,
+/// so that listing the children of a node involves a single shard.
+/// Parent nodes do not need to exist for children to be created.
+/// Subscription callbacks are executed by a single dispatch thread. Events of a node are queued under the lock of its shard,
+/// so that they are delivered in the order of changes.
+
+#include "ControlStateMachine/DirectoryBackend.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+
+
+namespace {
+
+const int nShards=16;   // number of independent parts of the tree
+
+// a node of the tree
+typedef struct {
+  std::string value;
+  uint64_t owner;       // id of backend instance owning the node if ephemeral, 0 otherwise
+} InprocNode;
+
+// a part of the tree
+typedef struct {
+  std::mutex mutex;                             // protects variables below
+  std::map<std::string,InprocNode> nodes;       // nodes (whose parent path hashes to this shard), by path
+  std::map<std::string,int> sequences;          // sequence counters, by parent path
+} InprocShard;
+
+// an event to be dispatched to a subscription
+const int InprocChildEvent=-1;    // event type for new children (other types are NodeCallback::NodeEventType)
+typedef struct {
+  uintptr_t token;      // subscription
+  int type;             // NodeCallback::NodeEventType, or InprocChildEvent
+  std::string path;
+  std::string value;
+} InprocEvent;
+
+
+std::string getParentPath(const std::string &path) {
+  size_t i=path.find_last_of('/');
+  if ((i==0)||(i==std::string::npos)) {
+    return "/";
+  }
+  return path.substr(0,i);
+}
+
+
+// the process-wide tree
+class InprocTree {
+  public:
+  static InprocTree *get();     // the tree is created on first use, and never destroyed
+
+  int create(const std::string &path, const std::string &value, uint64_t owner, int sequence, std::string &createdPath);
+  int set(const std::string &path, const std::string &value);
+  int get(const std::string &path, std::string &value);
+  int remove(const std::string &path, std::string *value=NULL, uint64_t owner=0);   // remove node (only if owned by given id, if non-zero)
+  int getChildren(const std::string &path, std::vector<std::string> &children);     // get path of children, in name order
+  uint64_t newOwnerId();
+
+  // subscriptions
+  uintptr_t subscribe(NodeCallback *callback, const std::string &path, int isChild);
+  void unsubscribe(uintptr_t token);
+  void post(uintptr_t token, int type, const std::string &path, const std::string &value);   // queue an event for a subscription
+  void postValue(uintptr_t token, const std::string &path);   // queue current value of node (if any) for a subscription
+
+  private:
+  InprocTree();
+  InprocShard &getShard(const std::string &path);
+  void notify(const std::string &path, int type, const std::string &value);  // queue events for a node change (called with shard locked)
+  void dispatchLoop();
+
+  InprocShard shards[nShards];
+  uint64_t lastOwnerId;
+
+  // a subscription
+  typedef struct {
+    NodeCallback *callback;
+    std::string path;
+    int isChild;
+  } Subscription;
+
+  std::mutex watchMutex;                                    // protects watches and lastToken
+  std::map<std::string,std::set<uintptr_t> > nodeWatches;   // subscriptions to node changes, by path
+  std::map<std::string,std::set<uintptr_t> > childWatches;  // subscriptions to new children, by parent path
+  uintptr_t lastToken;                                      // last subscription token allocated. Tokens are never reused.
+
+  std::recursive_mutex dispatchMutex;                       // held while callbacks execute. Protects subscriptions.
+  std::map<uintptr_t,Subscription> subscriptions;           // active subscriptions, by token
+
+  std::mutex queueMutex;                                    // protects queue
+  std::condition_variable queueCond;                        // signaled when an event is queued
+  std::deque<InprocEvent> queue;                            // events waiting dispatch
+};
+
+
+InprocTree *InprocTree::get() {
+  static InprocTree *tree=new InprocTree();
+  return tree;
+}
+
+InprocTree::InprocTree() {
+  lastOwnerId=0;
+  lastToken=0;
+  std::thread t(&InprocTree::dispatchLoop,this);
+  t.detach();
+}
+
+InprocShard &InprocTree::getShard(const std::string &path) {
+  return shards[std::hash<std::string>()(getParentPath(path))%nShards];
+}
+
+uint64_t InprocTree::newOwnerId() {
+  std::lock_guard<std::mutex> lock(watchMutex);
+  lastOwnerId++;
+  return lastOwnerId;
+}
+
+int InprocTree::create(const std::string &path, const std::string &value, uint64_t owner, int sequence, std::string &createdPath) {
+  std::string parent=getParentPath(path);
+  InprocShard &shard=getShard(path);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    createdPath=path;
+    if (sequence) {
+      char buf[16];
+      snprintf(buf,sizeof(buf),"%010d",shard.sequences[parent]++);
+      createdPath+=buf;
+    }
+    if (shard.nodes.find(createdPath)!=shard.nodes.end()) {
+      return -1;
+    }
+    InprocNode &n=shard.nodes[createdPath];
+    n.value=value;
+    n.owner=owner;
+    notify(createdPath,NodeCallback::NodeEventType::NodeCreated,value);
+    notify(parent,InprocChildEvent,"");
+  }
+  return 0;
+}
+
+int InprocTree::set(const std::string &path, const std::string &value) {
+  InprocShard &shard=getShard(path);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::map<std::string,InprocNode>::iterator it=shard.nodes.find(path);
+    if (it==shard.nodes.end()) {
+      return -1;
+    }
+    it->second.value=value;
+    notify(path,NodeCallback::NodeEventType::NodeUpdated,value);
+  }
+  return 0;
+}
+
+int InprocTree::get(const std::string &path, std::string &value) {
+  InprocShard &shard=getShard(path);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  std::map<std::string,InprocNode>::iterator it=shard.nodes.find(path);
+  if (it==shard.nodes.end()) {
+    return -1;
+  }
+  value=it->second.value;
+  return 0;
+}
+
+int InprocTree::remove(const std::string &path, std::string *value, uint64_t owner) {
+  InprocShard &shard=getShard(path);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::map<std::string,InprocNode>::iterator it=shard.nodes.find(path);
+    if (it==shard.nodes.end()) {
+      return -1;
+    }
+    if ((owner!=0)&&(it->second.owner!=owner)) {
+      return -1;
+    }
+    if (value!=NULL) {
+      value->swap(it->second.value);
+    }
+    shard.nodes.erase(it);
+    notify(path,NodeCallback::NodeEventType::NodeDestroyed,"");
+  }
+  return 0;
+}
+
+int InprocTree::getChildren(const std::string &path, std::vector<std::string> &children) {
+  children.clear();
+  std::string prefix=(path=="/")?"/":path+"/";
+  InprocShard &shard=shards[std::hash<std::string>()(path)%nShards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  for (std::map<std::string,InprocNode>::iterator it=shard.nodes.lower_bound(prefix);it!=shard.nodes.end();++it) {
+    if (it->first.compare(0,prefix.length(),prefix)!=0) {break;}
+    if (it->first.find('/',prefix.length())!=std::string::npos) {continue;}  // not a direct child
+    children.push_back(it->first);
+  }
+  return 0;
+}
+
+uintptr_t InprocTree::subscribe(NodeCallback *callback, const std::string &path, int isChild) {
+  std::lock_guard<std::recursive_mutex> lockDispatch(dispatchMutex);
+  std::lock_guard<std::mutex> lock(watchMutex);
+  lastToken++;
+  uintptr_t token=lastToken;
+  Subscription &s=subscriptions[token];
+  s.callback=callback;
+  s.path=path;
+  s.isChild=isChild;
+  if (isChild) {
+    childWatches[path].insert(token);
+  } else {
+    nodeWatches[path].insert(token);
+  }
+  return token;
+}
+
+void InprocTree::unsubscribe(uintptr_t token) {
+  std::lock_guard<std::recursive_mutex> lockDispatch(dispatchMutex);
+  std::map<uintptr_t,Subscription>::iterator it=subscriptions.find(token);
+  if (it==subscriptions.end()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(watchMutex);
+  std::map<std::string,std::set<uintptr_t> > &watches=it->second.isChild?childWatches:nodeWatches;
+  std::map<std::string,std::set<uintptr_t> >::iterator w=watches.find(it->second.path);
+  if (w!=watches.end()) {
+    w->second.erase(token);
+    if (w->second.empty()) {
+      watches.erase(w);
+    }
+  }
+  subscriptions.erase(it);
+}
+
+void InprocTree::notify(const std::string &path, int type, const std::string &value) {
+  std::vector<uintptr_t> tokens;
+  {
+    std::lock_guard<std::mutex> lock(watchMutex);
+    std::map<std::string,std::set<uintptr_t> > &watches=(type==InprocChildEvent)?childWatches:nodeWatches;
+    std::map<std::string,std::set<uintptr_t> >::iterator w=watches.find(path);
+    if (w==watches.end()) {
+      return;
+    }
+    tokens.assign(w->second.begin(),w->second.end());
+  }
+  for (unsigned int i=0;i<tokens.size();i++) {
+    post(tokens[i],type,path,value);
+  }
+}
+
+void InprocTree::post(uintptr_t token, int type, const std::string &path, const std::string &value) {
+  InprocEvent ev;
+  ev.token=token;
+  ev.type=type;
+  ev.path=path;
+  ev.value=value;
+  std::lock_guard<std::mutex> lock(queueMutex);
+  queue.push_back(ev);
+  queueCond.notify_one();
+}
+
+void InprocTree::postValue(uintptr_t token, const std::string &path) {
+  // under shard lock: not queued after the event of a later change
+  InprocShard &shard=getShard(path);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  std::map<std::string,InprocNode>::iterator it=shard.nodes.find(path);
+  if (it==shard.nodes.end()) {
+    return;
+  }
+  post(token,NodeCallback::NodeEventType::NodeUpdated,path,it->second.value);
+}
+
+void InprocTree::dispatchLoop() {
+  for (;;) {
+    InprocEvent ev;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      while (queue.empty()) {
+        queueCond.wait(lock);
+      }
+      ev=queue.front();
+      queue.pop_front();
+    }
+
+    std::lock_guard<std::recursive_mutex> lockDispatch(dispatchMutex);
+    std::map<uintptr_t,Subscription>::iterator it=subscriptions.find(ev.token);
+    if (it==subscriptions.end()) {
+      continue;   // unsubscribed in the meantime
+    }
+    NodeCallback *exe=it->second.callback;
+    if (ev.type==InprocChildEvent) {
+      // consume children: each is removed before its value is given to the callback, so that it is handled once only
+      std::vector<std::string> children;
+      getChildren(ev.path,children);
+      for (unsigned int i=0;i<children.size();i++) {
+        std::string value;
+        if (remove(children[i],&value)) {
+          continue;   // already taken
+        }
+        if (exe!=NULL) {
+          exe->f_callback(value,exe->context,NodeCallback::NodeEventType::NodeCreated);
+        }
+        if (subscriptions.find(ev.token)==subscriptions.end()) {
+          break;    // unsubscribed by callback
+        }
+      }
+    } else if (exe!=NULL) {
+      exe->f_callback(ev.value,exe->context,(NodeCallback::NodeEventType)ev.type);
+    }
+  }
+}
+
+
+// a backend instance: keeps track of its subscriptions and ephemeral nodes
+class DirectoryBackendInproc: public DirectoryBackend {
+  public:
+  DirectoryBackendInproc();
+  ~DirectoryBackendInproc();
+
+  int createNode(const std::string &node, const std::string &value, int options);
+  int setValue(const std::string &node, const std::string &value);
+  int getValue(const std::string &node, std::string &value);
+  int deleteNode(const std::string &node);
+  int subscribeNode(const std::string &node, NodeCallback *callback);
+  int subscribeNewChild(const std::string &node, int purge, NodeCallback *callback);
+  int unsubscribe(NodeCallback *callback);
+
+  private:
+  InprocTree *tree;
+  uint64_t id;                                            // owner id for ephemeral nodes
+  std::mutex listMutex;                                   // protects lists below
+  std::multimap<NodeCallback *,uintptr_t> subscriptions;  // tokens of subscriptions, by callback
+  std::set<std::string> ephemeralNodes;                   // ephemeral nodes created
+};
+
+DirectoryBackendInproc::DirectoryBackendInproc() {
+  tree=InprocTree::get();
+  id=tree->newOwnerId();
+}
+
+DirectoryBackendInproc::~DirectoryBackendInproc() {
+  std::multimap<NodeCallback *,uintptr_t> s;
+  std::set<std::string> n;
+  listMutex.lock();
+  s.swap(subscriptions);
+  n.swap(ephemeralNodes);
+  listMutex.unlock();
+  // list not locked while waiting for callbacks in progress, they may create nodes
+  for (auto &it : s) {
+    tree->unsubscribe(it.second);
+  }
+  for (auto &it : n) {
+    tree->remove(it,NULL,id);
+  }
+}
+
+int DirectoryBackendInproc::createNode(const std::string &node, const std::string &value, int options) {
+  int isEphemeral=(options & (Directory::NodeOption::ephemeral | Directory::NodeOption::sequence))?1:0;
+  int isSequence=(options & Directory::NodeOption::sequence)?1:0;
+  std::string path;
+  if (tree->create(node,value,isEphemeral?id:0,isSequence,path)) {
+    return 1;
+  }
+  if (isEphemeral) {
+    std::lock_guard<std::mutex> lock(listMutex);
+    ephemeralNodes.insert(path);
+  }
+  return 0;
+}
+
+int DirectoryBackendInproc::setValue(const std::string &node, const std::string &value) {
+  if (tree->set(node,value)) {
+    printf("Failed to publish %s = %s : no node\n",node.c_str(),value.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int DirectoryBackendInproc::getValue(const std::string &node, std::string &value) {
+  if (tree->get(node,value)) {
+    return 1;
+  }
+  return 0;
+}
+
+int DirectoryBackendInproc::deleteNode(const std::string &node) {
+  {
+    std::lock_guard<std::mutex> lock(listMutex);
+    ephemeralNodes.erase(node);
+  }
+  if (tree->remove(node)) {
+    return 1;
+  }
+  return 0;
+}
+
+int DirectoryBackendInproc::subscribeNode(const std::string &node, NodeCallback *callback) {
+  uintptr_t token=tree->subscribe(callback,node,0);
+  {
+    std::lock_guard<std::mutex> lock(listMutex);
+    subscriptions.insert(std::pair<NodeCallback *,uintptr_t>(callback,token));
+  }
+  // notify initial value
+  tree->postValue(token,node);
+  return 0;
+}
+
+int DirectoryBackendInproc::subscribeNewChild(const std::string &node, int purge, NodeCallback *callback) {
+  uintptr_t token=tree->subscribe(callback,node,1);
+  {
+    std::lock_guard<std::mutex> lock(listMutex);
+    subscriptions.insert(std::pair<NodeCallback *,uintptr_t>(callback,token));
+  }
+  if (purge) {
+    std::vector<std::string> children;
+    tree->getChildren(node,children);
+    for (unsigned int i=0;i<children.size();i++) {
+      tree->remove(children[i]);
+    }
+  }
+  return 0;
+}
+
+int DirectoryBackendInproc::unsubscribe(NodeCallback *callback) {
+  std::vector<uintptr_t> tokens;
+  listMutex.lock();
+  auto range=subscriptions.equal_range(callback);
+  for (auto it=range.first;it!=range.second;++it) {
+    tokens.push_back(it->second);
+  }
+  subscriptions.erase(range.first,range.second);
+  listMutex.unlock();
+  for (unsigned int i=0;i<tokens.size();i++) {
+    tree->unsubscribe(tokens[i]);
+  }
+  return 0;
+}
+
+}  // namespace
+
+
+DirectoryBackend *createDirectoryBackendInproc() {
+  return new DirectoryBackendInproc();
+}
@@ -0,0 +1,669 @@
+/// \file  DirectoryUnix.cxx
+/// \brief Directory backend accessing a local directory server through a unix socket, and the server itself
+///
+/// The server keeps the directory in memory (c.f. DirectoryInproc.cxx). Each client connection is served by a separate
+/// in-process backend instance, so that ephemeral nodes and subscriptions of a client are removed when it disconnects.
+///
+/// Protocol: messages are exchanged as frames made of a 32-bit length followed by the message content.
+/// A message starts with an operation code, followed by its fields: 32-bit integers, and strings (32-bit length + bytes).
+/// Client requests carry an id, repeated in the server reply. Events of subscriptions are sent asynchronously by the server.
+
+#include "ControlStateMachine/DirectoryBackend.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <map>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+
+namespace {
+
+// operation codes
+enum {
+  opCreate=1,     // reqId, path, value, options
+  opSet,          // reqId, path, value
+  opGet,          // reqId, path
+  opDelete,       // reqId, path
+  opSubscribeNode,    // reqId, subId, path
+  opSubscribeChild,   // reqId, subId, path, purge
+  opUnsubscribe,      // reqId, subId
+  opClose,            // reqId. Server removes client nodes and subscriptions, replies, and closes the connection.
+  opReply=100,        // reqId, err, value
+  opEvent             // subId, event type, value
+};
+
+
+// encoding/decoding of message fields
+class Message {
+  public:
+  Message() {ix=0;}
+  Message(std::string &content) {data.swap(content); ix=0;}
+
+  void putInt(uint32_t v) {data.append((const char *)&v,sizeof(v));}
+  void putString(const std::string &s) {putInt(s.length()); data.append(s);}
+
+  int getInt(uint32_t &v) {
+    if (ix+sizeof(v)>data.length()) {return -1;}
+    memcpy(&v,&data[ix],sizeof(v));
+    ix+=sizeof(v);
+    return 0;
+  }
+  int getString(std::string &s) {
+    uint32_t l;
+    if (getInt(l)) {return -1;}
+    if (ix+l>data.length()) {return -1;}
+    s.assign(data,ix,l);
+    ix+=l;
+    return 0;
+  }
+
+  std::string data;
+  private:
+  size_t ix;      // decoding position
+};
+
+
+// write/read complete buffer, retrying on short transfers
+int writeAll(int fd, const char *buf, size_t size) {
+  while (size>0) {
+    ssize_t n=send(fd,buf,size,MSG_NOSIGNAL);
+    if (n<0) {
+      if (errno==EINTR) {continue;}
+      return -1;
+    }
+    buf+=n;
+    size-=n;
+  }
+  return 0;
+}
+
+int readAll(int fd, char *buf, size_t size) {
+  while (size>0) {
+    ssize_t n=read(fd,buf,size);
+    if (n<0) {
+      if (errno==EINTR) {continue;}
+      return -1;
+    }
+    if (n==0) {
+      return -1;    // connection closed
+    }
+    buf+=n;
+    size-=n;
+  }
+  return 0;
+}
+
+int writeFrame(int fd, const Message &m) {
+  uint32_t l=m.data.length();
+  std::string frame((const char *)&l,sizeof(l));
+  frame.append(m.data);
+  return writeAll(fd,frame.data(),frame.length());
+}
+
+int readFrame(int fd, std::string &content) {
+  uint32_t l;
+  if (readAll(fd,(char *)&l,sizeof(l))) {return -1;}
+  content.resize(l);
+  if (l==0) {return 0;}
+  return readAll(fd,&content[0],l);
+}
+
+int setSocketAddress(struct sockaddr_un &addr, const std::string &path) {
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  if (path.length()>=sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strncpy(addr.sun_path,path.c_str(),sizeof(addr.sun_path)-1);
+  return 0;
+}
+
+
+// client side
+class DirectoryBackendUnix: public DirectoryBackend {
+  public:
+  DirectoryBackendUnix(const std::string &socketPath);
+  ~DirectoryBackendUnix();
+
+  int createNode(const std::string &node, const std::string &value, int options);
+  int setValue(const std::string &node, const std::string &value);
+  int getValue(const std::string &node, std::string &value);
+  int deleteNode(const std::string &node);
+  int subscribeNode(const std::string &node, NodeCallback *callback);
+  int subscribeNewChild(const std::string &node, int purge, NodeCallback *callback);
+  int unsubscribe(NodeCallback *callback);
+
+  private:
+  int fd;                             // connection to server
+  std::mutex writeMutex;              // serializes writes to server
+
+  // a request waiting reply
+  typedef struct {
+    int done;
+    uint32_t err;
+    std::string value;
+  } Request;
+  std::mutex requestMutex;            // protects variables below
+  std::condition_variable requestCond;    // signaled on reply
+  std::map<uint32_t,Request *> requests;  // requests waiting reply, by id
+  uint32_t lastRequestId;
+  int isConnected;
+
+  // send a request (args: fields after operation code and request id). If waitReply set, wait for reply, and store returned value if not NULL.
+  int request(int op, Message &args, std::string *value, int waitReply=1);
+
+  std::recursive_mutex dispatchMutex;                 // held while callbacks execute. Protects subscriptions.
+  std::map<uint32_t,NodeCallback *> subscriptions;    // active subscriptions, by id
+  uint32_t lastSubscriptionId;
+  int subscribe(int op, const std::string &node, int purge, NodeCallback *callback);
+
+  std::mutex eventMutex;                  // protects event queue
+  std::condition_variable eventCond;      // signaled when event queued
+  std::deque<Message> events;             // events received, waiting dispatch
+  int shutdown;
+
+  std::thread readerThread;               // receives messages from server
+  std::thread dispatchThread;             // executes callbacks, so that they can issue requests
+  void readerLoop();
+  void dispatchLoop();
+};
+
+
+DirectoryBackendUnix::DirectoryBackendUnix(const std::string &socketPath) {
+  lastRequestId=0;
+  lastSubscriptionId=0;
+  isConnected=1;
+  shutdown=0;
+
+  struct sockaddr_un addr;
+  if (setSocketAddress(addr,socketPath)) {
+    throw("directory server socket path too long");
+  }
+  fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd<0) {
+    throw("socket() failed");
+  }
+  if (connect(fd,(struct sockaddr *)&addr,sizeof(addr))) {
+    close(fd);
+    throw("directory server connection failed");
+  }
+  readerThread=std::thread(&DirectoryBackendUnix::readerLoop,this);
+  dispatchThread=std::thread(&DirectoryBackendUnix::dispatchLoop,this);
+}
+
+DirectoryBackendUnix::~DirectoryBackendUnix() {
+  // disconnecting removes our ephemeral nodes and subscriptions on server side.
+  // request it explicitly, so that it is completed when we return.
+  Message m;
+  request(opClose,m,NULL);
+  ::shutdown(fd,SHUT_RDWR);
+  readerThread.join();
+  eventMutex.lock();
+  shutdown=1;
+  eventCond.notify_one();
+  eventMutex.unlock();
+  dispatchThread.join();
+  close(fd);
+}
+
+int DirectoryBackendUnix::request(int op, Message &args, std::string *value, int waitReply) {
+  Request r;
+  r.done=0;
+  r.err=1;
+  uint32_t id;
+  {
+    std::lock_guard<std::mutex> lock(requestMutex);
+    if (!isConnected) {
+      return 1;
+    }
+    lastRequestId++;
+    id=lastRequestId;
+    if (waitReply) {
+      requests[id]=&r;
+    }
+  }
+
+  Message m;
+  m.putInt(op);
+  m.putInt(id);
+  m.data.append(args.data);
+  int err;
+  writeMutex.lock();
+  err=writeFrame(fd,m);
+  writeMutex.unlock();
+
+  std::unique_lock<std::mutex> lock(requestMutex);
+  if (!waitReply) {
+    return err?1:0;
+  }
+  if (err) {
+    requests.erase(id);
+    return 1;
+  }
+  while (!r.done) {
+    requestCond.wait(lock);
+  }
+  if (value!=NULL) {
+    value->swap(r.value);
+  }
+  return r.err;
+}
+
+void DirectoryBackendUnix::readerLoop() {
+  for (;;) {
+    std::string content;
+    if (readFrame(fd,content)) {
+      break;
+    }
+    Message m(content);
+    uint32_t op;
+    if (m.getInt(op)) {continue;}
+    if (op==opReply) {
+      uint32_t id, err;
+      std::string value;
+      if ((m.getInt(id))||(m.getInt(err))||(m.getString(value))) {continue;}
+      std::lock_guard<std::mutex> lock(requestMutex);
+      std::map<uint32_t,Request *>::iterator it=requests.find(id);
+      if (it!=requests.end()) {
+        it->second->err=err;
+        it->second->value.swap(value);
+        it->second->done=1;
+        requests.erase(it);
+        requestCond.notify_all();
+      }
+    } else if (op==opEvent) {
+      std::lock_guard<std::mutex> lock(eventMutex);
+      events.push_back(m);
+      eventCond.notify_one();
+    }
+  }
+
+  // disconnected: fail pending requests
+  std::lock_guard<std::mutex> lock(requestMutex);
+  isConnected=0;
+  for (std::map<uint32_t,Request *>::iterator it=requests.begin();it!=requests.end();++it) {
+    it->second->err=1;
+    it->second->done=1;
+  }
+  requests.clear();
+  requestCond.notify_all();
+}
+
+void DirectoryBackendUnix::dispatchLoop() {
+  for (;;) {
+    Message m;
+    {
+      std::unique_lock<std::mutex> lock(eventMutex);
+      while ((events.empty())&&(!shutdown)) {
+        eventCond.wait(lock);
+      }
+      if (events.empty()) {
+        break;
+      }
+      m=events.front();
+      events.pop_front();
+    }
+    uint32_t subId, type;
+    std::string value;
+    if ((m.getInt(subId))||(m.getInt(type))||(m.getString(value))) {continue;}
+
+    std::lock_guard<std::recursive_mutex> lock(dispatchMutex);
+    std::map<uint32_t,NodeCallback *>::iterator it=subscriptions.find(subId);
+    if (it==subscriptions.end()) {
+      continue;   // unsubscribed in the meantime
+    }
+    NodeCallback *exe=it->second;
+    if (exe!=NULL) {
+      exe->f_callback(value,exe->context,(NodeCallback::NodeEventType)type);
+    }
+  }
+}
+
+int DirectoryBackendUnix::createNode(const std::string &node, const std::string &value, int options) {
+  Message m;
+  m.putString(node);
+  m.putString(value);
+  m.putInt(options & ~Directory::NodeOption::async);
+  return request(opCreate,m,NULL,(options & Directory::NodeOption::async)?0:1);
+}
+
+int DirectoryBackendUnix::setValue(const std::string &node, const std::string &value) {
+  Message m;
+  m.putString(node);
+  m.putString(value);
+  int err=request(opSet,m,NULL);
+  if (err) {
+    printf("Failed to publish %s = %s\n",node.c_str(),value.c_str());
+  }
+  return err;
+}
+
+int DirectoryBackendUnix::getValue(const std::string &node, std::string &value) {
+  Message m;
+  m.putString(node);
+  return request(opGet,m,&value);
+}
+
+int DirectoryBackendUnix::deleteNode(const std::string &node) {
+  Message m;
+  m.putString(node);
+  return request(opDelete,m,NULL);
+}
+
+int DirectoryBackendUnix::subscribe(int op, const std::string &node, int purge, NodeCallback *callback) {
+  uint32_t subId;
+  dispatchMutex.lock();
+  lastSubscriptionId++;
+  subId=lastSubscriptionId;
+  subscriptions[subId]=callback;
+  dispatchMutex.unlock();
+
+  Message m;
+  m.putInt(subId);
+  m.putString(node);
+  if (op==opSubscribeChild) {
+    m.putInt(purge);
+  }
+  return request(op,m,NULL);
+}
+
+int DirectoryBackendUnix::subscribeNode(const std::string &node, NodeCallback *callback) {
+  return subscribe(opSubscribeNode,node,0,callback);
+}
+
+int DirectoryBackendUnix::subscribeNewChild(const std::string &node, int purge, NodeCallback *callback) {
+  return subscribe(opSubscribeChild,node,purge,callback);
+}
+
+int DirectoryBackendUnix::unsubscribe(NodeCallback *callback) {
+  std::vector<uint32_t> ids;
+  dispatchMutex.lock();
+  for (std::map<uint32_t,NodeCallback *>::iterator it=subscriptions.begin();it!=subscriptions.end();) {
+    if (it->second==callback) {
+      ids.push_back(it->first);
+      subscriptions.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  dispatchMutex.unlock();
+  // events already sent by server for these subscriptions are ignored
+  for (unsigned int i=0;i<ids.size();i++) {
+    Message m;
+    m.putInt(ids[i]);
+    request(opUnsubscribe,m,NULL,0);
+  }
+  return 0;
+}
+
+
+// server side: a client connection
+class DirectoryServerConnection {
+  public:
+  DirectoryServerConnection(int fd);
+  ~DirectoryServerConnection();
+
+  void run();       // serve client until disconnection
+  void shutdown();  // force disconnection
+
+  std::thread thread;
+  std::atomic<int> isDone;
+
+  private:
+  int fd;
+  std::mutex writeMutex;        // serializes writes to client (replies and events)
+  DirectoryBackend *backend;    // directory access for this client
+
+  // a subscription of the client
+  typedef struct {
+    NodeCallback callback;
+    DirectoryServerConnection *connection;
+    uint32_t id;
+  } Subscription;
+  std::map<uint32_t,Subscription *> subscriptions;   // by id (accessed by connection thread only)
+  static void eventCallback(const std::string value, void *context, NodeCallback::NodeEventType event);
+  int reply(uint32_t id, uint32_t err, const std::string &value);
+};
+
+DirectoryServerConnection::DirectoryServerConnection(int clientFd) {
+  fd=clientFd;
+  isDone=0;
+  backend=createDirectoryBackendInproc();
+}
+
+DirectoryServerConnection::~DirectoryServerConnection() {
+  // backend and subscriptions released at end of run()
+  close(fd);
+}
+
+void DirectoryServerConnection::shutdown() {
+  ::shutdown(fd,SHUT_RDWR);
+}
+
+int DirectoryServerConnection::reply(uint32_t id, uint32_t err, const std::string &value) {
+  Message m;
+  m.putInt(opReply);
+  m.putInt(id);
+  m.putInt(err);
+  m.putString(value);
+  std::lock_guard<std::mutex> lock(writeMutex);
+  return writeFrame(fd,m);
+}
+
+void DirectoryServerConnection::eventCallback(const std::string value, void *context, NodeCallback::NodeEventType event) {
+  Subscription *s=(Subscription *)context;
+  Message m;
+  m.putInt(opEvent);
+  m.putInt(s->id);
+  m.putInt(event);
+  m.putString(value);
+  std::lock_guard<std::mutex> lock(s->connection->writeMutex);
+  writeFrame(s->connection->fd,m);
+}
+
+void DirectoryServerConnection::run() {
+  for (;;) {
+    std::string content;
+    if (readFrame(fd,content)) {
+      break;
+    }
+    Message m(content);
+    uint32_t op, id;
+    if ((m.getInt(op))||(m.getInt(id))) {break;}
+
+    std::string path, value;
+    uint32_t err=1;
+    switch (op) {
+      case opCreate: {
+        uint32_t options;
+        if ((m.getString(path))||(m.getString(value))||(m.getInt(options))) {break;}
+        err=backend->createNode(path,value,options);
+        value.clear();
+        break;
+      }
+      case opSet:
+        if ((m.getString(path))||(m.getString(value))) {break;}
+        err=backend->setValue(path,value);
+        value.clear();
+        break;
+      case opGet:
+        if (m.getString(path)) {break;}
+        err=backend->getValue(path,value);
+        break;
+      case opDelete:
+        if (m.getString(path)) {break;}
+        err=backend->deleteNode(path);
+        break;
+      case opSubscribeNode:
+      case opSubscribeChild: {
+        uint32_t subId, purge=0;
+        if ((m.getInt(subId))||(m.getString(path))) {break;}
+        if ((op==opSubscribeChild)&&(m.getInt(purge))) {break;}
+        if (subscriptions.find(subId)!=subscriptions.end()) {break;}
+        Subscription *s=new Subscription;
+        s->callback.f_callback=eventCallback;
+        s->callback.context=s;
+        s->connection=this;
+        s->id=subId;
+        subscriptions[subId]=s;
+        if (op==opSubscribeNode) {
+          err=backend->subscribeNode(path,&s->callback);
+        } else {
+          err=backend->subscribeNewChild(path,purge,&s->callback);
+        }
+        break;
+      }
+      case opUnsubscribe: {
+        uint32_t subId;
+        if (m.getInt(subId)) {break;}
+        std::map<uint32_t,Subscription *>::iterator it=subscriptions.find(subId);
+        if (it==subscriptions.end()) {break;}
+        backend->unsubscribe(&it->second->callback);
+        delete it->second;
+        subscriptions.erase(it);
+        err=0;
+        break;
+      }
+      case opClose:
+        delete backend;
+        backend=NULL;
+        err=0;
+        break;
+      default:
+        break;
+    }
+    if (reply(id,err,value)) {
+      break;
+    }
+    if (backend==NULL) {
+      break;
+    }
+  }
+
+  // removes ephemeral nodes and subscriptions of client now, not when server next wakes up to reap the connection
+  if (backend!=NULL) {
+    delete backend;
+    backend=NULL;
+  }
+  for (std::map<uint32_t,Subscription *>::iterator it=subscriptions.begin();it!=subscriptions.end();++it) {
+    delete it->second;
+  }
+  subscriptions.clear();
+  isDone=1;
+}
+
+
+}  // namespace
+
+
+DirectoryBackend *createDirectoryBackendUnix(const std::string &socketPath) {
+  return new DirectoryBackendUnix(socketPath);
+}
+
+
+
+// server implementation
+class DirectoryServerPrivate {
+  public:
+  std::string path;
+  int listenFd;
+  int stopPipe[2];      // written to wake up run() on stop()
+  std::vector<DirectoryServerConnection *> connections;
+};
+
+DirectoryServer::DirectoryServer(const std::string socketPath) {
+  dPtr=new DirectoryServerPrivate;
+  dPtr->path=socketPath;
+
+  struct sockaddr_un addr;
+  if (setSocketAddress(addr,socketPath)) {
+    delete dPtr;
+    throw("socket path too long");
+  }
+  dPtr->listenFd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (dPtr->listenFd<0) {
+    delete dPtr;
+    throw("socket() failed");
+  }
+  unlink(socketPath.c_str());
+  if ((bind(dPtr->listenFd,(struct sockaddr *)&addr,sizeof(addr)))||(listen(dPtr->listenFd,64))) {
+    close(dPtr->listenFd);
+    delete dPtr;
+    throw("failed to listen on socket");
+  }
+  if (pipe(dPtr->stopPipe)) {
+    close(dPtr->listenFd);
+    delete dPtr;
+    throw("pipe() failed");
+  }
+}
+
+DirectoryServer::~DirectoryServer() {
+  close(dPtr->listenFd);
+  close(dPtr->stopPipe[0]);
+  close(dPtr->stopPipe[1]);
+  unlink(dPtr->path.c_str());
+  delete dPtr;
+}
+
+void DirectoryServer::stop() {
+  char c=0;
+  if (write(dPtr->stopPipe[1],&c,1)!=1) {
+    printf("Failed to stop directory server\n");
+  }
+}
+
+int DirectoryServer::run() {
+  for (;;) {
+    struct pollfd fds[2];
+    fds[0].fd=dPtr->listenFd;
+    fds[0].events=POLLIN;
+    fds[1].fd=dPtr->stopPipe[0];
+    fds[1].events=POLLIN;
+    if (poll(fds,2,-1)<0) {
+      if (errno==EINTR) {continue;}
+      break;
+    }
+    if (fds[1].revents) {
+      char c;
+      if (read(dPtr->stopPipe[0],&c,1)) {}
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd=accept(dPtr->listenFd,NULL,NULL);
+      if (fd<0) {continue;}
+      DirectoryServerConnection *c=new DirectoryServerConnection(fd);
+      c->thread=std::thread(&DirectoryServerConnection::run,c);
+      dPtr->connections.push_back(c);
+    }
+    // cleanup disconnected clients
+    for (std::vector<DirectoryServerConnection *>::iterator it=dPtr->connections.begin();it!=dPtr->connections.end();) {
+      if ((*it)->isDone) {
+        (*it)->thread.join();
+        delete *it;
+        it=dPtr->connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // disconnect remaining clients
+  for (unsigned int i=0;i<dPtr->connections.size();i++) {
+    dPtr->connections[i]->shutdown();
+    dPtr->connections[i]->thread.join();
+    delete dPtr->connections[i];
+  }
+  dPtr->connections.clear();
+  return 0;
+}
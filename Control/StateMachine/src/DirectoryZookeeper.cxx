@@ -0,0 +1,538 @@
+/// \file  DirectoryZookeeper.cxx
+/// \brief Directory backend storing data in zookeeper
+
+#include <zookeeper/zookeeper.h>
+#include "ControlStateMachine/DirectoryBackend.h"
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <vector>
+
+
+// A zookeeper session, shared by all the Directory instances of the process using the same server(s).
+// Sessions are reference-counted, and created on first use.
+// All watches of the session go through a single callback router: the watcher context is a token identifying
+// the subscription (and not a pointer to the callback), so that events for subscriptions removed in the meantime
+// are ignored, even if the callback memory has been reused.
+class DirectorySession {
+  public:
+  static DirectorySession *get(const std::string server);   // get a reference to the session for given server(s). Throws on error.
+  void release();                                           // release reference obtained with get()
+
+  void *addCallback(NodeCallback *callback);     // register a subscription, returns the token to be used as watcher context
+  void removeCallback(void *token);              // unregister a subscription. On return, the callback is not being and will not be called.
+  int enter(void *token, NodeCallback **callback);  // called at the start of a watcher: resolve token. Returns 0 if subscription still registered, in which case leave() must be called at the end.
+  void leave();
+
+  static void z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
+  
+  zhandle_t *zh;
+  boost::mutex mMutex;        // serializes zookeeper calls of the Directory instances
+  
+  private:
+  DirectorySession(const std::string server);
+  ~DirectorySession();
+
+  std::string server;
+  int nRef;                   // number of references (protected by poolMutex)
+  clientid_t z_id;
+  int z_shutdown;
+  int z_ok; 
+  std::condition_variable_any mConnectionChanged;   // signaled (with mMutex) when z_ok changes
+
+  boost::recursive_mutex mDispatchMutex;            // held while callbacks execute
+  std::map<uintptr_t,NodeCallback *> mCallbacks;    // registered subscriptions, by token
+  uintptr_t mLastToken;                             // last token allocated. Tokens are never reused.
+
+  static boost::mutex poolMutex;
+  static std::map<std::string,DirectorySession *> pool;   // active sessions, by server
+};
+
+boost::mutex DirectorySession::poolMutex;
+std::map<std::string,DirectorySession *> DirectorySession::pool;
+
+
+DirectorySession::DirectorySession(const std::string cfgServer) {
+  server=cfgServer;
+  nRef=0;
+  zh=0;
+  z_shutdown=0;
+  z_ok=0;
+  mLastToken=0;
+  bzero(&z_id,sizeof(z_id));
+    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+    zh = zookeeper_init(server.c_str(),  DirectorySession::z_watcher, 30000, &z_id, this, 0);
+    if (!zh) {throw("zookeeper_init() failed");}    
+    // wait connection to be notified by z_watcher
+    mMutex.lock();
+    mConnectionChanged.wait_for(mMutex,std::chrono::milliseconds(5000),[this]{return (z_ok!=0)||(z_shutdown!=0);});
+    int isConnected=z_ok;
+    mMutex.unlock();
+    if (!isConnected) {
+      if (zh!=0) {
+        zookeeper_close(zh);
+      }
+      throw("zookeeper init timeout");
+    }
+    printf("init done!\n");
+}
+
+DirectorySession::~DirectorySession() {
+  mMutex.lock();
+  z_shutdown=1;
+  zhandle_t *h=zh;
+  zh=0;
+  mMutex.unlock();
+  if (h!=0) {
+    zookeeper_close(h);
+  }
+}
+
+DirectorySession *DirectorySession::get(const std::string server) {
+  DirectorySession *s=NULL;
+  poolMutex.lock();
+  std::map<std::string,DirectorySession *>::iterator it=pool.find(server);
+  if (it!=pool.end()) {
+    s=it->second;
+    if (s->z_shutdown) {
+      // expired session: leave it to its current users, and create a new one
+      pool.erase(it);
+      s=NULL;
+    }
+  }
+  if (s==NULL) {
+    try {
+      s=new DirectorySession(server);
+    }
+    catch (...) {
+      poolMutex.unlock();
+      throw;
+    }
+    pool[server]=s;
+  }
+  s->nRef++;
+  poolMutex.unlock();
+  return s;
+}
+
+void DirectorySession::release() {
+  poolMutex.lock();
+  nRef--;
+  if (nRef>0) {
+    poolMutex.unlock();
+    return;
+  }
+  std::map<std::string,DirectorySession *>::iterator it=pool.find(server);
+  if ((it!=pool.end())&&(it->second==this)) {
+    pool.erase(it);
+  }
+  poolMutex.unlock();
+  delete this;
+}
+
+void *DirectorySession::addCallback(NodeCallback *callback) {
+  mDispatchMutex.lock();
+  mLastToken++;
+  uintptr_t token=mLastToken;
+  mCallbacks[token]=callback;
+  mDispatchMutex.unlock();
+  return (void *)token;
+}
+
+void DirectorySession::removeCallback(void *token) {
+  // dispatch mutex is held by callbacks in progress: once we get it, they are completed
+  mDispatchMutex.lock();
+  mCallbacks.erase((uintptr_t)token);
+  mDispatchMutex.unlock();
+}
+
+int DirectorySession::enter(void *token, NodeCallback **callback) {
+  mDispatchMutex.lock();
+  std::map<uintptr_t,NodeCallback *>::iterator it=mCallbacks.find((uintptr_t)token);
+  if (it==mCallbacks.end()) {
+    mDispatchMutex.unlock();
+    return -1;
+  }
+  *callback=it->second;
+  return 0;
+}
+
+void DirectorySession::leave() {
+  mDispatchMutex.unlock();
+}
+
+void DirectorySession::z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx){
+
+    DirectorySession *h;
+    h=(DirectorySession *)watcherCtx;
+    if (h==NULL) {return;}
+    if (h->z_shutdown) {return;}
+    
+    h->mMutex.lock();
+    if (type == ZOO_SESSION_EVENT) {
+        if (state == ZOO_CONNECTED_STATE) {
+            const clientid_t *id = zoo_client_id(zzh);
+            if (h->z_id.client_id == 0 || h->z_id.client_id != id->client_id) {
+                h->z_id = *id;
+                //fprintf(stderr, "Got a new session id: 0x%llx\n",(long long)h->z_id.client_id);            
+            }
+            h->z_ok=1;
+        } else if (state == ZOO_AUTH_FAILED_STATE) {
+            fprintf(stderr, "Authentication failure. Shutting down...\n");
+            h->z_shutdown=1;
+            h->z_ok=0;
+        } else if (state == ZOO_EXPIRED_SESSION_STATE) {
+            fprintf(stderr, "Session expired. Shutting down...\n");
+            h->z_shutdown=1;
+            h->z_ok=0;
+        } else {
+            h->z_ok=0;
+        }
+        h->mConnectionChanged.notify_all();
+    }
+    h->mMutex.unlock();
+}
+
+
+
+// The zookeeper backend is a namespace on top of the shared session: it keeps track of the subscriptions and ephemeral nodes it created,
+// so that they are removed when it is destroyed (they would otherwise live as long as the session).
+class DirectoryBackendZookeeper: public DirectoryBackend {
+  public:
+  DirectoryBackendZookeeper(const std::string &servers);
+  ~DirectoryBackendZookeeper();
+
+  int createNode(const std::string &node, const std::string &value, int options);
+  int setValue(const std::string &node, const std::string &value);
+  int getValue(const std::string &node, std::string &value);
+  int deleteNode(const std::string &node);
+  int subscribeNode(const std::string &node, NodeCallback *callback);
+  int subscribeNewChild(const std::string &node, int purge, NodeCallback *callback);
+  int unsubscribe(NodeCallback *callback);
+
+  static void z_completion_create (int rc, const char *value, const void *data);
+
+  static void z_watcher_subNode (zhandle_t *zzh, int type, int state, const char *path, void* watcherContext);
+  static void z_watcher_node (zhandle_t *zzh, int type, int state, const char *path, void* watcherContext);
+
+  private:
+  void *addSubscription(NodeCallback *callback);   // register a subscription in the session router, and return its token
+  
+  DirectorySession *session;    // shared connection
+  zhandle_t *zh;
+  boost::mutex &mMutex;         // session mutex
+
+  boost::mutex mListMutex;                                 // protects lists below
+  std::multimap<NodeCallback *,void *> mSubscriptions;     // tokens of subscriptions, by callback
+  std::set<std::string> mEphemeralNodes;                   // ephemeral nodes created
+};
+
+DirectoryBackendZookeeper::DirectoryBackendZookeeper(const std::string &servers):session(DirectorySession::get(servers)),mMutex(session->mMutex) {
+  zh=session->zh;
+}
+
+DirectoryBackendZookeeper::~DirectoryBackendZookeeper() {
+  std::multimap<NodeCallback *,void *> s;
+  std::set<std::string> n;
+  mListMutex.lock();
+  s.swap(mSubscriptions);
+  n.swap(mEphemeralNodes);
+  mListMutex.unlock();
+  // list not locked while waiting for callbacks in progress, they may create nodes
+  for (auto &it : s) {
+    session->removeCallback(it.second);
+  }
+  for (auto &it : n) {
+    mMutex.lock();
+    zoo_delete(zh,it.c_str(),-1);
+    mMutex.unlock();
+  }
+  session->release();
+}
+
+void *DirectoryBackendZookeeper::addSubscription(NodeCallback *callback) {
+  void *token=session->addCallback(callback);
+  mListMutex.lock();
+  mSubscriptions.insert(std::pair<NodeCallback *,void *>(callback,token));
+  mListMutex.unlock();
+  return token;
+}
+
+void DirectoryBackendZookeeper::z_completion_create (int rc, const char *, const void *data) {
+  if ((rc!=ZOK)&&(rc!=ZNODEEXISTS)) {
+    printf("zookeeper_create(%s): %s\n",(const char *)data,zerror(rc));
+  }
+  free((void *)data);
+}
+
+
+int DirectoryBackendZookeeper::createNode(const std::string &nodeName, const std::string &value, int options) {
+  int err;
+  int zoo_options=0;
+  if (options & Directory::NodeOption::ephemeral) {
+    zoo_options |= ZOO_EPHEMERAL;
+  }
+  if (options & Directory::NodeOption::sequence) {
+    zoo_options |= ZOO_EPHEMERAL | ZOO_SEQUENCE;
+  }
+  if (zoo_options == ZOO_EPHEMERAL) {
+    // session is shared: keep track of ephemeral nodes to delete them with the directory
+    mListMutex.lock();
+    mEphemeralNodes.insert(nodeName);
+    mListMutex.unlock();
+  }
+  //printf("create %s = %s\n",nodeName.c_str(),value.c_str());
+  if (options & Directory::NodeOption::async) {
+    // don't wait for completion: errors are reported by callback
+    mMutex.lock();
+    err=zoo_acreate( zh,nodeName.c_str(),value.c_str(),value.length(),&ZOO_OPEN_ACL_UNSAFE,zoo_options,DirectoryBackendZookeeper::z_completion_create,strdup(nodeName.c_str()));
+    mMutex.unlock();
+    if (err!=ZOK) {
+      printf("zookeeper_create(%s): %s\n",nodeName.c_str(),zerror(err));
+    }
+    return 0;
+  }
+  char buf[128]="";
+  mMutex.lock();
+  err=zoo_create( zh,nodeName.c_str(),value.c_str(),value.length(),&ZOO_OPEN_ACL_UNSAFE,zoo_options,buf,128);
+  mMutex.unlock();  
+  if (err!=ZOK) {
+    printf("zookeeper_create(%s): %s\n",nodeName.c_str(),zerror(err));
+  } else {
+    //printf("%s created (val=%s, %d bytes)\n",buf,value.c_str(),value.length());
+  }
+  return 0;
+}
+
+
+int DirectoryBackendZookeeper::setValue(const std::string &node ,const std::string &value) {
+  int l=value.length();
+  int err=0;
+  mMutex.lock();  
+  if (zh!=0) {
+    err=zoo_set(zh, node.c_str(), value.c_str(), l, -1);
+    if (err) {
+      printf("Failed to publish %s = %s : %s\n",node.c_str(), value.c_str(),zerror(err));
+    }
+  }
+  mMutex.unlock();
+  if (err) {
+    return 1;
+  }
+  return 0;
+}
+
+
+int DirectoryBackendZookeeper::getValue(const std::string &node, std::string &value) {
+  char buffer[1024];
+  int bufferSize=sizeof(buffer);
+  struct Stat stat;
+  int err;
+  mMutex.lock();
+  err=zoo_get(zh, node.c_str(), 0, buffer, &bufferSize, &stat);
+  if ((err==ZOK)&&(stat.dataLength>bufferSize)) {
+    // value larger than default buffer
+    std::string v(stat.dataLength,0);
+    bufferSize=stat.dataLength;
+    err=zoo_get(zh, node.c_str(), 0, &v[0], &bufferSize, &stat);
+    v.resize(bufferSize>0?bufferSize:0);
+    value=v;
+  } else if (err==ZOK) {
+    value.assign(buffer,bufferSize>0?bufferSize:0);
+  }
+  mMutex.unlock();
+  if (err!=ZOK) {
+    return 1;
+  }
+  return 0;
+}
+
+
+int DirectoryBackendZookeeper::deleteNode(const std::string &node) {
+  int err;
+  mMutex.lock();
+  err=zoo_delete(zh, node.c_str(), -1);
+  mMutex.unlock();
+  mListMutex.lock();
+  mEphemeralNodes.erase(node);
+  mListMutex.unlock();
+  if (err!=ZOK) {
+    return 1;
+  }
+  return 0;
+}
+
+
+int DirectoryBackendZookeeper::unsubscribe(NodeCallback *callback) {
+  std::vector<void *> tokens;
+  mListMutex.lock();
+  auto range=mSubscriptions.equal_range(callback);
+  for (auto it=range.first;it!=range.second;++it) {
+    tokens.push_back(it->second);
+  }
+  mSubscriptions.erase(range.first,range.second);
+  mListMutex.unlock();
+  for (unsigned int i=0;i<tokens.size();i++) {
+    session->removeCallback(tokens[i]);
+  }
+  return 0;
+}
+
+
+// watchers context is the subscription token, resolved through the session router
+
+void DirectoryBackendZookeeper::z_watcher_subNode (zhandle_t *zzh, int type, int state, const char *path, void* context){
+    String_vector s;
+    
+    DirectorySession *session=(DirectorySession *)zoo_get_context(zzh);
+    NodeCallback *exe=NULL;
+    if (session->enter(context,&exe)) {return;}   // unsubscribed: don't set watch again
+
+    if (type==ZOO_CHILD_EVENT) {
+      if (ZOK==zoo_wget_children(zzh, path, DirectoryBackendZookeeper::z_watcher_subNode, context, &s)) {
+          // todo: why are we called with s.count=0 ???
+          //printf("%s : %d commands received\n",path,s.count);
+          // children are listed in arbitrary order: process them by sequence number (10-digit suffix)
+          std::vector<std::string> children(s.data,s.data+s.count);
+          std::sort(children.begin(),children.end(),[](const std::string &a, const std::string &b) {
+            return a.substr(a.length()>10?a.length()-10:0) < b.substr(b.length()>10?b.length()-10:0);
+          });
+          for (unsigned int i=0;i<children.size();i++) {
+              std::string node(path);
+              std::string childNode;
+              childNode=node + "/" + children[i];      
+              //printf("handling command %s\n",childNode.c_str());
+              int err;
+              char val[1024];
+              int sz=sizeof(val);
+              struct Stat stat;
+              std::string command;
+              err=zoo_get(zzh, childNode.c_str(), 0, val, &sz, &stat);
+              if ((err==ZOK)&&(stat.dataLength>sz)) {
+                // commands with parameters may be larger than default buffer
+                command.resize(stat.dataLength);
+                sz=stat.dataLength;
+                err=zoo_get(zzh, childNode.c_str(), 0, &command[0], &sz, &stat);
+                command.resize(sz>0?sz:0);
+              } else if (err==ZOK) {
+                command.assign(val,sz>0?sz:0);
+              }
+              if (err==ZOK) {
+                //printf("%s command=%s (%d bytes)\n",childNode.c_str(),command.c_str(),sz);
+                //executeCommand(command);
+                if (exe!=NULL) {
+                  exe->f_callback(command,exe->context, NodeCallback::NodeEventType::NodeCreated);
+                }
+              }
+              err=zoo_delete(zzh,childNode.c_str(),-1);
+              if (err==ZOK) {
+                //printf("%s deleted\n",childNode.c_str());
+              }
+          }      
+          deallocate_String_vector(&s);
+      }
+    }
+    session->leave();
+}
+
+
+int DirectoryBackendZookeeper::subscribeNewChild(const std::string &node, int purge, NodeCallback *callback) {
+  String_vector s;
+  int err;
+  void *token=addSubscription(callback);
+  err=zoo_wget_children(zh, node.c_str(), DirectoryBackendZookeeper::z_watcher_subNode, token, &s); 
+  if (err!=ZOK) {
+    return __LINE__;
+  }
+  // should delete or process existing nodes?
+  for (int i=0;i<s.count;i++) {
+      std::string childNode;
+      childNode=node + "/" + s.data[i];      
+      // todo ...
+      if (purge) {
+        err=zoo_delete(zh,childNode.c_str(),-1);
+        //printf("deleting %s = %d\n",childNode.c_str(),err);
+      }
+  }
+  return 0;
+}
+
+
+// for initial callback setup, call with type=0 for "no type" event c.f. /opt/zookeeper-3.4.6/src/c/src/zk_adaptor.h
+
+void DirectoryBackendZookeeper::z_watcher_node (zhandle_t *zzh, int type, int state, const char *path, void* context) { 
+    //printf("callback %p:%p %s type %d\n",path,context,path,type);
+    DirectorySession *session=(DirectorySession *)zoo_get_context(zzh);
+    NodeCallback *exe=NULL;
+    if (session->enter(context,&exe)) {return;}   // unsubscribed: don't set watch again
+    std::string nodeValue;
+    
+    if (type==ZOO_CHANGED_EVENT) {
+         char buffer[1024];
+         int bufferSize=sizeof(buffer)/sizeof(char);
+         struct Stat stat;
+         // get new value (and subscribe to changed/deleted at the same time)
+         if (ZOK==zoo_wget(zzh, path, DirectoryBackendZookeeper::z_watcher_node, context, buffer, &bufferSize, &stat)) {         
+
+           if (stat.dataLength>bufferSize) {
+             // value larger than default buffer
+             std::string v(stat.dataLength,0);
+             bufferSize=stat.dataLength;
+             if (ZOK==zoo_get(zzh, path, 0, &v[0], &bufferSize, &stat)) {
+               v.resize(bufferSize>0?bufferSize:0);
+               nodeValue=v;
+             }
+           } else if (bufferSize>0) {
+             nodeValue=std::string(buffer,bufferSize);
+           }
+           if (exe!=NULL) {
+             exe->f_callback(nodeValue, exe->context, NodeCallback::NodeEventType::NodeUpdated);
+           }           
+           session->leave();
+           return;
+         }
+    } else if (type==ZOO_CREATED_EVENT) {
+         if (exe!=NULL) {
+           exe->f_callback(nodeValue, exe->context, NodeCallback::NodeEventType::NodeCreated);
+         }   
+    } else if (type==ZOO_DELETED_EVENT) {
+         if (exe!=NULL) {
+           exe->f_callback(nodeValue, exe->context, NodeCallback::NodeEventType::NodeDestroyed);
+         }
+    }
+    
+    // subscribe again
+    // this will trigger a callback on create/delete/change events
+    struct Stat s;
+    int err;
+    err=zoo_wexists(zzh, path, DirectoryBackendZookeeper::z_watcher_node, context, &s);
+    //printf("zoo_wexists %p=%d\n",path,err);
+    if ((err==ZOK)&&(type==0)) {
+      // if initial subscribe, subscribe again to get a 1st value (otherwise will trigger only on next change)
+      z_watcher_node(zzh,ZOO_CHANGED_EVENT,0,path,context);
+    }
+    session->leave();
+}
+
+
+int DirectoryBackendZookeeper::subscribeNode(const std::string &node, NodeCallback *callback) {
+  const char *p=node.c_str();
+  //printf("subscribe %s\n",p);
+  DirectoryBackendZookeeper::z_watcher_node(zh,0,0,p,addSubscription(callback));
+  return 0;
+//   return getNodeValue(zh, node.c_str(), callback);
+}
+
+
+DirectoryBackend *createDirectoryBackendZookeeper(const std::string &servers) {
+  return new DirectoryBackendZookeeper(servers);
+}
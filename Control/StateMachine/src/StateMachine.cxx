@@ -1,9 +1,27 @@
-#include <zookeeper/zookeeper.h>
 #include "ControlStateMachine/StateMachine.h"
-#include <strings.h>
-#include <unistd.h>
-#include <boost/thread/mutex.hpp>
+#include "ControlStateMachine/DirectoryBackend.h"
+#include "ControlStateMachine/CommandEnvelope.h"
 #include <iostream>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+
+
+class DirectoryPrivate;
+
+// a node value cached locally, kept up to date by a subscription to the node
+class DirectoryCacheEntry {
+  public:
+  DirectoryPrivate *dir;
+  NodeCallback callback;      // subscription to the node, with context pointing to this entry
+  std::string value;          // node value (if exists)
+  bool exists=false;          // node exists (if valid)
+  bool valid=false;           // value can be served from cache
+  bool subscribed=false;      // subscription to the node is active
+  unsigned long version=0;    // incremented on each change, so that a backend read started before a change is not stored
+};
+
 
 // implementation of private
 class DirectoryPrivate {
@@ -11,80 +29,166 @@ class DirectoryPrivate {
   DirectoryPrivate(const DirectoryConfig cfg);
   ~DirectoryPrivate();
 
-  static void  z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
+  int getValue(const std::string &node, std::string &value);    // get value from cache, or from backend on miss
+  unsigned long getCacheVersion(const std::string &node);                 // version of cached node, to be given to updateCache()
+  void updateCache(const std::string &node, const std::string *value, unsigned long version);   // update cache after a local change (value NULL: node deleted), started at given cache version
+  void invalidateCache(const std::string &node);                          // next read of node goes to backend
+
+  static void cacheCallback(const std::string value, void *context, NodeCallback::NodeEventType event);
 
-  static void z_watcher_subNode (zhandle_t *zzh, int type, int state, const char *path, void* watcherContext);
-  static void z_watcher_node (zhandle_t *zzh, int type, int state, const char *path, void* watcherContext);
-  
   friend class Directory;
-  friend class ControlObject;
-  friend class ControlPrivate;
   
   protected:
-  zhandle_t *zh;
-  clientid_t z_id;
-  int z_shutdown;
-  int z_ok; 
   DirectoryConfig dirConfig;
-  boost::mutex mMutex;
+  DirectoryBackend *mBackend;    // storage of the directory
+
+  std::mutex mCacheMutex;                                                // lock for cache access
+  std::map<std::string,std::unique_ptr<DirectoryCacheEntry>> mCache;    // cached values, by node path
+  std::atomic<unsigned long> mCacheHits;                                 // number of reads served from cache
+  std::atomic<unsigned long> mCacheMisses;                               // number of reads served from backend
 };
 
 DirectoryPrivate::DirectoryPrivate(const DirectoryConfig cfg) {
-  zh=0;
-  z_shutdown=0;
-  z_ok=0;
-  bzero(&z_id,sizeof(z_id));
-    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
-    zh = zookeeper_init(cfg.zookeeperServer.c_str(),  DirectoryPrivate::z_watcher, 30000, &z_id, this, 0);
-    if (!zh) {throw("zookeeper_init() failed");}    
-      for (int i=0;i<5000;i++) {
-        usleep(1000);
-        if (z_ok) {break;}
-    } 
-    if (!z_ok) {throw("zookeeper init timeout");}
-    printf("init done!\n");
+  dirConfig=cfg;
+  mBackend=createDirectoryBackend(cfg.zookeeperServer);
+  mCacheHits=0;
+  mCacheMisses=0;
 }
 
 DirectoryPrivate::~DirectoryPrivate() {
-  z_shutdown=1;
-  if (z_id.client_id!=0) {
-    zookeeper_close(zh);
+  // cancel cache subscriptions before releasing entries
+  for (auto &it : mCache) {
+    mBackend->unsubscribe(&it.second->callback);
   }
-}
-
-void DirectoryPrivate::z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx){
-
-    DirectoryPrivate *h;
-    h=(DirectoryPrivate *)watcherCtx;
-    if (h==NULL) {return;}
-    if (h->z_shutdown) {return;}
-    
-    h->mMutex.lock();
-    if (type == ZOO_SESSION_EVENT) {
-        if (state == ZOO_CONNECTED_STATE) {
-            const clientid_t *id = zoo_client_id(zzh);
-            if (h->z_id.client_id == 0 || h->z_id.client_id != id->client_id) {
-                h->z_id = *id;
-                //fprintf(stderr, "Got a new session id: 0x%llx\n",(long long)h->z_id.client_id);            
-            }
-            h->z_ok=1;
-        } else if (state == ZOO_AUTH_FAILED_STATE) {
-            fprintf(stderr, "Authentication failure. Shutting down...\n");
-            zookeeper_close(zzh);
-            h->z_shutdown=1;
-            h->zh=0;
-            h->z_ok=0;
-        } else if (state == ZOO_EXPIRED_SESSION_STATE) {
-            fprintf(stderr, "Session expired. Shutting down...\n");
-            zookeeper_close(zzh);
-            h->z_shutdown=1;
-            h->zh=0;
-            h->z_ok=0;
-        } else {
-            h->z_ok=0;
+  delete mBackend;
+}
+
+int DirectoryPrivate::getValue(const std::string &node, std::string &value) {
+  DirectoryCacheEntry *e=NULL;
+  bool isNew=false;
+  bool canStore=false;
+  unsigned long version=0;
+  {
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    auto it=mCache.find(node);
+    if (it!=mCache.end()) {
+      e=it->second.get();
+      if (e->valid) {
+        mCacheHits++;
+        if (!e->exists) {
+          return 1;
         }
+        value=e->value;
+        return 0;
+      }
+    } else {
+      e=new DirectoryCacheEntry;
+      e->dir=this;
+      e->callback.f_callback=DirectoryPrivate::cacheCallback;
+      e->callback.context=e;
+      mCache[node]=std::unique_ptr<DirectoryCacheEntry>(e);
+      isNew=true;
+    }
+    // a value read before the subscription is active may miss a change: don't store it
+    canStore=e->subscribed;
+    version=e->version;
+  }
+  mCacheMisses++;
+
+  // first read of this node: subscribe to its changes
+  // (done without lock, some backends notify initial value immediately)
+  if (isNew) {
+    if (mBackend->subscribeNode(node,&e->callback)==0) {
+      std::lock_guard<std::mutex> lock(mCacheMutex);
+      e->subscribed=true;
+      canStore=true;
+      version=e->version;
+    }
+  }
+
+  int err=mBackend->getValue(node,value);
+  if ((err==0)&&(canStore)) {
+    // store value, unless a change was notified in the mean time
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    if (e->version==version) {
+      e->value=value;
+      e->exists=true;
+      e->valid=true;
     }
-    h->mMutex.unlock();
+  }
+  return err;
+}
+
+unsigned long DirectoryPrivate::getCacheVersion(const std::string &node) {
+  std::lock_guard<std::mutex> lock(mCacheMutex);
+  auto it=mCache.find(node);
+  if (it==mCache.end()) {
+    return 0;
+  }
+  return it->second->version;
+}
+
+void DirectoryPrivate::updateCache(const std::string &node, const std::string *value, unsigned long version) {
+  std::lock_guard<std::mutex> lock(mCacheMutex);
+  auto it=mCache.find(node);
+  if (it==mCache.end()) {
+    return;
+  }
+  DirectoryCacheEntry *e=it->second.get();
+  // changes notified during the local one (possibly later writes of others): local value may be stale
+  bool isChanged=(e->version!=version);
+  e->version++;
+  if ((!e->subscribed)||(isChanged)) {
+    e->valid=false;
+    return;
+  }
+  e->exists=(value!=NULL);
+  e->value=(value!=NULL)?*value:"";
+  e->valid=true;
+}
+
+void DirectoryPrivate::invalidateCache(const std::string &node) {
+  std::lock_guard<std::mutex> lock(mCacheMutex);
+  auto it=mCache.find(node);
+  if (it!=mCache.end()) {
+    it->second->version++;
+    it->second->valid=false;
+  }
+}
+
+void DirectoryPrivate::cacheCallback(const std::string value, void *context, NodeCallback::NodeEventType event) {
+  DirectoryCacheEntry *e=(DirectoryCacheEntry *)context;
+  std::lock_guard<std::mutex> lock(e->dir->mCacheMutex);
+  e->version++;
+  switch (event) {
+    case NodeCallback::NodeEventType::NodeUpdated:
+      e->value=value;
+      e->exists=true;
+      e->valid=true;
+      break;
+    case NodeCallback::NodeEventType::NodeDestroyed:
+      e->value.clear();
+      e->exists=false;
+      e->valid=true;
+      break;
+    default:
+      // node created: value not always provided, next read goes to backend
+      e->valid=false;
+      break;
+  }
+}
+
+
+DirectoryBackend *createDirectoryBackend(const std::string &connection) {
+  const std::string inproc="inproc://";
+  const std::string unixSocket="unix://";
+  if (connection.compare(0,inproc.length(),inproc)==0) {
+    return createDirectoryBackendInproc();
+  }
+  if (connection.compare(0,unixSocket.length(),unixSocket)==0) {
+    return createDirectoryBackendUnix(connection.substr(unixSocket.length()));
+  }
+  return createDirectoryBackendZookeeper(connection);
 }
 
 
@@ -123,171 +227,50 @@ std::string getObjectPathCommand(const std::string objectName) {
 
 
 int Directory::CreateNode(const std::string nodeName, const std::string value, int options) {
-  int err;
-  int zoo_options=0;
-  if (options & Directory::NodeOption::ephemeral) {
-    zoo_options |= ZOO_EPHEMERAL;
-  }
-  if (options & Directory::NodeOption::sequence) {
-    zoo_options |= ZOO_EPHEMERAL | ZOO_SEQUENCE;
-  }
-  //printf("create %s = %s\n",nodeName.c_str(),value.c_str());
-  char buf[128]="";
-  dPtr->mMutex.lock();
-  err=zoo_create( dPtr->zh,nodeName.c_str(),value.c_str(),value.length(),&ZOO_OPEN_ACL_UNSAFE,zoo_options,buf,128);
-  dPtr->mMutex.unlock();  
-  if (err!=ZOK) {
-    printf("zookeeper_create(%s): %s\n",nodeName.c_str(),zerror(err));
-  } else {
-    //printf("%s created (val=%s, %d bytes)\n",buf,value.c_str(),value.length());
-  }
-  return 0;
+  int err=dPtr->mBackend->createNode(nodeName,value,options);
+  dPtr->invalidateCache(nodeName);
+  return err;
 }
 
-/*
-int Directory::DeleteChildren(const std::string node) {
-  String_vector s;
-  int err;
-  err=zoo_get_children(dPtr->zh, node.c_str(), 0, &s);
-  for (int i=0;i<s.count;i++) {
-      std::string childNode;
-      childNode=node + "/" + s.data[i];      
-      err=zoo_delete(dPtr->zh,childNode.c_str(),-1);
-      printf("deleting %s = %d\n",childNode.c_str(),err);
+int Directory::SetValue(const std::string node ,const std::string value) {
+  unsigned long version=dPtr->getCacheVersion(node);
+  int err=dPtr->mBackend->setValue(node,value);
+  if (err==0) {
+    // read own writes from cache
+    dPtr->updateCache(node,&value,version);
   }
-  return 0;
+  return err;
 }
-*/
 
+int Directory::GetValue(const std::string node, std::string &value) {
+  return dPtr->getValue(node,value);
+}
 
-int Directory::SetValue(const std::string node ,const std::string value) {
-  int l=value.length();
-  int err=0;
-  dPtr->mMutex.lock();  
-  if (dPtr->zh!=0) {
-    err=zoo_set(dPtr->zh, node.c_str(), value.c_str(), l, -1);
-    if (err) {
-      printf("Failed to publish %s = %s : %s\n",node.c_str(), value.c_str(),zerror(err));
-    }
+int Directory::DeleteNode(const std::string node) {
+  unsigned long version=dPtr->getCacheVersion(node);
+  int err=dPtr->mBackend->deleteNode(node);
+  if (err==0) {
+    dPtr->updateCache(node,NULL,version);
   }
-  dPtr->mMutex.unlock();
-  if (err) {
-    return 1;
-  }
-  return 0;
+  return err;
 }
 
-
-
-void DirectoryPrivate::z_watcher_subNode (zhandle_t *zzh, int type, int state, const char *path, void* context){
-    String_vector s;
-    
-    if (type==ZOO_CHILD_EVENT) {
-      if (ZOK==zoo_wget_children(zzh, path, DirectoryPrivate::z_watcher_subNode, context, &s)) {
-          // todo: why are we called with s.count=0 ???
-          //printf("%s : %d commands received\n",path,s.count);
-          // todo: reorder queue
-          for (int i=0;i<s.count;i++) {
-              std::string node(path);
-              std::string childNode;
-              childNode=node + "/" + s.data[i];      
-              //printf("handling command %s\n",childNode.c_str());
-              int err;
-              char val[128]="";
-              int sz=sizeof(val)-1;
-              err=zoo_get(zzh, childNode.c_str(), 0, val, &sz, NULL);
-              val[sz]=0;
-              if (err==ZOK) {
-                //printf("%s command=%s (%d bytes)\n",childNode.c_str(),val,sz);
-                std::string command(val,sz);
-                //executeCommand(command);
-                if (context!=NULL) {
-                  NodeCallback *exe=(NodeCallback *)context;
-                  exe->f_callback(command,exe->context, NodeCallback::NodeEventType::NodeCreated);
-                }
-              }
-              err=zoo_delete(zzh,childNode.c_str(),-1);
-              if (err==ZOK) {
-                //printf("%s deleted\n",childNode.c_str());
-              }
-          }      
-      }
-    }
+int Directory::GetCacheStats(unsigned long &hits, unsigned long &misses) {
+  hits=dPtr->mCacheHits;
+  misses=dPtr->mCacheMisses;
+  return 0;
 }
 
-
 int Directory::SubscribeNewChild(const std::string node, int purge, NodeCallback *callback) {
-  String_vector s;
-  int err;
-  err=zoo_wget_children(dPtr->zh, node.c_str(), DirectoryPrivate::z_watcher_subNode, callback, &s); 
-  if (err!=ZOK) {
-    return __LINE__;
-  }
-  // should delete or process existing nodes?
-  for (int i=0;i<s.count;i++) {
-      std::string childNode;
-      childNode=node + "/" + s.data[i];      
-      // todo ...
-      if (purge) {
-        err=zoo_delete(dPtr->zh,childNode.c_str(),-1);
-        //printf("deleting %s = %d\n",childNode.c_str(),err);
-      }
-  }
-  return 0;
+  return dPtr->mBackend->subscribeNewChild(node,purge,callback);
 }
 
-
-// for initial callback setup, call with type=0 for "no type" event c.f. /opt/zookeeper-3.4.6/src/c/src/zk_adaptor.h
-
-void DirectoryPrivate::z_watcher_node (zhandle_t *zzh, int type, int state, const char *path, void* context) { 
-    //printf("callback %p:%p %s type %d\n",path,context,path,type);
-    NodeCallback *exe=(NodeCallback *)context;
-    std::string nodeValue;
-    
-    if (type==ZOO_CHANGED_EVENT) {
-         char buffer[1024];
-         int bufferSize=sizeof(buffer)/sizeof(char);
-         struct Stat stat;
-         // get new value (and subscribe to changed/deleted at the same time)
-         if (ZOK==zoo_wget(zzh, path, DirectoryPrivate::z_watcher_node, context, buffer, &bufferSize, &stat)) {         
-
-           if (bufferSize>0) {
-             nodeValue=std::string(buffer,bufferSize);
-           }
-           if (exe!=NULL) {
-             exe->f_callback(nodeValue, exe->context, NodeCallback::NodeEventType::NodeUpdated);
-           }           
-           return;
-         }
-    } else if (type==ZOO_CREATED_EVENT) {
-         if (exe!=NULL) {
-           exe->f_callback(nodeValue, exe->context, NodeCallback::NodeEventType::NodeCreated);
-         }   
-    } else if (type==ZOO_DELETED_EVENT) {
-         if (exe!=NULL) {
-           exe->f_callback(nodeValue, exe->context, NodeCallback::NodeEventType::NodeDestroyed);
-         }
-    }
-    
-    // subscribe again
-    // this will trigger a callback on create/delete/change events
-    struct Stat s;
-    int err;
-    err=zoo_wexists(zzh, path, DirectoryPrivate::z_watcher_node, context, &s);
-    //printf("zoo_wexists %p=%d\n",path,err);
-    if ((err==ZOK)&&(type==0)) {
-      // if initial subscribe, subscribe again to get a 1st value (otherwise will trigger only on next change)
-      z_watcher_node(zzh,ZOO_CHANGED_EVENT,0,path,context);
-    }
+int Directory::SubscribeNode(const std::string node, NodeCallback *callback) {
+  return dPtr->mBackend->subscribeNode(node,callback);
 }
 
-
-int Directory::SubscribeNode(const std::string node, NodeCallback *callback) {
-  const char *p=node.c_str();
-  //printf("subscribe %s\n",p);
-  DirectoryPrivate::z_watcher_node(dPtr->zh,0,0,p,callback);
-  return 0;
-//   return getNodeValue(dPtr->zh, node.c_str(), callback);
+int Directory::Unsubscribe(NodeCallback *callback) {
+  return dPtr->mBackend->unsubscribe(callback);
 }
 
 
@@ -337,7 +320,9 @@ ControlPrivate::ControlPrivate(const std::string objectName, Directory *dir){
 }
 
 ControlPrivate::~ControlPrivate(){
-  // TODO: cancel subscribe
+  // cancel subscribe: no callback can be executed after this
+  mDirectory->Unsubscribe(&cbCommand);
+  mDirectory->Unsubscribe(&cbState);
 }
 
 
@@ -382,10 +367,12 @@ ControlObject::ControlObject(const std::string objectName, Directory *dir){
   dPtr=new ControlPrivate(objectName,dir);
   if (dPtr==NULL) {throw __LINE__;}
 
+  // nodes are created asynchronously: requests are executed in order by the server,
+  // before the subscription below which waits for the reply
   int err;
-  err=dPtr->mDirectory->CreateNode(dPtr->mPathNode,"");
-  err=dPtr->mDirectory->CreateNode(dPtr->mPathCommand,"");
-  err=dPtr->mDirectory->CreateNode(dPtr->mPathState,"",1);  
+  err=dPtr->mDirectory->CreateNode(dPtr->mPathNode,"",Directory::NodeOption::async);
+  err=dPtr->mDirectory->CreateNode(dPtr->mPathCommand,"",Directory::NodeOption::async);
+  err=dPtr->mDirectory->CreateNode(dPtr->mPathState,"",Directory::NodeOption::ephemeral | Directory::NodeOption::async);  
   if (err) {throw err;}
   
   dPtr->cbCommand.f_callback=&ControlPrivate::commandCallback;
@@ -438,6 +425,15 @@ int ControlClient::sendCommand(const std::string command) {
   return dPtr->mDirectory->CreateNode(zcmd,command,Directory::NodeOption::sequence);
 }
 
+int ControlClient::sendCommand(const CommandEnvelope &command) {
+  std::string zcmd=dPtr->mPathCommand + "/cmd-";
+  std::string payload;
+  command.encode(payload);
+  CommandView v(payload);
+  std::cout << zcmd << " -> " << v.getCommand() << " (" << v.getNumberOfParameters() << " parameters)" << std::endl;
+  return dPtr->mDirectory->CreateNode(zcmd,payload,Directory::NodeOption::sequence);
+}
+
 int ControlClient::getState(std::string &currentState) {
   currentState=dPtr->mCurrentState;
   return 0;
@@ -0,0 +1,250 @@
+/// \file    benchmarkControl.cxx
+/// \brief   Command round-trip latency benchmark for RuntimeControlEngine / ControlClient
+///
+/// N RuntimeControlledObjects are registered in an engine, and the same number of ControlClients
+/// send them storms of commands (prepare/start/stop/reset cycles).
+/// For each command, the latency is measured from the sendCommand() call to the
+/// time the client sees the corresponding new state published in the directory.
+/// Results (latency percentiles, throughput) are written in JSON format.
+///
+/// usage: benchmarkControl [-n objects] [-c cycles] [-d directory] [-o outputFile]
+///   -n : number of controlled objects (default 100)
+///   -c : number of prepare/start/stop/reset cycles (default 10)
+///   -d : directory connection string, c.f. DirectoryConfig (default "inproc://")
+///   -o : file where to write JSON results (default: stdout)
+
+#include "ControlStateMachine/BaseControl.h"
+#include "ControlStateMachine/StateMachine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+
+// a controlled object doing nothing, so that only the control overhead is measured
+class benchObject : public RuntimeControlledObject {
+  public:
+  benchObject(const std::string name):RuntimeControlledObject(name) {
+  }
+  int executePrepare() {return 0;}
+  int executeReset() {return 0;}
+  int executeStart() {return 0;}
+  int executeStop() {return 0;}
+  int executePause() {return 0;}
+  int executeResume() {return 0;}
+  int iterateRunning() {usleep(100); return 0;}
+  int iterateCheck() {return 0;}
+};
+
+
+// completion counter shared by all clients of a storm
+class benchSync {
+  public:
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  int nPending=0;
+};
+
+
+// a client recording the time when the expected state is reached
+class benchClient : public ControlClient {
+  public:
+  benchClient(const std::string name, Directory *dir, benchSync *sync):ControlClient(name,dir) {
+    mSync=sync;
+  }
+
+  // arm the client for given expected state, and send command
+  int send(const std::string command, const std::string expectedState) {
+    {
+      std::unique_lock<std::mutex> lock(mSync->mMutex);
+      mExpectedState=expectedState;
+      mDone=false;
+      tSent=benchClock::now();
+    }
+    return sendCommand(command);
+  }
+
+  void objectStateChangedCallback(const std::string newState) {
+    benchClock::time_point t=benchClock::now();
+    std::unique_lock<std::mutex> lock(mSync->mMutex);
+    if ((!mDone)&&(newState==mExpectedState)) {
+      latency=std::chrono::duration<double,std::micro>(t-tSent).count();
+      mDone=true;
+      mSync->nPending--;
+      if (mSync->nPending==0) {
+        mSync->mCond.notify_all();
+      }
+    }
+  }
+  void objectCreatedCallback() {}
+  void objectDestroyedCallback() {}
+
+  double latency=0;           // latency of last command, in microseconds
+
+  private:
+  benchSync *mSync;
+  std::string mExpectedState;
+  bool mDone=true;
+  benchClock::time_point tSent;
+};
+
+
+// get value at given percentile (0-100) of sorted samples
+static double getPercentile(const std::vector<double> &v, double p) {
+  if (v.size()==0) return 0;
+  size_t ix=(size_t)((p/100.0)*(v.size()-1)+0.5);
+  if (ix>=v.size()) ix=v.size()-1;
+  return v[ix];
+}
+
+
+int main(int argc, char *argv[]) {
+
+  int nObjects=100;
+  int nCycles=10;
+  const char *directory="inproc://";
+  const char *outputFile=NULL;
+  int timeout=10;  // timeout for each storm, in seconds
+
+  int opt;
+  while ((opt=getopt(argc,argv,"n:c:d:o:"))!=-1) {
+    switch (opt) {
+      case 'n': nObjects=atoi(optarg); break;
+      case 'c': nCycles=atoi(optarg); break;
+      case 'd': directory=optarg; break;
+      case 'o': outputFile=optarg; break;
+      default:
+        printf("usage: %s [-n objects] [-c cycles] [-d directory] [-o outputFile]\n",argv[0]);
+        return 1;
+    }
+  }
+  if ((nObjects<=0)||(nCycles<=0)) {
+    printf("wrong parameters\n");
+    return 1;
+  }
+
+  // commands of a cycle, and corresponding state reached
+  const std::vector<std::pair<std::string,std::string>> cycle={
+    {"prepare","READY"},
+    {"start","RUNNING"},
+    {"stop","READY"},
+    {"reset","STANDBY"}
+  };
+
+  std::vector<double> latencies;
+  latencies.reserve(nObjects*nCycles*cycle.size());
+  int nErrors=0;
+  double duration=0;
+
+  try {
+    DirectoryConfig cfg(directory);
+    Directory dClient(cfg);
+    benchSync sync;
+
+    // objects must outlive the engine
+    std::vector<std::unique_ptr<benchObject>> objects;
+    RuntimeControlEngine engine(cfg);
+    std::vector<std::unique_ptr<benchClient>> clients;
+    for (int i=0;i<nObjects;i++) {
+      char name[32];
+      snprintf(name,sizeof(name),"bench-%04d",i);
+      objects.push_back(std::make_unique<benchObject>(name));
+      engine.registerObject(objects.back().get());
+      clients.push_back(std::make_unique<benchClient>(name,&dClient,&sync));
+    }
+
+    // wait all objects published initial state
+    // (initial value may be notified before benchClient construction completes, so rely on getState())
+    benchClock::time_point tWait=benchClock::now()+std::chrono::seconds(timeout);
+    for (auto &c : clients) {
+      for (;;) {
+        std::string state;
+        c->getState(state);
+        if (state=="STANDBY") break;
+        if (benchClock::now()>tWait) {
+          throw "objects not ready";
+        }
+        usleep(1000);
+      }
+    }
+
+    benchClock::time_point t0=benchClock::now();
+    for (int k=0;k<nCycles;k++) {
+      for (auto const &step : cycle) {
+        {
+          std::unique_lock<std::mutex> lock(sync.mMutex);
+          sync.nPending=nObjects;
+        }
+        for (auto &c : clients) {
+          if (c->send(step.first,step.second)) {
+            nErrors++;
+          }
+        }
+        std::unique_lock<std::mutex> lock(sync.mMutex);
+        if (!sync.mCond.wait_for(lock,std::chrono::seconds(timeout),[&]{return sync.nPending==0;})) {
+          throw "timeout waiting for state change";
+        }
+        for (auto &c : clients) {
+          latencies.push_back(c->latency);
+        }
+      }
+    }
+    duration=std::chrono::duration<double>(benchClock::now()-t0).count();
+
+    // clients unsubscribe before objects and engine are destroyed
+    clients.clear();
+  }
+  catch (const char *e) {
+    printf("error : %s\n",e);
+    return 1;
+  }
+
+  std::sort(latencies.begin(),latencies.end());
+  double sum=0;
+  for (auto l : latencies) {
+    sum+=l;
+  }
+
+  FILE *fp=stdout;
+  if (outputFile!=NULL) {
+    fp=fopen(outputFile,"w");
+    if (fp==NULL) {
+      printf("failed to open %s : %s\n",outputFile,strerror(errno));
+      return 1;
+    }
+  }
+  fprintf(fp,"{\n");
+  fprintf(fp,"  \"benchmark\": \"controlRoundTrip\",\n");
+  fprintf(fp,"  \"directory\": \"%s\",\n",directory);
+  fprintf(fp,"  \"objects\": %d,\n",nObjects);
+  fprintf(fp,"  \"cycles\": %d,\n",nCycles);
+  fprintf(fp,"  \"commands\": %d,\n",(int)latencies.size());
+  fprintf(fp,"  \"errors\": %d,\n",nErrors);
+  fprintf(fp,"  \"durationSeconds\": %.6f,\n",duration);
+  fprintf(fp,"  \"commandsPerSecond\": %.1f,\n",(duration>0)?latencies.size()/duration:0);
+  fprintf(fp,"  \"latencyMicroseconds\": {\n");
+  fprintf(fp,"    \"mean\": %.1f,\n",(latencies.size()>0)?sum/latencies.size():0);
+  fprintf(fp,"    \"min\": %.1f,\n",getPercentile(latencies,0));
+  fprintf(fp,"    \"p50\": %.1f,\n",getPercentile(latencies,50));
+  fprintf(fp,"    \"p90\": %.1f,\n",getPercentile(latencies,90));
+  fprintf(fp,"    \"p99\": %.1f,\n",getPercentile(latencies,99));
+  fprintf(fp,"    \"p999\": %.1f,\n",getPercentile(latencies,99.9));
+  fprintf(fp,"    \"max\": %.1f\n",getPercentile(latencies,100));
+  fprintf(fp,"  }\n");
+  fprintf(fp,"}\n");
+  if (fp!=stdout) {
+    fclose(fp);
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+/// \file    directoryServer.cxx
+/// \brief   A local directory server, to be used with DirectoryConfig "unix://path"
+
+#include "ControlStateMachine/DirectoryBackend.h"
+#include <signal.h>
+#include <stdio.h>
+
+static DirectoryServer *server=NULL;
+
+static void signalHandler(int) {
+  if (server!=NULL) {
+    server->stop();
+  }
+}
+
+int main(int argc, char *argv[]) {
+
+  const char *socketPath="/tmp/o2directory.sock";
+  if (argc>1) {
+    socketPath=argv[1];
+  }
+
+  try {
+    DirectoryServer s(socketPath);
+    server=&s;
+    signal(SIGINT,signalHandler);
+    signal(SIGTERM,signalHandler);
+    printf("directory server listening on %s\n",socketPath);
+    s.run();
+    server=NULL;
+    printf("done\n");
+  }
+  catch (const char *e) {
+    printf("error : %s\n",e);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,135 @@
+#include "ControlStateMachine/BaseControl.h"
+#include "ControlStateMachine/StateMachine.h"
+#include "ControlStateMachine/CommandEnvelope.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// check encoding/decoding of commands with parameters, and their delivery to RuntimeControlledObject (using in-process directory)
+
+class paramObject:public RuntimeControlledObject {
+  public:
+  std::atomic<int64_t> eventSize;
+  std::atomic<int> nStart;
+  std::string source;
+  paramObject(const std::string objectName):RuntimeControlledObject(objectName) {
+    eventSize=0;
+    nStart=0;
+  }
+  int executeStart() {
+    int64_t v;
+    if (getCommand().getParameter("eventSize",v)==0) {
+      eventSize=v;
+    }
+    getCommand().getParameter("source",source);
+    nStart++;
+    return 0;
+  }
+};
+
+// wait for a condition, at most 5 seconds
+template <typename T> int waitFor(T condition) {
+  for (int i=0;i<5000;i++) {
+    if (condition()) {return 0;}
+    usleep(1000);
+  }
+  return -1;
+}
+
+int testEncoding() {
+  CommandEnvelope c("start");
+  c.setSequence(12);
+  c.setDeadline(123456789);
+  c.setCorrelationId("run-42");
+  c.addParameter("eventSize",(int64_t)-1024);
+  c.addParameter("rate",2.5);
+  c.addParameter("source",std::string("file.raw"));
+  std::string buffer=c.encode();
+
+  CommandView v(buffer);
+  int64_t i=0;
+  double d=0;
+  std::string s;
+  if ((!v.isValid())||(strcmp(v.getCommand(),"start"))||(v.getSequence()!=12)||(v.getDeadline()!=123456789)||(strcmp(v.getCorrelationId(),"run-42"))) {
+    printf("error: wrong envelope header\n");
+    return -1;
+  }
+  if ((v.getParameter("eventSize",i))||(i!=-1024)||(v.getParameter("rate",d))||(d!=2.5)||(v.getParameter("source",s))||(s!="file.raw")) {
+    printf("error: wrong parameters\n");
+    return -1;
+  }
+  if ((v.getParameter("rate",i)==0)||(v.getString("missing")!=NULL)) {
+    printf("error: parameter type not checked\n");
+    return -1;
+  }
+
+  // plain string commands
+  std::string plain("stop");
+  CommandView p(plain);
+  if ((!p.isValid())||(strcmp(p.getCommand(),"stop"))||(p.getNumberOfParameters()!=0)) {
+    printf("error: plain command not decoded\n");
+    return -1;
+  }
+
+  // truncated envelopes rejected
+  for (size_t l=0;l<buffer.size();l++) {
+    CommandView t(buffer.data(),l);
+    if ((l>=4)&&(t.isValid())) {
+      printf("error: truncated envelope (%d/%d bytes) accepted\n",(int)l,(int)buffer.size());
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  if (testEncoding()) {
+    return -1;
+  }
+
+  DirectoryConfig dCfg("inproc://");
+  Directory dClient(dCfg);
+  paramObject obj("testCommandEnvelope");
+  RuntimeControlEngine e(dCfg,1);
+  e.registerObject(&obj);
+  ControlClient client("testCommandEnvelope",&dClient);
+
+  auto inState=[&](const char *s) {
+    std::string state;
+    client.getState(state);
+    return state==s;
+  };
+  if (waitFor([&]{return inState("STANDBY");})) {
+    printf("error: object not in STANDBY\n");
+    return -1;
+  }
+  client.sendCommand("prepare");
+  if (waitFor([&]{return inState("READY");})) {
+    printf("error: object not READY\n");
+    return -1;
+  }
+
+  // expired command ignored
+  CommandEnvelope late("start");
+  late.setDeadline(1);
+  client.sendCommand(late);
+
+  // parameters given with the command
+  CommandEnvelope start("start");
+  start.addParameter("eventSize",(int64_t)8192);
+  start.addParameter("source",std::string(2000,'x'));
+  client.sendCommand(start);
+  if (waitFor([&]{return inState("RUNNING");})) {
+    printf("error: object not RUNNING\n");
+    return -1;
+  }
+  if ((obj.nStart!=1)||(obj.eventSize!=8192)||(obj.source.length()!=2000)) {
+    printf("error: parameters not received (%d start, eventSize %d)\n",(int)obj.nStart,(int)obj.eventSize);
+    return -1;
+  }
+  printf("Test completed\n");
+  return 0;
+}
@@ -0,0 +1,216 @@
+#include "ControlStateMachine/StateMachine.h"
+#include "ControlStateMachine/DirectoryBackend.h"
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <mutex>
+
+// check directory backends which don't need an external server: in-process, and local server
+
+class testObject:public ControlObject {
+  public:
+  std::atomic<int> nCommands;
+  testObject(const std::string objectName, Directory * dir):ControlObject(objectName,dir) {
+    nCommands=0;
+    setState("READY");
+  };
+  void executeCommand(const std::string command){
+    nCommands++;
+    setState(command);
+  };
+};
+
+// wait for a condition, at most 2 seconds
+template <typename T> int waitFor(T condition) {
+  for (int i=0;i<2000;i++) {
+    if (condition()) {return 0;}
+    usleep(1000);
+  }
+  return -1;
+}
+
+int testBackend(const char *connection) {
+  printf("Testing %s\n",connection);
+  DirectoryConfig dCfg(connection);
+  Directory dObject(dCfg);
+  Directory dClient(dCfg);
+
+  testObject obj("testDirectory",&dObject);
+  ControlClient client("testDirectory",&dClient);
+
+  const int nCommands=100;
+  for (int i=0;i<nCommands;i++) {
+    char cmd[32];
+    snprintf(cmd,sizeof(cmd),"CMD%03d",i);
+    client.sendCommand(cmd);
+  }
+  if (waitFor([&]{return obj.nCommands==nCommands;})) {
+    printf("error: %d/%d commands received\n",(int)obj.nCommands,nCommands);
+    return -1;
+  }
+  std::string state;
+  if (waitFor([&]{client.getState(state); return state=="CMD099";})) {
+    printf("error: state %s\n",state.c_str());
+    return -1;
+  }
+
+  // ephemeral nodes removed with their directory
+  std::string v;
+  Directory *dEphemeral=new Directory(dCfg);
+  dEphemeral->CreateNode("/testDirectoryEphemeral","1",Directory::NodeOption::ephemeral);
+  if ((dObject.GetValue("/testDirectoryEphemeral",v))||(v!="1")) {
+    printf("error: ephemeral node not found\n");
+    return -1;
+  }
+  delete dEphemeral;
+  // deletion seen by other instances once notified
+  if (waitFor([&]{return dObject.GetValue("/testDirectoryEphemeral",v)!=0;})) {
+    printf("error: ephemeral node not deleted\n");
+    return -1;
+  }
+
+  // cached values: served locally, and updated on changes made by other instances
+  unsigned long hits0, misses0, hits, misses;
+  dClient.CreateNode("/testDirectoryCache","A",Directory::NodeOption::ephemeral);
+  dObject.GetCacheStats(hits0,misses0);
+  for (int i=0;i<1000;i++) {
+    dObject.GetValue("/testDirectoryCache",v);
+  }
+  dObject.GetCacheStats(hits,misses);
+  if ((v!="A")||(hits-hits0<990)) {
+    printf("error: cache not used, value %s, %lu hits %lu misses\n",v.c_str(),hits-hits0,misses-misses0);
+    return -1;
+  }
+  dClient.SetValue("/testDirectoryCache","B");
+  if (waitFor([&]{dObject.GetValue("/testDirectoryCache",v); return v=="B";})) {
+    printf("error: cache not updated, value %s\n",v.c_str());
+    return -1;
+  }
+  dObject.SetValue("/testDirectoryCache","C");
+  if ((dObject.GetValue("/testDirectoryCache",v))||(v!="C")) {
+    printf("error: own write not seen, value %s\n",v.c_str());
+    return -1;
+  }
+  dClient.DeleteNode("/testDirectoryCache");
+  if (waitFor([&]{return dObject.GetValue("/testDirectoryCache",v)!=0;})) {
+    printf("error: cache not invalidated\n");
+    return -1;
+  }
+
+  // concurrent writers: once writes are completed, each instance serves the final value (not its own last write)
+  dObject.CreateNode("/testDirectoryWriters","",Directory::NodeOption::ephemeral);
+  dObject.GetValue("/testDirectoryWriters",v);
+  dClient.GetValue("/testDirectoryWriters",v);
+  std::thread w1([&]{for (int i=0;i<2000;i++) {dObject.SetValue("/testDirectoryWriters","object"+std::to_string(i));}});
+  std::thread w2([&]{for (int i=0;i<2000;i++) {dClient.SetValue("/testDirectoryWriters","client"+std::to_string(i));}});
+  w1.join();
+  w2.join();
+  std::string vFinal;
+  {
+    Directory dCheck(dCfg);   // new instance, nothing cached
+    dCheck.GetValue("/testDirectoryWriters",vFinal);
+  }
+  std::string vObject, vClient;
+  if (waitFor([&]{dObject.GetValue("/testDirectoryWriters",vObject); dClient.GetValue("/testDirectoryWriters",vClient); return (vObject==vFinal)&&(vClient==vFinal);})) {
+    printf("error: stale cache after concurrent writes: %s %s, expected %s\n",vObject.c_str(),vClient.c_str(),vFinal.c_str());
+    return -1;
+  }
+  dObject.DeleteNode("/testDirectoryWriters");
+
+  printf("%s : ok\n",connection);
+  return 0;
+}
+
+// last value notified is the last value set, when several threads update a node
+typedef struct {
+  std::mutex mutex;
+  std::string lastValue;
+  int done;
+} OrderCheck;
+
+void orderCallback(const std::string value, void *context, NodeCallback::NodeEventType event) {
+  OrderCheck *c=(OrderCheck *)context;
+  std::lock_guard<std::mutex> lock(c->mutex);
+  if (event!=NodeCallback::NodeEventType::NodeUpdated) {return;}
+  if (value=="done") {
+    c->done=1;
+  } else {
+    c->lastValue=value;
+  }
+}
+
+int testInprocOrder() {
+  DirectoryBackend *b=createDirectoryBackendInproc();
+  OrderCheck check;
+  check.done=0;
+  NodeCallback cb;
+  cb.f_callback=orderCallback;
+  cb.context=&check;
+  b->createNode("/testDirectoryOrder","",0);
+  b->subscribeNode("/testDirectoryOrder",&cb);
+  std::vector<std::thread> writers;
+  for (int i=0;i<4;i++) {
+    writers.push_back(std::thread([b,i]{
+      for (int j=0;j<10000;j++) {
+        b->setValue("/testDirectoryOrder",std::to_string(i)+"-"+std::to_string(j));
+      }
+    }));
+  }
+  for (auto &t : writers) {
+    t.join();
+  }
+  // events are dispatched in a single queue: once this one is notified, all previous ones are
+  b->createNode("/testDirectoryOrderDone","done",0);
+  b->subscribeNode("/testDirectoryOrderDone",&cb);
+  int err=waitFor([&]{std::lock_guard<std::mutex> lock(check.mutex); return check.done==1;});
+  b->unsubscribe(&cb);
+  std::string v;
+  b->getValue("/testDirectoryOrder",v);
+  if ((err)||(check.lastValue!=v)) {
+    printf("error: last value notified %s, expected %s\n",check.lastValue.c_str(),v.c_str());
+    err=-1;
+  }
+  b->deleteNode("/testDirectoryOrder");
+  b->deleteNode("/testDirectoryOrderDone");
+  delete b;
+  return err;
+}
+
+int main(int argc, char *argv[]) {
+  int err=0;
+  try {
+    if (testBackend("inproc://")) {err=1;}
+    if (testInprocOrder()) {err=1;}
+
+    const char *socketPath="/tmp/testDirectory.sock";
+    DirectoryServer server(socketPath);
+    std::thread t(&DirectoryServer::run,&server);
+    std::string connection=std::string("unix://")+socketPath;
+    if (testBackend(connection.c_str())) {err=1;}
+
+    // ephemeral nodes of a client exiting without closing its directory are removed, even if server is idle
+    Directory dCheck(DirectoryConfig(connection.c_str()));
+    pid_t pid=fork();
+    if (pid==0) {
+      Directory *d=new Directory(DirectoryConfig(connection.c_str()));
+      d->CreateNode("/testDirectoryCrash","1",Directory::NodeOption::ephemeral);
+      _exit(0);
+    }
+    waitpid(pid,NULL,0);
+    std::string v;
+    if (waitFor([&]{return dCheck.GetValue("/testDirectoryCrash",v)!=0;})) {
+      printf("error: ephemeral node of disconnected client not deleted\n");
+      err=1;
+    }
+    server.stop();
+    t.join();
+  }
+  catch (const char *e) {
+    printf("error : %s\n",e);
+    err=1;
+  }
+  return err;
+}
@@ -0,0 +1,174 @@
+#include "ControlStateMachine/BaseControl.h"
+#include "ControlStateMachine/StateMachine.h"
+#include "ControlStateMachine/TransitionTable.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+// check that RuntimeControlEngine executes objects in parallel (using in-process directory)
+
+// transition tables are built at compile time
+enum class testState {undefined,idle,busy};
+enum class testCommand {undefined,go,done};
+constexpr EnumNames<testState,3> testStateNames({"UNDEFINED","IDLE","BUSY"});
+constexpr Transition<testState,testCommand> testTransitions[]={
+  {testState::idle, testCommand::go,   testState::busy},
+  {testState::busy, testCommand::done, testState::idle},
+};
+constexpr TransitionTable<testState,testCommand,3,3> testTable(testTransitions,testState::undefined);
+static_assert(testTable.next(testState::idle,testCommand::go)==testState::busy,"table built at compile time");
+static_assert(!testTable.isValid(testState::busy,testCommand::go),"transition not in table is invalid");
+
+class slowObject:public RuntimeControlledObject {
+  public:
+  std::atomic<int> nPrepare;
+  std::atomic<int> nCheck;
+  slowObject(const std::string objectName):RuntimeControlledObject(objectName) {
+    nPrepare=0;
+    nCheck=0;
+  }
+  int executePrepare() {
+    nPrepare++;
+    usleep(200000);
+    return 0;
+  }
+  int iterateRunning() {
+    // a slow iteration should not block other objects
+    usleep(500000);
+    return 0;
+  }
+  int iterateCheck() {
+    nCheck++;
+    return 0;
+  }
+};
+
+// wait for a condition, at most 5 seconds
+template <typename T> int waitFor(T condition) {
+  for (int i=0;i<5000;i++) {
+    if (condition()) {return 0;}
+    usleep(1000);
+  }
+  return -1;
+}
+
+int main(int argc, const char *argv[]) {
+  if ((testStateNames.getId("BUSY")!=testState::busy)||(testStateNames.getId("unknown")!=testState::undefined)) {
+    printf("error: bad state name lookup\n");
+    return -1;
+  }
+
+  DirectoryConfig dCfg("inproc://");
+  Directory dClient(dCfg);
+
+  const int nObjects=20;
+  std::vector<std::unique_ptr<slowObject>> objects;
+  for (int i=0;i<nObjects;i++) {
+    objects.push_back(std::make_unique<slowObject>("testEngine"+std::to_string(i)));
+  }
+  // periodic check enabled for one object of the pool, and for the object with its own thread
+  const int checkIntervalMs=50;
+  objects[1]->setCheckInterval(checkIntervalMs);
+  objects[nObjects-1]->setCheckInterval(checkIntervalMs);
+
+  RuntimeControlEngine e(dCfg,nObjects);
+  for (int i=0;i<nObjects;i++) {
+    // last object runs in its own thread
+    e.registerObject(objects[i].get(),i==nObjects-1);
+  }
+
+  std::vector<std::unique_ptr<ControlClient>> clients;
+  for (int i=0;i<nObjects;i++) {
+    clients.push_back(std::make_unique<ControlClient>("testEngine"+std::to_string(i),&dClient));
+  }
+  auto allInState=[&](const char *s) {
+    for (auto &c : clients) {
+      std::string state;
+      c->getState(state);
+      if (state!=s) {return false;}
+    }
+    return true;
+  };
+  if (waitFor([&]{return allInState("STANDBY");})) {
+    printf("error: objects not in STANDBY\n");
+    return -1;
+  }
+
+  // one object running a slow iteration
+  clients[0]->sendCommand("prepare");
+  if (waitFor([&]{std::string s; clients[0]->getState(s); return s=="READY";})) {
+    printf("error: object not READY\n");
+    return -1;
+  }
+  clients[0]->sendCommand("start");
+  usleep(100000);
+
+  // prepare all other objects in parallel: should take about the time of the slowest one
+  auto t0=std::chrono::steady_clock::now();
+  for (int i=1;i<nObjects;i++) {
+    clients[i]->sendCommand("prepare");
+  }
+  if (waitFor([&]{
+    for (int i=1;i<nObjects;i++) {
+      std::string s;
+      clients[i]->getState(s);
+      if (s!="READY") {return false;}
+    }
+    return true;
+  })) {
+    printf("error: objects not READY\n");
+    return -1;
+  }
+  double t=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+  printf("%d objects prepared in %.3fs\n",nObjects-1,t);
+  if (t>1.0) {
+    printf("error: objects not prepared in parallel\n");
+    return -1;
+  }
+
+  // burst of commands: all executed back to back, without loss
+  for (int i=1;i<nObjects;i++) {
+    clients[i]->sendCommand("start");
+    clients[i]->sendCommand("stop");
+    clients[i]->sendCommand("reset");
+    clients[i]->sendCommand("prepare");
+  }
+  if (waitFor([&]{
+    for (int i=1;i<nObjects;i++) {
+      if (objects[i]->nPrepare!=2) {return false;}
+      std::string s;
+      clients[i]->getState(s);
+      if (s!="READY") {return false;}
+    }
+    return true;
+  })) {
+    printf("error: burst of commands not executed\n");
+    return -1;
+  }
+
+  // periodic check only for objects which enabled it, others not woken up while idle
+  for (auto &o : objects) {
+    o->nCheck=0;
+  }
+  usleep(1000000);
+  for (int i=0;i<nObjects;i++) {
+    int n=objects[i]->nCheck;
+    bool isEnabled=(i==1)||(i==nObjects-1);
+    if ((isEnabled)&&((n<1000/checkIntervalMs/2)||(n>1000/checkIntervalMs+2))) {
+      printf("error: object %d checked %d times in 1s, interval %dms\n",i,n,checkIntervalMs);
+      return -1;
+    }
+    if ((!isEnabled)&&(n!=0)) {
+      printf("error: object %d checked %d times, check not enabled\n",i,n);
+      return -1;
+    }
+  }
+
+  clients.clear();
+  printf("Test completed\n");
+  return 0;
+}
@@ -9,13 +9,22 @@
 #define	ZDAQ_H
 
 
-enum class mt_status {UNDEFINED, NOT_READY, READY, RUNNING, STOPPED, ERROR};
-enum class mt_command {UNDEFINED, INIT, START, STOP, RELEASE, RESET};
+#include <atomic>
+
+// ARM: prepare for synchronized start (c.f. zdaqCtrl_group::execSynchronizedStart). Command arguments: barrier path, deadline.
+// ARMED: ready to start, waiting for barrier release. Goes to RUNNING when released.
+enum class mt_status {UNDEFINED, NOT_READY, READY, RUNNING, STOPPED, ERROR, ARMED};
+enum class mt_command {UNDEFINED, INIT, START, STOP, RELEASE, RESET, ARM};
 
 
 
 
 #include "zdaq_ctrl.h"
+#include "zdaq_record.h"
+#include "zdaq_metrics.h"
+
+class daqEvent;
+class daqReplaySource;
 
 class zdaqCtrl_config {
     std::string m_objectName;     // object name, as in zookeeper tree
@@ -34,7 +43,7 @@ class zdaqCtrl_config {
 
 
 
-class daqModule: public zdaqCtrl_object {    
+class daqModule: public zdaqCtrl_object, public zdaqMetrics_source {    
   
   ////////////////////////////////
   // implementation of zdaq_ctrl
@@ -57,6 +66,11 @@ public:
   
   protected:
   int setStatus(mt_status s);
+  
+  private:
+  std::atomic<mt_status> status;  // current status, as last set by setStatus()
+  
+  protected:
  
   virtual int exec_INIT();
   virtual int exec_START();
@@ -69,6 +83,7 @@ private:
   pthread_t thread;  // thread for execution of loop
   int th_status;     // thread status: 0=stopped, 1=running, 2=error
   int th_do_stop;    // flag to stop thread loop
+  int th_armed;      // flag set when thread should wait for start barrier before loop
   protected:
   int th_stop_immediate;  // flag set to 1 when thread should complete immediately on STOP command, or if it should flush pending work first.
   pthread_t thread_id;
@@ -90,6 +105,13 @@ private:
   int stats_nItems_out;  // counter for number of items output by module
   long long stats_nBytes_in;   // counter for number of bytes input by module
   long long stats_nBytes_out;  // counter for number of bytes output by module
+  zdaqMetrics_histogram stats_loopTime;  // duration of do_loop() calls, in microseconds
+
+  // metrics published periodically in the directory (c.f. zdaqCtrl_client::getMetrics)
+  virtual void getMetrics(zdaqMetrics_writer &w);  // derived classes may add their own, after calling this one
+
+  protected:
+  zdaqMetrics_publisher *metrics;   // publisher of the process. Derived classes with metrics using their own members should call metrics->removeSource(this) in destructor.
 };
 
 
@@ -109,6 +131,8 @@ class daqModule_fifo: public daqModule {
 
   int isFull();
   int isEmpty();
+
+  void getMetrics(zdaqMetrics_writer &w);  // adds FIFO depth and size
   
   private:
   int size;
@@ -166,6 +190,51 @@ class daqModule_producer_rand: public daqModule_producer {
 
 
 
+/*
+ * A producer module replaying files written by daqModule_consumer_recordToFile.
+ * Files are mapped in memory, and events emitted with payloads pointing directly to the mapping (no copy).
+ * Each file stays mapped as long as events referencing it are alive.
+ * Several files are replayed in parallel, events being taken from each in turn (or by timestamp in ORIGINAL_TIMING mode),
+ * and each file has a thread reading its data ahead of the replay position.
+ * Event ids are those recorded in the files.
+ */
+class daqModule_producer_fileReplay: public daqModule_producer {
+  public:
+  daqModule_producer_fileReplay(zdaqCtrl_config);
+  ~daqModule_producer_fileReplay();
+
+  enum t_replayMode {MAX_SPEED, FIXED_RATE, ORIGINAL_TIMING};
+
+  int do_loop(int maxItems);
+
+  int addFile(const char *path);                  // add a file to be replayed
+  int setMode(t_replayMode mode, double value=0); // replay mode. value: events per second for FIXED_RATE, speed factor for ORIGINAL_TIMING (1.0 = as recorded). ORIGINAL_TIMING needs files with index (INIT fails otherwise).
+  int setLoop(int nLoops);                        // number of times files are replayed (0: forever). Default: 1.
+  int setReadAhead(unsigned long long bytes);     // amount of data read ahead of replay position, for each file
+
+  int exec_INIT();
+  int exec_STOP();
+  int exec_RELEASE();
+
+  private:
+  int setup();
+  int cleanup();
+
+  std::vector<std::string> files;             // files to replay
+  std::vector<daqReplaySource *> sources;     // opened files
+  t_replayMode mode;
+  double modeValue;
+  int nLoops;
+  unsigned long long readAhead;
+
+  int isStarted;                  // set when replay timing reference defined, cleared on STOP
+  unsigned long long tStart;      // replay start time (ns)
+  unsigned long long nEmitted;    // number of events emitted since start
+  int ixSource;                   // next source for round-robin
+};
+
+
+
 class daqModule_consumer_recordToFile: public daqModule_consumer {
   public:
   daqModule_consumer_recordToFile(zdaqCtrl_config);
@@ -173,15 +242,37 @@ class daqModule_consumer_recordToFile: public daqModule_consumer {
   
   int do_loop(int maxItems);
   int setFile(const char* f);
+  int setDirectIO(int bufferSize);  // record with O_DIRECT through page-aligned staging buffers of given size (bytes), written by a separate thread. 0: use stdio (default).
+  int addDirectory(const char *path);                             // record striped over several directories, one writer thread each. The name given by setFile() is then used as base name.
+  int setChunkSize(unsigned long long bytes);                     // size of the chunks distributed round-robin over directories
+  int setRotation(unsigned long long maxBytes, int maxSeconds);   // start a new output file when current one exceeds maxBytes or maxSeconds (0: no limit)
+  int setIndex(int enabled);                                      // write an index file [file].idx next to each output file, for random access with daqFileReader
 
   int exec_INIT();
   int exec_RELEASE();
 
   private:
   char* filename;
-  FILE *fd;
   int setup();
   int cleanup();
+  int writeEvent(daqEvent *ev);    // write event to output (O_DIRECT or striped modes)
+
+  daqRecordGather *gather;          // writer used in default mode, events written in batches
+  std::vector<daqEvent *> batch;    // events pending in gather writer
+  int flushBatch();                 // write events pending in gather writer
+
+  int directBufferSize;       // size of staging buffers for O_DIRECT mode, 0 if disabled
+  daqRecordWriter *writer;    // writer used in O_DIRECT mode
+  time_t lastStatsPublish;    // time of last flush statistics publication
+
+  std::vector<std::string> stripeDirectories;   // output directories for striped recording
+  unsigned long long stripeChunkSize;           // chunk size for striped recording (0: default)
+  unsigned long long rotateMaxBytes;            // max file size (0: no limit)
+  int rotateMaxSeconds;                         // max file age (0: no limit)
+  daqRecordStriper *striper;                    // used for striped and/or rotated recording
+  int useIndex;                                 // write index files
+  daqFileIndexWriter *index;                    // index of single output file
+  int publishFlushStats();    // publish writer flush latency (single or striped output)
 
   unsigned long long nEvents;
   unsigned long long nBytes;
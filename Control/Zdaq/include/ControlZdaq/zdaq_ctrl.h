@@ -9,8 +9,15 @@
 #define	ZDAQ_CTRL_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include <zookeeper/zookeeper.h>
 #include <vector>
+#include <string>
+#include <set>
+#include <map>
+#include <deque>
+
+#include "zdaq_metrics.h"
 
 #ifdef	__cplusplus
 extern "C" {
@@ -56,6 +63,74 @@ private:
 */
 
 
+/* A connection to the zookeeper service, shared by all control objects of the process using the same DNS.
+ * Sessions are reference-counted: get() returns the session for a DNS (created on first use), release() drops the reference.
+ * Connection state changes are signaled with a condition variable, so that objects wait for the connection without polling.
+ *
+ * Callbacks are routed through the session: each object attached gets a token, to be used as watcher/completion context
+ * instead of the object address. Callbacks start with enter(token), which returns the object if still attached (and then
+ * leave() must be called at the end), or NULL. Tokens are never reused, so that pending watches of a destroyed object
+ * can not reach another object allocated at the same address. Once detach() returns, no callback is running or will run for the object.
+ *
+ * Each token is also a namespace for the ephemeral nodes created by the object: as the session outlives the objects,
+ * these nodes are deleted by detach().
+ *
+ * The session also publishes the states of all the objects of the process in a single ephemeral node below ZDAQ_STATUS_ROOT,
+ * one line "objectName=state" per object. This allows groups to follow many objects with a few watches (c.f. zdaqCtrl_group).
+ * Updates are coalesced: while a write is in progress, changes are accumulated and written with the next one.
+ */
+#define ZDAQ_STATUS_ROOT "/zdaqStatus"
+
+class zdaqCtrl_session {
+public:
+    static zdaqCtrl_session *get(const char *DNS);   // get a reference to the session for given DNS (a new one if previous expired). Returns NULL on error.
+    void release();                                   // release reference obtained with get()
+
+    zhandle_t *getHandle();
+    int waitConnected(int timeout);   // wait until session connected, for at most timeout milliseconds. Returns 0 if connected.
+    int isConnected();
+
+    void *attach(void *listener);     // register an object receiving callbacks. Returns its token.
+    int detach(void *token);          // unregister an object, and delete its ephemeral nodes. Waits for callbacks in progress.
+    void *enter(void *token);         // to be called at start of callbacks. Returns the object if still registered (then leave() must be called at the end), NULL otherwise.
+    void leave();
+
+    int addEphemeral(void *token, const char *path);      // record an ephemeral node created by the object
+    int setObjectStatus(const char *objectName, const char *state);  // update object state in aggregated status node. NULL state removes the object.
+
+private:
+    zdaqCtrl_session(const char *DNS);
+    ~zdaqCtrl_session();
+
+    std::string dns;
+    int nRef;                         // number of references (protected by pool mutex)
+    zhandle_t *zh;
+    int z_ok;                         // set when connected
+    int z_shutdown;                   // set when session expired or authentication failed
+    pthread_mutex_t mutex;            // protects connection state
+    pthread_cond_t cond;              // signaled on connection state change
+    pthread_mutex_t dispatchMutex;    // held while callbacks execute (recursive). Protects listeners.
+    typedef struct {
+        void *object;                           // the object receiving callbacks
+        std::set<std::string> ephemeralNodes;   // ephemeral nodes created by the object
+    } t_listener;
+    std::map<uintptr_t,t_listener> listeners;   // objects registered for callbacks, by token
+    uintptr_t lastToken;                        // last token allocated
+    static void z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
+
+    // aggregated status
+    pthread_mutex_t statusMutex;                      // protects variables below
+    std::map<std::string,std::string> statusEntries;  // state of each object
+    std::string statusNode;                           // path of aggregated status node
+    int statusNodeCreated;
+    int statusWritePending;                           // set while a write is in progress
+    int statusDirty;                                  // set when entries changed since last write
+    void writeStatus();                               // write status node (called with statusMutex locked)
+    static void z_completion_status(int rc, const struct Stat *stat, const void *data);
+    static void z_completion_status_create(int rc, const char *value, const void *data);
+};
+
+
 class zdaqCtrl_client {
 public:
     zdaqCtrl_client(const char *objectName, const char* DNS);      // serviceName: name of the service to register. DNS: info to access to service directory (host/port).
@@ -64,14 +139,14 @@ public:
     const char* getState();     // retrieves the remote object state
     int execCommand(const char *command);       // send a command to remote object
     int getData(const char *key, char *value, int *valueSz);  // retrieve data published in object. valueSz initially set to size of 'value' buffer given, returned with actual data size and buffer set.
+    int getCacheStats(unsigned long *hits, unsigned long *misses);  // number of getData() calls served from local cache (hits), or from zookeeper (misses)
+    int getMetrics(std::vector<zdaqMetrics_value> &metrics);  // retrieve latest metrics published by remote object (c.f. zdaqMetrics_publisher). Returns 0 on success.
     
 private:
        
+    zdaqCtrl_session *session;    // shared connection
     zhandle_t *zh;
-    clientid_t z_id;
-    static void z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
-    int z_shutdown;
-    int z_ok;
+    void *z_token;                // token for callbacks
     
     char state[128];
     char objname[128];
@@ -81,6 +156,23 @@ private:
     
     static void z_watcher_state (zhandle_t *zzh, int type, int state, const char *path, void* context);
 
+    // cache of data read with getData(): first read of a key sets a watch on its node,
+    // changes invalidate the entry and trigger an asynchronous refresh.
+    // Values are stored only if not older (by modification zxid) than the one cached.
+    typedef struct {
+        std::string value;
+        int exists;           // node exists (if valid)
+        int valid;            // entry can be served from cache
+        int64_t mzxid;        // zxid of the modification which set the value
+    } t_dataEntry;
+    pthread_mutex_t dataMutex;                    // protects variables below
+    std::map<std::string,t_dataEntry> dataCache;  // by node path
+    unsigned long dataHits;
+    unsigned long dataMisses;
+    void storeData(const char *path, const char *value, int valueSz, const struct Stat *stat);  // store value read, if not older than cached one
+    static void z_watcher_data (zhandle_t *zzh, int type, int state, const char *path, void* context);
+    static void z_completion_data(int rc, const char *value, int value_len, const struct Stat *stat, const void *data);
+
 };
 
 class zdaqCtrl_object {
@@ -88,14 +180,15 @@ public:
     zdaqCtrl_object(const char *objectName, const char* DNS);      // objectName: name of the service to register. DNS: info to access to service directory (host/port).
     ~zdaqCtrl_object();    
     
-    int publishString(const char *key, const char *value);  // publish a value
+    int publishString(const char *key, const char *value);  // publish a value. Values are queued, and published in batches (c.f. setPublishInterval).
+    int setPublishInterval(int ms);     // minimum time between two publications of queued values, in milliseconds (0: publish immediately). Default: 100ms.
+    int flushPublish();                 // publish queued values now. Returns 0 on success.
     
 private:       
+    zdaqCtrl_session *session;    // shared connection
     zhandle_t *zh;
-    clientid_t z_id;
-    static void z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
-    int z_shutdown;
-    int z_ok;
+    void *z_token;                // token for callbacks
+    static void z_completion_create(int rc, const char *value, const void *data);     // completion for registration znodes
     
     char state[128];
     char objname[128];
@@ -104,16 +197,64 @@ private:
     char znode_command[128];
     char znode_data[128];
     
-    int cmd_purge;
+    // command queue: command znodes are listed, retrieved and deleted asynchronously, and delivered in sequence order
+    // to a separate thread executing them, so that the zookeeper thread never blocks on commands.
+    typedef struct {
+        int fetched;                    // set when retrieval completed
+        int valid;                      // set if retrieval succeeded
+        std::string value;              // command
+    } t_cmdPending;
+    pthread_mutex_t cmdMutex;           // protects variables below
+    pthread_cond_t cmdCond;             // signaled when a command is ready, or on shutdown
+    std::map<int64_t,t_cmdPending> cmdPending;  // commands being retrieved, by sequence number
+    int64_t cmdLastSeq;                 // highest sequence number listed so far
+    std::deque<std::string> cmdQueue;   // commands ready for execution, in order
+    int cmdShutdown;                    // set to stop command thread
+    int cmdThreadStarted;
+    pthread_t cmdThread;
+    static void *cmdThreadLoop(void *arg);
+    void cmdDeliver();                  // move retrieved commands from head of cmdPending to cmdQueue (called with cmdMutex locked)
     static void z_watcher_cmd (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
+    static void z_completion_cmdList(int rc, const struct String_vector *strings, const void *data);
+    static void z_completion_cmdGet(int rc, const char *value, int value_len, const struct Stat *stat, const void *data);
     
     int m_debug;
+
+    // publication batcher: values published are coalesced by key (last value wins), and written in a single transaction.
+    // State changes are written immediately, together with queued values.
+    pthread_mutex_t publishMutex;       // protects queue below
+    pthread_cond_t publishCond;         // signaled when a value is queued, or on shutdown
+    std::map<std::string,std::string> publishQueue;   // values not published yet, by node path
+    pthread_mutex_t publishFlushMutex;  // held while a transaction is executed, so that they are written in order
+    std::set<std::string> publishNodes; // data nodes already created
+    int publishInterval;                // minimum time between publications (ms)
+    double publishLastTime;             // time of last publication
+    int publishShutdown;                // set to stop publication thread
+    int publishThreadStarted;
+    pthread_t publishThread;
+    static void *publishThreadLoop(void *arg);
+    int publish(const char *newState);  // write queued values, and new state if not NULL, in a single transaction
+    
+    // start barrier: see armBarrier()
+    pthread_mutex_t barrierMutex;       // protects variables below
+    pthread_cond_t barrierCond;         // signaled when barrier released or cancelled
+    char barrierPath[128];              // znode released when created
+    double barrierDeadline;             // time (CLOCK_REALTIME, in seconds) of release (0: none)
+    int barrierReleased;
+    int barrierCancelled;
+    static void z_watcher_barrier (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
     
 protected:    
     int setState(const char *newState);
     virtual int executeCommand(const char *command)=0;
     const char*getName();
     const char*getState();        
+
+    // synchronized start: the barrier is released when znode path is created, or at deadline (CLOCK_REALTIME seconds, 0: no deadline).
+    // Objects arm the barrier, prepare what is needed to start, then wait for release in waitBarrier(), which returns 0 once released.
+    int armBarrier(const char *path, double deadline);
+    int waitBarrier();            // returns 0 when released, -1 if cancelled
+    void cancelBarrier();         // abort waitBarrier()
 };
 
 class testStateObj: public zdaqCtrl_object {
@@ -135,8 +276,14 @@ class zdaqCtrl_item {
 public:
     zdaqCtrl_item(const char* name, zdaqCtrl_group *group);    // create an item associated to given object name in given group
     ~zdaqCtrl_item();
-    int execCommand(const char *command);       // send a command to the object
+    int execCommand(const char *command);       // send a command to the object (synchronous)
     int debug;  // flag for debug messages
+
+    const char *getName();          // object name
+    const char *getState();         // current (known) state of the object
+    int getCommandStatus();         // result of last command sent by the group: 0 ok, 1 not completed (pending or timeout), -1 failed
+    double getCommandLatency();     // time (seconds) for last command sent by the group to be acknowledged, or to reach target state if requested
+    double getStartTime();          // time (CLOCK_REALTIME, in seconds) when the object actually started on last execSynchronizedStart(), 0 if unknown
 private:
      const zdaqCtrl_group *Ctrl_group;        // group associated to the object
      
@@ -145,6 +292,16 @@ private:
     
     char znode_state[128];    // path to znode for object state in zookeeper
     char znode_command[128];  // path to znode for object command queue in zookeeper   
+    void *z_token;            // token for callbacks
+
+    // status of last command sent by the group (protected by group mutex)
+    int cmdId;                // id of last command
+    int cmdAcked;             // set when command znode created
+    int cmdDone;              // set when command completed (acknowledged, and target state reached if requested)
+    int cmdError;             // zookeeper error code for command znode creation
+    double cmdTime;           // time when command sent
+    double cmdLatency;        // time to complete command
+    double startTime;         // start time reported by object on last synchronized start
     
     friend class zdaqCtrl_group;
 };
@@ -153,26 +310,56 @@ private:
  */
 class zdaqCtrl_group {
 public:
-    zdaqCtrl_group(const char* DNS);      // DNS: info to access to service directory (host/port).
+    zdaqCtrl_group(const char* DNS, int aggregatedStatus=1);      // DNS: info to access to service directory (host/port). aggregatedStatus: if set, follow items states from aggregated status nodes (a few watches for all items), otherwise with one watch per item.
     ~zdaqCtrl_group();
 
-    int execCommand(const char *command);       // send a command to all items in group
+    // send a command to all items in group, in parallel. Returns once all commands acknowledged, or if targetState is set, when all items are in this state.
+    // timeout in milliseconds (0: 10 seconds). Returns 0 on success, -1 if a command failed or timeout.
+    int execCommand(const char *command, const char *targetState=NULL, int timeout=0);
+    
+    // start all items at the same time, in two phases: items are first armed (ARM command, state ARMED),
+    // then released together by the creation of a barrier znode, or at a deadline 'delay' milliseconds after all items armed (0: barrier only).
+    // Returns once all items RUNNING, 0 on success, -1 on error or timeout (items armed are then stopped). Timeout in milliseconds, for each phase (0: 10 seconds).
+    int execSynchronizedStart(int timeout=0, int delay=0);
+    double getStartSkew();                        // difference between first and last item start times of last execSynchronizedStart() (seconds)
     
     int addObject(const char *objectName);        // add a new object to group
+
+    int getNumberOfItems();
+    zdaqCtrl_item *getItem(int ix);
+    zdaqCtrl_item *getSlowestItem();              // item which took longest to complete last command (NULL if none)
+    double getCommandTime();                      // duration of last execCommand() (seconds)
     
     int debug;  // flag for debug messages
     private:
         int addItem(zdaqCtrl_item *i);     // add an item to the group
+
+    pthread_mutex_t mutex;        // protects items state and command status
+    pthread_cond_t cond;          // signaled on command completion and state change
+    int cmdId;                    // id of last command sent
+    const char *cmdTargetState;   // state expected for last command (NULL: none)
+    int cmdPending;               // number of items for which last command not completed
+    double cmdTotalTime;          // duration of last execCommand()
+    double startSkew;             // skew of last execSynchronizedStart()
+    int waitPending(double deadline);             // wait until no command pending (cmdPending), or deadline (getTimeNow() reference). Returns 0 on success, -1 on timeout.
+    int updateCommandStatus(zdaqCtrl_item *i);    // check if item completed current command (called with mutex locked)
+    static void z_completion_cmd(int rc, const char *value, const void *data);   // zookeeper completion for command znodes
     
     std::vector<zdaqCtrl_item*> items;           // internal list of the items part of this group
     
+    // aggregated status (c.f. zdaqCtrl_session)
+    int useAggregatedStatus;
+    void *z_token;                                                 // token for callbacks of status nodes
+    std::map<std::string,std::set<std::string>> statusNodes;       // status nodes watched, with names of objects they contain (protected by mutex)
+    std::map<std::string,std::string> knownStates;                 // states of objects found in status nodes (protected by mutex)
+    std::map<std::string,zdaqCtrl_item*> itemsByName;              // items, by object name (protected by mutex)
+    void readStatusRoot();                                         // update list of status nodes (to be called with session entered)
+    void readStatusNode(const char *path);                         // decode a status node (to be called with session entered)
+    static void z_watcher_status (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);
+    
+    zdaqCtrl_session *session;    // shared connection
     zhandle_t *zh;
-    clientid_t z_id;
-    static void z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx);            // zookeeper callback for general connection handling
     static void z_watcher_item (zhandle_t *zzh, int type, int state, const char *path, void* watcherCtx);         // zookeeper callback for items (states, commands) in the group
-
-    int z_shutdown;
-    int z_ok;
     
     friend class zdaqCtrl_item;
 };
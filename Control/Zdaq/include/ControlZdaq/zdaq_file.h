@@ -0,0 +1,160 @@
+/*
+ * File:   zdaq_file.h
+ *
+ * Format of files written by daqModule_consumer_recordToFile,
+ * and classes to index them and read them back.
+ */
+
+#ifndef ZDAQ_FILE_H
+#define	ZDAQ_FILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+
+/* Data file: a plain sequence of events, each made of an eventHeader followed by the payload (h.size bytes). */
+
+typedef struct {
+    int id;
+    int size;
+} eventHeader;
+
+
+/* Index file: a sidecar file [datafile].idx made of
+ * - a daqFileIndexHeader
+ * - one daqFileIndexEntry per event, in file order
+ * - a table of daqFileChunkEntry, with checksums of consecutive chunks of the data file
+ * - a daqFileIndexTrailer, written when the data file is closed
+ * If the recording was interrupted, the trailer and chunk table are missing, but the events entries are still valid.
+ */
+
+#define DAQ_FILE_INDEX_MAGIC 0x4951445A           // "ZDQI"
+#define DAQ_FILE_INDEX_TRAILER_MAGIC 0x4551445A   // "ZDQE"
+#define DAQ_FILE_INDEX_VERSION 1
+#define DAQ_FILE_INDEX_SUFFIX ".idx"
+
+typedef struct {
+    uint32_t magic;             // DAQ_FILE_INDEX_MAGIC
+    uint32_t version;           // DAQ_FILE_INDEX_VERSION
+    uint32_t entrySize;         // sizeof(daqFileIndexEntry)
+    uint32_t chunkEntrySize;    // sizeof(daqFileChunkEntry)
+    uint64_t chunkSize;         // nominal size of checksum chunks, in bytes (0: no checksums)
+} daqFileIndexHeader;
+
+typedef struct {
+    int32_t  id;                // event id
+    uint32_t size;              // payload size
+    uint64_t offset;            // offset of eventHeader in data file
+    uint64_t timestamp;         // recording time, in nanoseconds since epoch
+} daqFileIndexEntry;
+
+typedef struct {
+    uint64_t offset;            // offset of chunk in data file
+    uint64_t size;              // size of chunk (a chunk always contains complete events)
+    uint64_t firstEvent;        // index of first event in chunk
+    uint32_t nEvents;           // number of events in chunk
+    uint32_t checksum;          // CRC-32 of chunk data
+} daqFileChunkEntry;
+
+typedef struct {
+    uint64_t nEvents;           // number of event entries
+    uint64_t nChunks;           // number of chunk entries
+    uint64_t chunkTableOffset;  // offset of chunk table in index file
+    uint32_t magic;             // DAQ_FILE_INDEX_TRAILER_MAGIC
+    uint32_t reserved;
+} daqFileIndexTrailer;
+
+
+// compute CRC-32 (same as zlib crc32()) of a buffer. Start with crc=0, and call again with previous result to continue.
+uint32_t daqFileChecksum(uint32_t crc, const void *data, size_t size);
+
+// returns current time, in nanoseconds since epoch, as stored in index entries
+uint64_t daqFileTimestamp();
+
+
+/* A class to write the index file of a data file being recorded */
+class daqFileIndexWriter {
+  public:
+  daqFileIndexWriter(uint64_t chunkSize=8*1024*1024);     // chunkSize: nominal size of checksum chunks (0: no checksums)
+  ~daqFileIndexWriter();
+
+  int open(const char *dataFilePath);   // create index file for given data file
+  int addEvent(const eventHeader *h, const void *data, uint64_t offset);  // record event written at given offset of data file
+  int close();                          // complete the index
+
+  private:
+  FILE *fp;
+  uint64_t chunkSize;
+  uint64_t nEvents;
+  uint64_t nextOffset;                        // expected offset of next event in data file
+  std::vector<daqFileChunkEntry> chunks;      // completed chunks
+  daqFileChunkEntry currentChunk;             // chunk being filled
+  int endChunk();
+};
+
+
+/* A class to access recorded data files, mapped in memory.
+ * Any event can be accessed in constant time through the index file (or an index built by scanning the data file if there is none).
+ * The data returned points directly to the mapped file, and is valid until the reader is closed.
+ */
+class daqFileReader {
+  public:
+  daqFileReader();
+  ~daqFileReader();
+
+  int open(const char *path);   // map data file and its index. Returns 0 on success.
+  int close();
+
+  uint64_t getNumberOfEvents();
+  int getEvent(uint64_t ix, eventHeader *h, const void **data, uint64_t *timestamp=NULL);  // get event by index (0..N-1): header copied (not aligned in file), payload pointer. Returns 0 on success.
+  const daqFileIndexEntry *getIndexEntry(uint64_t ix);                  // get index entry of an event, or NULL
+
+  int hasChecksums();           // returns 1 if checksums available
+  int hasTimestamps();          // returns 1 if event timestamps available (index built by scan has none)
+  int verify();                 // check chunk checksums. Returns number of bad chunks, -1 on error.
+
+  int prefetch(uint64_t ix, uint64_t count);    // hint the kernel to read ahead the data of given events
+  int release(uint64_t ix, uint64_t count);     // hint the kernel that data of given events is no longer needed
+
+  private:
+  int fd;
+  const char *data;             // mapped data file
+  size_t dataSize;
+
+  int indexFd;
+  const char *indexMap;         // mapped index file (NULL if index built by scan)
+  size_t indexSize;
+  const daqFileIndexEntry *entries;           // event entries
+  uint64_t nEvents;
+  const daqFileChunkEntry *chunks;            // chunk entries
+  uint64_t nChunks;
+  std::vector<daqFileIndexEntry> scanEntries; // index built by scanning the data file
+
+  int openIndex(const char *path);
+  int scan();
+  int madviseRange(uint64_t ix, uint64_t count, int advice);
+};
+
+
+/* A class to iterate sequentially over a range of events of a daqFileReader,
+ * reading ahead a window of data (madvise) and releasing pages already consumed.
+ */
+class daqFileRange {
+  public:
+  daqFileRange(daqFileReader *reader, uint64_t first, uint64_t count, uint64_t readAhead=32*1024*1024);
+  ~daqFileRange();
+
+  int next(eventHeader *h, const void **data, uint64_t *timestamp=NULL);   // get next event (c.f. daqFileReader::getEvent). Returns 0 on success, -1 at end of range.
+
+  private:
+  daqFileReader *reader;
+  uint64_t ixNext;              // next event to return
+  uint64_t ixEnd;               // end of range
+  uint64_t ixPrefetched;        // events before this one have been prefetched
+  uint64_t ixReleased;          // events before this one have been released
+  uint64_t readAhead;           // size of read-ahead window, in bytes
+};
+
+#endif	/* ZDAQ_FILE_H */
@@ -0,0 +1,143 @@
+/*
+ * File:   zdaq_metrics.h
+ *
+ * Publication of module metrics (counters, gauges, histograms) to zookeeper.
+ *
+ * Each process has one publisher per DNS, with a thread taking periodically a snapshot of all
+ * the registered sources (e.g. daqModule), and writing it in a single ephemeral node per process,
+ * ZDAQ_METRICS_ROOT/<host>-<pid>. The monitoring load on zookeeper is one write per process and period,
+ * whatever the number of modules and metrics. Processes of the same host do not overwrite each other:
+ * clients merge the nodes of all processes when needed (c.f. zdaqCtrl_client::getMetrics).
+ *
+ * Snapshots are encoded in a compact binary format, with varints and deltas:
+ *   'Z' 'M' version
+ *   varint timestamp (milliseconds since epoch), varint period (milliseconds)
+ *   varint nSources, then for each source:
+ *     name, varint nMetrics, then for each metric:
+ *       type (1 byte), name, value
+ *   Names are delta-encoded against the previous name of the same kind (source / metric):
+ *   varint length of common prefix, varint length of suffix, suffix bytes.
+ *   Values: counter = varint, gauge = zigzag varint,
+ *   histogram = varint nBins (trailing empty bins removed), then each bin as zigzag varint of its difference with previous bin.
+ *
+ * Clients decode snapshots with zdaqMetrics_decode(), or zdaqCtrl_client::getMetrics() for a given object.
+ */
+
+#ifndef ZDAQ_METRICS_H
+#define	ZDAQ_METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define ZDAQ_METRICS_ROOT "/zdaqMetrics"
+#define ZDAQ_METRICS_VERSION 1
+
+class zdaqCtrl_session;
+
+
+/* A histogram with power-of-2 bins, filled without lock.
+ * Bin 0 counts value 0, bin i counts values in [2^(i-1), 2^i[, the last bin counts larger values.
+ */
+class zdaqMetrics_histogram {
+public:
+    static const int nBins=32;
+    zdaqMetrics_histogram();
+    void add(uint64_t value);
+    void reset();
+    std::atomic<uint64_t> bins[nBins];
+};
+
+
+/* Encoding of a snapshot */
+class zdaqMetrics_writer {
+public:
+    zdaqMetrics_writer();
+
+    void begin(uint64_t timestamp, int period);     // start new snapshot. timestamp: milliseconds since epoch. period: publication interval (ms)
+    void beginSource(const char *name);             // following metrics belong to given source
+    void addCounter(const char *name, uint64_t value);
+    void addGauge(const char *name, int64_t value);
+    void addHistogram(const char *name, const zdaqMetrics_histogram &h);
+    const std::string &end();                       // complete snapshot, and get buffer
+
+private:
+    uint64_t timestamp;
+    int period;
+    std::string body;           // sources completed
+    std::string sourceName;     // name of current source (encoded)
+    std::string sourceMetrics;  // metrics of current source (encoded)
+    std::string snapshot;       // complete snapshot
+    int nSources;
+    int nMetrics;               // number of metrics of current source
+    std::string lastSource;     // previous names, for delta encoding
+    std::string lastMetric;
+    void endSource();
+    void putName(std::string &b, std::string &last, const char *name);
+};
+
+
+/* A decoded metric */
+typedef struct {
+    enum {COUNTER=1, GAUGE=2, HISTOGRAM=3};
+    std::string source;             // e.g. module name
+    std::string name;
+    int type;
+    int64_t value;                  // counter or gauge value
+    std::vector<uint64_t> bins;     // histogram bins
+} zdaqMetrics_value;
+
+int zdaqMetrics_decode(const char *data, int size, std::vector<zdaqMetrics_value> &metrics, uint64_t *timestamp=NULL);  // decode a snapshot. Returns 0 on success.
+
+
+/* Something publishing metrics */
+class zdaqMetrics_source {
+public:
+    virtual ~zdaqMetrics_source() {}
+    virtual void getMetrics(zdaqMetrics_writer &w)=0;   // called by the publisher thread, to add current values with w.addCounter() etc
+};
+
+
+/* The metrics publisher of the process, for a given DNS. Reference-counted, like zdaqCtrl_session. */
+class zdaqMetrics_publisher {
+public:
+    static zdaqMetrics_publisher *get(const char *DNS);   // get a reference to the publisher for given DNS. Returns NULL on error.
+    void release();
+
+    int addSource(zdaqMetrics_source *s, const char *name);   // register a source
+    int removeSource(zdaqMetrics_source *s);                  // unregister a source. Waits for snapshot in progress.
+    int setPeriod(int ms);                                    // time between publications, in milliseconds. Default: 1000ms.
+    const char *getNodePath();                                // node where metrics are published
+    int publishNow();                                         // take and publish a snapshot now. Returns 0 on success.
+
+private:
+    zdaqMetrics_publisher(const char *DNS);
+    ~zdaqMetrics_publisher();
+
+    std::string dns;
+    int nRef;                           // number of references (protected by pool mutex)
+    zdaqCtrl_session *session;
+    void *z_token;                      // token in session, owning the ephemeral node
+    std::string node;                   // path of metrics node
+    int nodeCreated;
+
+    pthread_mutex_t mutex;              // protects variables below
+    pthread_cond_t cond;                // signaled on period change, or on shutdown
+    typedef struct {
+        zdaqMetrics_source *source;
+        std::string name;
+    } t_source;
+    std::vector<t_source> sources;
+    int period;
+    int shutdown;
+    pthread_mutex_t snapshotMutex;      // held while a snapshot is taken and written
+    zdaqMetrics_writer writer;
+
+    int threadStarted;
+    pthread_t thread;
+    static void *threadLoop(void *arg);
+};
+
+#endif	/* ZDAQ_METRICS_H */
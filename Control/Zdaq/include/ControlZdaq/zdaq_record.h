@@ -0,0 +1,196 @@
+/*
+ * File:   zdaq_record.h
+ *
+ * Helper classes to record data streams to disk.
+ */
+
+#ifndef ZDAQ_RECORD_H
+#define	ZDAQ_RECORD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "zdaq_ctrl.h"
+#include "zdaq_file.h"
+
+
+// alignment (in bytes) of staging buffers, file offsets and write sizes when using O_DIRECT
+#define DAQ_RECORD_ALIGNMENT 4096
+
+
+/* A class to write a data stream to a file with O_DIRECT, bypassing the page cache.
+ * Data is copied in large page-aligned staging buffers. Full buffers are written
+ * by a dedicated thread, while the caller fills the next one.
+ * On close, the last buffer is padded to the alignment and the file truncated to its actual size.
+ * If the filesystem does not support O_DIRECT, buffered I/O is used and written pages are dropped from cache.
+ * O_DIRECT can also be disabled explicitly, in which case the writer thread uses plain buffered I/O.
+ */
+class daqRecordWriter {
+  public:
+  daqRecordWriter(int bufferSize, int nBuffers=2, int useDirectIO=1);    // bufferSize: size of each staging buffer (rounded up to alignment). nBuffers: number of staging buffers (at least 2). useDirectIO: open file with O_DIRECT.
+  ~daqRecordWriter();
+
+  int open(const char *path);                 // create file and start writer thread. Returns 0 on success.
+  int write(const void *data, size_t size);   // append data to the stream. Returns 0 on success, -1 on error (including a previous asynchronous write failure).
+  int closeAsync();                           // queue pending data, and let the writer thread truncate and close the file, without waiting. Returns 0 on success.
+  int close();                                // write pending data, truncate file to logical size, stop writer thread. Returns 0 on success.
+
+  unsigned long long getBytesWritten();       // logical number of bytes written to the stream so far
+  int isDirectIO();                           // returns 1 if O_DIRECT is active, 0 if fallback to buffered I/O
+
+  // statistics on buffer flush to disk: count, last/average/max latency (seconds)
+  int getFlushStats(unsigned long long *count, double *last, double *avg, double *max);
+
+  private:
+  int fd;                     // file descriptor (-1 if not open)
+  int useDirectIO;            // O_DIRECT requested
+  int directIO;               // O_DIRECT active
+  size_t bufferSize;          // size of each staging buffer
+  int nBuffers;               // number of staging buffers
+  char **buffers;             // the staging buffers
+  size_t *bufferUsed;         // number of bytes to write for each buffer
+  int *bufferQueued;          // set when buffer submitted to the writer thread, cleared once written
+
+  int ixFill;                 // index of buffer being filled by caller
+  int ixWrite;                // index of next buffer to be written by writer thread
+  unsigned long long nBytes;        // logical stream size
+  unsigned long long fileOffset;    // file offset of next buffer write (writer thread)
+
+  int writeError;             // set by writer thread on failure
+  int threadShutdown;         // flag to stop writer thread once all queued buffers written
+  int threadRunning;          // writer thread started
+  int isClosing;              // closeAsync() called: no more data accepted
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  myTimer flushTimer;               // to measure buffer flush time
+  unsigned long long flushCount;
+  double flushLast;
+  double flushTotal;
+  double flushMax;
+
+  int submit(int isLast);     // queue current buffer to writer thread, and wait next one available
+  int writeBuffer(int ix);    // write given buffer to disk (writer thread)
+  void run();                 // writer thread loop
+  static void *threadLoop(void *arg);
+};
+
+
+/* A class to write many small segments (e.g. event headers and payloads) to a file with few system calls.
+ * Segments are not copied: they are gathered in an iovec array, and written with a single writev()
+ * when the maximum number of segments (IOV_MAX) or of bytes is reached, or on explicit flush().
+ * The caller must keep segments valid until they are flushed.
+ */
+class daqRecordGather {
+  public:
+  daqRecordGather(size_t maxBytes=4*1024*1024);    // maxBytes: amount of data after which isFull() is set
+  ~daqRecordGather();
+
+  int open(const char *path);                 // create file. Returns 0 on success.
+  int add(const void *data, size_t size);     // append a segment to the batch. Returns 0 on success, -1 if batch full.
+  int isFull();                               // returns 1 if batch should be flushed before adding more segments
+  int getFreeSegments();                      // number of segments which can still be added before flush
+  int flush();                                // write pending segments. Returns 0 on success.
+  int close();                                // flush and close file. Returns 0 on success.
+
+  unsigned long long getBytesWritten();       // number of bytes written to file (excluding pending segments)
+  unsigned long long getWriteCalls();         // number of writev() calls issued
+
+  private:
+  int fd;
+  struct iovec *iov;          // pending segments
+  int maxSegments;            // size of iov
+  int nSegments;              // number of pending segments
+  size_t maxBytes;
+  size_t nPending;            // bytes pending
+  unsigned long long nBytes;
+  unsigned long long nWriteCalls;
+};
+
+
+/* A class to record a stream of events striped over several directories (e.g. one per disk or mount point).
+ * Events are grouped in chunks of (at least) a given size, distributed round-robin over the directories,
+ * each directory being written by its own daqRecordWriter thread.
+ * Chunks always contain complete events, so that each file can also be read on its own.
+ * A manifest file, in the first directory, lists the chunks in order to allow reassembly of the stream.
+ * Output files are rotated when they reach a maximum size or age, checked at chunk boundaries.
+ * On rotation, the previous file is completed by its writer thread while the next one is filled,
+ * so a target can hold the staging buffers of two writers.
+ *
+ * File naming: [dir]/[baseName].[target].[fileIndex], and manifest [dir0]/[baseName].manifest
+ * Optionally, an index file is written next to each data file (see zdaq_file.h). Headers must then be eventHeader.
+ */
+class daqRecordStriper {
+  public:
+  daqRecordStriper();
+  ~daqRecordStriper();
+
+  // configuration, to be done before open()
+  int addDirectory(const char *path);                             // add an output directory (stripe target)
+  int setChunkSize(unsigned long long bytes);                     // minimum number of bytes written to a target before switching to the next one
+  int setRotation(unsigned long long maxBytes, int maxSeconds);   // start a new file when current one exceeds maxBytes or is older than maxSeconds (0: no limit)
+  int setBuffers(int bufferSize, int useDirectIO);                // staging buffers size for each target writer, and O_DIRECT usage
+  int setIndex(int enabled);                                      // write an index file for each data file
+
+  int open(const char *baseName);    // start recording. Returns 0 on success.
+  int writeEvent(int eventId, const void *header, size_t headerSize, const void *data, size_t dataSize);  // write an event. Returns 0 on success.
+  int close();                       // complete pending writes and close files and manifest. Returns 0 on success.
+
+  // statistics on buffer flush to disk, for all writers since open(): count, last/average/max latency (seconds)
+  // last is the slowest of the latest flushes of the targets
+  int getFlushStats(unsigned long long *count, double *last, double *avg, double *max);
+
+  private:
+  class target {
+    public:
+    std::string directory;          // output directory
+    daqRecordWriter *writer;        // writer for current file
+    daqRecordWriter *closingWriter; // writer of previous file, being completed in background (NULL if none)
+    daqFileIndexWriter *index;      // index of current file (NULL if disabled)
+    int fileIndex;                  // index of current file (incremented at each rotation)
+    std::string fileName;           // current file name (relative to directory)
+    unsigned long long fileBytes;   // current file size
+    time_t fileOpenTime;            // current file creation time
+  };
+  std::vector<target> targets;
+
+  unsigned long long chunkSize;
+  unsigned long long maxFileBytes;
+  int maxFileSeconds;
+  int bufferSize;
+  int useDirectIO;
+  int useIndex;
+
+  std::string baseName;
+  FILE *manifest;                   // manifest file
+  int isOpen;
+  int writeError;
+
+  int ixTarget;                     // target of current chunk
+  unsigned long long chunkIndex;    // index of current chunk
+  unsigned long long chunkBytes;    // bytes in current chunk
+  unsigned long long chunkOffset;   // offset of current chunk in target file
+  int chunkFirstEvent;              // id of first event in current chunk
+  int chunkEvents;                  // number of events in current chunk
+  unsigned long long nEvents;       // total number of events
+  unsigned long long nBytes;        // total number of bytes
+
+  unsigned long long flushCount;    // flush statistics of released writers
+  double flushLast;
+  double flushTotal;
+  double flushMax;
+
+  int openFile(target &t);          // open next file for given target
+  int closeFile(target &t, int wait);   // close current file of given target. If wait not set, the writer thread completes it in background.
+  int releaseFile(target &t);       // wait previous file of given target completed, and release its writer
+  int endChunk();                   // record current chunk in manifest
+  void releaseWriter(daqRecordWriter *w);   // keep flush statistics of a closed writer, and delete it
+};
+
+#endif	/* ZDAQ_RECORD_H */
@@ -0,0 +1,163 @@
+/*
+ * File:   benchmarkZdaq.cxx
+ *
+ * Command round-trip latency benchmark for daqModule / zdaqCtrl_group.
+ * N daqModules are created, and a group sends them storms of commands (INIT/START/STOP/RELEASE cycles).
+ * For each command and each module, the latency is measured from the command sent
+ * to the new state of the module seen by the group.
+ * Results (latency percentiles, throughput) are written in JSON format.
+ * With -s, modules are started with zdaqCtrl_group::execSynchronizedStart(), and the start skew is reported
+ * (-s 0: barrier znode release, -s N: release at a deadline N milliseconds after arming).
+ *
+ * usage: benchmarkZdaq [-n modules] [-c cycles] [-z zookeeper] [-o outputFile] [-s delay]
+ */
+
+#include "Control/zdaq.h"
+#include "Control/zdaq_ctrl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+
+// get value at given percentile (0-100) of sorted samples
+static double getPercentile(const std::vector<double> &v, double p) {
+  if (v.size()==0) return 0;
+  size_t ix=(size_t)((p/100.0)*(v.size()-1)+0.5);
+  if (ix>=v.size()) ix=v.size()-1;
+  return v[ix];
+}
+
+
+int main(int argc, char *argv[]) {
+  int nModules=100;
+  int nCycles=10;
+  const char *zcx="127.0.0.1:2181";
+  const char *outputFile=NULL;
+  int timeout=10000;  // timeout for each command, in milliseconds
+  int syncStart=-1;   // delay for synchronized start (-1: normal START)
+
+  int opt;
+  while ((opt=getopt(argc,argv,"n:c:z:o:s:"))!=-1) {
+    switch (opt) {
+      case 'n': nModules=atoi(optarg); break;
+      case 'c': nCycles=atoi(optarg); break;
+      case 'z': zcx=optarg; break;
+      case 'o': outputFile=optarg; break;
+      case 's': syncStart=atoi(optarg); break;
+      default:
+        printf("usage: %s [-n modules] [-c cycles] [-z zookeeper] [-o outputFile] [-s delay]\n",argv[0]);
+        return 1;
+    }
+  }
+  if ((nModules<=0)||(nCycles<=0)) {
+    printf("wrong parameters\n");
+    return 1;
+  }
+
+  // commands of a cycle, and corresponding state reached
+  const char *cycle[][2]={
+    {"INIT","READY"},
+    {"START","RUNNING"},
+    {"STOP","STOPPED"},
+    {"RELEASE","NOT_READY"}
+  };
+  const int cycleSize=sizeof(cycle)/sizeof(cycle[0]);
+
+  std::vector<double> latencies;  // in microseconds
+  latencies.reserve(nModules*nCycles*cycleSize);
+  std::vector<double> skews;      // in microseconds
+  int nErrors=0;
+  double duration=0;
+
+  std::vector<daqModule *> modules;
+  zdaqCtrl_group g(zcx);
+  for (int i=0;i<nModules;i++) {
+    char name[32];
+    snprintf(name,sizeof(name),"/bench%04d",i);
+    modules.push_back(new daqModule(zdaqCtrl_config(name,zcx)));
+    g.addObject(name);
+  }
+
+  // commands are sent in parallel to all modules
+  for (int k=0;k<nCycles;k++) {
+    for (int j=0;j<cycleSize;j++) {
+      if ((syncStart>=0)&&(!strcmp(cycle[j][0],"START"))) {
+        if (g.execSynchronizedStart(timeout,syncStart)) {
+          nErrors++;
+        } else {
+          skews.push_back(g.getStartSkew()*1000000.0);
+        }
+        duration+=g.getCommandTime();
+        continue;
+      }
+      if (g.execCommand(cycle[j][0],cycle[j][1],timeout)) {
+        nErrors++;
+      }
+      duration+=g.getCommandTime();
+      for (int i=0;i<g.getNumberOfItems();i++) {
+        zdaqCtrl_item *item=g.getItem(i);
+        if (item->getCommandStatus()==0) {
+          latencies.push_back(item->getCommandLatency()*1000000.0);
+        }
+      }
+    }
+  }
+
+  for (auto m : modules) {
+    delete m;
+  }
+
+  std::sort(latencies.begin(),latencies.end());
+  std::sort(skews.begin(),skews.end());
+  double sum=0;
+  for (auto l : latencies) {
+    sum+=l;
+  }
+
+  FILE *fp=stdout;
+  if (outputFile!=NULL) {
+    fp=fopen(outputFile,"w");
+    if (fp==NULL) {
+      printf("failed to open %s : %s\n",outputFile,strerror(errno));
+      return 1;
+    }
+  }
+  fprintf(fp,"{\n");
+  fprintf(fp,"  \"benchmark\": \"zdaqRoundTrip\",\n");
+  fprintf(fp,"  \"directory\": \"%s\",\n",zcx);
+  fprintf(fp,"  \"objects\": %d,\n",nModules);
+  fprintf(fp,"  \"cycles\": %d,\n",nCycles);
+  fprintf(fp,"  \"commands\": %d,\n",(int)latencies.size());
+  fprintf(fp,"  \"errors\": %d,\n",nErrors);
+  fprintf(fp,"  \"durationSeconds\": %.6f,\n",duration);
+  fprintf(fp,"  \"commandsPerSecond\": %.1f,\n",(duration>0)?latencies.size()/duration:0);
+  fprintf(fp,"  \"latencyMicroseconds\": {\n");
+  fprintf(fp,"    \"mean\": %.1f,\n",(latencies.size()>0)?sum/latencies.size():0);
+  fprintf(fp,"    \"min\": %.1f,\n",getPercentile(latencies,0));
+  fprintf(fp,"    \"p50\": %.1f,\n",getPercentile(latencies,50));
+  fprintf(fp,"    \"p90\": %.1f,\n",getPercentile(latencies,90));
+  fprintf(fp,"    \"p99\": %.1f,\n",getPercentile(latencies,99));
+  fprintf(fp,"    \"p999\": %.1f,\n",getPercentile(latencies,99.9));
+  fprintf(fp,"    \"max\": %.1f\n",getPercentile(latencies,100));
+  fprintf(fp,"  }");
+  if (syncStart>=0) {
+    fprintf(fp,",\n");
+    fprintf(fp,"  \"startSkewMicroseconds\": {\n");
+    fprintf(fp,"    \"delayMilliseconds\": %d,\n",syncStart);
+    fprintf(fp,"    \"min\": %.1f,\n",getPercentile(skews,0));
+    fprintf(fp,"    \"p50\": %.1f,\n",getPercentile(skews,50));
+    fprintf(fp,"    \"max\": %.1f\n",getPercentile(skews,100));
+    fprintf(fp,"  }");
+  }
+  fprintf(fp,"\n");
+  fprintf(fp,"}\n");
+  if (fp!=stdout) {
+    fclose(fp);
+  }
+  return (nErrors==0)?0:1;
+}
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -8,6 +9,7 @@
 #include <unistd.h>
 
 #include "Control/zdaq.h"
+#include "ControlStateMachine/TransitionTable.h"
 
 using namespace std;
 
@@ -33,8 +35,10 @@ const char* zdaqCtrl_config:: getDNS() {
 
 
 daqModule::daqModule(zdaqCtrl_config c): zdaqCtrl_object(c.getObjectName(),c.getDNS())  {
+  status=mt_status::UNDEFINED;
   th_status=0;
   th_do_stop=0;
+  th_armed=0;
   th_stop_immediate=1;
   thread_id=0;
   
@@ -43,11 +47,23 @@ daqModule::daqModule(zdaqCtrl_config c): zdaqCtrl_object(c.getObjectName(),c.get
   stats_nBytes_in=0;
   stats_nBytes_out=0;  
   setStatus(mt_status::NOT_READY);
+
+  // register for periodic publication of metrics, and tell clients where to find them
+  metrics=zdaqMetrics_publisher::get(c.getDNS());
+  if (metrics!=NULL) {
+    metrics->addSource(this,getName());
+    publishString("metricsNode",metrics->getNodePath());
+  }
 }
 
 daqModule::~daqModule() {
   //cout << "destroy " << getName() << endl;
   fflush(stdout);
+  if (metrics!=NULL) {
+    metrics->removeSource(this);
+    metrics->release();
+    metrics=NULL;
+  }
   if (th_status) {
     cout << "desctructor: waiting thread exit" << endl;
     th_stop_immediate=1;
@@ -82,37 +98,36 @@ void *daqModule_loop(void *arg) {
   return 0;
 }
 
+// names of states and commands, as published / received through zookeeper
+constexpr EnumNames<mt_status,7> statusNames({"UNDEFINED","NOT_READY","READY","RUNNING","STOPPED","ERROR","ARMED"});
+constexpr EnumNames<mt_command,7> commandNames({"UNDEFINED","INIT","START","STOP","RELEASE","RESET","ARM"});
+
+// state reached on successful command execution. Other commands are ignored.
+constexpr Transition<mt_status,mt_command> daqModuleTransitions[]={
+  {mt_status::NOT_READY, mt_command::INIT,    mt_status::READY},
+  {mt_status::READY,     mt_command::START,   mt_status::RUNNING},
+  {mt_status::RUNNING,   mt_command::STOP,    mt_status::STOPPED},
+  {mt_status::READY,     mt_command::RELEASE, mt_status::NOT_READY},
+  {mt_status::STOPPED,   mt_command::RELEASE, mt_status::NOT_READY},
+  {mt_status::ERROR,     mt_command::RESET,   mt_status::NOT_READY},
+  {mt_status::READY,     mt_command::ARM,     mt_status::ARMED},      // goes RUNNING on barrier release
+  {mt_status::ARMED,     mt_command::STOP,    mt_status::STOPPED},
+};
+constexpr TransitionTable<mt_status,mt_command,7,7> daqModuleTable(daqModuleTransitions,mt_status::UNDEFINED);
+
 mt_status getStatusFromString(const char *c) {
-    if (c==NULL) {return mt_status::UNDEFINED;}    
-    else if (!strcmp(c,"NOT_READY")) {return mt_status::NOT_READY;}
-    else if (!strcmp(c,"READY")) {return mt_status::READY;}
-    else if (!strcmp(c,"RUNNING")) {return mt_status::RUNNING;}
-    else if (!strcmp(c,"STOPPED")) {return mt_status::STOPPED;}
-    else if (!strcmp(c,"ERROR")) {return mt_status::ERROR;}
-    
-    return mt_status::UNDEFINED;
+    return statusNames.getId(c);
 }
 
 mt_command getCommandFromString(const char *c) {
-    if (c==NULL) {return mt_command::UNDEFINED;}
-    else if (!strcmp(c,"INIT")) {return mt_command::INIT;}
-    else if (!strcmp(c,"START")) {return mt_command::START;}
-    else if (!strcmp(c,"STOP")) {return mt_command::STOP;}
-    else if (!strcmp(c,"RELEASE")) {return mt_command::RELEASE;}
-    else if (!strcmp(c,"RESET")) {return mt_command::RESET;}
-
-    return mt_command::UNDEFINED;
+    return commandNames.getId(c);
 }
 
 const char *getStringFromStatus( mt_status m) {
-    if (m==mt_status::NOT_READY) { return "NOT_READY"; }
-    else if (m==mt_status::READY) { return "READY"; }
-    else if (m==mt_status::RUNNING) { return "RUNNING"; }
-    else if (m==mt_status::STOPPED) { return "STOPPED"; }
-    else if (m==mt_status::ERROR) { return "ERROR"; }
-    return "UNDEFINED";
+    return statusNames.getName(m);
 }
 int daqModule::setStatus(mt_status s) {
+    status=s;
     return setState(getStringFromStatus(s));
 }
 int daqModule::executeCommand(const char *command) {
@@ -120,98 +135,126 @@ int daqModule::executeCommand(const char *command) {
   // this is called by control loop, beware of sync with loop thread
   int success=0;
   int error=0;
+  int statusSet=0;  // set when new status already published during execution
 
   //cout << getName() << " executing command " << command << endl;
   
-  mt_command m;
-  m=getCommandFromString(command);
+  // command name, followed by optional arguments
+  char commandName[32];
+  const char *commandArgs="";
+  if (command==NULL) {command="";}
+  int l=strcspn(command," ");
+  if (l>=(int)sizeof(commandName)) {l=sizeof(commandName)-1;}
+  memcpy(commandName,command,l);
+  commandName[l]=0;
+  if (command[l]!=0) {commandArgs=&command[l+1];}
   
-  mt_status currentStatus=mt_status::UNDEFINED;
-  mt_status newStatus=mt_status::UNDEFINED;
+  mt_command m;
+  m=getCommandFromString(commandName);
   
-  currentStatus=getStatusFromString(this->zdaqCtrl_object::getState());
-  newStatus=currentStatus;
+  mt_status currentStatus=status;
+  mt_status newStatus=daqModuleTable.next(currentStatus,m);
   
   //cout << getName() << " current status " << getStringFromStatus(currentStatus) << endl;
   
+  if (newStatus==mt_status::UNDEFINED) {
+    // wrong command in this state: no change
+    setStatus(currentStatus);
+    return 0;
+  }
+  
   switch (m) {
     case mt_command::INIT:
-      if (currentStatus==mt_status::NOT_READY) {
-        if (exec_INIT()==0) {
-          newStatus=mt_status::READY;
-          success=1;
-        } else {
-          error=1;
-        }
+      if (exec_INIT()) {
+        error=1;
       }
       break;
     case mt_command::START:
-      if (currentStatus==mt_status::READY) {
-        if (pthread_create(&thread,NULL,&daqModule_loop,(void *) this)) {
-          error=1;
-          break;
-        }      
-        stats_nItems_in=0;
-        stats_nItems_out=0;
-        stats_nBytes_in=0;
-        stats_nBytes_out=0;
-        if (exec_START()==0) {
-          newStatus=mt_status::RUNNING;
-          success=1;
-        } else {
-          error=1;
-        }
+      th_do_stop=0;  // may be set by previous STOP
+      if (pthread_create(&thread,NULL,&daqModule_loop,(void *) this)) {
+        error=1;
+        break;
+      }      
+      stats_nItems_in=0;
+      stats_nItems_out=0;
+      stats_nBytes_in=0;
+      stats_nBytes_out=0;
+      stats_loopTime.reset();
+      if (exec_START()) {
+        error=1;
       }
       break;
+    case mt_command::ARM: {
+      // arguments: barrier path, release time
+      char barrier[128];
+      double deadline=0;
+      if (sscanf(commandArgs,"%127s %lf",barrier,&deadline)<1) {
+        error=1;
+        break;
+      }
+      if (armBarrier(barrier,deadline)) {
+        error=1;
+        break;
+      }
+      // prepare everything now, thread only waits for release
+      stats_nItems_in=0;
+      stats_nItems_out=0;
+      stats_nBytes_in=0;
+      stats_nBytes_out=0;
+      stats_loopTime.reset();
+      if (exec_START()) {
+        error=1;
+        break;
+      }
+      th_do_stop=0;
+      th_armed=1;
+      // publish ARMED before thread starts: once released, thread sets RUNNING, which must not be overwritten
+      setStatus(mt_status::ARMED);
+      statusSet=1;
+      if (pthread_create(&thread,NULL,&daqModule_loop,(void *) this)) {
+        th_armed=0;
+        error=1;
+      }
+      break;
+    }
     case mt_command::STOP:
-      if (currentStatus==mt_status::RUNNING) {
-        th_do_stop=1;
-        while (th_status==1) {
-          // wait thread to complete
-          //cout << "wait thread to complete" << endl;
-          usleep(1000);
-          // todo: add timeout
-        }
-        pthread_join(thread,NULL); // todo: check thread exit code
-        if (exec_STOP()==0) {
-          newStatus=mt_status::STOPPED;
-          success=1;
-        } else {
-          error=1;
-        }
+      th_do_stop=1;
+      cancelBarrier();  // in case still ARMED
+      while (th_status==1) {
+        // wait thread to complete
+        //cout << "wait thread to complete" << endl;
+        usleep(1000);
+        // todo: add timeout
+      }
+      pthread_join(thread,NULL); // todo: check thread exit code
+      if (exec_STOP()) {
+        error=1;
       }
       break;
     case mt_command::RELEASE:
-      if ((currentStatus==mt_status::READY)||(currentStatus==mt_status::STOPPED)) {
-        if (exec_RELEASE()==0) {
-          newStatus=mt_status::NOT_READY;
-          success=1;
-        } else {
-          error=1;
-        }
+      if (exec_RELEASE()) {
+        error=1;
       }
       break;      
    case mt_command::RESET:
-      if (currentStatus==mt_status::ERROR) {
-        if (exec_RESET()==0) {
-          newStatus=mt_status::NOT_READY;
-          success=1;
-        } else {
-          error=1;
-        }
+      if (exec_RESET()) {
+        error=1;
       }
       break;
     case mt_command::UNDEFINED:
-      // TODO
       break;
   }
   if (error) {
     // go to state error if execution failed
     // but not if wrong command received
     newStatus=mt_status::ERROR;
+  } else {
+    success=1;
   }
 
-  setStatus(newStatus);
+  if ((error)||(!statusSet)) {
+    setStatus(newStatus);
+  }
   //cout << getName() << " after command " << (int)m << " status= " << getStringFromStatus(newStatus) << endl;
   return success;
 }
@@ -238,14 +281,46 @@ int daqModule::do_loop(int maxItems){
   return 0;
 }
 
+void daqModule::getMetrics(zdaqMetrics_writer &w) {
+  w.addGauge("status",(int64_t)status.load());
+  w.addCounter("nItemsIn",stats_nItems_in);
+  w.addCounter("nItemsOut",stats_nItems_out);
+  w.addCounter("nBytesIn",stats_nBytes_in);
+  w.addCounter("nBytesOut",stats_nBytes_out);
+  w.addHistogram("loopTime",stats_loopTime);
+}
+
 
 void daqModule::thread_loop() {
   thread_id=pthread_self();
   //cout << "thread " << thread_id << " starting" << endl;
   th_status=1;
+  
+  if (th_armed) {
+    // synchronized start: wait release
+    th_armed=0;
+    if (waitBarrier()) {
+      th_status=0;
+      return;
+    }
+    // report actual start time, published together with the new state
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    char startTime[32];
+    snprintf(startTime,sizeof(startTime),"%.6f",ts.tv_sec+ts.tv_nsec/1000000000.0);
+    publishString("startTime",startTime);
+    if (!th_do_stop) {
+      setStatus(mt_status::RUNNING);
+    }
+  }
   while (!th_do_stop) {  
 //    cout << "loop tick " << endl;
-    if (this->do_loop(100)<0) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    int err=this->do_loop(100);
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    stats_loopTime.add((t1.tv_sec-t0.tv_sec)*1000000LL+(t1.tv_nsec-t0.tv_nsec)/1000);
+    if (err<0) {
       th_status=2;
       break;
     }
@@ -332,6 +407,9 @@ int daqModule_fifo::setGlobalTimeout(int timeout,t_fifoAction a) {
 
 daqModule_fifo::~daqModule_fifo() {
   cout << "deleting FIFO" << endl;
+  if (metrics!=NULL) {
+    metrics->removeSource(this);
+  }
   
   /* if not empty, warning */
   if (this->index_start!=this->index_end) {
@@ -377,6 +455,17 @@ int daqModule_fifo::isFull() {
     return 1;
 }
 
+void daqModule_fifo::getMetrics(zdaqMetrics_writer &w) {
+  daqModule::getMetrics(w);
+  // size+1 slots, one always free
+  int depth=this->index_end-this->index_start;
+  if (depth<0) {
+    depth+=this->size+1;
+  }
+  w.addGauge("fifoDepth",depth);
+  w.addGauge("fifoSize",this->size);
+}
+
 
 /* implementation mostly lock free (locks only on blocking calls)
    assumes only 1 reader and 1 writer at a time.
@@ -525,13 +614,7 @@ int daqModule_fifo::read(void **item, int timeout) {
 
 
 
-typedef struct {
-    int id;
-    int size;
-} eventHeader;
-
-
-/* class to store an event */
+/* class to store an event (eventHeader is defined in zdaq_file.h) */
 class daqEvent {
   public:
     eventHeader h;
@@ -545,6 +628,10 @@ class daqEvent {
     void reference();
       
     pthread_mutex_t mxRef;
+
+    // if set, called on destruction instead of free(data), for data not owned by the event
+    void (*releaseData)(void *arg);
+    void *releaseArg;
 };
 void daqEvent::dereference() {
     pthread_mutex_lock(&mxRef);
@@ -569,6 +656,8 @@ daqEvent::daqEvent() {
     data=NULL;
     nRef=1;
     pthread_mutex_init(&mxRef,NULL);
+    releaseData=NULL;
+    releaseArg=NULL;
 }
 daqEvent::daqEvent(int size) {  
 
@@ -580,6 +669,8 @@ daqEvent::daqEvent(int size) {
     data=NULL;
     nRef=1;
     pthread_mutex_init(&mxRef,NULL);
+    releaseData=NULL;
+    releaseArg=NULL;
     
     data=malloc(size);
     if (data==NULL) {throw "Failed to allocate memory";}
@@ -593,7 +684,9 @@ daqEvent::~daqEvent() {
       printf("Warning, trying to delete referenced object\n");
   }
   pthread_mutex_unlock(&mxRef);
-  if (data!=NULL) {
+  if (releaseData!=NULL) {
+    releaseData(releaseArg);
+  } else if (data!=NULL) {
     free(data);
   }
   pthread_mutex_destroy(&mxRef);
@@ -704,11 +797,405 @@ int daqModule_producer_rand::do_loop(int maxItems) {
 
 
 
+/* returns monotonic time in nanoseconds, for replay timing */
+static unsigned long long getTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ((unsigned long long)ts.tv_sec)*1000000000ULL+ts.tv_nsec;
+}
+
+
+/* A file being replayed by daqModule_producer_fileReplay.
+ * The file is unmapped when the last reference is dropped (module and events emitted).
+ * A thread touches the pages ahead of the replay position, so that they are in memory when emitted.
+ */
+class daqReplaySource {
+  public:
+    daqReplaySource(const char *path, unsigned long long readAhead);
+    void reference();
+    void dereference();
+    void stopPrefetch();            // stop read-ahead thread
+
+    daqFileReader reader;
+    uint64_t ixNext;                // index of next event to emit
+    int nLoops;                     // number of times file fully replayed
+    int isDone;                     // set when file completed
+    uint64_t tsFirst;               // recording time of first event (ns)
+    unsigned long long t0;          // replay time of first event of current loop (ns)
+
+    void setPosition(uint64_t ix);  // update replay position for read-ahead thread
+    static void releaseEvent(void *arg);    // daqEvent release hook
+
+  private:
+    ~daqReplaySource();
+    int nRef;
+    pthread_mutex_t mxRef;
+
+    unsigned long long readAhead;
+    uint64_t ixWanted;              // current replay position
+    uint64_t ixPrefetched;          // events before this one are in memory
+    int threadShutdown;
+    int threadRunning;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int needPrefetch();             // returns 1 if read-ahead window should be extended (called with mutex locked)
+    void run();
+    static void *threadLoop(void *arg);
+};
+
+daqReplaySource::daqReplaySource(const char *path, unsigned long long readAhead) {
+  if (reader.open(path)) {throw "Failed to open file";}
+  nRef=1;
+  pthread_mutex_init(&mxRef,NULL);
+  ixNext=0;
+  nLoops=0;
+  isDone=(reader.getNumberOfEvents()==0)?1:0;
+  tsFirst=0;
+  if (!isDone) {tsFirst=reader.getIndexEntry(0)->timestamp;}
+  t0=0;
+
+  this->readAhead=readAhead;
+  ixWanted=0;
+  ixPrefetched=0;
+  threadShutdown=0;
+  threadRunning=0;
+  pthread_mutex_init(&mutex,NULL);
+  pthread_cond_init(&cond,NULL);
+  if ((readAhead>0)&&(!isDone)) {
+    if (pthread_create(&thread,NULL,threadLoop,this)==0) {
+      threadRunning=1;
+    }
+  }
+}
+
+daqReplaySource::~daqReplaySource() {
+  stopPrefetch();
+  reader.close();
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mxRef);
+}
+
+void daqReplaySource::reference() {
+  pthread_mutex_lock(&mxRef);
+  nRef++;
+  pthread_mutex_unlock(&mxRef);
+}
+
+void daqReplaySource::dereference() {
+  pthread_mutex_lock(&mxRef);
+  nRef--;
+  if (nRef<1) {
+    pthread_mutex_unlock(&mxRef);
+    delete this;
+  } else {
+    pthread_mutex_unlock(&mxRef);
+  }
+}
+
+void daqReplaySource::releaseEvent(void *arg) {
+  ((daqReplaySource *)arg)->dereference();
+}
+
+void daqReplaySource::stopPrefetch() {
+  if (!threadRunning) {return;}
+  pthread_mutex_lock(&mutex);
+  threadShutdown=1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread,NULL);
+  threadRunning=0;
+}
+
+void daqReplaySource::setPosition(uint64_t ix) {
+  if (!threadRunning) {return;}
+  pthread_mutex_lock(&mutex);
+  ixWanted=ix;
+  if (needPrefetch()) {pthread_cond_signal(&cond);}
+  pthread_mutex_unlock(&mutex);
+}
+
+int daqReplaySource::needPrefetch() {
+  // read-ahead resumes when less than half of the window is ahead of replay position
+  uint64_t n=reader.getNumberOfEvents();
+  if (ixWanted>=n) {return 0;}
+  if (ixPrefetched<=ixWanted) {return 1;}
+  uint64_t offsetWanted=reader.getIndexEntry(ixWanted)->offset;
+  uint64_t offsetPrefetched=(ixPrefetched<n)?reader.getIndexEntry(ixPrefetched)->offset:reader.getIndexEntry(n-1)->offset+1;
+  if (offsetPrefetched-offsetWanted>readAhead) {
+    // replay went back (loop) far from the window: restart read-ahead from there
+    ixPrefetched=ixWanted;
+    return 1;
+  }
+  if (ixPrefetched>=n) {return 0;}
+  return (offsetPrefetched-offsetWanted<readAhead/2)?1:0;
+}
+
+void *daqReplaySource::threadLoop(void *arg) {
+  ((daqReplaySource *)arg)->run();
+  return NULL;
+}
+
+void daqReplaySource::run() {
+  uint64_t n=reader.getNumberOfEvents();
+  uint64_t pageSize=getpagesize();
+  volatile unsigned char sum=0;
+  for (;;) {
+    pthread_mutex_lock(&mutex);
+    while ((!threadShutdown)&&(!needPrefetch())) {
+      pthread_cond_wait(&cond,&mutex);
+    }
+    if (threadShutdown) {
+      pthread_mutex_unlock(&mutex);
+      break;
+    }
+    if (ixPrefetched<ixWanted) {ixPrefetched=ixWanted;}
+    uint64_t ixFirst=ixPrefetched;
+    uint64_t limit=reader.getIndexEntry(ixWanted)->offset+readAhead;
+    pthread_mutex_unlock(&mutex);
+
+    // touch all pages of the events up to the end of the window
+    uint64_t ix=ixFirst;
+    while ((ix<n)&&((ix==ixFirst)||(reader.getIndexEntry(ix)->offset<limit))) {ix++;}
+    reader.prefetch(ixFirst,ix-ixFirst);
+    for (uint64_t i=ixFirst;i<ix;i++) {
+      eventHeader h;
+      const void *data;
+      if (reader.getEvent(i,&h,&data)) {break;}
+      const unsigned char *p=(const unsigned char *)data-sizeof(eventHeader);
+      const unsigned char *end=(const unsigned char *)data+h.size;
+      for (;p<end;p+=pageSize) {sum+=*p;}
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (ixPrefetched==ixFirst) {ixPrefetched=ix;}
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+
+
+daqModule_producer_fileReplay::daqModule_producer_fileReplay(zdaqCtrl_config c): daqModule_producer(c) {
+  mode=MAX_SPEED;
+  modeValue=0;
+  nLoops=1;
+  readAhead=64*1024*1024;
+  isStarted=0;
+  tStart=0;
+  nEmitted=0;
+  ixSource=0;
+}
+
+daqModule_producer_fileReplay::~daqModule_producer_fileReplay() {
+  cleanup();
+}
+
+int daqModule_producer_fileReplay::addFile(const char *path) {
+  if (path==NULL) {return 1;}
+  files.push_back(path);
+  return 0;
+}
+
+int daqModule_producer_fileReplay::setMode(t_replayMode mode, double value) {
+  if ((mode==FIXED_RATE)&&(value<=0)) {return 1;}
+  if ((mode==ORIGINAL_TIMING)&&(value<=0)) {value=1.0;}
+  this->mode=mode;
+  modeValue=value;
+  return 0;
+}
+
+int daqModule_producer_fileReplay::setLoop(int nLoops) {
+  if (nLoops<0) {return 1;}
+  this->nLoops=nLoops;
+  return 0;
+}
+
+int daqModule_producer_fileReplay::setReadAhead(unsigned long long bytes) {
+  readAhead=bytes;
+  return 0;
+}
+
+int daqModule_producer_fileReplay::setup() {
+  for (unsigned int i=0;i<files.size();i++) {
+    daqReplaySource *src=NULL;
+    try {
+      src=new daqReplaySource(files[i].c_str(),readAhead);
+    }
+    catch (const char *e) {
+      cout << "Failed to open " << files[i] << ": " << e << endl;
+      cleanup();
+      return -1;
+    }
+    sources.push_back(src);
+    if ((mode==ORIGINAL_TIMING)&&(!src->reader.hasTimestamps())) {
+      // would be replayed at max speed
+      cout << "Can not replay " << files[i] << " with original timing: no index file with event timestamps" << endl;
+      cleanup();
+      return -1;
+    }
+    cout << "Replaying " << files[i] << ": " << src->reader.getNumberOfEvents() << " events" << endl;
+  }
+  isStarted=0;
+  ixSource=0;
+  return 0;
+}
+
+int daqModule_producer_fileReplay::cleanup() {
+  // files are unmapped once all events emitted are released
+  for (unsigned int i=0;i<sources.size();i++) {
+    sources[i]->stopPrefetch();
+    sources[i]->dereference();
+  }
+  sources.clear();
+  return 0;
+}
+
+int daqModule_producer_fileReplay::exec_INIT() {
+  return setup();
+}
+
+int daqModule_producer_fileReplay::exec_STOP() {
+  // timing restarts from next event on next START
+  isStarted=0;
+  return 0;
+}
+
+int daqModule_producer_fileReplay::exec_RELEASE() {
+  return cleanup();
+}
+
+int daqModule_producer_fileReplay::do_loop(int maxItems) {
+  if (f_out==NULL) {return 1;}
+  int nSources=sources.size();
+  if (nSources==0) {
+    usleep(10000);
+    return 0;
+  }
+
+  unsigned long long now=getTimeNs();
+  if (!isStarted) {
+    tStart=now;
+    nEmitted=0;
+    for (int i=0;i<nSources;i++) {sources[i]->t0=0;}
+    isStarted=1;
+  }
+
+  int nItems=0;
+  for (int i=0;(i<maxItems) || (maxItems==0);i++) {
+
+    // select source of next event
+    daqReplaySource *src=NULL;
+    unsigned long long due=0;
+    if (mode==ORIGINAL_TIMING) {
+      // the one with earliest event
+      for (int k=0;k<nSources;k++) {
+        daqReplaySource *s=sources[k];
+        if (s->isDone) {continue;}
+        if (s->t0==0) {s->t0=now;}
+        uint64_t ts=s->reader.getIndexEntry(s->ixNext)->timestamp;
+        unsigned long long d=s->t0;
+        if (ts>s->tsFirst) {d+=(unsigned long long)((ts-s->tsFirst)/modeValue);}
+        if ((src==NULL)||(d<due)) {
+          src=s;
+          due=d;
+        }
+      }
+    } else {
+      for (int k=0;k<nSources;k++) {
+        daqReplaySource *s=sources[(ixSource+k)%nSources];
+        if (!s->isDone) {
+          src=s;
+          ixSource=(ixSource+k)%nSources;
+          break;
+        }
+      }
+      if (mode==FIXED_RATE) {
+        due=tStart+(unsigned long long)(nEmitted*1000000000.0/modeValue);
+      }
+    }
+    if (src==NULL) {
+      // all files completed
+      if (nItems==0) {usleep(10000);}
+      break;
+    }
+
+    // wait until event is due, but return regularly to remain responsive to commands
+    if (due>now) {
+      now=getTimeNs();
+      if (due>now) {
+        if (nItems==0) {
+          unsigned long long wait=due-now;
+          if (wait>1000000) {wait=1000000;}
+          usleep(wait/1000);
+        }
+        break;
+      }
+    }
+
+    // create event pointing to mapped data
+    eventHeader h;
+    const void *data;
+    if (src->reader.getEvent(src->ixNext,&h,&data)) {return -1;}
+    daqEvent *ev=new daqEvent();
+    ev->h=h;
+    ev->data=(void *)data;
+    src->reference();
+    ev->releaseData=daqReplaySource::releaseEvent;
+    ev->releaseArg=src;
+
+    int nb=ev->h.size+sizeof(ev->h);
+    int timeout;
+    if (i==0) {
+      timeout=10000;
+    } else {
+      timeout=0;
+    }
+    if (f_out->write(ev,timeout)) {
+      delete ev;
+      break;
+    }
+    stats_nItems_out++;
+    stats_nBytes_out+=nb;
+    nEmitted++;
+    nItems++;
+
+    // move to next event
+    src->ixNext++;
+    if (src->ixNext>=src->reader.getNumberOfEvents()) {
+      src->nLoops++;
+      if ((nLoops==0)||(src->nLoops<nLoops)) {
+        src->ixNext=0;
+        src->t0=0;
+      } else {
+        src->isDone=1;
+      }
+    }
+    src->setPosition(src->ixNext);
+    if (mode!=ORIGINAL_TIMING) {
+      ixSource=(ixSource+1)%nSources;
+    }
+  }
+  return 0;
+}
+
+
+
+
 daqModule_consumer_recordToFile::daqModule_consumer_recordToFile(zdaqCtrl_config c): daqModule_consumer(c) {
   filename=NULL;
-  fd=NULL;
+  gather=NULL;
   nEvents=0;
   nBytes=0;
+  directBufferSize=0;
+  writer=NULL;
+  lastStatsPublish=0;
+  stripeChunkSize=0;
+  rotateMaxBytes=0;
+  rotateMaxSeconds=0;
+  striper=NULL;
+  useIndex=0;
+  index=NULL;
 }
 
 daqModule_consumer_recordToFile::~daqModule_consumer_recordToFile(){
@@ -719,12 +1206,56 @@ daqModule_consumer_recordToFile::~daqModule_consumer_recordToFile(){
 
 int daqModule_consumer_recordToFile::setFile(const char* f){
   if (filename!=NULL) {free(filename);}
+  filename=NULL;
   if (f==NULL) {return 0;}
   filename=strdup(f);
   if (filename==NULL) {return 1;}
   return 0;
 }
 
+int daqModule_consumer_recordToFile::setDirectIO(int bufferSize){
+  if (bufferSize<0) {return 1;}
+  directBufferSize=bufferSize;
+  return 0;
+}
+
+int daqModule_consumer_recordToFile::addDirectory(const char *path){
+  if (path==NULL) {return 1;}
+  stripeDirectories.push_back(path);
+  return 0;
+}
+
+int daqModule_consumer_recordToFile::setChunkSize(unsigned long long bytes){
+  stripeChunkSize=bytes;
+  return 0;
+}
+
+int daqModule_consumer_recordToFile::setRotation(unsigned long long maxBytes, int maxSeconds){
+  if (maxSeconds<0) {return 1;}
+  rotateMaxBytes=maxBytes;
+  rotateMaxSeconds=maxSeconds;
+  return 0;
+}
+
+int daqModule_consumer_recordToFile::setIndex(int enabled){
+  useIndex=enabled;
+  return 0;
+}
+
+int daqModule_consumer_recordToFile::writeEvent(daqEvent *ev) {
+  if (striper!=NULL) {
+    if (striper->writeEvent(ev->h.id,&ev->h,sizeof(ev->h),ev->data,ev->h.size)) {return 1;}
+  } else if (writer!=NULL) {
+    if (writer->write(&ev->h,sizeof(ev->h))) {return 1;}
+    if (writer->write(ev->data,ev->h.size)) {return 1;}
+  }
+  if (index!=NULL) {
+    // single file output: the event starts at the number of bytes recorded so far
+    if (index->addEvent(&ev->h,ev->data,nBytes)) {return 1;}
+  }
+  return 0;
+}
+
 int daqModule_consumer_recordToFile::do_loop(int maxItems) {
   daqEvent *ev=NULL;
   if (f_in==NULL) {return 1;}
@@ -742,64 +1273,235 @@ int daqModule_consumer_recordToFile::do_loop(int maxItems) {
 
     //cout << "try read " << nEvents << endl;
     if (f_in->read((void**)&ev,timeout)) {
-      return 0;
+      break;
     }
     //cout << "read ok " << nEvents << endl;
     if (ev==NULL) {return 1;}
-    for(;;) {
-      if (fd!=NULL) {
-        //printf("REC: event %d: sz=%d p=%p data=%p\n",ev->h.id,ev->h.size,ev,ev->data);
-        if (fwrite(&ev->h,sizeof(ev->h),1,fd)!=1) {status=1; break;}
-        /*for (int x=0;x<ev->h.size;x++) {
-            printf("%d ",(int)(((char *)ev->data)[x]));
+    if (gather!=NULL) {
+      // header and payload must go in the same batch
+      if (gather->getFreeSegments()<2) {
+        if (flushBatch()) {
+          cout << "write failed" << endl;
+          ev->dereference();
+          status=1;
+          break;
         }
-        printf("\n");*/
-        if (fwrite(ev->data,ev->h.size,1,fd)!=1) {status=1; break;}
       }
-      delete ev;
+      if ((gather->add(&ev->h,sizeof(ev->h)))||(gather->add(ev->data,ev->h.size))) {
+        cout << "failed to add event to batch" << endl;
+        ev->dereference();
+        status=1;
+        break;
+      }
+      // event kept until batch written
+      batch.push_back(ev);
+      if (gather->isFull()) {
+        if (flushBatch()) {
+          cout << "write failed" << endl;
+          status=1;
+          break;
+        }
+      }
+      continue;
+    }
+    if (writeEvent(ev)) {
+      status=1;
+    } else {
       nEvents++;
       nBytes+=ev->h.size+sizeof(ev->h);
       
       stats_nItems_out++;
       stats_nBytes_out+=ev->h.size+sizeof(ev->h);
-      break;
     }
+    ev->dereference();
     if (status) {
        cout << "write failed" << endl;
+       break;
+    }
+  }
+
+  if (gather!=NULL) {
+    if (flushBatch()) {
+      cout << "write failed" << endl;
+      status=1;
+    }
+  }
+
+  // publish flush statistics periodically
+  if ((writer!=NULL)||(striper!=NULL)) {
+    time_t now=time(NULL);
+    if (now!=lastStatsPublish) {
+      publishFlushStats();
+      lastStatsPublish=now;
     }
-    delete ev;
   }
   return status;
 }
 
 
+int daqModule_consumer_recordToFile::flushBatch() {
+  if ((gather==NULL)||(batch.size()==0)) {return 0;}
+  int err=gather->flush();
+  for (unsigned int i=0;i<batch.size();i++) {
+    daqEvent *ev=batch[i];
+    if (!err) {
+      if (index!=NULL) {
+        if (index->addEvent(&ev->h,ev->data,nBytes)) {err=1;}
+      }
+      nEvents++;
+      nBytes+=ev->h.size+sizeof(ev->h);
+      stats_nItems_out++;
+      stats_nBytes_out+=ev->h.size+sizeof(ev->h);
+    }
+    ev->dereference();
+  }
+  batch.clear();
+  return err;
+}
+
+
+int daqModule_consumer_recordToFile::publishFlushStats() {
+  unsigned long long count;
+  double last, avg, max;
+  if (striper!=NULL) {
+    striper->getFlushStats(&count,&last,&avg,&max);
+  } else if (writer!=NULL) {
+    writer->getFlushStats(&count,&last,&avg,&max);
+  } else {
+    return 0;
+  }
+  char buf[128];
+  snprintf(buf,sizeof(buf),"count=%llu last=%.0fus avg=%.0fus max=%.0fus",count,last*1000000,avg*1000000,max*1000000);
+  return publishString("flushLatency",buf);
+}
+
+
 int daqModule_consumer_recordToFile::setup() {
   cout << "recordToFile setup() " << endl;
   nEvents=0;
   nBytes=0;
+
+  if ((stripeDirectories.size()>0)||(rotateMaxBytes>0)||(rotateMaxSeconds>0)) {
+    // striped and/or rotated output
+    std::string baseName="zdaq";
+    std::vector<std::string> dirs=stripeDirectories;
+    if (filename!=NULL) {
+      baseName=filename;
+      size_t ix=baseName.find_last_of('/');
+      if (ix!=std::string::npos) {
+        if (dirs.size()==0) {dirs.push_back(baseName.substr(0,ix));}
+        baseName=baseName.substr(ix+1);
+      }
+    }
+    if (dirs.size()==0) {dirs.push_back(".");}
+
+    striper=new daqRecordStriper();
+    for (unsigned int i=0;i<dirs.size();i++) {
+      striper->addDirectory(dirs[i].c_str());
+    }
+    if (stripeChunkSize>0) {striper->setChunkSize(stripeChunkSize);}
+    striper->setRotation(rotateMaxBytes,rotateMaxSeconds);
+    if (directBufferSize>0) {striper->setBuffers(directBufferSize,1);}
+    striper->setIndex(useIndex);
+    cout << "Opening " << baseName << " striped over " << dirs.size() << " directories" << endl;
+    if (striper->open(baseName.c_str())) {
+      delete striper;
+      striper=NULL;
+      return -1;
+    }
+    lastStatsPublish=time(NULL);
+    return 0;
+  }
+
   if (filename==NULL) {return 0;}
   cout << "Opening " << filename << endl;
-  fd=fopen(filename,"w");
-  if (fd==NULL) {return -1;}
+  if (useIndex) {
+    index=new daqFileIndexWriter();
+    if (index->open(filename)) {
+      delete index;
+      index=NULL;
+      return -1;
+    }
+  }
+  if (directBufferSize>0) {
+    try {
+      writer=new daqRecordWriter(directBufferSize,2);
+    }
+    catch (const char *e) {
+      cout << "Failed to create writer: " << e << endl;
+      writer=NULL;
+      cleanup();
+      return -1;
+    }
+    if (writer->open(filename)) {
+      delete writer;
+      writer=NULL;
+      cleanup();
+      return -1;
+    }
+    lastStatsPublish=time(NULL);
+    return 0;
+  }
+  gather=new daqRecordGather();
+  if (gather->open(filename)) {
+    delete gather;
+    gather=NULL;
+    cleanup();
+    return -1;
+  }
   return 0;
 }
 int daqModule_consumer_recordToFile::cleanup() {
-  if (fd!=NULL) {
-    fclose(fd);
+  int err=0;
+  if (striper!=NULL) {
+    if (striper->close()) {
+      cout << "write failed" << endl;
+      err=-1;
+    }
+    publishFlushStats();
+    delete striper;
+    striper=NULL;
+  }
+  if (writer!=NULL) {
+    if (writer->close()) {
+      cout << "write failed" << endl;
+      err=-1;
+    }
+    publishFlushStats();
+    delete writer;
+    writer=NULL;
     cout << "fd closed" << endl;
   }
-  fd=NULL; 
-  return 0;
+  if (gather!=NULL) {
+    if (flushBatch()) {err=-1;}
+    if (gather->close()) {
+      cout << "write failed" << endl;
+      err=-1;
+    }
+    cout << "fd closed, " << gather->getWriteCalls() << " write calls" << endl;
+    delete gather;
+    gather=NULL;
+  }
+  if (index!=NULL) {
+    if (index->close()) {
+      cout << "index write failed" << endl;
+      err=-1;
+    }
+    delete index;
+    index=NULL;
+  }
+  return err;
 }
 
 int daqModule_consumer_recordToFile::exec_INIT() {
   return setup();
 }
 int daqModule_consumer_recordToFile::exec_RELEASE() {
+  int err=cleanup();
   cout << getName() << " number of events " << nEvents << endl;
   cout << getName() << " number of bytes " << nBytes << endl;
 
-  return cleanup();
+  return err;
 }
 
 
@@ -1,4 +1,8 @@
 #include "Control/zdaq_ctrl.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <map>
 #include <unistd.h>
 #include <boost/uuid/uuid.hpp>
 #include <boost/lexical_cast.hpp>
@@ -8,6 +12,24 @@
 
 
 
+// returns current time, in seconds
+static double getTimeNow() {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+// returns sequence number of a sequential znode name (e.g. cmd-0000000012), or -1
+static int64_t getSequenceNumber(const char *name) {
+    const char *p=strrchr(name,'-');
+    if (p==NULL) {return -1;}
+    char *end=NULL;
+    long long v=strtoll(p+1,&end,10);
+    if ((end==p+1)||(*end!=0)) {return -1;}
+    return (int64_t)v;
+}
+
+
 static const char* state2String(int state){
   if (state == 0)
     return "CLOSED_STATE";
@@ -161,6 +183,298 @@ void zdaqCtrl_service::z_watcher (zhandle_t *zzh, int type, int state, const cha
 
 
 
+// pool of sessions opened in this process, by DNS
+static pthread_mutex_t sessionPoolMutex=PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string,zdaqCtrl_session *> sessionPool;
+
+zdaqCtrl_session *zdaqCtrl_session::get(const char *DNS) {
+    if (DNS==NULL) {return NULL;}
+    zdaqCtrl_session *s=NULL;
+    pthread_mutex_lock(&sessionPoolMutex);
+    std::map<std::string,zdaqCtrl_session *>::iterator it=sessionPool.find(DNS);
+    if (it!=sessionPool.end()) {
+        s=it->second;
+        pthread_mutex_lock(&s->mutex);
+        int isShutdown=s->z_shutdown;
+        pthread_mutex_unlock(&s->mutex);
+        if (isShutdown) {
+            // expired, or authentication failed: not reused. Deleted when last reference released.
+            sessionPool.erase(it);
+            s=NULL;
+        } else {
+            s->nRef++;
+        }
+    }
+    if (s==NULL) {
+        try {
+            s=new zdaqCtrl_session(DNS);
+            sessionPool[DNS]=s;
+        }
+        catch (const char *e) {
+            printf("Failed to create session: %s\n",e);
+            s=NULL;
+        }
+    }
+    pthread_mutex_unlock(&sessionPoolMutex);
+    return s;
+}
+
+void zdaqCtrl_session::release() {
+    pthread_mutex_lock(&sessionPoolMutex);
+    nRef--;
+    if (nRef>0) {
+        pthread_mutex_unlock(&sessionPoolMutex);
+        return;
+    }
+    // pool may already refer to a new session, if this one was shut down
+    std::map<std::string,zdaqCtrl_session *>::iterator it=sessionPool.find(dns);
+    if ((it!=sessionPool.end())&&(it->second==this)) {
+        sessionPool.erase(it);
+    }
+    pthread_mutex_unlock(&sessionPoolMutex);
+    delete this;
+}
+
+zdaqCtrl_session::zdaqCtrl_session(const char *DNS) {
+    dns=DNS;
+    nRef=1;
+    lastToken=0;
+    z_ok=0;
+    z_shutdown=0;
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&cond,NULL);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&dispatchMutex,&attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_mutex_init(&statusMutex,NULL);
+    statusNodeCreated=0;
+    statusWritePending=0;
+    statusDirty=0;
+    char host[64];
+    if (gethostname(host,sizeof(host))) {
+        snprintf(host,sizeof(host),"unknown");
+    }
+    host[sizeof(host)-1]=0;
+    char path[128];
+    snprintf(path,sizeof(path),"%s/%s-%d",ZDAQ_STATUS_ROOT,host,(int)getpid());
+    statusNode=path;
+
+    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+    zh = zookeeper_init(DNS,  zdaqCtrl_session::z_watcher, 30000, 0, this, 0);
+    if (!zh) {
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&dispatchMutex);
+        pthread_mutex_destroy(&statusMutex);
+        throw("zookeeper_init() failed");
+    }
+}
+
+zdaqCtrl_session::~zdaqCtrl_session() {
+    if (zh!=0) {
+        // zookeeper_close() waits pending callbacks (if any) to complete before returning.
+        zookeeper_close(zh);
+        zh=0;
+    }
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&dispatchMutex);
+    pthread_mutex_destroy(&statusMutex);
+}
+
+zhandle_t *zdaqCtrl_session::getHandle() {
+    return zh;
+}
+
+int zdaqCtrl_session::waitConnected(int timeout) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    struct timespec ts;
+    ts.tv_sec=tv.tv_sec+timeout/1000;
+    ts.tv_nsec=tv.tv_usec*1000+(timeout%1000)*1000000;
+    if (ts.tv_nsec>=1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec-=1000000000;
+    }
+    int err=0;
+    pthread_mutex_lock(&mutex);
+    while ((!z_ok)&&(!z_shutdown)) {
+        if (pthread_cond_timedwait(&cond,&mutex,&ts)==ETIMEDOUT) {break;}
+    }
+    if (!z_ok) {err=-1;}
+    pthread_mutex_unlock(&mutex);
+    return err;
+}
+
+int zdaqCtrl_session::isConnected() {
+    return z_ok;
+}
+
+void *zdaqCtrl_session::attach(void *listener) {
+    pthread_mutex_lock(&dispatchMutex);
+    lastToken++;
+    uintptr_t token=lastToken;
+    listeners[token].object=listener;
+    pthread_mutex_unlock(&dispatchMutex);
+    return (void *)token;
+}
+
+int zdaqCtrl_session::detach(void *token) {
+    // callbacks hold the dispatch mutex: once we get it, none is running for this object
+    pthread_mutex_lock(&dispatchMutex);
+    std::map<uintptr_t,t_listener>::iterator it=listeners.find((uintptr_t)token);
+    if (it==listeners.end()) {
+        pthread_mutex_unlock(&dispatchMutex);
+        return -1;
+    }
+    std::set<std::string> nodes;
+    nodes.swap(it->second.ephemeralNodes);
+    listeners.erase(it);
+    pthread_mutex_unlock(&dispatchMutex);
+
+    // ephemeral nodes would otherwise live as long as the session
+    for (std::set<std::string>::iterator n=nodes.begin();n!=nodes.end();++n) {
+        int err=zoo_delete(zh,n->c_str(),-1);
+        if ((err!=ZOK)&&(err!=ZNONODE)) {
+            printf("Failed to delete %s : %s\n",n->c_str(),zerror(err));
+        }
+    }
+    return 0;
+}
+
+void *zdaqCtrl_session::enter(void *token) {
+    pthread_mutex_lock(&dispatchMutex);
+    std::map<uintptr_t,t_listener>::iterator it=listeners.find((uintptr_t)token);
+    if (it==listeners.end()) {
+        pthread_mutex_unlock(&dispatchMutex);
+        return NULL;
+    }
+    return it->second.object;
+}
+
+int zdaqCtrl_session::addEphemeral(void *token, const char *path) {
+    int err=-1;
+    pthread_mutex_lock(&dispatchMutex);
+    std::map<uintptr_t,t_listener>::iterator it=listeners.find((uintptr_t)token);
+    if (it!=listeners.end()) {
+        it->second.ephemeralNodes.insert(path);
+        err=0;
+    }
+    pthread_mutex_unlock(&dispatchMutex);
+    return err;
+}
+
+void zdaqCtrl_session::leave() {
+    pthread_mutex_unlock(&dispatchMutex);
+}
+
+int zdaqCtrl_session::setObjectStatus(const char *objectName, const char *state) {
+    if (objectName==NULL) {return -1;}
+    pthread_mutex_lock(&statusMutex);
+    if (state==NULL) {
+        statusEntries.erase(objectName);
+    } else {
+        statusEntries[objectName]=state;
+    }
+    writeStatus();
+    pthread_mutex_unlock(&statusMutex);
+    return 0;
+}
+
+void zdaqCtrl_session::writeStatus() {
+    if (statusWritePending) {
+        // written on completion of current write
+        statusDirty=1;
+        return;
+    }
+    std::string v;
+    for (std::map<std::string,std::string>::iterator it=statusEntries.begin();it!=statusEntries.end();++it) {
+        v+=it->first;
+        v+="=";
+        v+=it->second;
+        v+="\n";
+    }
+    statusDirty=0;
+    statusWritePending=1;
+    int rc;
+    if (!statusNodeCreated) {
+        statusNodeCreated=1;
+        zoo_acreate(zh,ZDAQ_STATUS_ROOT,0,0,&ZOO_OPEN_ACL_UNSAFE,0,NULL,NULL);
+        rc=zoo_acreate(zh,statusNode.c_str(),v.c_str(),v.length(),&ZOO_OPEN_ACL_UNSAFE,ZOO_EPHEMERAL,z_completion_status_create,this);
+    } else {
+        rc=zoo_aset(zh,statusNode.c_str(),v.c_str(),v.length(),-1,z_completion_status,this);
+    }
+    if (rc!=ZOK) {
+        // completion will not be called
+        statusWritePending=0;
+        printf("Failed to write %s : %s\n",statusNode.c_str(),zerror(rc));
+    }
+}
+
+void zdaqCtrl_session::z_completion_status(int rc, const struct Stat *stat, const void *data) {
+    zdaqCtrl_session *h=(zdaqCtrl_session *)data;
+    pthread_mutex_lock(&h->statusMutex);
+    h->statusWritePending=0;
+    if (rc!=ZOK) {
+        if (rc!=ZCLOSING) {
+            printf("Failed to write %s : %s\n",h->statusNode.c_str(),zerror(rc));
+        }
+    } else if (h->statusDirty) {
+        h->writeStatus();
+    }
+    pthread_mutex_unlock(&h->statusMutex);
+}
+
+void zdaqCtrl_session::z_completion_status_create(int rc, const char *value, const void *data) {
+    zdaqCtrl_session *h=(zdaqCtrl_session *)data;
+    pthread_mutex_lock(&h->statusMutex);
+    h->statusWritePending=0;
+    if (rc==ZNODEEXISTS) {
+        // left by a previous session: overwrite it
+        h->writeStatus();
+    } else if (rc!=ZOK) {
+        if (rc!=ZCLOSING) {
+            printf("Failed to create %s : %s\n",h->statusNode.c_str(),zerror(rc));
+        }
+    } else if (h->statusDirty) {
+        h->writeStatus();
+    }
+    pthread_mutex_unlock(&h->statusMutex);
+}
+
+void zdaqCtrl_session::z_watcher (zhandle_t *zzh, int type, int state, const char *path, void* context){
+    /* Be careful using zh here rather than zzh - as this may be mt code
+     * the client lib may call the watcher before zookeeper_init returns */
+
+    zdaqCtrl_session *h;
+    h=(zdaqCtrl_session *)context;
+    if (h==NULL) {return;}
+    if (type != ZOO_SESSION_EVENT) {return;}
+
+    pthread_mutex_lock(&h->mutex);
+    if (state == ZOO_CONNECTED_STATE) {
+        h->z_ok=1;
+    } else if (state == ZOO_AUTH_FAILED_STATE) {
+        fprintf(stderr, "Authentication failure. Shutting down...\n");
+        h->z_shutdown=1;
+        h->z_ok=0;
+    } else if (state == ZOO_EXPIRED_SESSION_STATE) {
+        fprintf(stderr, "Session expired. Shutting down...\n");
+        h->z_shutdown=1;
+        h->z_ok=0;
+    } else {
+        h->z_ok=0;
+    }
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->mutex);
+}
+
+
+
+
 zdaqCtrl_client::zdaqCtrl_client(const char* objectName, const char* DNS) {
    if (objectName==NULL) {throw ("objectName is NULL");}
     if (DNS==NULL) {throw ("DNS");}
@@ -174,18 +488,17 @@ zdaqCtrl_client::zdaqCtrl_client(const char* objectName, const char* DNS) {
     this->objname[l]=0;
     if (DNS==NULL) {throw("DNS is NULL");}
     
-    zh=0;
-    z_shutdown=0;
-    z_ok=0;
-    bzero(&z_id,sizeof(z_id));
-
-    zh = zookeeper_init(DNS,  zdaqCtrl_client::z_watcher, 30000, &z_id, this, 0);
-    if (!zh) {throw("zookeeper_init() failed");}    
-      for (int i=0;i<5000;i++) {
-        usleep(1000);
-        if (z_ok) {break;}
-    } 
-    if (!z_ok) {throw("zookeeper init timeout");}
+    session=zdaqCtrl_session::get(DNS);
+    if (session==NULL) {throw("zookeeper_init() failed");}
+    if (session->waitConnected(5000)) {
+        session->release();
+        throw("zookeeper init timeout");
+    }
+    zh=session->getHandle();
+    pthread_mutex_init(&dataMutex,NULL);
+    dataHits=0;
+    dataMisses=0;
+    z_token=session->attach(this);
     
     snprintf(znode_state,sizeof(znode_state),"%s/state",objname);
     snprintf(znode_command,sizeof(znode_command),"%s/command",objname);
@@ -194,7 +507,7 @@ zdaqCtrl_client::zdaqCtrl_client(const char* objectName, const char* DNS) {
     
     int err;
     l=sizeof(this->state)-1;
-    err=zoo_wget(zh, znode_state, zdaqCtrl_client::z_watcher_state, this, this->state, &l, NULL);
+    err=zoo_wget(zh, znode_state, zdaqCtrl_client::z_watcher_state, z_token, this->state, &l, NULL);
     if (err) {
         printf("Failed to get %s : %s",znode_state,zerror(err));
     } else {
@@ -204,9 +517,9 @@ zdaqCtrl_client::zdaqCtrl_client(const char* objectName, const char* DNS) {
 }
 
 zdaqCtrl_client::~zdaqCtrl_client() {
-    if (zh!=0) {
-        zookeeper_close(zh);
-    }
+    session->detach(z_token);
+    session->release();
+    pthread_mutex_destroy(&dataMutex);
 }
 
 int zdaqCtrl_client::execCommand(const char* command) {
@@ -220,58 +533,14 @@ int zdaqCtrl_client::execCommand(const char* command) {
 
 
 
-void zdaqCtrl_client::z_watcher (zhandle_t *zzh, int type, int state, const char *path, void* context){
-    /* Be careful using zh here rather than zzh - as this may be mt code
-     * the client lib may call the watcher before zookeeper_init returns */
-
-    /*
-     * fprintf(stderr, "Watcher %s state = %s", type2String(type), state2String(state));
-    if (path && strlen(path) > 0) {
-      fprintf(stderr, " for path %s", path);
-    }
-    fprintf(stderr, "\n");
-*/
-    
-        zdaqCtrl_client *h;
-    h=(zdaqCtrl_client *)context;
-    if (h==NULL) {return;}
-    //printf("z_watcher(%p)\n",(void *)h);
-
-    if (type == ZOO_SESSION_EVENT) {
-        if (state == ZOO_CONNECTED_STATE) {
-            const clientid_t *id = zoo_client_id(zzh);
-            if (h->z_id.client_id == 0 || h->z_id.client_id != id->client_id) {
-                h->z_id = *id;
-                fprintf(stderr, "Got a new session id: 0x%llx\n",
-                        (long long)h->z_id.client_id);            
-            }
-            h->z_ok=1;
-        } else if (state == ZOO_AUTH_FAILED_STATE) {
-            fprintf(stderr, "Authentication failure. Shutting down...\n");
-            zookeeper_close(zzh);
-            h->z_shutdown=1;
-            h->zh=0;
-            h->z_ok=0;
-        } else if (state == ZOO_EXPIRED_SESSION_STATE) {
-            fprintf(stderr, "Session expired. Shutting down...\n");
-            zookeeper_close(zzh);
-            h->z_shutdown=1;
-            h->zh=0;
-            h->z_ok=0;
-        } else {
-            h->z_ok=0;
-        }
-    }
-}
-
-
-
 void zdaqCtrl_client::z_watcher_state (zhandle_t *zzh, int type, int state, const char *path, void* context){
     int err;
   
     
+    // object may have been destroyed: get session from handle, and check object still registered
+    zdaqCtrl_session *session=(zdaqCtrl_session *)zoo_get_context(zzh);
     zdaqCtrl_client *h;
-    h=(zdaqCtrl_client *)context;
+    h=(zdaqCtrl_client *)session->enter(context);
     if (h==NULL) {return;}
     
     //fprintf(stderr, "Watcher %s : %s state = %s\n", h->znode_state, type2String(type), state2String(state));
@@ -282,7 +551,7 @@ void zdaqCtrl_client::z_watcher_state (zhandle_t *zzh, int type, int state, cons
     
     int l;
     l=sizeof(h->state)-1;
-    err=zoo_wget(h->zh, h->znode_state, zdaqCtrl_client::z_watcher_state, h, h->state, &l, NULL);
+    err=zoo_wget(h->zh, h->znode_state, zdaqCtrl_client::z_watcher_state, h->z_token, h->state, &l, NULL);
     if (err) {
         printf("Failed to get %s : %s\n",h->znode_state,zerror(err));
     } else {
@@ -290,6 +559,7 @@ void zdaqCtrl_client::z_watcher_state (zhandle_t *zzh, int type, int state, cons
     }
     printf("client: %s = %s\n",h->znode_state,h->state);
     fflush(stdout);
+    session->leave();
 }
 
 
@@ -313,20 +583,31 @@ zdaqCtrl_object::zdaqCtrl_object(const char *objectName, const char* DNS){
     m_debug=0;
 
     zh=0;
-    z_shutdown=0;
-    z_ok=0;
-    bzero(&z_id,sizeof(z_id));
+    session=NULL;
+
+    pthread_mutex_init(&publishMutex,NULL);
+    pthread_cond_init(&publishCond,NULL);
+    pthread_mutex_init(&publishFlushMutex,NULL);
+    publishInterval=100;
+    publishLastTime=0;
+    publishShutdown=0;
+    publishThreadStarted=0;
+
+    pthread_mutex_init(&barrierMutex,NULL);
+    pthread_cond_init(&barrierCond,NULL);
+    barrierPath[0]=0;
+    barrierDeadline=0;
+    barrierReleased=0;
+    barrierCancelled=0;
+
+    pthread_mutex_init(&cmdMutex,NULL);
+    pthread_cond_init(&cmdCond,NULL);
+    cmdLastSeq=-1;
+    cmdShutdown=0;
+    cmdThreadStarted=0;
 
     setState("UNDEFINED");
     
-    zh = zookeeper_init(DNS,  zdaqCtrl_object::z_watcher, 30000, &z_id, this, 0);
-    if (!zh) {throw("zookeeper_init() failed");}    
-      for (int i=0;i<500;i++) {
-        usleep(10000);
-        if (z_ok) {break;}
-    }
-     
-    
     t_zdaqCtrl_srvinfo info;
     info.version=ZDAQ_CTRL_VERSION;    
     strncpy(info.name,objname,sizeof(info.name));    
@@ -344,44 +625,104 @@ zdaqCtrl_object::zdaqCtrl_object(const char *objectName, const char* DNS){
         info.uuid[i]=v[i];
     }
 
-    
-    if (!z_ok) {throw("zookeeper init timeout");}
-    int err;
-    zoo_create( zh,objname,0,0,&ZOO_OPEN_ACL_UNSAFE, 0,0,0);
-    // check if aname exists / create
+
+    session=zdaqCtrl_session::get(DNS);
+    if (session==NULL) {throw("zookeeper_init() failed");}
+    if (session->waitConnected(5000)) {
+        session->release();
+        session=NULL;
+        throw("zookeeper init timeout");
+    }
+    zh=session->getHandle();
+    z_token=session->attach(this);
     
     snprintf(znode_state,sizeof(znode_state),"%s/state",objname);
     snprintf(znode_command,sizeof(znode_command),"%s/command",objname);
     snprintf(znode_data,sizeof(znode_data),"%s/data",objname);
     
-    zoo_create( zh,znode_state,0,0,&ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL,0,0);
-    zoo_create( zh,znode_command,0,0,&ZOO_OPEN_ACL_UNSAFE, 0,0,0);
-    zoo_create( zh,znode_data,0,0,&ZOO_OPEN_ACL_UNSAFE, 0,0,0);
+    // create object nodes (if they don't exist yet) asynchronously:
+    // requests are pipelined on the session, and executed in order by the server.
+    zoo_acreate( zh,objname,0,0,&ZOO_OPEN_ACL_UNSAFE, 0,z_completion_create,"object");
+    zoo_acreate( zh,znode_state,0,0,&ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL,z_completion_create,"state");
+    session->addEphemeral(z_token,znode_state);
+    zoo_acreate( zh,znode_command,0,0,&ZOO_OPEN_ACL_UNSAFE, 0,z_completion_create,"command");
+    zoo_acreate( zh,znode_data,0,0,&ZOO_OPEN_ACL_UNSAFE, 0,z_completion_create,"data");
+    
     
+    // commands are executed by a separate thread
+    if (pthread_create(&cmdThread,NULL,cmdThreadLoop,this)==0) {
+        cmdThreadStarted=1;
+    }
     
+    // cleanup pending commands, and watch for new ones.
+    // Lock held so that commands listed by the watcher are compared to the ones purged.
     String_vector s;     
-    cmd_purge=1;
-    if (0==zoo_wget_children(zh, znode_command,  zdaqCtrl_object::z_watcher_cmd, this, &s)){
-        // cleanup pending commands
+    pthread_mutex_lock(&cmdMutex);
+    if (0==zoo_wget_children(zh, znode_command,  zdaqCtrl_object::z_watcher_cmd, z_token, &s)){
         for (int i=0;i<s.count;i++) {
               char zn[128];
               snprintf(zn,sizeof(zn),"%s/%s",znode_command,s.data[i]);
               if (m_debug) {
                   printf("%s purging cmd %d = %s\n",objname,i,zn);
               }
-              err=zoo_delete(zh,zn,-1);
-              //printf("err=%d %s",err,zerror(err));
+              zoo_adelete(zh,zn,-1,0,0);
+              int64_t seq=getSequenceNumber(s.data[i]);
+              if (seq>cmdLastSeq) {
+                  cmdLastSeq=seq;
+              }
         }
+        deallocate_String_vector(&s);
+    }
+    pthread_mutex_unlock(&cmdMutex);
+
+    if (pthread_create(&publishThread,NULL,publishThreadLoop,this)==0) {
+        publishThreadStarted=1;
     }
-    cmd_purge=0;
 }
 
 zdaqCtrl_object::~zdaqCtrl_object() {
+    // stop executing commands
+    if (cmdThreadStarted) {
+        pthread_mutex_lock(&cmdMutex);
+        cmdShutdown=1;
+        pthread_cond_signal(&cmdCond);
+        pthread_mutex_unlock(&cmdMutex);
+        pthread_join(cmdThread,NULL);
+        cmdThreadStarted=0;
+    }
+    // publish last state together with pending values
     setState("DEAD");
-    if (zh!=0) {
-        zookeeper_close(zh);
+    if (session!=NULL) {
+        session->setObjectStatus(objname,NULL);
+    }
+    if (publishThreadStarted) {
+        pthread_mutex_lock(&publishMutex);
+        publishShutdown=1;
+        pthread_cond_signal(&publishCond);
+        pthread_mutex_unlock(&publishMutex);
+        pthread_join(publishThread,NULL);
+        publishThreadStarted=0;
+    }
+    if (session!=NULL) {
+        // the session is shared: ephemeral nodes (state, data) are removed by detach
+        session->detach(z_token);
+        session->release();
+        session=NULL;
         zh=0;
     }
+    pthread_mutex_destroy(&publishMutex);
+    pthread_cond_destroy(&publishCond);
+    pthread_mutex_destroy(&publishFlushMutex);
+    pthread_mutex_destroy(&barrierMutex);
+    pthread_cond_destroy(&barrierCond);
+    pthread_mutex_destroy(&cmdMutex);
+    pthread_cond_destroy(&cmdCond);
+}
+
+void zdaqCtrl_object::z_completion_create(int rc, const char *value, const void *data) {
+    if ((rc!=ZOK)&&(rc!=ZNODEEXISTS)) {
+        printf("Failed to create %s node : %s\n",(const char *)data,zerror(rc));
+    }
 }
 
 int zdaqCtrl_object::setState(const char *newState) {
@@ -401,103 +742,147 @@ int zdaqCtrl_object::setState(const char *newState) {
     
     if (m_debug) {printf("Object %s: newstate = %s\n",objname,newState);}
     if (zh!=0) {
-        err=zoo_set(zh, znode_state, this->state, l, -1);
-        if (err) {
-            printf("Failed to publish %s : %s\n",znode_state,zerror(err));
-        }
+        // state is not delayed: write it now, with values pending
+        err=publish(this->state);
+        session->setObjectStatus(objname,this->state);
     }
     return err;
 }
 
-void zdaqCtrl_object::z_watcher (zhandle_t *zzh, int type, int state, const char *path, void* context){
-    /* Be careful using zh here rather than zzh - as this may be mt code
-     * the client lib may call the watcher before zookeeper_init returns */
-
-    /*
-        printf("Object %s: newstate = %s\n",objname,newState);}
-        fprintf(stderr, "Watcher %s state = %s", type2String(type), state2String(state));
+// context of asynchronous command retrieval
+typedef struct {
+    void *objectToken;    // token of object in session
+    zdaqCtrl_session *session;
+    int64_t seq;          // sequence number of command retrieved
+    std::string path;     // command node
+} t_zdaqCtrl_cmdFetch;
 
-        if (path && strlen(path) > 0) {
-            fprintf(stderr, " for path %s", path);            
-        }
-        fprintf(stderr, "\n");
-    */
+void zdaqCtrl_object::z_watcher_cmd (zhandle_t *zzh, int type, int state, const char *path, void* context){
+    if (type!=ZOO_CHILD_EVENT) {return;}
 
+    // object may have been destroyed: get session from handle, and check object still registered
+    zdaqCtrl_session *session=(zdaqCtrl_session *)zoo_get_context(zzh);
     zdaqCtrl_object *h;
-    h=(zdaqCtrl_object *)context;
+    h=(zdaqCtrl_object *)session->enter(context);
     if (h==NULL) {return;}
-    if (h->m_debug) {
-        printf("z_watcher(%p)\n",(void *)h);
+    
+    //    printf("WatcherCMD %s: %s %s\n",h->objname, type2String(type), state2String(state));
+    
+    // list commands, and watch again
+    t_zdaqCtrl_cmdFetch *req=new t_zdaqCtrl_cmdFetch;
+    req->objectToken=context;
+    req->session=session;
+    req->seq=-1;
+    if (zoo_awget_children(zzh, h->znode_command, zdaqCtrl_object::z_watcher_cmd, context, zdaqCtrl_object::z_completion_cmdList, req)!=ZOK) {
+        delete req;
     }
+    session->leave();
+}
 
-    if (type == ZOO_SESSION_EVENT) {
-        if (state == ZOO_CONNECTED_STATE) {
-            const clientid_t *id = zoo_client_id(zzh);
-            if (h->z_id.client_id == 0 || h->z_id.client_id != id->client_id) {
-                h->z_id = *id;
-                if (h->m_debug) {
-                    fprintf(stderr, "Got a new session id: 0x%llx\n", (long long)h->z_id.client_id);            
-                }
+void zdaqCtrl_object::z_completion_cmdList(int rc, const struct String_vector *strings, const void *data) {
+    t_zdaqCtrl_cmdFetch *req=(t_zdaqCtrl_cmdFetch *)data;
+    if (req==NULL) {return;}
+    zdaqCtrl_object *h=(zdaqCtrl_object *)req->session->enter(req->objectToken);
+    if ((h!=NULL)&&(rc==ZOK)&&(strings!=NULL)) {
+        // sort new commands by sequence number
+        std::map<int64_t,const char *> newCommands;
+        pthread_mutex_lock(&h->cmdMutex);
+        for (int i=0;i<strings->count;i++) {
+            int64_t seq=getSequenceNumber(strings->data[i]);
+            if ((seq>h->cmdLastSeq)&&(h->cmdPending.find(seq)==h->cmdPending.end())) {
+                newCommands[seq]=strings->data[i];
             }
-            h->z_ok=1;
-        } else if (state == ZOO_AUTH_FAILED_STATE) {
-            fprintf(stderr, "Authentication failure. Shutting down...\n");
-            zookeeper_close(zzh);
-            h->z_shutdown=1;
-            h->zh=0;
-            h->z_ok=0;
-        } else if (state == ZOO_EXPIRED_SESSION_STATE) {
-            fprintf(stderr, "Session expired. Shutting down...\n");
-            zookeeper_close(zzh);
-            h->z_shutdown=1;
-            h->zh=0;
-            h->z_ok=0;
-        } else {
-            h->z_ok=0;
         }
+        // retrieve them: requests are executed in order, but completions are delivered in sequence order anyway
+        for (std::map<int64_t,const char *>::iterator it=newCommands.begin();it!=newCommands.end();++it) {
+            t_zdaqCtrl_cmdFetch *r=new t_zdaqCtrl_cmdFetch;
+            r->objectToken=req->objectToken;
+            r->session=req->session;
+            r->seq=it->first;
+            r->path=std::string(h->znode_command)+"/"+it->second;
+            t_cmdPending &p=h->cmdPending[it->first];
+            p.fetched=0;
+            p.valid=0;
+            if (zoo_aget(h->zh, r->path.c_str(), 0, zdaqCtrl_object::z_completion_cmdGet, r)!=ZOK) {
+                printf("Failed to get cmd %s\n",r->path.c_str());
+                p.fetched=1;
+                delete r;
+            }
+            h->cmdLastSeq=it->first;
+        }
+        h->cmdDeliver();
+        pthread_mutex_unlock(&h->cmdMutex);
     }
+    if (h!=NULL) {
+        req->session->leave();
+    }
+    delete req;
 }
 
-
-void zdaqCtrl_object::z_watcher_cmd (zhandle_t *zzh, int type, int state, const char *path, void* context){
-    zdaqCtrl_object *h;
-    h=(zdaqCtrl_object *)context;
-    if (h==NULL) {return;}
-    
-    //    printf("WatcherCMD %s: %s %s\n",h->objname, type2String(type), state2String(state));
-    
-
-    String_vector s;
-    
-    while (h->cmd_purge) {
-        usleep(100);
+void zdaqCtrl_object::z_completion_cmdGet(int rc, const char *value, int value_len, const struct Stat *stat, const void *data) {
+    t_zdaqCtrl_cmdFetch *req=(t_zdaqCtrl_cmdFetch *)data;
+    if (req==NULL) {return;}
+    zdaqCtrl_object *h=(zdaqCtrl_object *)req->session->enter(req->objectToken);
+    if (h!=NULL) {
+        if (rc==ZOK) {
+            // command consumed
+            zoo_adelete(h->zh,req->path.c_str(),-1,0,0);
+        } else {
+            printf("Failed to get cmd %s : %s\n",req->path.c_str(),zerror(rc));
+        }
+        pthread_mutex_lock(&h->cmdMutex);
+        std::map<int64_t,t_cmdPending>::iterator it=h->cmdPending.find(req->seq);
+        if (it!=h->cmdPending.end()) {
+            it->second.fetched=1;
+            if ((rc==ZOK)&&(value!=NULL)&&(value_len>0)) {
+                it->second.value.assign(value,strnlen(value,value_len));
+                it->second.valid=1;
+            }
+        }
+        h->cmdDeliver();
+        pthread_mutex_unlock(&h->cmdMutex);
+        req->session->leave();
     }
-    
-    if (type==ZOO_CHILD_EVENT) {
-      if (0==zoo_wget_children(zzh, h->znode_command,  zdaqCtrl_object::z_watcher_cmd, h,
-        &s)){
-          // printf("WatcherCMD: %d pending actions\n",s.count);
-          
-          // todo: reorder queue
-          for (int i=0;i<s.count;i++) {
-              // printf("WatcherCMD : found cmd %d = %s\n",i,s.data[i]);
+    delete req;
+}
 
-              int err;
-              char zn[128];
-              snprintf(zn,sizeof(zn),"%s/%s",h->znode_command,s.data[i]);
-              char val[128];
-              int sz=sizeof(val);
-              err=zoo_get(zzh, zn, 0, val, &sz, NULL);
-              printf("%s command=%s (%d bytes)\n",h->getName(),val,sz);
-              h->executeCommand(val);
-              if (err) {
-                     printf("Failed to get cmd : %s\n",zerror(err));
-              }
-              zoo_delete(zzh,zn,-1);
-          }      
-      }
+void zdaqCtrl_object::cmdDeliver() {
+    int n=0;
+    while (!cmdPending.empty()) {
+        std::map<int64_t,t_cmdPending>::iterator it=cmdPending.begin();
+        if (!it->second.fetched) {
+            // keep order: wait for retrieval of this one
+            break;
+        }
+        if (it->second.valid) {
+            cmdQueue.push_back(it->second.value);
+            n++;
+        }
+        cmdPending.erase(it);
     }
+    if (n) {
+        pthread_cond_signal(&cmdCond);
+    }
+}
 
+void *zdaqCtrl_object::cmdThreadLoop(void *arg) {
+    zdaqCtrl_object *o=(zdaqCtrl_object *)arg;
+    pthread_mutex_lock(&o->cmdMutex);
+    for (;;) {
+        if (o->cmdShutdown) {break;}
+        if (o->cmdQueue.empty()) {
+            pthread_cond_wait(&o->cmdCond,&o->cmdMutex);
+            continue;
+        }
+        std::string command=o->cmdQueue.front();
+        o->cmdQueue.pop_front();
+        pthread_mutex_unlock(&o->cmdMutex);
+        printf("%s command=%s\n",o->getName(),command.c_str());
+        o->executeCommand(command.c_str());
+        pthread_mutex_lock(&o->cmdMutex);
+    }
+    pthread_mutex_unlock(&o->cmdMutex);
+    return NULL;
 }
 
 
@@ -516,6 +901,78 @@ int testStateObj::executeCommand(const char *command) {
     return 0;
 }
 
+int zdaqCtrl_object::armBarrier(const char *path, double deadline) {
+    if (path==NULL) {return -1;}
+    pthread_mutex_lock(&barrierMutex);
+    snprintf(barrierPath,sizeof(barrierPath),"%s",path);
+    barrierDeadline=deadline;
+    barrierReleased=0;
+    barrierCancelled=0;
+    pthread_mutex_unlock(&barrierMutex);
+
+    // watch barrier creation (it may exist already)
+    struct Stat stat;
+    int rc=zoo_wexists(zh,path,zdaqCtrl_object::z_watcher_barrier,z_token,&stat);
+    if (rc==ZOK) {
+        pthread_mutex_lock(&barrierMutex);
+        barrierReleased=1;
+        pthread_cond_broadcast(&barrierCond);
+        pthread_mutex_unlock(&barrierMutex);
+    } else if (rc!=ZNONODE) {
+        printf("%s : failed to watch barrier %s : %s\n",objname,path,zerror(rc));
+        if (deadline<=0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int zdaqCtrl_object::waitBarrier() {
+    int err=0;
+    pthread_mutex_lock(&barrierMutex);
+    while ((!barrierReleased)&&(!barrierCancelled)) {
+        if (barrierDeadline>0) {
+            // pthread_cond_timedwait() default clock is CLOCK_REALTIME
+            struct timespec ts;
+            ts.tv_sec=(time_t)barrierDeadline;
+            ts.tv_nsec=(long)((barrierDeadline-ts.tv_sec)*1000000000.0);
+            if (pthread_cond_timedwait(&barrierCond,&barrierMutex,&ts)==ETIMEDOUT) {
+                barrierReleased=1;
+            }
+        } else {
+            pthread_cond_wait(&barrierCond,&barrierMutex);
+        }
+    }
+    if (barrierCancelled) {
+        err=-1;
+    }
+    pthread_mutex_unlock(&barrierMutex);
+    return err;
+}
+
+void zdaqCtrl_object::cancelBarrier() {
+    pthread_mutex_lock(&barrierMutex);
+    barrierCancelled=1;
+    pthread_cond_broadcast(&barrierCond);
+    pthread_mutex_unlock(&barrierMutex);
+}
+
+void zdaqCtrl_object::z_watcher_barrier (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx){
+    zdaqCtrl_session *session=(zdaqCtrl_session *)zoo_get_context(zzh);
+    zdaqCtrl_object *h;
+    h=(zdaqCtrl_object *)session->enter(watcherCtx);
+    if (h==NULL) {return;}
+    if ((type==ZOO_CREATED_EVENT)&&(path!=NULL)) {
+        pthread_mutex_lock(&h->barrierMutex);
+        if (!strcmp(path,h->barrierPath)) {
+            h->barrierReleased=1;
+            pthread_cond_broadcast(&h->barrierCond);
+        }
+        pthread_mutex_unlock(&h->barrierMutex);
+    }
+    session->leave();
+}
+
 const char* zdaqCtrl_object::getName(){
     return this->objname;
 }
@@ -529,23 +986,147 @@ const char* zdaqCtrl_object::getState(){
 int zdaqCtrl_object::publishString(const char *key, const char *value){
     if (key==NULL) {return -1;}
     if (value==NULL) {value="";}
-    printf("publish\n");
     char path[256];
     snprintf(path,sizeof(path),"%s/%s",this->znode_data,key);
-    int l;
-    l=strlen(value)+1;
-    
-    int err=0;
-    if (zoo_exists(zh, path, 0, NULL)==ZOK) {
-        err=zoo_set(zh, path, value,l, -1);
+
+    pthread_mutex_lock(&publishMutex);
+    publishQueue[path]=std::string(value,strlen(value)+1);
+    int now=(publishInterval<=0)||(!publishThreadStarted);
+    if (!now) {
+        pthread_cond_signal(&publishCond);
+    }
+    pthread_mutex_unlock(&publishMutex);
+
+    if (now) {
+        return publish(NULL);
+    }
+    return 0;
+}
+
+int zdaqCtrl_object::setPublishInterval(int ms) {
+    if (ms<0) {ms=0;}
+    pthread_mutex_lock(&publishMutex);
+    publishInterval=ms;
+    pthread_cond_signal(&publishCond);
+    pthread_mutex_unlock(&publishMutex);
+    return 0;
+}
+
+int zdaqCtrl_object::flushPublish() {
+    return publish(NULL);
+}
+
+int zdaqCtrl_object::publish(const char *newState) {
+    if (zh==0) {return -1;}
+
+    pthread_mutex_lock(&publishFlushMutex);
+
+    // take all values queued so far
+    std::map<std::string,std::string> values;
+    pthread_mutex_lock(&publishMutex);
+    values.swap(publishQueue);
+    publishLastTime=getTimeNow();
+    pthread_mutex_unlock(&publishMutex);
+
+    int nOps=values.size();
+    if (newState!=NULL) {nOps++;}
+    if (nOps==0) {
+        pthread_mutex_unlock(&publishFlushMutex);
+        return 0;
+    }
+
+    // one operation per node: update if it exists, create it otherwise
+    std::vector<zoo_op_t> ops(nOps);
+    std::vector<zoo_op_result_t> results(nOps);
+    std::vector<int> isCreate(nOps,0);
+    int ix=0;
+    for (std::map<std::string,std::string>::iterator it=values.begin();it!=values.end();++it,ix++) {
+        if (publishNodes.find(it->first)!=publishNodes.end()) {
+            zoo_set_op_init(&ops[ix],it->first.c_str(),it->second.data(),it->second.size(),-1,NULL);
+        } else {
+            zoo_create_op_init(&ops[ix],it->first.c_str(),it->second.data(),it->second.size(),&ZOO_OPEN_ACL_UNSAFE,ZOO_EPHEMERAL,NULL,0);
+            isCreate[ix]=1;
+        }
+    }
+    if (newState!=NULL) {
+        zoo_set_op_init(&ops[ix],znode_state,newState,strlen(newState),-1,NULL);
+    }
+
+    int err=zoo_multi(zh,nOps,&ops[0],&results[0]);
+    if (err==ZOK) {
+        ix=0;
+        for (std::map<std::string,std::string>::iterator it=values.begin();it!=values.end();++it,ix++) {
+            if (isCreate[ix]) {
+                publishNodes.insert(it->first);
+                session->addEphemeral(z_token,it->first.c_str());
+            }
+        }
     } else {
-        err=zoo_create( zh,path,value,l,&ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL,0,0);
+        // the transaction failed as a whole (e.g. node created/deleted by someone else): write nodes one by one
+        if (m_debug) {printf("%s : publication of %d values failed (%s), retrying individually\n",objname,nOps,zerror(err));}
+        err=0;
+        for (std::map<std::string,std::string>::iterator it=values.begin();it!=values.end();++it) {
+            const char *path=it->first.c_str();
+            int l=it->second.size();
+            int e=zoo_set(zh, path, it->second.data(), l, -1);
+            if (e==ZNONODE) {
+                e=zoo_create(zh, path, it->second.data(), l, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL,0,0);
+            }
+            if (e==ZOK) {
+                if (publishNodes.insert(it->first).second) {
+                    session->addEphemeral(z_token,path);
+                }
+            } else {
+                printf("Failed to publish %s : %s\n",path,zerror(e));
+                err=e;
+            }
+        }
+        if (newState!=NULL) {
+            int e=zoo_set(zh, znode_state, newState, strlen(newState), -1);
+            if (e) {
+                printf("Failed to publish %s : %s\n",znode_state,zerror(e));
+                err=e;
+            }
+        }
     }
-    printf("Create %s : %s\n",path,zerror(err));
-    
+
+    pthread_mutex_unlock(&publishFlushMutex);
     return err;
 }
 
+void *zdaqCtrl_object::publishThreadLoop(void *arg) {
+    zdaqCtrl_object *o=(zdaqCtrl_object *)arg;
+    pthread_mutex_lock(&o->publishMutex);
+    for (;;) {
+        if (o->publishQueue.empty()) {
+            if (o->publishShutdown) {break;}
+            pthread_cond_wait(&o->publishCond,&o->publishMutex);
+            continue;
+        }
+        // bound publication rate
+        double next=o->publishLastTime+o->publishInterval/1000.0;
+        if ((!o->publishShutdown)&&(getTimeNow()<next)) {
+            struct timespec ts;
+            ts.tv_sec=(time_t)next;
+            ts.tv_nsec=(long)((next-ts.tv_sec)*1000000000.0);
+            pthread_cond_timedwait(&o->publishCond,&o->publishMutex,&ts);
+            continue;
+        }
+        pthread_mutex_unlock(&o->publishMutex);
+        o->publish(NULL);
+        pthread_mutex_lock(&o->publishMutex);
+    }
+    pthread_mutex_unlock(&o->publishMutex);
+    return NULL;
+}
+
+// context of asynchronous refresh of a cached data value
+typedef struct {
+    void *clientToken;    // token of client in session
+    zdaqCtrl_session *session;
+    std::string path;     // node read
+} t_zdaqCtrl_dataRequest;
+
 int zdaqCtrl_client::getData(const char *key, char *value, int *valueSz) {
     if (key==NULL) {return -1;}
     if (value==NULL) {return -1;}
@@ -554,13 +1135,183 @@ int zdaqCtrl_client::getData(const char *key, char *value, int *valueSz) {
     
     char path[256];
     snprintf(path,sizeof(path),"%s/data/%s",this->objname,key);
-        
+    
+    // try cache first
+    pthread_mutex_lock(&dataMutex);
+    std::map<std::string,t_dataEntry>::iterator it;
+    it=dataCache.find(path);
+    if ((it!=dataCache.end())&&(it->second.valid)) {
+        dataHits++;
+        int err=-1;
+        if (it->second.exists) {
+            int l=it->second.value.length();
+            if (l>*valueSz) {l=*valueSz;}
+            memcpy(value,it->second.value.data(),l);
+            *valueSz=l;
+            err=0;
+        }
+        pthread_mutex_unlock(&dataMutex);
+        return err;
+    }
+    dataMisses++;
+    pthread_mutex_unlock(&dataMutex);
+    
+    // get value, and watch for changes
     int err;
-    err=zoo_get(zh, path, 0, value, valueSz, NULL);
-    if (err==ZOK) {return 0;}
+    int bufSz=*valueSz;
+    struct Stat stat;
+    err=zoo_wget(zh, path, zdaqCtrl_client::z_watcher_data, z_token, value, valueSz, &stat);
+    if (err==ZOK) {
+        if (stat.dataLength<=bufSz) {
+            // complete value: can be cached
+            storeData(path,value,*valueSz,&stat);
+        }
+        return 0;
+    }
+    if (err==ZNONODE) {
+        // watch for node creation, and remember node does not exist
+        if (zoo_wexists(zh, path, zdaqCtrl_client::z_watcher_data, z_token, &stat)==ZNONODE) {
+            pthread_mutex_lock(&dataMutex);
+            it=dataCache.find(path);
+            if (it==dataCache.end()) {
+                t_dataEntry e;
+                e.exists=0;
+                e.valid=1;
+                e.mzxid=-1;
+                dataCache.insert(std::pair<std::string,t_dataEntry>(path,e));
+            } else if (!it->second.valid) {
+                it->second.exists=0;
+                it->second.valid=1;
+            }
+            pthread_mutex_unlock(&dataMutex);
+        }
+    }
     return -1;
 }
 
+void zdaqCtrl_client::storeData(const char *path, const char *value, int valueSz, const struct Stat *stat) {
+    pthread_mutex_lock(&dataMutex);
+    std::map<std::string,t_dataEntry>::iterator it;
+    it=dataCache.find(path);
+    if (it==dataCache.end()) {
+        t_dataEntry e;
+        e.exists=0;
+        e.valid=0;
+        e.mzxid=-1;
+        it=dataCache.insert(std::pair<std::string,t_dataEntry>(path,e)).first;
+    }
+    if (stat->mzxid>=it->second.mzxid) {
+        it->second.value.assign(value,valueSz>0?valueSz:0);
+        it->second.exists=1;
+        it->second.valid=1;
+        it->second.mzxid=stat->mzxid;
+    }
+    pthread_mutex_unlock(&dataMutex);
+}
+
+int zdaqCtrl_client::getCacheStats(unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&dataMutex);
+    if (hits!=NULL) {*hits=dataHits;}
+    if (misses!=NULL) {*misses=dataMisses;}
+    pthread_mutex_unlock(&dataMutex);
+    return 0;
+}
+
+// read and decode a metrics node, keeping metrics of given source only
+static int readMetricsNode(zhandle_t *zh, const char *node, const char *source, std::vector<zdaqMetrics_value> &metrics) {
+    // the node changes every period: not cached, read latest value
+    std::vector<char> buffer(4096);
+    for (int i=0;i<3;i++) {
+        int sz=buffer.size();
+        struct Stat stat;
+        if (zoo_get(zh, node, 0, &buffer[0], &sz, &stat)!=ZOK) {return -1;}
+        if (stat.dataLength>(int)buffer.size()) {
+            // node grew, retry with a bigger buffer
+            buffer.resize(stat.dataLength+1024);
+            continue;
+        }
+        std::vector<zdaqMetrics_value> all;
+        if (zdaqMetrics_decode(&buffer[0],sz,all)) {return -1;}
+        for (size_t j=0;j<all.size();j++) {
+            if (all[j].source==source) {
+                metrics.push_back(all[j]);
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int zdaqCtrl_client::getMetrics(std::vector<zdaqMetrics_value> &metrics) {
+    metrics.clear();
+
+    // where the object publishes its metrics (does not change, served from cache)
+    char node[256];
+    int nodeSz=sizeof(node)-1;
+    if (getData("metricsNode",node,&nodeSz)==0) {
+        node[nodeSz]=0;
+        return readMetricsNode(zh,node,objname,metrics);
+    }
+
+    // node not advertised: merge the nodes of all processes
+    struct String_vector children;
+    if (zoo_get_children(zh,ZDAQ_METRICS_ROOT,0,&children)!=ZOK) {return -1;}
+    int found=0;
+    for (int i=0;i<children.count;i++) {
+        std::string path=std::string(ZDAQ_METRICS_ROOT)+"/"+children.data[i];
+        size_t n=metrics.size();
+        if (readMetricsNode(zh,path.c_str(),objname,metrics)==0) {
+            found=1;
+        }
+        if (metrics.size()>n) {break;}   // an object is published by a single process
+    }
+    deallocate_String_vector(&children);
+    return found?0:-1;
+}
+
+void zdaqCtrl_client::z_watcher_data (zhandle_t *zzh, int type, int state, const char *path, void* context){
+    if ((type!=ZOO_CHANGED_EVENT)&&(type!=ZOO_CREATED_EVENT)&&(type!=ZOO_DELETED_EVENT)) {return;}
+    
+    zdaqCtrl_session *session=(zdaqCtrl_session *)zoo_get_context(zzh);
+    zdaqCtrl_client *h;
+    h=(zdaqCtrl_client *)session->enter(context);
+    if (h==NULL) {return;}
+    
+    // invalidate entry: reads go to zookeeper until refreshed
+    pthread_mutex_lock(&h->dataMutex);
+    std::map<std::string,t_dataEntry>::iterator it;
+    it=h->dataCache.find(path);
+    if (it!=h->dataCache.end()) {
+        it->second.valid=0;
+    }
+    pthread_mutex_unlock(&h->dataMutex);
+    
+    if (type!=ZOO_DELETED_EVENT) {
+        // refresh value, and watch again
+        t_zdaqCtrl_dataRequest *req=new t_zdaqCtrl_dataRequest;
+        req->clientToken=context;
+        req->session=session;
+        req->path=path;
+        if (zoo_awget(zzh, path, zdaqCtrl_client::z_watcher_data, context, zdaqCtrl_client::z_completion_data, req)!=ZOK) {
+            delete req;
+        }
+    }
+    session->leave();
+}
+
+void zdaqCtrl_client::z_completion_data(int rc, const char *value, int value_len, const struct Stat *stat, const void *data) {
+    t_zdaqCtrl_dataRequest *req=(t_zdaqCtrl_dataRequest *)data;
+    if (req==NULL) {return;}
+    zdaqCtrl_client *h=(zdaqCtrl_client *)req->session->enter(req->clientToken);
+    if (h!=NULL) {
+        if ((rc==ZOK)&&(stat!=NULL)&&(value_len>=stat->dataLength)) {
+            h->storeData(req->path.c_str(),value,value_len,stat);
+        }
+        req->session->leave();
+    }
+    delete req;
+}
+
 
 
 
@@ -583,12 +1334,39 @@ zdaqCtrl_item::zdaqCtrl_item(const char* objectName, zdaqCtrl_group *group){
     snprintf(znode_state,sizeof(znode_state),"%s/state",objname);
     snprintf(znode_command,sizeof(znode_command),"%s/command",objname);  
     snprintf(this->state,sizeof(this->state),"UNKNOWN");      
+
+    cmdId=0;
+    cmdAcked=0;
+    cmdDone=0;
+    cmdError=0;
+    cmdTime=0;
+    cmdLatency=0;
+    startTime=0;
+    z_token=NULL;
     
     group->addItem(this);
 }
 zdaqCtrl_item::~zdaqCtrl_item() {
 }
 
+const char *zdaqCtrl_item::getName() {
+    return objname;
+}
+const char *zdaqCtrl_item::getState() {
+    return state;
+}
+int zdaqCtrl_item::getCommandStatus() {
+    if (cmdError) {return -1;}
+    if (!cmdDone) {return 1;}
+    return 0;
+}
+double zdaqCtrl_item::getCommandLatency() {
+    return cmdLatency;
+}
+double zdaqCtrl_item::getStartTime() {
+    return startTime;
+}
+
 int zdaqCtrl_item::execCommand(const char *command) {
     if (command==NULL) {
         return -1;
@@ -604,112 +1382,502 @@ int zdaqCtrl_item::execCommand(const char *command) {
 };
 
 
-zdaqCtrl_group::zdaqCtrl_group(const char* DNS){
+
+// a command sent by a group to one of its items, waiting for completion
+typedef struct {
+    void *itemToken;      // token of item in session
+    int cmdId;
+    zdaqCtrl_session *session;
+} t_zdaqCtrl_cmdRequest;
+
+
+zdaqCtrl_group::zdaqCtrl_group(const char* DNS, int aggregatedStatus){
     if (DNS==NULL) {throw("DNS is NULL");}
     debug=0;
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&cond,NULL);
+    cmdId=0;
+    cmdTargetState=NULL;
+    cmdPending=0;
+    cmdTotalTime=0;
+    startSkew=0;
     zh=0;
-    z_shutdown=0;
-    z_ok=0;
-    bzero(&z_id,sizeof(z_id));
-zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
-    zh = zookeeper_init(DNS,  zdaqCtrl_group::z_watcher, 30000, &z_id, this, 0);
-    if (!zh) {throw("zookeeper_init() failed");}    
-      for (int i=0;i<5000;i++) {
-        usleep(1000);
-        if (z_ok) {break;}
-    } 
-    if (!z_ok) {throw("zookeeper init timeout");}
+    session=zdaqCtrl_session::get(DNS);
+    if (session==NULL) {throw("zookeeper_init() failed");}
+    if (session->waitConnected(5000)) {
+        session->release();
+        throw("zookeeper init timeout");
+    }
+    zh=session->getHandle();
+    
+    useAggregatedStatus=aggregatedStatus;
+    z_token=NULL;
+    if (useAggregatedStatus) {
+        z_token=session->attach(this);
+        int rc=zoo_create(zh,ZDAQ_STATUS_ROOT,0,0,&ZOO_OPEN_ACL_UNSAFE,0,NULL,0);
+        if ((rc!=ZOK)&&(rc!=ZNODEEXISTS)) {
+            printf("Failed to create %s : %s\n",ZDAQ_STATUS_ROOT,zerror(rc));
+        }
+        // serialized with callbacks
+        session->enter(z_token);
+        readStatusRoot();
+        session->leave();
+    }
 }
 
 zdaqCtrl_group::~zdaqCtrl_group(){
-  if (zh!=0) {
-    zookeeper_close(zh);
-    // zookeper_close() waits pending callbacks (if any) to complete before returning. (feature tested 19/08/2013)
-    // at this stage, we are sure no zdaqCtrl_group::z_watcher callback is being / will be executed, the object can be deleted safely.
+  if (z_token!=NULL) {
+      session->detach(z_token);
+  }
+  // after detach, we are sure no callback is being / will be executed for the items, they can be deleted safely.
+  for (int i=0;i<items.size();i++) {
+      session->detach(items[i]->z_token);
   }
+  session->release();
   for (int i=0;i<items.size();i++) {
       delete items[i];
   }
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
 }
-int zdaqCtrl_group::execCommand(const char *command) {
-    int i;
-    for (i=0;i<items.size();i++){
-        items[i]->execCommand(command);
+
+int zdaqCtrl_group::execCommand(const char *command, const char *targetState, int timeout) {
+    if (command==NULL) {return -1;}
+    if (timeout<=0) {timeout=10000;}
+    double t0=getTimeNow();
+    double deadline=t0+timeout/1000.0;
+    int err=0;
+
+    // send command to all items at once, completions are gathered asynchronously
+    pthread_mutex_lock(&mutex);
+    cmdId++;
+    cmdTargetState=targetState;
+    cmdPending=items.size();
+    for (unsigned int i=0;i<items.size();i++) {
+        zdaqCtrl_item *it=items[i];
+        it->cmdId=cmdId;
+        it->cmdAcked=0;
+        it->cmdDone=0;
+        it->cmdError=0;
+        it->cmdTime=getTimeNow();
+        it->cmdLatency=0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (unsigned int i=0;i<items.size();i++) {
+        zdaqCtrl_item *it=items[i];
+        char zn[128];
+        snprintf(zn,sizeof(zn),"%s/cmd-",it->znode_command);
+        t_zdaqCtrl_cmdRequest *req=new t_zdaqCtrl_cmdRequest;
+        req->itemToken=it->z_token;
+        req->cmdId=cmdId;
+        req->session=session;
+        int rc=zoo_acreate(zh,zn,command,strlen(command)+1,&ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL | ZOO_SEQUENCE,z_completion_cmd,req);
+        if (rc!=ZOK) {
+            // completion will not be called
+            delete req;
+            pthread_mutex_lock(&mutex);
+            it->cmdError=rc;
+            it->cmdDone=1;
+            cmdPending--;
+            pthread_mutex_unlock(&mutex);
+            printf("Failed to send command to %s : %s\n",it->objname,zerror(rc));
+        }
+    }
+
+    // wait completion of all items
+    err=waitPending(deadline);
+    pthread_mutex_lock(&mutex);
+    zdaqCtrl_item *slowest=NULL;
+    for (unsigned int i=0;i<items.size();i++) {
+        zdaqCtrl_item *it=items[i];
+        if ((it->cmdError)||(!it->cmdDone)) {
+            err=-1;
+            if (debug) {
+                printf("%s : command %s failed (%s, state %s)\n",it->objname,command,it->cmdError?zerror(it->cmdError):"timeout",it->state);
+            }
+            continue;
+        }
+        if ((slowest==NULL)||(it->cmdLatency>slowest->cmdLatency)) {slowest=it;}
+    }
+    cmdTargetState=NULL;
+    cmdTotalTime=getTimeNow()-t0;
+    pthread_mutex_unlock(&mutex);
+
+    if (debug) {
+        printf("Command %s : %d items in %.3f ms",command,(int)items.size(),cmdTotalTime*1000);
+        if (slowest!=NULL) {
+            printf(", slowest %s (%.3f ms)",slowest->objname,slowest->cmdLatency*1000);
+        }
+        printf("\n");
+    }
+    return err;
+}
+
+int zdaqCtrl_group::waitPending(double deadline) {
+    int err=0;
+    pthread_mutex_lock(&mutex);
+    while (cmdPending>0) {
+        double now=getTimeNow();
+        if (now>=deadline) {break;}
+        struct timespec ts;
+        ts.tv_sec=(time_t)deadline;
+        ts.tv_nsec=(long)((deadline-ts.tv_sec)*1000000000.0);
+        pthread_cond_timedwait(&cond,&mutex,&ts);
+    }
+    if (cmdPending>0) {err=-1;}
+    pthread_mutex_unlock(&mutex);
+    return err;
+}
+
+int zdaqCtrl_group::execSynchronizedStart(int timeout, int delay) {
+    static int barrierCounter=0;
+    if (timeout<=0) {timeout=10000;}
+    double t0=getTimeNow();
+    
+    pthread_mutex_lock(&mutex);
+    startSkew=0;
+    for (unsigned int i=0;i<items.size();i++) {
+        items[i]->startTime=0;
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    // barrier name, unique for this request
+    char host[64];
+    if (gethostname(host,sizeof(host))) {
+        snprintf(host,sizeof(host),"unknown");
+    }
+    host[sizeof(host)-1]=0;
+    char barrier[128];
+    snprintf(barrier,sizeof(barrier),"/zdaqBarrier-%s-%d-%d",host,(int)getpid(),__sync_add_and_fetch(&barrierCounter,1));
+
+    // release time, if any
+    double releaseTime=0;
+    if (delay>0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME,&ts);
+        releaseTime=ts.tv_sec+ts.tv_nsec/1000000000.0+delay/1000.0;
+    }
+    
+    // phase 1: arm items
+    char cmd[256];
+    snprintf(cmd,sizeof(cmd),"ARM %s %.6f",barrier,releaseTime);
+    if (execCommand(cmd,"ARMED",timeout)) {
+        printf("Synchronized start: failed to arm all items\n");
+        execCommand("STOP",NULL,timeout);
+        return -1;
+    }
+
+    // phase 2: release items, and wait all running
+    pthread_mutex_lock(&mutex);
+    cmdId++;
+    cmdTargetState="RUNNING";
+    cmdPending=items.size();
+    for (unsigned int i=0;i<items.size();i++) {
+        zdaqCtrl_item *it=items[i];
+        it->cmdId=cmdId;
+        it->cmdAcked=1;   // no command sent, only waiting for state
+        it->cmdDone=0;
+        it->cmdError=0;
+        it->cmdTime=getTimeNow();
+        it->cmdLatency=0;
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    if (releaseTime>0) {
+        // items release themselves at given time. Barrier is created then, for items with late clocks.
+        struct timespec ts;
+        ts.tv_sec=(time_t)releaseTime;
+        ts.tv_nsec=(long)((releaseTime-ts.tv_sec)*1000000000.0);
+        while (clock_nanosleep(CLOCK_REALTIME,TIMER_ABSTIME,&ts,NULL)==EINTR) {}
+    }
+    int err=zoo_create(zh,barrier,0,0,&ZOO_OPEN_ACL_UNSAFE,ZOO_EPHEMERAL,NULL,0);
+    if (err!=ZOK) {
+        printf("Synchronized start: failed to create barrier %s : %s\n",barrier,zerror(err));
+    }
+    
+    // items may be RUNNING already
+    pthread_mutex_lock(&mutex);
+    for (unsigned int i=0;i<items.size();i++) {
+        updateCommandStatus(items[i]);
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    err=waitPending(getTimeNow()+timeout/1000.0);
+    pthread_mutex_lock(&mutex);
+    cmdTargetState=NULL;
+    pthread_mutex_unlock(&mutex);
+    zoo_delete(zh,barrier,-1);
+    if (err) {
+        printf("Synchronized start: not all items running\n");
+        execCommand("STOP",NULL,timeout);
+        return -1;
+    }
+    
+    // gather start times reported by items
+    double tmin=0,tmax=0;
+    for (unsigned int i=0;i<items.size();i++) {
+        zdaqCtrl_item *it=items[i];
+        char zn[256];
+        snprintf(zn,sizeof(zn),"%s/data/startTime",it->objname);
+        char val[64];
+        int sz=sizeof(val)-1;
+        if (zoo_get(zh,zn,0,val,&sz,NULL)!=ZOK) {
+            continue;
+        }
+        val[sz]=0;
+        double t=atof(val);
+        pthread_mutex_lock(&mutex);
+        it->startTime=t;
+        pthread_mutex_unlock(&mutex);
+        if ((tmin==0)||(t<tmin)) {tmin=t;}
+        if (t>tmax) {tmax=t;}
+    }
+    startSkew=tmax-tmin;
+    cmdTotalTime=getTimeNow()-t0;
+    if (debug) {
+        printf("Synchronized start : %d items in %.3f ms, start skew %.3f ms\n",(int)items.size(),cmdTotalTime*1000,startSkew*1000);
     }
     return 0;
 }
-void zdaqCtrl_group::z_watcher (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx){
-    /* add lock to prevent delete while in there */
-    zdaqCtrl_group *h;
-    h=(zdaqCtrl_group *)watcherCtx;
-    if (h==NULL) {return;}
-    if (type == ZOO_SESSION_EVENT) {
-        if (state == ZOO_CONNECTED_STATE) {
-            const clientid_t *id = zoo_client_id(zzh);
-            if (h->z_id.client_id == 0 || h->z_id.client_id != id->client_id) {
-                h->z_id = *id;
-                //fprintf(stderr, "Got a new session id: 0x%llx\n",(long long)h->z_id.client_id);            
-            }
-            h->z_ok=1;
-        } else if (state == ZOO_AUTH_FAILED_STATE) {
-            //fprintf(stderr, "Authentication failure\n");
-            h->z_ok=0;
-        } else if (state == ZOO_EXPIRED_SESSION_STATE) {
-            //fprintf(stderr, "Session expired\n");
-            h->z_ok=0;
+
+double zdaqCtrl_group::getStartSkew() {
+    return startSkew;
+}
+
+void zdaqCtrl_group::z_completion_cmd(int rc, const char *value, const void *data) {
+    t_zdaqCtrl_cmdRequest *req=(t_zdaqCtrl_cmdRequest *)data;
+    if (req==NULL) {return;}
+    zdaqCtrl_item *it=(zdaqCtrl_item *)req->session->enter(req->itemToken);
+    if (it==NULL) {
+        // item destroyed
+        delete req;
+        return;
+    }
+    zdaqCtrl_group *g=(zdaqCtrl_group *)it->Ctrl_group;
+    pthread_mutex_lock(&g->mutex);
+    if ((req->cmdId==g->cmdId)&&(req->cmdId==it->cmdId)) {
+        // ignore completions of previous commands
+        it->cmdAcked=1;
+        if (rc!=ZOK) {
+            it->cmdError=rc;
+            it->cmdDone=1;
+            g->cmdPending--;
+            pthread_cond_broadcast(&g->cond);
         } else {
-            h->z_ok=0;
+            g->updateCommandStatus(it);
         }
-    } else {
-        printf("unhandled ZOO type %d\n",type);    
-    }     
+    }
+    pthread_mutex_unlock(&g->mutex);
+    req->session->leave();
+    delete req;
+}
+
+int zdaqCtrl_group::updateCommandStatus(zdaqCtrl_item *i) {
+    if ((i->cmdDone)||(!i->cmdAcked)||(i->cmdId!=cmdId)) {return 0;}
+    if ((cmdTargetState!=NULL)&&(strcmp(i->state,cmdTargetState))) {
+        // an armed item released at its start time (short delay) may be seen directly RUNNING
+        if ((strcmp(cmdTargetState,"ARMED"))||(strcmp(i->state,"RUNNING"))) {return 0;}
+    }
+    i->cmdDone=1;
+    i->cmdLatency=getTimeNow()-i->cmdTime;
+    cmdPending--;
+    pthread_cond_broadcast(&cond);
+    return 1;
+}
+
+int zdaqCtrl_group::getNumberOfItems() {
+    return items.size();
+}
+
+zdaqCtrl_item *zdaqCtrl_group::getItem(int ix) {
+    if ((ix<0)||(ix>=(int)items.size())) {return NULL;}
+    return items[ix];
+}
+
+zdaqCtrl_item *zdaqCtrl_group::getSlowestItem() {
+    zdaqCtrl_item *slowest=NULL;
+    pthread_mutex_lock(&mutex);
+    for (unsigned int i=0;i<items.size();i++) {
+        zdaqCtrl_item *it=items[i];
+        if ((it->cmdError)||(!it->cmdDone)) {continue;}
+        if ((slowest==NULL)||(it->cmdLatency>slowest->cmdLatency)) {slowest=it;}
+    }
+    pthread_mutex_unlock(&mutex);
+    return slowest;
+}
+
+double zdaqCtrl_group::getCommandTime() {
+    return cmdTotalTime;
 }
 int zdaqCtrl_group::addItem(zdaqCtrl_item *i) {
+    pthread_mutex_lock(&mutex);
     this->items.push_back(i);
+    if (useAggregatedStatus) {
+        itemsByName[i->objname]=i;
+        std::map<std::string,std::string>::iterator it=knownStates.find(i->objname);
+        if (it!=knownStates.end()) {
+            snprintf(i->state,sizeof(i->state),"%s",it->second.c_str());
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    i->z_token=session->attach(i);
     int ix;
     ix=this->items.size();
     
-    z_watcher_item(this->zh, ZOO_CHANGED_EVENT, ZOO_CONNECTED_STATE, i->znode_state, i);  // initiate state update callback
+    if (!useAggregatedStatus) {
+        z_watcher_item(this->zh, ZOO_CHANGED_EVENT, ZOO_CONNECTED_STATE, i->znode_state, i->z_token);  // initiate state update callback
+    }
     
     return ix;
 }
 
 
+void zdaqCtrl_group::readStatusRoot() {
+    String_vector s;
+    int rc=zoo_wget_children(zh,ZDAQ_STATUS_ROOT,zdaqCtrl_group::z_watcher_status,z_token,&s);
+    if (rc!=ZOK) {
+        printf("Failed to read %s : %s\n",ZDAQ_STATUS_ROOT,zerror(rc));
+        return;
+    }
+    // read new nodes. Nodes removed are handled by their own watch.
+    for (int i=0;i<s.count;i++) {
+        char path[256];
+        snprintf(path,sizeof(path),"%s/%s",ZDAQ_STATUS_ROOT,s.data[i]);
+        pthread_mutex_lock(&mutex);
+        int isNew=(statusNodes.find(path)==statusNodes.end());
+        pthread_mutex_unlock(&mutex);
+        if (isNew) {
+            readStatusNode(path);
+        }
+    }
+    deallocate_String_vector(&s);
+}
+
+
+void zdaqCtrl_group::readStatusNode(const char *path) {
+    std::vector<char> buf(65536);
+    struct Stat stat;
+    int len=buf.size();
+    int rc=zoo_wget(zh,path,zdaqCtrl_group::z_watcher_status,z_token,&buf[0],&len,&stat);
+    if ((rc==ZOK)&&(stat.dataLength>len)) {
+        // buffer too small: read again
+        buf.resize(stat.dataLength);
+        len=buf.size();
+        rc=zoo_wget(zh,path,zdaqCtrl_group::z_watcher_status,z_token,&buf[0],&len,&stat);
+    }
+    if ((rc!=ZOK)&&(rc!=ZNONODE)) {
+        printf("Failed to read %s : %s\n",path,zerror(rc));
+        return;
+    }
+    if ((rc!=ZOK)||(len<0)) {
+        // node removed: all objects it contains are gone
+        len=0;
+    }
+
+    // decode lines objectName=state
+    std::map<std::string,std::string> entries;
+    int lineStart=0;
+    for (int k=0;k<len;k++) {
+        if (buf[k]!='\n') {continue;}
+        std::string line(&buf[lineStart],k-lineStart);
+        lineStart=k+1;
+        size_t sep=line.find('=');
+        if (sep==std::string::npos) {continue;}
+        entries[line.substr(0,sep)]=line.substr(sep+1);
+    }
+
+    pthread_mutex_lock(&mutex);
+    std::set<std::string> &names=statusNodes[path];
+    for (std::set<std::string>::iterator n=names.begin();n!=names.end();++n) {
+        if (entries.find(*n)!=entries.end()) {continue;}
+        knownStates.erase(*n);
+        std::map<std::string,zdaqCtrl_item*>::iterator it=itemsByName.find(*n);
+        if (it!=itemsByName.end()) {
+            snprintf(it->second->state,sizeof(it->second->state),"UNKOWN");
+            updateCommandStatus(it->second);
+        }
+    }
+    names.clear();
+    for (std::map<std::string,std::string>::iterator e=entries.begin();e!=entries.end();++e) {
+        names.insert(e->first);
+        knownStates[e->first]=e->second;
+        std::map<std::string,zdaqCtrl_item*>::iterator it=itemsByName.find(e->first);
+        if (it!=itemsByName.end()) {
+            zdaqCtrl_item *i=it->second;
+            if (strcmp(i->state,e->second.c_str())) {
+                snprintf(i->state,sizeof(i->state),"%s",e->second.c_str());
+                if (i->debug) {
+                    printf("State update: %s = %s\n",i->znode_state,i->state);
+                }
+            }
+            updateCommandStatus(i);
+        }
+    }
+    if (rc!=ZOK) {
+        statusNodes.erase(path);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void zdaqCtrl_group::z_watcher_status (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx){
+    zdaqCtrl_session *session=(zdaqCtrl_session *)zoo_get_context(zzh);
+    zdaqCtrl_group *g;
+    g=(zdaqCtrl_group *)session->enter(watcherCtx);
+    if (g==NULL) {return;}
+    if ((type==ZOO_CHILD_EVENT)&&(!strcmp(path,ZDAQ_STATUS_ROOT))) {
+        g->readStatusRoot();
+    } else if ((type==ZOO_CHANGED_EVENT)||(type==ZOO_DELETED_EVENT)||(type==ZOO_CREATED_EVENT)) {
+        g->readStatusNode(path);
+    }
+    session->leave();
+}
+
+
 void zdaqCtrl_group::z_watcher_item (zhandle_t *zzh, int type, int state, const char *path, void *watcherCtx){
     int err;
   
+    // item may have been destroyed: get session from handle, and check item still registered
+    zdaqCtrl_session *session=(zdaqCtrl_session *)zoo_get_context(zzh);
     zdaqCtrl_item *i;
-    i=(zdaqCtrl_item *)watcherCtx;
+    i=(zdaqCtrl_item *)session->enter(watcherCtx);
     if (i==NULL) {return;}
+    zdaqCtrl_group *g=(zdaqCtrl_group *)i->Ctrl_group;
     
     //fprintf(stderr, "Watcher %s : %s state = %s\n", path, type2String(type), state2String(state));
-    
-    if (type==ZOO_DELETED_EVENT) {
-        snprintf(i->state,sizeof(i->state),"UNKOWN");
-    }
-    if (type==ZOO_CREATED_EVENT) {
-        snprintf(i->state,sizeof(i->state),"UNKOWN");
-    }
+
+    char newState[sizeof(i->state)];
+    snprintf(newState,sizeof(newState),"UNKOWN");
 
     int l=0;
-    l=sizeof(i->state)-1;
-    err=zoo_wget(zzh, i->znode_state, zdaqCtrl_group::z_watcher_item, i, i->state, &l, NULL);
+    l=sizeof(newState)-1;
+    err=zoo_wget(zzh, i->znode_state, zdaqCtrl_group::z_watcher_item, i->z_token, newState, &l, NULL);
     if (err) {
         if (err==ZNONODE) {
             // set watch for when objects comes online
-             zoo_wexists(zzh, i->znode_state, zdaqCtrl_group::z_watcher_item, i, NULL);
+             zoo_wexists(zzh, i->znode_state, zdaqCtrl_group::z_watcher_item, i->z_token, NULL);
         }
         //printf("Failed to get %s : %s\n",i->znode_state,zerror(err));
+        l=0;
     } else {
-        i->state[l]=0;
+        newState[l]=0;
     }
     if (l==0) {
-      snprintf(i->state,sizeof(i->state),"UNKOWN");
+      snprintf(newState,sizeof(newState),"UNKOWN");
     }
+
+    // update state, and check if a pending command completed
+    pthread_mutex_lock(&g->mutex);
+    memcpy(i->state,newState,sizeof(i->state));
+    g->updateCommandStatus(i);
+    pthread_mutex_unlock(&g->mutex);
+
     if (i->debug) {
-        printf("State update: %s = %s\n",i->znode_state,i->state);
+        printf("State update: %s = %s\n",i->znode_state,newState);
     }
     fflush(stdout);
+    session->leave();
 }
 
 int zdaqCtrl_group::addObject(const char *objectName) {
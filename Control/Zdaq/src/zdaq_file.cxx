@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+
+#include "Control/zdaq_file.h"
+
+
+/* CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320), slicing-by-4 tables */
+
+static uint32_t crcTable[4][256];
+static pthread_once_t crcTableOnce=PTHREAD_ONCE_INIT;
+
+static void crcTableInit() {
+  for (uint32_t i=0;i<256;i++) {
+    uint32_t c=i;
+    for (int k=0;k<8;k++) {
+      c=(c&1)?(0xEDB88320^(c>>1)):(c>>1);
+    }
+    crcTable[0][i]=c;
+  }
+  for (uint32_t i=0;i<256;i++) {
+    uint32_t c=crcTable[0][i];
+    for (int t=1;t<4;t++) {
+      c=crcTable[0][c&0xFF]^(c>>8);
+      crcTable[t][i]=c;
+    }
+  }
+}
+
+uint32_t daqFileChecksum(uint32_t crc, const void *data, size_t size) {
+  pthread_once(&crcTableOnce,crcTableInit);
+  const unsigned char *p=(const unsigned char *)data;
+  crc=~crc;
+  // byte by byte until aligned, then 4 bytes at a time (little endian)
+  while ((size>0)&&(((uintptr_t)p)&3)) {
+    crc=crcTable[0][(crc^*p++)&0xFF]^(crc>>8);
+    size--;
+  }
+  while (size>=4) {
+    uint32_t w;
+    memcpy(&w,p,4);
+    crc^=w;
+    crc=crcTable[3][crc&0xFF]^crcTable[2][(crc>>8)&0xFF]^crcTable[1][(crc>>16)&0xFF]^crcTable[0][crc>>24];
+    p+=4;
+    size-=4;
+  }
+  while (size>0) {
+    crc=crcTable[0][(crc^*p++)&0xFF]^(crc>>8);
+    size--;
+  }
+  return ~crc;
+}
+
+uint64_t daqFileTimestamp() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return ((uint64_t)ts.tv_sec)*1000000000ULL+ts.tv_nsec;
+}
+
+
+
+/* daqFileIndexWriter */
+
+daqFileIndexWriter::daqFileIndexWriter(uint64_t chunkSize) {
+  fp=NULL;
+  this->chunkSize=chunkSize;
+  nEvents=0;
+  nextOffset=0;
+  memset(&currentChunk,0,sizeof(currentChunk));
+}
+
+daqFileIndexWriter::~daqFileIndexWriter() {
+  close();
+}
+
+int daqFileIndexWriter::open(const char *dataFilePath) {
+  if (fp!=NULL) {return -1;}
+  if (dataFilePath==NULL) {return -1;}
+  std::string path=std::string(dataFilePath) + DAQ_FILE_INDEX_SUFFIX;
+  fp=fopen(path.c_str(),"w");
+  if (fp==NULL) {
+    printf("Failed to create index %s: %s\n",path.c_str(),strerror(errno));
+    return -1;
+  }
+  // entries are small: use a large stdio buffer to write them in big blocks
+  setvbuf(fp,NULL,_IOFBF,1024*1024);
+
+  daqFileIndexHeader hdr;
+  memset(&hdr,0,sizeof(hdr));
+  hdr.magic=DAQ_FILE_INDEX_MAGIC;
+  hdr.version=DAQ_FILE_INDEX_VERSION;
+  hdr.entrySize=sizeof(daqFileIndexEntry);
+  hdr.chunkEntrySize=sizeof(daqFileChunkEntry);
+  hdr.chunkSize=chunkSize;
+  if (fwrite(&hdr,sizeof(hdr),1,fp)!=1) {
+    fclose(fp);
+    fp=NULL;
+    return -1;
+  }
+  nEvents=0;
+  nextOffset=0;
+  chunks.clear();
+  memset(&currentChunk,0,sizeof(currentChunk));
+  return 0;
+}
+
+int daqFileIndexWriter::addEvent(const eventHeader *h, const void *data, uint64_t offset) {
+  if (fp==NULL) {return -1;}
+  if (h==NULL) {return -1;}
+
+  daqFileIndexEntry e;
+  e.id=h->id;
+  e.size=h->size;
+  e.offset=offset;
+  e.timestamp=daqFileTimestamp();
+  if (fwrite(&e,sizeof(e),1,fp)!=1) {return -1;}
+
+  if (chunkSize>0) {
+    // chunks must be contiguous in data file: close current one if there is a gap
+    if ((currentChunk.nEvents>0)&&(offset!=nextOffset)) {endChunk();}
+    if (currentChunk.nEvents==0) {
+      currentChunk.offset=offset;
+      currentChunk.size=0;
+      currentChunk.firstEvent=nEvents;
+      currentChunk.checksum=0;
+    }
+    currentChunk.checksum=daqFileChecksum(currentChunk.checksum,h,sizeof(eventHeader));
+    currentChunk.checksum=daqFileChecksum(currentChunk.checksum,data,h->size);
+    currentChunk.size+=sizeof(eventHeader)+h->size;
+    currentChunk.nEvents++;
+    if (currentChunk.size>=chunkSize) {endChunk();}
+  }
+  nEvents++;
+  nextOffset=offset+sizeof(eventHeader)+h->size;
+  return 0;
+}
+
+int daqFileIndexWriter::endChunk() {
+  if (currentChunk.nEvents>0) {
+    chunks.push_back(currentChunk);
+  }
+  memset(&currentChunk,0,sizeof(currentChunk));
+  return 0;
+}
+
+int daqFileIndexWriter::close() {
+  if (fp==NULL) {return 0;}
+  int err=0;
+  endChunk();
+
+  daqFileIndexTrailer trl;
+  memset(&trl,0,sizeof(trl));
+  trl.nEvents=nEvents;
+  trl.nChunks=chunks.size();
+  trl.chunkTableOffset=sizeof(daqFileIndexHeader)+nEvents*sizeof(daqFileIndexEntry);
+  trl.magic=DAQ_FILE_INDEX_TRAILER_MAGIC;
+  if (chunks.size()>0) {
+    if (fwrite(&chunks[0],sizeof(daqFileChunkEntry),chunks.size(),fp)!=chunks.size()) {err=-1;}
+  }
+  if (fwrite(&trl,sizeof(trl),1,fp)!=1) {err=-1;}
+  if (fclose(fp)) {err=-1;}
+  fp=NULL;
+  chunks.clear();
+  return err;
+}
+
+
+
+/* daqFileReader */
+
+daqFileReader::daqFileReader() {
+  fd=-1;
+  data=NULL;
+  dataSize=0;
+  indexFd=-1;
+  indexMap=NULL;
+  indexSize=0;
+  entries=NULL;
+  nEvents=0;
+  chunks=NULL;
+  nChunks=0;
+}
+
+daqFileReader::~daqFileReader() {
+  close();
+}
+
+int daqFileReader::open(const char *path) {
+  if (fd>=0) {return -1;}
+  if (path==NULL) {return -1;}
+
+  fd=::open(path,O_RDONLY);
+  if (fd<0) {
+    printf("Failed to open %s: %s\n",path,strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd,&st)) {
+    close();
+    return -1;
+  }
+  dataSize=st.st_size;
+  if (dataSize>0) {
+    void *p=mmap(NULL,dataSize,PROT_READ,MAP_SHARED,fd,0);
+    if (p==MAP_FAILED) {
+      printf("Failed to map %s: %s\n",path,strerror(errno));
+      close();
+      return -1;
+    }
+    data=(const char *)p;
+    // default access pattern is random, ranges are read ahead explicitly
+    madvise(p,dataSize,MADV_RANDOM);
+  }
+
+  if (openIndex(path)) {
+    // no usable index: build it from the data file
+    if (scan()) {
+      close();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int daqFileReader::openIndex(const char *path) {
+  std::string indexPath=std::string(path) + DAQ_FILE_INDEX_SUFFIX;
+  indexFd=::open(indexPath.c_str(),O_RDONLY);
+  if (indexFd<0) {return -1;}
+  struct stat st;
+  if ((fstat(indexFd,&st))||(st.st_size<(off_t)sizeof(daqFileIndexHeader))) {
+    ::close(indexFd);
+    indexFd=-1;
+    return -1;
+  }
+  indexSize=st.st_size;
+  void *p=mmap(NULL,indexSize,PROT_READ,MAP_SHARED,indexFd,0);
+  if (p==MAP_FAILED) {
+    ::close(indexFd);
+    indexFd=-1;
+    indexSize=0;
+    return -1;
+  }
+  indexMap=(const char *)p;
+
+  const daqFileIndexHeader *hdr=(const daqFileIndexHeader *)indexMap;
+  int isValid=1;
+  if ((hdr->magic!=DAQ_FILE_INDEX_MAGIC)||(hdr->version!=DAQ_FILE_INDEX_VERSION)) {isValid=0;}
+  if ((hdr->entrySize!=sizeof(daqFileIndexEntry))||(hdr->chunkEntrySize!=sizeof(daqFileChunkEntry))) {isValid=0;}
+
+  const daqFileIndexTrailer *trl=NULL;
+  if ((isValid)&&(indexSize>=sizeof(daqFileIndexHeader)+sizeof(daqFileIndexTrailer))) {
+    trl=(const daqFileIndexTrailer *)(indexMap+indexSize-sizeof(daqFileIndexTrailer));
+    if (trl->magic!=DAQ_FILE_INDEX_TRAILER_MAGIC) {
+      trl=NULL;
+    } else {
+      // a completed index: event table, chunk table and trailer must fill the file exactly
+      uint64_t maxEntries=indexSize/sizeof(daqFileIndexEntry);
+      if ((trl->nEvents>maxEntries)||(trl->nChunks>maxEntries)) {isValid=0;}
+      else if (trl->chunkTableOffset!=sizeof(daqFileIndexHeader)+trl->nEvents*sizeof(daqFileIndexEntry)) {isValid=0;}
+      else if (trl->chunkTableOffset+trl->nChunks*sizeof(daqFileChunkEntry)+sizeof(daqFileIndexTrailer)!=indexSize) {isValid=0;}
+    }
+  }
+  if (!isValid) {
+    printf("Invalid index %s, ignored\n",indexPath.c_str());
+    munmap(p,indexSize);
+    ::close(indexFd);
+    indexMap=NULL;
+    indexFd=-1;
+    indexSize=0;
+    return -1;
+  }
+
+  entries=(const daqFileIndexEntry *)(indexMap+sizeof(daqFileIndexHeader));
+  nChunks=0;
+  chunks=NULL;
+  if (trl!=NULL) {
+    nEvents=trl->nEvents;
+    nChunks=trl->nChunks;
+    chunks=(const daqFileChunkEntry *)(indexMap+trl->chunkTableOffset);
+  } else {
+    // index not completed (interrupted recording): use all complete entries
+    nEvents=(indexSize-sizeof(daqFileIndexHeader))/sizeof(daqFileIndexEntry);
+  }
+
+  // ignore entries from the first one beyond end of data file (truncated file, or index not matching)
+  for (uint64_t i=0;i<nEvents;i++) {
+    const daqFileIndexEntry *e=&entries[i];
+    if ((e->offset>dataSize)||(e->size>dataSize)||(e->offset+sizeof(eventHeader)+e->size>dataSize)) {
+      printf("Index entry %llu beyond end of data file, following entries ignored\n",(unsigned long long)i);
+      nEvents=i;
+      break;
+    }
+  }
+  return 0;
+}
+
+int daqFileReader::scan() {
+  scanEntries.clear();
+  uint64_t offset=0;
+  while (offset+sizeof(eventHeader)<=dataSize) {
+    eventHeader h;
+    memcpy(&h,data+offset,sizeof(h));   // not aligned in file
+    if ((h.size<0)||(offset+sizeof(eventHeader)+h.size>dataSize)) {
+      printf("Truncated or corrupted event at offset %llu, scan stopped\n",(unsigned long long)offset);
+      break;
+    }
+    daqFileIndexEntry e;
+    e.id=h.id;
+    e.size=h.size;
+    e.offset=offset;
+    e.timestamp=0;
+    scanEntries.push_back(e);
+    offset+=sizeof(eventHeader)+h.size;
+  }
+  nEvents=scanEntries.size();
+  entries=(nEvents>0)?&scanEntries[0]:NULL;
+  chunks=NULL;
+  nChunks=0;
+  return 0;
+}
+
+int daqFileReader::close() {
+  if (data!=NULL) {munmap((void *)data,dataSize);}
+  if (indexMap!=NULL) {munmap((void *)indexMap,indexSize);}
+  if (fd>=0) {::close(fd);}
+  if (indexFd>=0) {::close(indexFd);}
+  fd=-1;
+  data=NULL;
+  dataSize=0;
+  indexFd=-1;
+  indexMap=NULL;
+  indexSize=0;
+  entries=NULL;
+  nEvents=0;
+  chunks=NULL;
+  nChunks=0;
+  scanEntries.clear();
+  return 0;
+}
+
+uint64_t daqFileReader::getNumberOfEvents() {
+  return nEvents;
+}
+
+const daqFileIndexEntry *daqFileReader::getIndexEntry(uint64_t ix) {
+  if (ix>=nEvents) {return NULL;}
+  return &entries[ix];
+}
+
+int daqFileReader::getEvent(uint64_t ix, eventHeader *h, const void **data, uint64_t *timestamp) {
+  if (ix>=nEvents) {return -1;}
+  const daqFileIndexEntry *e=&entries[ix];
+  if (h!=NULL) {
+    // header not aligned in file. Its size must match the index entry, checked against data file size.
+    memcpy(h,this->data+e->offset,sizeof(eventHeader));
+    if (h->size!=(int)e->size) {return -1;}
+  }
+  if (data!=NULL) {*data=this->data+e->offset+sizeof(eventHeader);}
+  if (timestamp!=NULL) {*timestamp=e->timestamp;}
+  return 0;
+}
+
+int daqFileReader::hasChecksums() {
+  return (nChunks>0)?1:0;
+}
+
+int daqFileReader::hasTimestamps() {
+  if (indexMap==NULL) {return 0;}
+  if ((nEvents>0)&&(entries[nEvents-1].timestamp==0)) {return 0;}
+  return 1;
+}
+
+int daqFileReader::verify() {
+  if (data==NULL) {return -1;}
+  int nBad=0;
+  for (uint64_t i=0;i<nChunks;i++) {
+    const daqFileChunkEntry *c=&chunks[i];
+    if (c->offset+c->size>dataSize) {
+      nBad++;
+      continue;
+    }
+    uint64_t pageOffset=(c->offset/getpagesize())*getpagesize();
+    madvise((void *)(data+pageOffset),c->offset+c->size-pageOffset,MADV_WILLNEED);
+    if (daqFileChecksum(0,data+c->offset,c->size)!=c->checksum) {
+      printf("Checksum error in chunk %llu (offset %llu size %llu)\n",(unsigned long long)i,(unsigned long long)c->offset,(unsigned long long)c->size);
+      nBad++;
+    }
+  }
+  return nBad;
+}
+
+int daqFileReader::madviseRange(uint64_t ix, uint64_t count, int advice) {
+  if (ix>=nEvents) {return -1;}
+  if (count>nEvents-ix) {count=nEvents-ix;}
+  if (count==0) {return 0;}
+  const daqFileIndexEntry *first=&entries[ix];
+  const daqFileIndexEntry *last=&entries[ix+count-1];
+  uint64_t begin=first->offset;
+  uint64_t end=last->offset+sizeof(eventHeader)+last->size;
+  uint64_t pageSize=getpagesize();
+  if (advice==MADV_DONTNEED) {
+    // release only pages fully covered by the range
+    begin=((begin+pageSize-1)/pageSize)*pageSize;
+    end=(end/pageSize)*pageSize;
+  } else {
+    begin=(begin/pageSize)*pageSize;
+  }
+  if (end<=begin) {return 0;}
+  if (madvise((void *)(data+begin),end-begin,advice)) {return -1;}
+  return 0;
+}
+
+int daqFileReader::prefetch(uint64_t ix, uint64_t count) {
+  return madviseRange(ix,count,MADV_WILLNEED);
+}
+
+int daqFileReader::release(uint64_t ix, uint64_t count) {
+  return madviseRange(ix,count,MADV_DONTNEED);
+}
+
+
+
+/* daqFileRange */
+
+daqFileRange::daqFileRange(daqFileReader *reader, uint64_t first, uint64_t count, uint64_t readAhead) {
+  this->reader=reader;
+  uint64_t n=reader->getNumberOfEvents();
+  if (first>n) {first=n;}
+  if (count>n-first) {count=n-first;}
+  ixNext=first;
+  ixEnd=first+count;
+  ixPrefetched=first;
+  ixReleased=first;
+  this->readAhead=readAhead;
+}
+
+daqFileRange::~daqFileRange() {
+}
+
+int daqFileRange::next(eventHeader *h, const void **data, uint64_t *timestamp) {
+  if (ixNext>=ixEnd) {return -1;}
+
+  // keep a window of readAhead bytes prefetched in front of current event.
+  // It is extended by half a window at a time, to issue few large requests.
+  if (readAhead>0) {
+    const daqFileIndexEntry *cur=reader->getIndexEntry(ixNext);
+    uint64_t limit=cur->offset+readAhead;
+    if ((ixPrefetched<=ixNext)||(reader->getIndexEntry(ixPrefetched-1)->offset<cur->offset+readAhead/2)) {
+      uint64_t ix=(ixPrefetched>ixNext)?ixPrefetched:ixNext;
+      uint64_t ixStart=ix;
+      while ((ix<ixEnd)&&((ix==ixStart)||(reader->getIndexEntry(ix)->offset<limit))) {ix++;}
+      reader->prefetch(ixStart,ix-ixStart);
+      ixPrefetched=ix;
+    }
+    // drop pages of events consumed, by blocks of one window
+    const daqFileIndexEntry *rel=reader->getIndexEntry(ixReleased);
+    if (cur->offset-rel->offset>=readAhead) {
+      reader->release(ixReleased,ixNext-ixReleased);
+      ixReleased=ixNext;
+    }
+  }
+
+  int err=reader->getEvent(ixNext,h,data,timestamp);
+  ixNext++;
+  return err;
+}
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <map>
+
+#include "Control/zdaq_ctrl.h"
+#include "Control/zdaq_metrics.h"
+
+
+/* encoding helpers */
+
+static void putVarint(std::string &b, uint64_t v) {
+    while (v>=0x80) {
+        b.push_back((char)((v&0x7F)|0x80));
+        v>>=7;
+    }
+    b.push_back((char)v);
+}
+
+static uint64_t zigzag(int64_t v) {
+    return (((uint64_t)v)<<1)^(uint64_t)(v>>63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v>>1)^-(int64_t)(v&1);
+}
+
+// read a varint, and advance p. Returns 0 on success.
+static int getVarint(const char *&p, const char *end, uint64_t &v) {
+    v=0;
+    for (int shift=0;shift<64;shift+=7) {
+        if (p>=end) {return -1;}
+        uint8_t c=(uint8_t)*(p++);
+        v|=((uint64_t)(c&0x7F))<<shift;
+        if (!(c&0x80)) {return 0;}
+    }
+    return -1;
+}
+
+// read a delta-encoded name, and advance p. Returns 0 on success.
+static int getName(const char *&p, const char *end, std::string &last) {
+    uint64_t prefix, l;
+    if ((getVarint(p,end,prefix))||(getVarint(p,end,l))) {return -1;}
+    if ((prefix>last.length())||((uint64_t)(end-p)<l)) {return -1;}
+    last.resize(prefix);
+    last.append(p,l);
+    p+=l;
+    return 0;
+}
+
+
+
+/* zdaqMetrics_histogram */
+
+zdaqMetrics_histogram::zdaqMetrics_histogram() {
+    reset();
+}
+
+void zdaqMetrics_histogram::add(uint64_t value) {
+    int i=0;
+    if (value) {
+        i=64-__builtin_clzll(value);
+        if (i>=nBins) {i=nBins-1;}
+    }
+    bins[i].fetch_add(1,std::memory_order_relaxed);
+}
+
+void zdaqMetrics_histogram::reset() {
+    for (int i=0;i<nBins;i++) {
+        bins[i]=0;
+    }
+}
+
+
+
+/* zdaqMetrics_writer */
+
+zdaqMetrics_writer::zdaqMetrics_writer() {
+    timestamp=0;
+    period=0;
+    nSources=0;
+    nMetrics=0;
+}
+
+void zdaqMetrics_writer::begin(uint64_t t, int p) {
+    timestamp=t;
+    period=p;
+    body.clear();
+    sourceName.clear();
+    sourceMetrics.clear();
+    lastSource.clear();
+    lastMetric.clear();
+    nSources=0;
+    nMetrics=0;
+}
+
+void zdaqMetrics_writer::putName(std::string &b, std::string &last, const char *name) {
+    size_t l=strlen(name);
+    size_t prefix=0;
+    while ((prefix<l)&&(prefix<last.length())&&(last[prefix]==name[prefix])) {
+        prefix++;
+    }
+    putVarint(b,prefix);
+    putVarint(b,l-prefix);
+    b.append(name+prefix,l-prefix);
+    last.assign(name,l);
+}
+
+void zdaqMetrics_writer::beginSource(const char *name) {
+    if (nSources) {
+        endSource();
+    }
+    putName(sourceName,lastSource,name);
+    nSources++;
+    nMetrics=0;
+}
+
+void zdaqMetrics_writer::endSource() {
+    // metrics of the source are appended once their number is known
+    body.append(sourceName);
+    putVarint(body,nMetrics);
+    body.append(sourceMetrics);
+    sourceName.clear();
+    sourceMetrics.clear();
+    nMetrics=0;
+}
+
+void zdaqMetrics_writer::addCounter(const char *name, uint64_t value) {
+    sourceMetrics.push_back((char)zdaqMetrics_value::COUNTER);
+    putName(sourceMetrics,lastMetric,name);
+    putVarint(sourceMetrics,value);
+    nMetrics++;
+}
+
+void zdaqMetrics_writer::addGauge(const char *name, int64_t value) {
+    sourceMetrics.push_back((char)zdaqMetrics_value::GAUGE);
+    putName(sourceMetrics,lastMetric,name);
+    putVarint(sourceMetrics,zigzag(value));
+    nMetrics++;
+}
+
+void zdaqMetrics_writer::addHistogram(const char *name, const zdaqMetrics_histogram &h) {
+    uint64_t bins[zdaqMetrics_histogram::nBins];
+    int n=0;
+    for (int i=0;i<zdaqMetrics_histogram::nBins;i++) {
+        bins[i]=h.bins[i].load(std::memory_order_relaxed);
+        if (bins[i]) {n=i+1;}
+    }
+    sourceMetrics.push_back((char)zdaqMetrics_value::HISTOGRAM);
+    putName(sourceMetrics,lastMetric,name);
+    putVarint(sourceMetrics,n);
+    uint64_t previous=0;
+    for (int i=0;i<n;i++) {
+        putVarint(sourceMetrics,zigzag((int64_t)(bins[i]-previous)));
+        previous=bins[i];
+    }
+    nMetrics++;
+}
+
+const std::string &zdaqMetrics_writer::end() {
+    if (nSources) {
+        endSource();
+    }
+    snapshot.clear();
+    snapshot.push_back('Z');
+    snapshot.push_back('M');
+    snapshot.push_back(ZDAQ_METRICS_VERSION);
+    putVarint(snapshot,timestamp);
+    putVarint(snapshot,period);
+    putVarint(snapshot,nSources);
+    snapshot.append(body);
+    nSources=0;
+    return snapshot;
+}
+
+
+
+/* decoder */
+
+int zdaqMetrics_decode(const char *data, int size, std::vector<zdaqMetrics_value> &metrics, uint64_t *timestamp) {
+    metrics.clear();
+    if ((data==NULL)||(size<3)) {return -1;}
+    if ((data[0]!='Z')||(data[1]!='M')||(data[2]!=ZDAQ_METRICS_VERSION)) {return -1;}
+    const char *p=data+3;
+    const char *end=data+size;
+    uint64_t ts, period, nSources;
+    if ((getVarint(p,end,ts))||(getVarint(p,end,period))||(getVarint(p,end,nSources))) {return -1;}
+    if (timestamp!=NULL) {
+        *timestamp=ts;
+    }
+    std::string lastSource;
+    std::string lastMetric;
+    for (uint64_t i=0;i<nSources;i++) {
+        uint64_t nMetrics;
+        if ((getName(p,end,lastSource))||(getVarint(p,end,nMetrics))) {return -1;}
+        for (uint64_t j=0;j<nMetrics;j++) {
+            if (p>=end) {return -1;}
+            zdaqMetrics_value m;
+            m.type=(uint8_t)*(p++);
+            m.value=0;
+            if (getName(p,end,lastMetric)) {return -1;}
+            m.source=lastSource;
+            m.name=lastMetric;
+            uint64_t v;
+            switch (m.type) {
+                case zdaqMetrics_value::COUNTER:
+                    if (getVarint(p,end,v)) {return -1;}
+                    m.value=(int64_t)v;
+                    break;
+                case zdaqMetrics_value::GAUGE:
+                    if (getVarint(p,end,v)) {return -1;}
+                    m.value=unzigzag(v);
+                    break;
+                case zdaqMetrics_value::HISTOGRAM: {
+                    uint64_t n;
+                    if ((getVarint(p,end,n))||(n>zdaqMetrics_histogram::nBins)) {return -1;}
+                    uint64_t previous=0;
+                    for (uint64_t k=0;k<n;k++) {
+                        if (getVarint(p,end,v)) {return -1;}
+                        previous+=(uint64_t)unzigzag(v);
+                        m.bins.push_back(previous);
+                    }
+                    break;
+                }
+                default:
+                    return -1;
+            }
+            metrics.push_back(m);
+        }
+    }
+    return 0;
+}
+
+
+
+/* zdaqMetrics_publisher */
+
+static pthread_mutex_t publisherPoolMutex=PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string,zdaqMetrics_publisher *> publisherPool;
+
+zdaqMetrics_publisher *zdaqMetrics_publisher::get(const char *DNS) {
+    if (DNS==NULL) {return NULL;}
+    zdaqMetrics_publisher *p=NULL;
+    pthread_mutex_lock(&publisherPoolMutex);
+    std::map<std::string,zdaqMetrics_publisher *>::iterator it=publisherPool.find(DNS);
+    if (it!=publisherPool.end()) {
+        p=it->second;
+        p->nRef++;
+    } else {
+        try {
+            p=new zdaqMetrics_publisher(DNS);
+            publisherPool[DNS]=p;
+        }
+        catch (const char *e) {
+            printf("Failed to create metrics publisher: %s\n",e);
+            p=NULL;
+        }
+    }
+    pthread_mutex_unlock(&publisherPoolMutex);
+    return p;
+}
+
+void zdaqMetrics_publisher::release() {
+    pthread_mutex_lock(&publisherPoolMutex);
+    nRef--;
+    if (nRef>0) {
+        pthread_mutex_unlock(&publisherPoolMutex);
+        return;
+    }
+    publisherPool.erase(dns);
+    pthread_mutex_unlock(&publisherPoolMutex);
+    delete this;
+}
+
+zdaqMetrics_publisher::zdaqMetrics_publisher(const char *DNS) {
+    dns=DNS;
+    nRef=1;
+    nodeCreated=0;
+    period=1000;
+    shutdown=0;
+    threadStarted=0;
+
+    char host[128];
+    if (gethostname(host,sizeof(host))) {
+        throw("gethostname() failed");
+    }
+    host[sizeof(host)-1]=0;
+    // one node per process: several processes of a host publish concurrently
+    char path[256];
+    snprintf(path,sizeof(path),"%s/%s-%d",ZDAQ_METRICS_ROOT,host,(int)getpid());
+    node=path;
+
+    session=zdaqCtrl_session::get(DNS);
+    if (session==NULL) {throw("zookeeper_init() failed");}
+    z_token=session->attach(this);
+
+    pthread_mutex_init(&mutex,NULL);
+    pthread_cond_init(&cond,NULL);
+    pthread_mutex_init(&snapshotMutex,NULL);
+
+    if (pthread_create(&thread,NULL,threadLoop,this)==0) {
+        threadStarted=1;
+    }
+}
+
+zdaqMetrics_publisher::~zdaqMetrics_publisher() {
+    if (threadStarted) {
+        pthread_mutex_lock(&mutex);
+        shutdown=1;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread,NULL);
+        threadStarted=0;
+    }
+    // metrics node is removed with the token
+    session->detach(z_token);
+    session->release();
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&snapshotMutex);
+}
+
+int zdaqMetrics_publisher::addSource(zdaqMetrics_source *s, const char *name) {
+    if ((s==NULL)||(name==NULL)) {return -1;}
+    t_source src;
+    src.source=s;
+    src.name=name;
+    pthread_mutex_lock(&snapshotMutex);
+    pthread_mutex_lock(&mutex);
+    sources.push_back(src);
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&snapshotMutex);
+    return 0;
+}
+
+int zdaqMetrics_publisher::removeSource(zdaqMetrics_source *s) {
+    int err=-1;
+    // wait snapshot in progress, source may be in use
+    pthread_mutex_lock(&snapshotMutex);
+    pthread_mutex_lock(&mutex);
+    for (std::vector<t_source>::iterator it=sources.begin();it!=sources.end();++it) {
+        if (it->source==s) {
+            sources.erase(it);
+            err=0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&snapshotMutex);
+    return err;
+}
+
+int zdaqMetrics_publisher::setPeriod(int ms) {
+    if (ms<=0) {return -1;}
+    pthread_mutex_lock(&mutex);
+    period=ms;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+const char *zdaqMetrics_publisher::getNodePath() {
+    return node.c_str();
+}
+
+int zdaqMetrics_publisher::publishNow() {
+    pthread_mutex_lock(&snapshotMutex);
+
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    pthread_mutex_lock(&mutex);
+    writer.begin(tv.tv_sec*1000ULL+tv.tv_usec/1000,period);
+    pthread_mutex_unlock(&mutex);
+
+    // sources can not be removed while snapshot in progress (snapshotMutex), but list may be appended
+    for (size_t i=0;;i++) {
+        pthread_mutex_lock(&mutex);
+        if (i>=sources.size()) {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        t_source s=sources[i];
+        pthread_mutex_unlock(&mutex);
+        writer.beginSource(s.name.c_str());
+        s.source->getMetrics(writer);
+    }
+    const std::string &v=writer.end();
+
+    // write node (from publisher thread: blocking calls are fine here)
+    zhandle_t *zh=session->getHandle();
+    int rc;
+    if (nodeCreated) {
+        rc=zoo_set(zh,node.c_str(),v.data(),v.length(),-1);
+        if (rc==ZNONODE) {
+            nodeCreated=0;
+        }
+    }
+    if (!nodeCreated) {
+        zoo_create(zh,ZDAQ_METRICS_ROOT,0,0,&ZOO_OPEN_ACL_UNSAFE,0,NULL,0);
+        rc=zoo_create(zh,node.c_str(),v.data(),v.length(),&ZOO_OPEN_ACL_UNSAFE,ZOO_EPHEMERAL,NULL,0);
+        if (rc==ZNODEEXISTS) {
+            // left by a previous process with the same pid, session not expired yet
+            rc=zoo_set(zh,node.c_str(),v.data(),v.length(),-1);
+        }
+        if (rc==ZOK) {
+            nodeCreated=1;
+            session->addEphemeral(z_token,node.c_str());
+        }
+    }
+    pthread_mutex_unlock(&snapshotMutex);
+    if (rc!=ZOK) {
+        printf("Failed to write %s : %s\n",node.c_str(),zerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+void *zdaqMetrics_publisher::threadLoop(void *arg) {
+    zdaqMetrics_publisher *p=(zdaqMetrics_publisher *)arg;
+    pthread_mutex_lock(&p->mutex);
+    for (;;) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec+=p->period/1000;
+        ts.tv_nsec+=(p->period%1000)*1000000L;
+        if (ts.tv_nsec>=1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec-=1000000000L;
+        }
+        int rc=0;
+        while ((!p->shutdown)&&(rc!=ETIMEDOUT)) {
+            rc=pthread_cond_timedwait(&p->cond,&p->mutex,&ts);
+            if (rc==0) {
+                // period changed: restart wait
+                break;
+            }
+        }
+        if (p->shutdown) {break;}
+        if (rc!=ETIMEDOUT) {continue;}
+        int isEmpty=p->sources.empty();
+        pthread_mutex_unlock(&p->mutex);
+        if (!isEmpty) {
+            p->publishNow();
+        }
+        pthread_mutex_lock(&p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
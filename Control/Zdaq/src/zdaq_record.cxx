@@ -0,0 +1,718 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Control/zdaq_record.h"
+
+
+daqRecordWriter::daqRecordWriter(int bufferSize, int nBuffers, int useDirectIO) {
+  if (bufferSize<=0) {throw "invalid buffer size";}
+  if (nBuffers<2) {nBuffers=2;}
+
+  // round up buffer size to alignment
+  this->bufferSize=((bufferSize+DAQ_RECORD_ALIGNMENT-1)/DAQ_RECORD_ALIGNMENT)*DAQ_RECORD_ALIGNMENT;
+  this->nBuffers=nBuffers;
+
+  buffers=new char* [nBuffers];
+  bufferUsed=new size_t [nBuffers];
+  bufferQueued=new int [nBuffers];
+  for (int i=0;i<nBuffers;i++) {
+    buffers[i]=NULL;
+    bufferUsed[i]=0;
+    bufferQueued[i]=0;
+  }
+  for (int i=0;i<nBuffers;i++) {
+    void *p=NULL;
+    if (posix_memalign(&p,DAQ_RECORD_ALIGNMENT,this->bufferSize)) {
+      for (int j=0;j<i;j++) {free(buffers[j]);}
+      delete[] buffers;
+      delete[] bufferUsed;
+      delete[] bufferQueued;
+      throw "Failed to allocate memory";
+    }
+    buffers[i]=(char *)p;
+  }
+
+  fd=-1;
+  this->useDirectIO=useDirectIO;
+  directIO=0;
+  ixFill=0;
+  ixWrite=0;
+  nBytes=0;
+  fileOffset=0;
+  writeError=0;
+  threadShutdown=0;
+  threadRunning=0;
+  isClosing=0;
+
+  flushCount=0;
+  flushLast=0;
+  flushTotal=0;
+  flushMax=0;
+
+  pthread_mutex_init(&mutex,NULL);
+  pthread_cond_init(&cond,NULL);
+}
+
+daqRecordWriter::~daqRecordWriter() {
+  close();
+  for (int i=0;i<nBuffers;i++) {
+    free(buffers[i]);
+  }
+  delete[] buffers;
+  delete[] bufferUsed;
+  delete[] bufferQueued;
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+
+int daqRecordWriter::open(const char *path) {
+  if (path==NULL) {return -1;}
+  if (fd>=0) {return -1;}
+
+  directIO=0;
+  if (useDirectIO) {
+    directIO=1;
+    fd=::open(path,O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT,0644);
+    if ((fd<0)&&(errno==EINVAL)) {
+      // filesystem does not support O_DIRECT (e.g. tmpfs)
+      printf("O_DIRECT not supported for %s, using buffered I/O\n",path);
+      directIO=0;
+    }
+  }
+  if (!directIO) {
+    fd=::open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  }
+  if (fd<0) {
+    printf("Failed to open %s : %s\n",path,strerror(errno));
+    return -1;
+  }
+
+  ixFill=0;
+  ixWrite=0;
+  nBytes=0;
+  fileOffset=0;
+  writeError=0;
+  threadShutdown=0;
+  isClosing=0;
+  for (int i=0;i<nBuffers;i++) {
+    bufferUsed[i]=0;
+    bufferQueued[i]=0;
+  }
+
+  if (pthread_create(&thread,NULL,&daqRecordWriter::threadLoop,(void *)this)) {
+    ::close(fd);
+    fd=-1;
+    return -1;
+  }
+  threadRunning=1;
+  return 0;
+}
+
+
+int daqRecordWriter::write(const void *data, size_t size) {
+  if (fd<0) {return -1;}
+  if (isClosing) {return -1;}
+  if (writeError) {return -1;}
+
+  const char *p=(const char *)data;
+  while (size>0) {
+    size_t n=bufferSize-bufferUsed[ixFill];
+    if (n>size) {n=size;}
+    memcpy(&buffers[ixFill][bufferUsed[ixFill]],p,n);
+    bufferUsed[ixFill]+=n;
+    nBytes+=n;
+    p+=n;
+    size-=n;
+    if (bufferUsed[ixFill]==bufferSize) {
+      if (submit(0)) {return -1;}
+    }
+  }
+  return 0;
+}
+
+
+int daqRecordWriter::submit(int isLast) {
+  int err=0;
+  pthread_mutex_lock(&mutex);
+  if ((isLast)&&(directIO)) {
+    // pad tail with zeros up to alignment
+    size_t sz=bufferUsed[ixFill];
+    size_t szPadded=((sz+DAQ_RECORD_ALIGNMENT-1)/DAQ_RECORD_ALIGNMENT)*DAQ_RECORD_ALIGNMENT;
+    bzero(&buffers[ixFill][sz],szPadded-sz);
+    bufferUsed[ixFill]=szPadded;
+  }
+  bufferQueued[ixFill]=1;
+  ixFill++;
+  if (ixFill>=nBuffers) {ixFill=0;}
+  pthread_cond_broadcast(&cond);
+
+  // wait next buffer is free
+  while ((bufferQueued[ixFill])&&(!writeError)&&(!isLast)) {
+    pthread_cond_wait(&cond,&mutex);
+  }
+  if (writeError) {err=-1;}
+  pthread_mutex_unlock(&mutex);
+  return err;
+}
+
+
+int daqRecordWriter::closeAsync() {
+  if (fd<0) {return 0;}
+  if (isClosing) {return 0;}
+
+  if (bufferUsed[ixFill]>0) {
+    submit(1);
+  }
+
+  // writer thread completes the file once all queued buffers written
+  pthread_mutex_lock(&mutex);
+  threadShutdown=1;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  isClosing=1;
+  return 0;
+}
+
+
+int daqRecordWriter::close() {
+  if (fd<0) {return 0;}
+
+  closeAsync();
+  if (threadRunning) {
+    pthread_join(thread,NULL);
+    threadRunning=0;
+  }
+  fd=-1;
+  isClosing=0;
+
+  if (writeError) {return -1;}
+  return 0;
+}
+
+
+void *daqRecordWriter::threadLoop(void *arg) {
+  ((daqRecordWriter *)arg)->run();
+  return NULL;
+}
+
+void daqRecordWriter::run() {
+  pthread_mutex_lock(&mutex);
+  for(;;) {
+    while ((!bufferQueued[ixWrite])&&(!threadShutdown)) {
+      pthread_cond_wait(&cond,&mutex);
+    }
+    if (!bufferQueued[ixWrite]) {
+      // shutdown requested, and nothing left to write
+      break;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    flushTimer.reset();
+    flushTimer.start();
+    int err=writeBuffer(ixWrite);
+    flushTimer.stop();
+
+    pthread_mutex_lock(&mutex);
+    if (err) {
+      writeError=1;
+    }
+    flushLast=flushTimer.getTime();
+    flushTotal+=flushLast;
+    if (flushLast>flushMax) {flushMax=flushLast;}
+    flushCount++;
+
+    bufferUsed[ixWrite]=0;
+    bufferQueued[ixWrite]=0;
+    ixWrite++;
+    if (ixWrite>=nBuffers) {ixWrite=0;}
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  // remove tail padding
+  int err=0;
+  if (fileOffset!=nBytes) {
+    if (ftruncate(fd,nBytes)) {
+      printf("Failed to truncate file : %s\n",strerror(errno));
+      err=1;
+    }
+  }
+  if (::close(fd)) {
+    err=1;
+  }
+  if (err) {
+    pthread_mutex_lock(&mutex);
+    writeError=1;
+    pthread_mutex_unlock(&mutex);
+  }
+}
+
+
+int daqRecordWriter::writeBuffer(int ix) {
+  const char *p=buffers[ix];
+  size_t sz=bufferUsed[ix];
+  off_t offset=fileOffset;
+
+  // loop to complete short writes
+  while (sz>0) {
+    ssize_t n=pwrite(fd,p,sz,offset);
+    if (n<0) {
+      if (errno==EINTR) {continue;}
+      printf("write failed : %s\n",strerror(errno));
+      return -1;
+    }
+    if (n==0) {return -1;}
+    if ((directIO)&&((size_t)n<sz)) {
+      // O_DIRECT needs aligned buffer and offset: resume from the last complete block, the rest is written again
+      n-=n%DAQ_RECORD_ALIGNMENT;
+      if (n==0) {
+        printf("write failed : short write of less than a block\n");
+        return -1;
+      }
+    }
+    p+=n;
+    sz-=n;
+    offset+=n;
+  }
+
+  if ((useDirectIO)&&(!directIO)) {
+    // O_DIRECT not available: flush and drop written pages from the page cache
+    fdatasync(fd);
+    posix_fadvise(fd,fileOffset,bufferUsed[ix],POSIX_FADV_DONTNEED);
+  }
+  fileOffset=offset;
+  return 0;
+}
+
+
+unsigned long long daqRecordWriter::getBytesWritten() {
+  return nBytes;
+}
+
+int daqRecordWriter::isDirectIO() {
+  return directIO;
+}
+
+int daqRecordWriter::getFlushStats(unsigned long long *count, double *last, double *avg, double *max) {
+  pthread_mutex_lock(&mutex);
+  if (count!=NULL) {*count=flushCount;}
+  if (last!=NULL) {*last=flushLast;}
+  if (avg!=NULL) {*avg=(flushCount>0)?flushTotal/flushCount:0;}
+  if (max!=NULL) {*max=flushMax;}
+  pthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+
+
+
+/* daqRecordGather ********************/
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+daqRecordGather::daqRecordGather(size_t maxBytes) {
+  fd=-1;
+  maxSegments=IOV_MAX;
+  iov=new struct iovec [maxSegments];
+  nSegments=0;
+  this->maxBytes=maxBytes;
+  nPending=0;
+  nBytes=0;
+  nWriteCalls=0;
+}
+
+daqRecordGather::~daqRecordGather() {
+  close();
+  delete[] iov;
+}
+
+int daqRecordGather::open(const char *path) {
+  if (fd>=0) {return -1;}
+  if (path==NULL) {return -1;}
+  fd=::open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if (fd<0) {
+    printf("Failed to open %s: %s\n",path,strerror(errno));
+    return -1;
+  }
+  nSegments=0;
+  nPending=0;
+  nBytes=0;
+  nWriteCalls=0;
+  return 0;
+}
+
+int daqRecordGather::add(const void *data, size_t size) {
+  if (nSegments>=maxSegments) {return -1;}
+  if (size==0) {return 0;}
+  iov[nSegments].iov_base=(void *)data;
+  iov[nSegments].iov_len=size;
+  nSegments++;
+  nPending+=size;
+  return 0;
+}
+
+int daqRecordGather::isFull() {
+  if ((nSegments>=maxSegments)||(nPending>=maxBytes)) {return 1;}
+  return 0;
+}
+
+int daqRecordGather::flush() {
+  if (fd<0) {return -1;}
+  int ix=0;
+  while (ix<nSegments) {
+    ssize_t n=writev(fd,&iov[ix],nSegments-ix);
+    nWriteCalls++;
+    if (n<0) {
+      if (errno==EINTR) {continue;}
+      printf("write failed : %s\n",strerror(errno));
+      nSegments=0;
+      nPending=0;
+      return -1;
+    }
+    if (n==0) {
+      nSegments=0;
+      nPending=0;
+      return -1;
+    }
+    nBytes+=n;
+    // short write: skip completed segments, and resume in the middle of partial one
+    while ((ix<nSegments)&&((size_t)n>=iov[ix].iov_len)) {
+      n-=iov[ix].iov_len;
+      ix++;
+    }
+    if (n>0) {
+      iov[ix].iov_base=(char *)iov[ix].iov_base+n;
+      iov[ix].iov_len-=n;
+    }
+  }
+  nSegments=0;
+  nPending=0;
+  return 0;
+}
+
+int daqRecordGather::close() {
+  if (fd<0) {return 0;}
+  int err=0;
+  if (flush()) {err=-1;}
+  if (::close(fd)) {err=-1;}
+  fd=-1;
+  return err;
+}
+
+unsigned long long daqRecordGather::getBytesWritten() {
+  return nBytes;
+}
+
+unsigned long long daqRecordGather::getWriteCalls() {
+  return nWriteCalls;
+}
+
+int daqRecordGather::getFreeSegments() {
+  return maxSegments-nSegments;
+}
+
+
+
+
+/* daqRecordStriper ********************/
+
+daqRecordStriper::daqRecordStriper() {
+  chunkSize=8*1024*1024;
+  maxFileBytes=0;
+  maxFileSeconds=0;
+  bufferSize=4*1024*1024;
+  useDirectIO=0;
+  useIndex=0;
+  manifest=NULL;
+  isOpen=0;
+  writeError=0;
+  ixTarget=0;
+  chunkIndex=0;
+  chunkBytes=0;
+  chunkOffset=0;
+  chunkFirstEvent=0;
+  chunkEvents=0;
+  nEvents=0;
+  nBytes=0;
+  flushCount=0;
+  flushLast=0;
+  flushTotal=0;
+  flushMax=0;
+}
+
+daqRecordStriper::~daqRecordStriper() {
+  close();
+}
+
+int daqRecordStriper::addDirectory(const char *path) {
+  if (path==NULL) {return -1;}
+  if (isOpen) {return -1;}
+  target t;
+  t.directory=path;
+  t.writer=NULL;
+  t.closingWriter=NULL;
+  t.index=NULL;
+  t.fileIndex=0;
+  t.fileBytes=0;
+  t.fileOpenTime=0;
+  targets.push_back(t);
+  return 0;
+}
+
+int daqRecordStriper::setChunkSize(unsigned long long bytes) {
+  if (bytes==0) {return -1;}
+  chunkSize=bytes;
+  return 0;
+}
+
+int daqRecordStriper::setRotation(unsigned long long maxBytes, int maxSeconds) {
+  if (maxSeconds<0) {return -1;}
+  maxFileBytes=maxBytes;
+  maxFileSeconds=maxSeconds;
+  return 0;
+}
+
+int daqRecordStriper::setBuffers(int bufferSize, int useDirectIO) {
+  if (bufferSize<=0) {return -1;}
+  this->bufferSize=bufferSize;
+  this->useDirectIO=useDirectIO;
+  return 0;
+}
+
+int daqRecordStriper::setIndex(int enabled) {
+  if (isOpen) {return -1;}
+  useIndex=enabled;
+  return 0;
+}
+
+
+int daqRecordStriper::openFile(target &t) {
+  char fn[256];
+  snprintf(fn,sizeof(fn),"%s.%02d.%06d",baseName.c_str(),(int)(&t-&targets[0]),t.fileIndex);
+  t.fileName=fn;
+  std::string path=t.directory + "/" + t.fileName;
+  try {
+    t.writer=new daqRecordWriter(bufferSize,2,useDirectIO);
+  }
+  catch (const char *e) {
+    printf("Failed to create writer: %s\n",e);
+    t.writer=NULL;
+    return -1;
+  }
+  if (t.writer->open(path.c_str())) {
+    delete t.writer;
+    t.writer=NULL;
+    return -1;
+  }
+  if (useIndex) {
+    t.index=new daqFileIndexWriter();
+    if (t.index->open(path.c_str())) {
+      delete t.index;
+      t.index=NULL;
+      closeFile(t,1);
+      return -1;
+    }
+  }
+  t.fileBytes=0;
+  t.fileOpenTime=time(NULL);
+  // manifest lines passed to the kernel at once, so that they survive a crash of the process
+  fprintf(manifest,"file %d %s\n",(int)(&t-&targets[0]),t.fileName.c_str());
+  fflush(manifest);
+  return 0;
+}
+
+int daqRecordStriper::closeFile(target &t, int wait) {
+  int err=0;
+  if (releaseFile(t)) {err=-1;}
+  if (t.writer!=NULL) {
+    if (wait) {
+      if (t.writer->close()) {err=-1;}
+      releaseWriter(t.writer);
+    } else {
+      if (t.writer->closeAsync()) {err=-1;}
+      t.closingWriter=t.writer;
+    }
+    t.writer=NULL;
+    t.fileIndex++;
+  }
+  if (t.index!=NULL) {
+    if (t.index->close()) {err=-1;}
+    delete t.index;
+    t.index=NULL;
+  }
+  if ((wait)&&(releaseFile(t))) {err=-1;}
+  return err;
+}
+
+int daqRecordStriper::releaseFile(target &t) {
+  if (t.closingWriter==NULL) {return 0;}
+  int err=t.closingWriter->close();
+  releaseWriter(t.closingWriter);
+  t.closingWriter=NULL;
+  return err;
+}
+
+void daqRecordStriper::releaseWriter(daqRecordWriter *w) {
+  unsigned long long count;
+  double last, avg, max;
+  w->getFlushStats(&count,&last,&avg,&max);
+  if (count>0) {
+    flushCount+=count;
+    flushTotal+=avg*count;
+    flushLast=last;
+    if (max>flushMax) {flushMax=max;}
+  }
+  delete w;
+}
+
+
+int daqRecordStriper::open(const char *baseName) {
+  if (isOpen) {return -1;}
+  if (targets.size()==0) {return -1;}
+  if (baseName==NULL) {baseName="zdaq";}
+  this->baseName=baseName;
+
+  std::string path=targets[0].directory + "/" + this->baseName + ".manifest";
+  manifest=fopen(path.c_str(),"w");
+  if (manifest==NULL) {
+    printf("Failed to create manifest %s\n",path.c_str());
+    return -1;
+  }
+  fprintf(manifest,"# zdaq stripe manifest v1\n");
+  for (unsigned int i=0;i<targets.size();i++) {
+    fprintf(manifest,"target %d %s\n",i,targets[i].directory.c_str());
+    targets[i].fileIndex=0;
+  }
+
+  isOpen=1;
+  writeError=0;
+  flushCount=0;
+  flushLast=0;
+  flushTotal=0;
+  flushMax=0;
+  ixTarget=0;
+  chunkIndex=0;
+  chunkBytes=0;
+  nEvents=0;
+  nBytes=0;
+
+  // all targets start writing immediately, each in their own thread
+  for (unsigned int i=0;i<targets.size();i++) {
+    if (openFile(targets[i])) {
+      close();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int daqRecordStriper::endChunk() {
+  target &t=targets[ixTarget];
+  fprintf(manifest,"chunk %llu %d %s %llu %llu %d %d\n",chunkIndex,ixTarget,t.fileName.c_str(),chunkOffset,chunkBytes,chunkFirstEvent,chunkEvents);
+  fflush(manifest);
+  chunkIndex++;
+  chunkBytes=0;
+  chunkEvents=0;
+  ixTarget++;
+  if (ixTarget>=(int)targets.size()) {ixTarget=0;}
+  return 0;
+}
+
+
+int daqRecordStriper::writeEvent(int eventId, const void *header, size_t headerSize, const void *data, size_t dataSize) {
+  if (!isOpen) {return -1;}
+  if (writeError) {return -1;}
+  target &t=targets[ixTarget];
+
+  if (chunkBytes==0) {
+    // new chunk: rotate file if needed
+    int doRotate=0;
+    if ((maxFileBytes>0)&&(t.fileBytes>=maxFileBytes)) {doRotate=1;}
+    if ((maxFileSeconds>0)&&(time(NULL)-t.fileOpenTime>=maxFileSeconds)) {doRotate=1;}
+    if ((doRotate)&&(t.fileBytes>0)) {
+      // previous file completed by its writer thread, not to block the caller
+      if (closeFile(t,0)) {writeError=1;}
+      if (openFile(t)) {writeError=1;}
+    }
+    if (t.writer==NULL) {writeError=1;}
+    if (writeError) {return -1;}
+    chunkOffset=t.fileBytes;
+    chunkFirstEvent=eventId;
+  }
+
+  if (t.writer->write(header,headerSize)) {writeError=1; return -1;}
+  if (t.writer->write(data,dataSize)) {writeError=1; return -1;}
+  if (t.index!=NULL) {
+    if (t.index->addEvent((const eventHeader *)header,data,t.fileBytes)) {writeError=1; return -1;}
+  }
+  chunkBytes+=headerSize+dataSize;
+  chunkEvents++;
+  t.fileBytes+=headerSize+dataSize;
+  nEvents++;
+  nBytes+=headerSize+dataSize;
+
+  if (chunkBytes>=chunkSize) {
+    endChunk();
+  }
+  return 0;
+}
+
+
+int daqRecordStriper::close() {
+  if (!isOpen) {return 0;}
+  if (chunkBytes>0) {
+    endChunk();
+  }
+  for (unsigned int i=0;i<targets.size();i++) {
+    if (closeFile(targets[i],1)) {writeError=1;}
+  }
+  if (manifest!=NULL) {
+    fprintf(manifest,"end %llu %llu %llu\n",chunkIndex,nEvents,nBytes);
+    if (fclose(manifest)) {writeError=1;}
+    manifest=NULL;
+  }
+  isOpen=0;
+  if (writeError) {return -1;}
+  return 0;
+}
+
+
+int daqRecordStriper::getFlushStats(unsigned long long *count, double *last, double *avg, double *max) {
+  unsigned long long n=flushCount;
+  double vLast=0;
+  double vTotal=flushTotal;
+  double vMax=flushMax;
+  int isActive=0;
+  for (unsigned int i=0;i<targets.size();i++) {
+    daqRecordWriter *w[2]={targets[i].writer,targets[i].closingWriter};
+    for (int j=0;j<2;j++) {
+      if (w[j]==NULL) {continue;}
+      unsigned long long wCount;
+      double wLast, wAvg, wMax;
+      w[j]->getFlushStats(&wCount,&wLast,&wAvg,&wMax);
+      if (wCount==0) {continue;}
+      n+=wCount;
+      vTotal+=wAvg*wCount;
+      if (wMax>vMax) {vMax=wMax;}
+      if (wLast>vLast) {vLast=wLast;}
+      isActive=1;
+    }
+  }
+  if (!isActive) {vLast=flushLast;}
+  if (count!=NULL) {*count=n;}
+  if (last!=NULL) {*last=vLast;}
+  if (avg!=NULL) {*avg=(n>0)?vTotal/n:0;}
+  if (max!=NULL) {*max=vMax;}
+  return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * File:   testZdaqFile.cxx
+ *
+ * Write a data file with its index, and read it back with daqFileReader.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "Control/zdaq_file.h"
+
+using namespace std;
+
+int main() {
+  char dataPath[]="/tmp/testZdaqFile.XXXXXX";
+  int fd=mkstemp(dataPath);
+  if (fd<0) {return 1;}
+  FILE *fp=fdopen(fd,"w");
+  std::string indexPath=std::string(dataPath) + DAQ_FILE_INDEX_SUFFIX;
+
+  // write events of various sizes, each filled with its id
+  const int nEvents=1000;
+  char buf[5000];
+  daqFileIndexWriter index(64*1024);
+  if (index.open(dataPath)) {return 1;}
+  unsigned long long offset=0;
+  for (int i=0;i<nEvents;i++) {
+    eventHeader h;
+    h.id=i;
+    h.size=(i*37)%sizeof(buf);
+    memset(buf,i&0xFF,h.size);
+    fwrite(&h,sizeof(h),1,fp);
+    fwrite(buf,h.size,1,fp);
+    index.addEvent(&h,buf,offset);
+    offset+=sizeof(h)+h.size;
+  }
+  fclose(fp);
+  if (index.close()) {return 1;}
+
+  int err=0;
+  if (daqFileChecksum(0,"123456789",9)!=0xCBF43926) {
+    cout << "bad checksum" << endl;
+    err=1;
+  }
+
+  // random access with index
+  daqFileReader reader;
+  if (reader.open(dataPath)) {return 1;}
+  if ((reader.getNumberOfEvents()!=nEvents)||(!reader.hasChecksums())||(!reader.hasTimestamps())||(reader.verify()!=0)) {
+    cout << "bad index" << endl;
+    err=1;
+  }
+  for (int i=nEvents-1;i>=0;i-=7) {
+    eventHeader h;
+    const void *data;
+    if ((reader.getEvent(i,&h,&data))||(h.id!=i)||((h.size>0)&&(((const unsigned char *)data)[h.size-1]!=(i&0xFF)))) {
+      cout << "bad event " << i << endl;
+      err=1;
+      break;
+    }
+  }
+
+  // sequential access to a range
+  daqFileRange range(&reader,100,500,16*1024);
+  eventHeader h;
+  const void *data;
+  int n=0;
+  while (!range.next(&h,&data)) {
+    if (h.id!=100+n) {err=1; break;}
+    n++;
+  }
+  if (n!=500) {
+    cout << "bad range: " << n << " events" << endl;
+    err=1;
+  }
+  reader.close();
+
+  // index with inconsistent trailer: ignored, the data file is scanned
+  int indexFd=open(indexPath.c_str(),O_RDWR);
+  if (indexFd<0) {return 1;}
+  off_t indexSize=lseek(indexFd,0,SEEK_END);
+  daqFileIndexTrailer trl, trlBad;
+  if (pread(indexFd,&trl,sizeof(trl),indexSize-sizeof(trl))!=sizeof(trl)) {return 1;}
+  trlBad=trl;
+  trlBad.nEvents+=1000;
+  if (pwrite(indexFd,&trlBad,sizeof(trl),indexSize-sizeof(trl))!=sizeof(trl)) {return 1;}
+  if ((reader.open(dataPath))||(reader.getNumberOfEvents()!=nEvents)||(reader.hasChecksums())) {
+    cout << "bad trailer accepted" << endl;
+    err=1;
+  }
+  reader.close();
+  if (pwrite(indexFd,&trl,sizeof(trl),indexSize-sizeof(trl))!=sizeof(trl)) {return 1;}
+
+  // index entry beyond end of data file: it and following ones ignored
+  daqFileIndexEntry entry, entryBad;
+  off_t entryOffset=sizeof(daqFileIndexHeader)+500*sizeof(daqFileIndexEntry);
+  if (pread(indexFd,&entry,sizeof(entry),entryOffset)!=sizeof(entry)) {return 1;}
+  entryBad=entry;
+  entryBad.offset=offset;
+  if (pwrite(indexFd,&entryBad,sizeof(entry),entryOffset)!=sizeof(entry)) {return 1;}
+  if ((reader.open(dataPath))||(reader.getNumberOfEvents()!=500)||(reader.getEvent(500,&h,&data)==0)) {
+    cout << "bad entry accepted" << endl;
+    err=1;
+  }
+  reader.close();
+  if (pwrite(indexFd,&entry,sizeof(entry),entryOffset)!=sizeof(entry)) {return 1;}
+  close(indexFd);
+
+  // without index, the data file is scanned
+  unlink(indexPath.c_str());
+  if (reader.open(dataPath)) {return 1;}
+  if ((reader.getNumberOfEvents()!=nEvents)||(reader.hasChecksums())||(reader.hasTimestamps())) {
+    cout << "bad scan" << endl;
+    err=1;
+  }
+  reader.close();
+  unlink(dataPath);
+
+  if (!err) {cout << "testZdaqFile ok" << endl;}
+  return err;
+}
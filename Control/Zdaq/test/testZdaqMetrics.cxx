@@ -0,0 +1,82 @@
+/*
+ * File:   testZdaqMetrics.cxx
+ *
+ * Encode a metrics snapshot with zdaqMetrics_writer, and decode it back.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+
+#include "Control/zdaq_metrics.h"
+
+using namespace std;
+
+int main() {
+  int err=0;
+
+  zdaqMetrics_histogram h;
+  h.add(0);
+  h.add(1);
+  h.add(1000);
+  h.add(1000);
+  h.add(1ULL<<62);   // overflow bin
+
+  // same metrics names in each source, as for modules of a host
+  const int nSources=50;
+  zdaqMetrics_writer w;
+  w.begin(1234567890123ULL,1000);
+  for (int i=0;i<nSources;i++) {
+    char name[32];
+    snprintf(name,sizeof(name),"/module%03d",i);
+    w.beginSource(name);
+    w.addCounter("nItemsIn",1000000ULL*i);
+    w.addGauge("fifoDepth",-i);
+    w.addHistogram("loopTime",h);
+  }
+  const std::string &buf=w.end();
+
+  std::vector<zdaqMetrics_value> v;
+  uint64_t ts=0;
+  if ((zdaqMetrics_decode(buf.data(),buf.size(),v,&ts))||(ts!=1234567890123ULL)||(v.size()!=3*nSources)) {
+    cout << "bad snapshot" << endl;
+    return 1;
+  }
+  for (int i=0;i<nSources;i++) {
+    char name[32];
+    snprintf(name,sizeof(name),"/module%03d",i);
+    const zdaqMetrics_value &c=v[3*i];
+    const zdaqMetrics_value &g=v[3*i+1];
+    const zdaqMetrics_value &hh=v[3*i+2];
+    if ((c.source!=name)||(c.name!="nItemsIn")||(c.type!=zdaqMetrics_value::COUNTER)||(c.value!=1000000LL*i)) {err=1;}
+    if ((g.source!=name)||(g.name!="fifoDepth")||(g.type!=zdaqMetrics_value::GAUGE)||(g.value!=-i)) {err=1;}
+    if ((hh.name!="loopTime")||(hh.type!=zdaqMetrics_value::HISTOGRAM)||(hh.bins.size()!=zdaqMetrics_histogram::nBins)) {
+      err=1;
+    } else if ((hh.bins[0]!=1)||(hh.bins[1]!=1)||(hh.bins[10]!=2)||(hh.bins[zdaqMetrics_histogram::nBins-1]!=1)) {
+      err=1;
+    }
+    if (err) {
+      cout << "bad metrics for " << name << endl;
+      break;
+    }
+  }
+
+  // names delta-encoded, values as varints: much smaller than full names and 64-bit values
+  size_t fixedSize=nSources*(10+8+9+8+8+8+8*zdaqMetrics_histogram::nBins);
+  if (buf.size()*4>fixedSize) {
+    cout << "snapshot too big: " << buf.size() << " bytes" << endl;
+    err=1;
+  }
+
+  // truncated snapshots are rejected
+  for (size_t l=0;l<buf.size();l+=7) {
+    if (zdaqMetrics_decode(buf.data(),l,v)==0) {
+      cout << "truncated snapshot accepted" << endl;
+      err=1;
+      break;
+    }
+  }
+
+  if (!err) {cout << "testZdaqMetrics ok" << endl;}
+  return err;
+}
@@ -0,0 +1,411 @@
+/*
+ * File:   testZdaqRecord.cxx
+ *
+ * Record event streams with daqRecordWriter, daqRecordGather and daqRecordStriper, and read them back with daqFileReader.
+ * open() and pwrite() are replaced in this process to simulate a filesystem without O_DIRECT, and short writes.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <string>
+#include <map>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "Control/zdaq_record.h"
+
+using namespace std;
+
+
+// when set, open() with O_DIRECT fails with EINVAL
+static int failDirectOpen=0;
+
+// when set, every given number of pwrite() calls completes only part of the request
+static int shortWriteInterval=0;
+static int nWriteCalls=0;
+static int nShortWrites=0;
+
+extern "C" int testOpen(const char *path, int flags, ...) __asm__("open");
+extern "C" int testOpen(const char *path, int flags, ...) {
+  mode_t mode=0;
+  if (flags&O_CREAT) {
+    va_list ap;
+    va_start(ap,flags);
+    mode=va_arg(ap,int);
+    va_end(ap);
+  }
+  if ((failDirectOpen)&&(flags&O_DIRECT)) {
+    errno=EINVAL;
+    return -1;
+  }
+  return syscall(SYS_openat,AT_FDCWD,path,flags,mode);
+}
+
+extern "C" ssize_t testPwrite(int fd, const void *buf, size_t count, off_t offset) __asm__("pwrite");
+extern "C" ssize_t testPwrite(int fd, const void *buf, size_t count, off_t offset) {
+  // only one writer thread when enabled
+  if (shortWriteInterval>0) {
+    nWriteCalls++;
+    if ((nWriteCalls%shortWriteInterval==0)&&(count>2*DAQ_RECORD_ALIGNMENT)) {
+      // write some blocks, but report a size which is not a multiple of the alignment
+      size_t n=(count/2/DAQ_RECORD_ALIGNMENT)*DAQ_RECORD_ALIGNMENT;
+      ssize_t r=syscall(SYS_pwrite64,fd,buf,n,offset);
+      if (r!=(ssize_t)n) {return r;}
+      nShortWrites++;
+      return n+100;
+    }
+  }
+  return syscall(SYS_pwrite64,fd,buf,count,offset);
+}
+
+
+// events of various sizes, each filled with its id
+static void makeEvent(int i, eventHeader *h, char *buf) {
+  h->id=i;
+  h->size=(i*37)%5000;
+  memset(buf,i&0xFF,h->size);
+}
+
+// check an event made by makeEvent(). Returns 0 if ok.
+static int checkEvent(int i, const eventHeader *h, const void *data) {
+  if ((h->id!=i)||(h->size!=(i*37)%5000)) {return -1;}
+  for (int j=0;j<h->size;j++) {
+    if (((const unsigned char *)data)[j]!=(i&0xFF)) {return -1;}
+  }
+  return 0;
+}
+
+// write events to a stream. Returns the stream size, 0 on error.
+static unsigned long long writeEvents(daqRecordWriter *w, int nEvents) {
+  char buf[5000];
+  unsigned long long n=0;
+  for (int i=0;i<nEvents;i++) {
+    eventHeader h;
+    makeEvent(i,&h,buf);
+    if ((w->write(&h,sizeof(h)))||(w->write(buf,h.size))) {return 0;}
+    n+=sizeof(h)+h.size;
+  }
+  return n;
+}
+
+// check events written by writeEvents(). Returns 0 if ok.
+static int checkEvents(const char *path, int nEvents) {
+  daqFileReader reader;
+  if (reader.open(path)) {return -1;}
+  int err=0;
+  if (reader.getNumberOfEvents()!=(uint64_t)nEvents) {err=-1;}
+  for (int i=0;(i<nEvents)&&(!err);i++) {
+    eventHeader h;
+    const void *data;
+    if ((reader.getEvent(i,&h,&data))||(checkEvent(i,&h,data))) {err=-1;}
+  }
+  reader.close();
+  return err;
+}
+
+// record a stream to path and read it back. Returns 0 if ok.
+static int testWriter(const char *name, const char *path, int useDirectIO, int expectDirectIO) {
+  const int nEvents=1001;
+  daqRecordWriter w(64*1024,2,useDirectIO);
+  if (w.open(path)) {
+    cout << name << ": open failed" << endl;
+    return -1;
+  }
+  int err=0;
+  if (w.isDirectIO()!=expectDirectIO) {
+    cout << name << ": O_DIRECT " << w.isDirectIO() << " expected " << expectDirectIO << endl;
+    err=-1;
+  }
+  unsigned long long n=writeEvents(&w,nEvents);
+  if ((n==0)||(w.closeAsync())) {
+    cout << name << ": write failed" << endl;
+    return -1;
+  }
+  // file completed by writer thread: no more data accepted
+  if ((w.write("x",1)==0)||(w.close())) {
+    cout << name << ": close failed" << endl;
+    return -1;
+  }
+
+  // stream does not end on a block boundary: padding must have been truncated
+  struct stat st;
+  if ((stat(path,&st))||((unsigned long long)st.st_size!=n)||(w.getBytesWritten()!=n)||(n%DAQ_RECORD_ALIGNMENT==0)) {
+    cout << name << ": bad file size " << st.st_size << " expected " << n << endl;
+    err=-1;
+  }
+  if (checkEvents(path,nEvents)) {
+    cout << name << ": bad events" << endl;
+    err=-1;
+  }
+
+  unsigned long long count;
+  double last, avg, max;
+  w.getFlushStats(&count,&last,&avg,&max);
+  if ((count<n/(64*1024))||(max<avg)) {
+    cout << name << ": bad flush stats" << endl;
+    err=-1;
+  }
+  unlink(path);
+  return err;
+}
+
+
+// record a stream in batches, as recordToFile does, and read it back. Returns 0 if ok.
+static int testGather(const char *path) {
+  // first event has no payload: following headers fall on odd segments
+  const int nEvents=3001;
+  eventHeader *headers=new eventHeader[nEvents];
+  char *payloads=new char[nEvents*5000];
+  for (int i=0;i<nEvents;i++) {
+    makeEvent(i,&headers[i],&payloads[i*5000]);
+  }
+
+  daqRecordGather g(1024*1024);
+  if (g.open(path)) {return -1;}
+  int err=0;
+  unsigned long long nBytes=0;
+  for (int i=0;(i<nEvents)&&(!err);i++) {
+    // header and payload must go in the same batch: only complete events written
+    if ((g.getFreeSegments()<2)||(g.isFull())) {
+      if ((g.flush())||(g.getBytesWritten()!=nBytes)) {
+        cout << "gather: bad flush at event " << i << endl;
+        err=-1;
+      }
+    }
+    int nFree=g.getFreeSegments();
+    if ((g.add(&headers[i],sizeof(eventHeader)))||(g.add(&payloads[i*5000],headers[i].size))) {
+      cout << "gather: add failed at event " << i << endl;
+      err=-1;
+    }
+    // empty payload takes no segment
+    if (g.getFreeSegments()!=nFree-((headers[i].size>0)?2:1)) {
+      cout << "gather: bad number of segments at event " << i << endl;
+      err=-1;
+    }
+    nBytes+=sizeof(eventHeader)+headers[i].size;
+  }
+  if ((g.close())||(g.getBytesWritten()!=nBytes)||(g.getWriteCalls()<(unsigned long long)(2*nEvents/IOV_MAX))) {
+    cout << "gather: close failed" << endl;
+    err=-1;
+  }
+  if ((!err)&&(checkEvents(path,nEvents))) {
+    cout << "gather: bad events" << endl;
+    err=-1;
+  }
+  delete[] headers;
+  delete[] payloads;
+
+  // more than IOV_MAX segments: batch full, further segments refused until flush
+  char buf[IOV_MAX+1];
+  memset(buf,'x',sizeof(buf));
+  if (g.open(path)) {return -1;}
+  for (int i=0;i<IOV_MAX;i++) {
+    if (g.add(&buf[i],1)) {
+      cout << "gather: add failed at segment " << i << endl;
+      err=-1;
+      break;
+    }
+  }
+  if ((g.getFreeSegments()!=0)||(!g.isFull())||(g.add(&buf[IOV_MAX],1)==0)) {
+    cout << "gather: overflow not detected" << endl;
+    err=-1;
+  }
+  if ((g.flush())||(g.getBytesWritten()!=IOV_MAX)||(g.getFreeSegments()!=IOV_MAX)||(g.isFull())) {
+    cout << "gather: bad flush of full batch" << endl;
+    err=-1;
+  }
+  if ((g.add(&buf[IOV_MAX],1))||(g.close())||(g.getBytesWritten()!=IOV_MAX+1)) {
+    cout << "gather: add after flush failed" << endl;
+    err=-1;
+  }
+  struct stat st;
+  if ((stat(path,&st))||(st.st_size!=IOV_MAX+1)) {
+    cout << "gather: bad file size" << endl;
+    err=-1;
+  }
+  unlink(path);
+  return err;
+}
+
+
+// record a stream striped over two directories, with rotation, and reassemble it from the manifest. Returns 0 if ok.
+static int testStriper(const char *dir) {
+  const int nEvents=2001;
+  std::string dirs[2]={std::string(dir) + "/a", std::string(dir) + "/b"};
+  daqRecordStriper s;
+  for (int i=0;i<2;i++) {
+    if ((mkdir(dirs[i].c_str(),0755))||(s.addDirectory(dirs[i].c_str()))) {return -1;}
+  }
+  s.setChunkSize(20000);
+  s.setRotation(100000,0);
+  s.setBuffers(16*1024,1);
+  s.setIndex(1);
+  if (s.open("run")) {
+    cout << "striper: open failed" << endl;
+    return -1;
+  }
+  char buf[5000];
+  unsigned long long nBytes=0;
+  for (int i=0;i<nEvents;i++) {
+    eventHeader h;
+    makeEvent(i,&h,buf);
+    if (s.writeEvent(i,&h,sizeof(h),buf,h.size)) {
+      cout << "striper: write failed" << endl;
+      return -1;
+    }
+    nBytes+=sizeof(h)+h.size;
+  }
+  // flush statistics of all writers, including those of rotated files
+  unsigned long long count, countOpen;
+  double last, avg, max;
+  s.getFlushStats(&countOpen,&last,&avg,&max);
+  if (s.close()) {
+    cout << "striper: close failed" << endl;
+    return -1;
+  }
+  s.getFlushStats(&count,&last,&avg,&max);
+  if ((countOpen<nBytes/(100*1024))||(count<countOpen)||(max<avg)||(avg<=0)) {
+    cout << "striper: bad flush stats" << endl;
+    return -1;
+  }
+
+  std::string manifestPath=dirs[0] + "/run.manifest";
+  FILE *fp=fopen(manifestPath.c_str(),"r");
+  if (fp==NULL) {
+    cout << "striper: no manifest" << endl;
+    return -1;
+  }
+  int err=0;
+  std::map<std::string,int> files;      // files announced in manifest, and their target
+  int nFiles[2]={0,0};
+  unsigned long long nChunks=0;
+  int nextEvent=0;
+  int isEnd=0;
+  char line[1024];
+  while ((!err)&&(fgets(line,sizeof(line),fp)!=NULL)) {
+    char name[256];
+    int ix, nev, first;
+    unsigned long long chunk, offset, size, totalEvents, totalBytes;
+    if ((line[0]=='#')||(!strncmp(line,"target ",7))) {
+      continue;
+    }
+    if (isEnd) {
+      cout << "striper: data after end of manifest" << endl;
+      err=-1;
+    } else if (sscanf(line,"file %d %255s",&ix,name)==2) {
+      if ((ix<0)||(ix>1)||(files.count(name))) {err=-1; break;}
+      files[name]=ix;
+      nFiles[ix]++;
+    } else if (sscanf(line,"chunk %llu %d %255s %llu %llu %d %d",&chunk,&ix,name,&offset,&size,&first,&nev)==7) {
+      // chunks are in order, round-robin over the targets, in files announced before
+      if ((chunk!=nChunks)||(ix!=(int)(chunk%2))||(files.count(name)==0)||(files[name]!=ix)||(first!=nextEvent)||(nev<=0)) {
+        cout << "striper: bad chunk " << line;
+        err=-1;
+        break;
+      }
+      char *data=(char *)malloc(size);
+      std::string path=dirs[ix] + "/" + name;
+      FILE *fd=fopen(path.c_str(),"r");
+      if ((data==NULL)||(fd==NULL)||(fseek(fd,offset,SEEK_SET))||(fread(data,1,size,fd)!=size)) {
+        cout << "striper: failed to read chunk " << chunk << " from " << path << endl;
+        err=-1;
+      }
+      if (fd!=NULL) {fclose(fd);}
+      // chunk made of complete events
+      unsigned long long pos=0;
+      for (int i=0;(i<nev)&&(!err);i++) {
+        eventHeader h;
+        if (pos+sizeof(h)>size) {err=-1; break;}
+        memcpy(&h,&data[pos],sizeof(h));
+        pos+=sizeof(h);
+        if ((pos+h.size>size)||(checkEvent(nextEvent,&h,&data[pos]))) {err=-1; break;}
+        pos+=h.size;
+        nextEvent++;
+      }
+      if ((!err)&&(pos!=size)) {err=-1;}
+      if (err) {cout << "striper: bad events in chunk " << chunk << endl;}
+      free(data);
+      nChunks++;
+    } else if (sscanf(line,"end %llu %llu %llu",&chunk,&totalEvents,&totalBytes)==3) {
+      if ((chunk!=nChunks)||(totalEvents!=(unsigned long long)nEvents)||(totalBytes!=nBytes)) {
+        cout << "striper: bad end " << line;
+        err=-1;
+      }
+      isEnd=1;
+    } else {
+      cout << "striper: bad manifest line " << line;
+      err=-1;
+    }
+  }
+  fclose(fp);
+  if ((!err)&&((!isEnd)||(nextEvent!=nEvents))) {
+    cout << "striper: incomplete manifest, " << nextEvent << " events" << endl;
+    err=-1;
+  }
+  if ((!err)&&((nFiles[0]<2)||(nFiles[1]<2))) {
+    cout << "striper: no rotation" << endl;
+    err=-1;
+  }
+
+  // each file can be read on its own, with its index
+  for (std::map<std::string,int>::iterator it=files.begin();it!=files.end();it++) {
+    std::string path=dirs[it->second] + "/" + it->first;
+    daqFileReader reader;
+    if ((reader.open(path.c_str()))||(!reader.hasChecksums())||(reader.verify()!=0)) {
+      cout << "striper: bad file " << path << endl;
+      err=-1;
+    }
+    reader.close();
+    unlink(path.c_str());
+    unlink((path + DAQ_FILE_INDEX_SUFFIX).c_str());
+  }
+  unlink(manifestPath.c_str());
+  rmdir(dirs[0].c_str());
+  rmdir(dirs[1].c_str());
+  return err;
+}
+
+
+int main() {
+  char dir[]="/tmp/testZdaqRecord.XXXXXX";
+  if (mkdtemp(dir)==NULL) {return 1;}
+  std::string path=std::string(dir) + "/data";
+  int err=0;
+
+  // O_DIRECT, padded tail
+  if (testWriter("direct",path.c_str(),1,1)) {err=1;}
+
+  // buffered I/O requested
+  if (testWriter("buffered",path.c_str(),0,0)) {err=1;}
+
+  // filesystem without O_DIRECT: fallback to buffered I/O
+  failDirectOpen=1;
+  if (testWriter("fallback",path.c_str(),1,0)) {err=1;}
+  failDirectOpen=0;
+
+  // short writes with O_DIRECT: resumed from the last complete block
+  shortWriteInterval=3;
+  nShortWrites=0;
+  if (testWriter("short write",path.c_str(),1,1)) {err=1;}
+  shortWriteInterval=0;
+  if (nShortWrites==0) {
+    cout << "no short write" << endl;
+    err=1;
+  }
+
+  // batches of segments written with writev()
+  if (testGather(path.c_str())) {err=1;}
+
+  // striped output, with rotation
+  if (testStriper(dir)) {err=1;}
+
+  rmdir(dir);
+  if (!err) {cout << "testZdaqRecord ok" << endl;}
+  return err;
+}
@@ -0,0 +1,80 @@
+/*
+ * File:   testZdaqSession.cxx
+ *
+ * Expire the zookeeper session shared by objects of this process,
+ * and check that zdaqCtrl_session::get() then gives a new working session.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+#include "Control/zdaq_ctrl.h"
+
+using namespace std;
+
+// a second handle on the same session id, once closed, makes the server expire the session
+static void expireSession(zhandle_t *zh, const char *zcx) {
+  const clientid_t *id=zoo_client_id(zh);
+  zhandle_t *zh2=zookeeper_init(zcx,NULL,30000,id,NULL,0);
+  if (zh2==NULL) {return;}
+  for (int i=0;(i<50)&&(zoo_state(zh2)!=ZOO_CONNECTED_STATE);i++) {
+    usleep(100000);
+  }
+  zookeeper_close(zh2);
+}
+
+int main() {
+  const char *zcx="127.0.0.1:2181";
+
+  zdaqCtrl_session *s=zdaqCtrl_session::get(zcx);
+  if ((s==NULL)||(s->waitConnected(5000))) {
+    cout << "failed to connect to " << zcx << endl;
+    return 1;
+  }
+
+  // same session while valid
+  zdaqCtrl_session *s1=zdaqCtrl_session::get(zcx);
+  if (s1!=s) {
+    cout << "session not shared" << endl;
+    return 1;
+  }
+  s1->release();
+
+  expireSession(s->getHandle(),zcx);
+
+  // expired session is not reused
+  zdaqCtrl_session *s2=NULL;
+  for (int i=0;i<100;i++) {
+    s2=zdaqCtrl_session::get(zcx);
+    if (s2!=s) {break;}
+    s2->release();
+    s2=NULL;
+    usleep(100000);
+  }
+  int err=0;
+  if (s2==NULL) {
+    cout << "session not expired" << endl;
+    err=1;
+  } else {
+    if (s2->waitConnected(5000)) {
+      cout << "new session not connected" << endl;
+      err=1;
+    }
+    // old session released by its last user: new one stays in pool
+    s->release();
+    s=NULL;
+    zdaqCtrl_session *s3=zdaqCtrl_session::get(zcx);
+    if (s3!=s2) {
+      cout << "new session not shared" << endl;
+      err=1;
+    }
+    if (s3!=NULL) {s3->release();}
+    s2->release();
+  }
+  if (s!=NULL) {s->release();}
+
+  if (!err) {cout << "testZdaqSession ok" << endl;}
+  return err;
+}
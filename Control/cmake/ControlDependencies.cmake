@@ -47,6 +47,7 @@ o2_define_bucket(
         SYSTEMINCLUDE_DIRECTORIES
         ${Boost_INCLUDE_DIRS}
         ${Zookeeper_INCLUDE_DIRS}
+        ${CMAKE_CURRENT_LIST_DIR}/../StateMachine/include # header-only ControlStateMachine/TransitionTable.h
 )
 
 o2_define_bucket(
@@ -24,10 +24,14 @@ int main() {
   boost::property_tree::ptree message;
   message.put("name", "test");
 
-  // publish values
+  // keep only latest values of a widget if subscribers are slow
+  publisher->setTopic("widget", 10, AliceO2::GUI::Publisher::DropPolicy::DropOldest);
+
+  // publish values: each message is received as two frames, topic ("" for the first two) then body
   for (;;) {
     publisher->publish(blob);
     publisher->publish(message);
+    publisher->publish("widget", message);
     std::this_thread::sleep_for(std::chrono::milliseconds(3000));
   }
 }
@@ -0,0 +1,108 @@
+///
+/// \file Coalescer.h
+///
+
+#ifndef ALICEO2_GUI_COALESCER_H
+#define ALICEO2_GUI_COALESCER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "GUI/Publisher.h"
+
+namespace AliceO2
+{
+/// ALICE O2 Monitoring system
+namespace GUI
+{
+
+/// Limits the rate of messages sent to GUI: keeps only the latest message of each key (e.g. a widget,
+/// or an object shown in a widget), and publishes them at a fixed frame rate.
+/// A producer may call update() at any rate, slow clients receive at most one message per key and frame.
+/// Messages replaced before being published are counted as dropped.
+///
+/// In Snapshot mode, all keys updated during a frame are published together, as a single JSON object
+/// {"key":message,...} per topic (messages must then be JSON-encoded): thousands of objects changing
+/// state give one message per frame.
+class Coalescer
+{
+  public:
+    enum class Mode {
+      PerKey,  ///< one message per key updated
+      Snapshot ///< one message per topic, with all keys updated
+    };
+
+  private:
+    /// where messages are published
+    Publisher &mPublisher;
+
+    /// how updates are published
+    Mode mMode;
+
+    /// time between frames, in microseconds
+    std::atomic<long> mFramePeriod;
+
+    /// latest message of keys updated since last frame, by topic and key
+    std::map<std::string, std::map<std::string, std::string>> mPending;
+
+    /// mutex that protects pending messages
+    std::mutex mPendingMutex;
+
+    /// serializes flushes (from thread, or user)
+    std::mutex mFlushMutex;
+
+    /// signaled on shutdown
+    std::condition_variable mCondition;
+
+    /// messages replaced before being published, or dropped by publisher
+    std::atomic<uint64_t> mDropped;
+
+    /// messages given to publisher
+    std::atomic<uint64_t> mPublished;
+
+    /// dedicated thread publishing frames
+    std::thread mFlushThread;
+
+    /// States whether flush thread should keep running
+    bool mThreadRunning;
+
+    /// Flush thread loop
+    void flushLoop();
+  public:
+    /// Starts publishing frames
+    /// \param publisher 	publisher used to send messages (must exist as long as coalescer)
+    /// \param framesPerSecond 	maximum number of messages per key (or per topic, in Snapshot mode) and second
+    /// \param mode 	how updates are published
+    Coalescer(Publisher &publisher, double framesPerSecond, Mode mode = Mode::PerKey);
+
+    /// Publishes pending messages and stops
+    ~Coalescer();
+
+    /// Sets frame rate, applied from next frame
+    void setFrameRate(double framesPerSecond);
+
+    /// Sets latest message of a key, to be published at next frame
+    /// \param key 	name of what this message updates
+    /// \param message 	message body, replacing previous message of this key if not published yet
+    /// \param topic 	topic to publish on ("": no topic)
+    void update(const std::string &key, std::string &&message, const std::string &topic = "");
+    void update(const std::string &key, const std::string &message, const std::string &topic = "");
+
+    /// Publishes pending messages now
+    void flush();
+
+    /// Number of messages dropped since creation (replaced before being published, or dropped by publisher)
+    uint64_t getDropped();
+
+    /// Number of messages published since creation
+    uint64_t getPublished();
+};
+
+} // namespace GUI
+} // namespace AliceO2
+
+#endif // ALICEO2_GUI_COALESCER_H
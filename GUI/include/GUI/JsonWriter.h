@@ -0,0 +1,98 @@
+///
+/// \file JsonWriter.h
+///
+
+#ifndef ALICEO2_GUI_JSONWRITER_H
+#define ALICEO2_GUI_JSONWRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+
+namespace AliceO2
+{
+/// ALICE O2 Monitoring system
+namespace GUI
+{
+
+/// Writes JSON-encoded messages directly into a growable buffer, without intermediate tree or stream.
+/// The buffer is kept between messages (clear() does not release memory), so that a writer reused
+/// for each message does not allocate once it reached its working size.
+/// Commas and colons are inserted automatically; strings are escaped, numbers written in C locale.
+///
+/// \code
+/// JsonWriter json;
+/// json.beginObject().key("name").value("status").key("count").value(count).endObject();
+/// publisher->publish(json.str());
+/// \endcode
+class JsonWriter
+{
+  private:
+    /// encoded message
+    std::string mBuffer;
+
+    /// for each object / array being written: set once it has a first element
+    std::vector<bool> mHasElements;
+
+    /// set after a key, until its value is written
+    bool mAfterKey;
+
+    /// adds comma if needed before a new element
+    void separate();
+
+    /// appends escaped string, with quotes
+    void appendString(const char *s, size_t length);
+
+    /// appends decimal digits
+    void appendUnsigned(unsigned long long v);
+
+    /// appends ptree node (objects, arrays and strings, as boost::property_tree::write_json)
+    void appendTree(const boost::property_tree::ptree &tree);
+  public:
+    /// \param capacity 	initial buffer size
+    JsonWriter(size_t capacity = 1024);
+
+    /// starts a new message, keeping buffer memory
+    void clear();
+
+    JsonWriter &beginObject();
+    JsonWriter &endObject();
+    JsonWriter &beginArray();
+    JsonWriter &endArray();
+
+    /// writes key of next value, in an object
+    JsonWriter &key(const char *name);
+    JsonWriter &key(const std::string &name);
+
+    JsonWriter &value(const char *s);
+    JsonWriter &value(const std::string &s);
+    JsonWriter &value(bool b);
+    JsonWriter &value(int v);
+    JsonWriter &value(long v);
+    JsonWriter &value(long long v);
+    JsonWriter &value(unsigned int v);
+    JsonWriter &value(unsigned long v);
+    JsonWriter &value(unsigned long long v);
+    JsonWriter &value(double v); ///< NaN and infinity, not representable in JSON, are written as null
+    JsonWriter &null();
+
+    /// writes a ptree, with the same encoding as boost::property_tree::write_json
+    JsonWriter &value(const boost::property_tree::ptree &tree);
+
+    /// inserts already encoded JSON
+    JsonWriter &raw(const std::string &json);
+
+    /// encoded message (valid until next modification)
+    const std::string &str() const;
+    const char *data() const;
+    size_t size() const;
+
+    /// gives encoded message away (e.g. to Publisher::publish(std::string&&)), buffer memory is not kept
+    std::string release();
+};
+
+} // namespace GUI
+} // namespace AliceO2
+
+#endif // ALICEO2_GUI_JSONWRITER_H
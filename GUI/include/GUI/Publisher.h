@@ -7,6 +7,12 @@
 #define ALICEO2_GUI_PUBLISHER_H
 
 #include <iostream>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 #include "zmq.hpp"
 #include <boost/property_tree/ptree.hpp>
 
@@ -17,35 +23,122 @@ namespace GUI
 {
 
 /// Allows to publish generic messages that are passed through WebSocket server and then delivered to given widget on client side
+///
+/// Messages may be published on a named topic: the topic is sent as a first ZeroMQ frame, so that
+/// subscribers (e.g. a dashboard rendering only some widgets) receive only topics they subscribed to,
+/// filtering being done on publisher side. Messages without topic have an empty topic frame:
+/// each message is always two frames, topic then body.
+/// Each topic has its own queue, bounded by a high-water mark, and a drop policy applied when it is full.
+/// Messages are sent by a dedicated thread, taking in turn one message of each topic:
+/// order is kept within a topic, not between topics.
 class Publisher
 {
+  public:
+    /// What to do when publishing on a topic whose queue is full
+    enum class DropPolicy {
+      DropNewest, ///< message published is discarded
+      DropOldest  ///< oldest message of queue is discarded to make room
+    };
+
   private:
     /// ZeroMQ context
     zmq::context_t context;
 
-    /// ZeroMQ publisher socket
+    /// ZeroMQ publisher socket (used by sender thread only)
     zmq::socket_t socket;
 
     /// Publishr server socket URL
     std::string url;
+
+    /// Messages waiting to be sent on a topic
+    struct Topic {
+      std::deque<std::string> messages;
+      size_t highWaterMark;
+      DropPolicy policy;
+      uint64_t dropped;
+    };
+
+    /// queues, by topic name ("": messages without topic)
+    std::map<std::string, Topic> mTopics;
+
+    /// high-water mark and policy of topics not configured with setTopic()
+    size_t mDefaultHighWaterMark;
+    DropPolicy mDefaultPolicy;
+
+    /// number of messages in all queues
+    size_t mPending;
+
+    /// mutex that protects topics
+    std::mutex mTopicsMutex;
+
+    /// signaled when a message is queued, or on shutdown
+    std::condition_variable mTopicsCondition;
+
+    /// dedicated thread sending messages
+    std::thread mSenderThread;
+
+    /// States whether sender thread should keep running
+    bool mThreadRunning;
+
+    /// Sender thread loop
+    void senderLoop();
+
+    /// Queues message on given topic, applying its policy
+    /// \return 	false if message was dropped
+    bool enqueue(const std::string &topic, std::string &&message);
+
+    /// Sends a message, handing its buffer to ZeroMQ without copy
+    void send(const std::string &topic, std::string &&message);
   public:
     /// Creates context and socket
     /// Binds ZeroMQ socket to provided URL
     /// \param url 	URL used to bind socket
     Publisher(const std::string &url);
 
-    /// Unbinds server sockets
+    /// Sends pending messages and unbinds server sockets
     ~Publisher();
 
+    /// Sets high-water mark and drop policy of a topic
+    /// \param topic 	topic name ("": messages without topic)
+    /// \param highWaterMark 	maximum number of messages waiting to be sent on this topic
+    /// \param policy 	what to do when this limit is reached
+    void setTopic(const std::string &topic, size_t highWaterMark, DropPolicy policy);
+
+    /// Number of messages dropped on a topic since creation
+    uint64_t getDropped(const std::string &topic);
+
     /// Sends blob message to WebSocket server
     /// \param message 	message body
-    /// \return 	success
+    /// \return 	success (false if dropped)
     bool publish(const std::string &message);
-  
+
+    /// Sends blob message to WebSocket server, without copy
+    /// \param message 	message body, moved to publisher
+    /// \return 	success (false if dropped)
+    bool publish(std::string &&message);
+
     /// Sends JSON-encoded message to WebSocket server
     /// \param message 	key-value message
-    /// \return 	success
+    /// \return 	success (false if dropped)
     bool publish(const boost::property_tree::ptree &message);
+
+    /// Sends blob message on a topic
+    /// \param topic 	topic name, sent as first frame
+    /// \param message 	message body
+    /// \return 	success (false if dropped)
+    bool publish(const std::string &topic, const std::string &message);
+
+    /// Sends blob message on a topic, without copy
+    /// \param topic 	topic name, sent as first frame
+    /// \param message 	message body, moved to publisher
+    /// \return 	success (false if dropped)
+    bool publish(const std::string &topic, std::string &&message);
+
+    /// Sends JSON-encoded message on a topic
+    /// \param topic 	topic name, sent as first frame
+    /// \param message 	key-value message
+    /// \return 	success (false if dropped)
+    bool publish(const std::string &topic, const boost::property_tree::ptree &message);
 };
 } // namespace Monitoring
 } // namespace AliceO2
@@ -11,6 +11,8 @@
 #include <thread>
 #include <queue>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <map>
 #include "zmq.hpp"
 
@@ -25,6 +27,7 @@ namespace GUI
 /// Receives requests (in new thread) from client side and stores them in queue.
 /// User binds callback functions to messages names
 /// User decides when to obtain messages from the queue; callbacks are executed in his context
+/// The receiving thread waits on the socket and on a shutdown pipe (zmq_poll), and acknowledges each request as soon as received.
 class RequestNotifier
 {
   private:
@@ -46,21 +49,28 @@ class RequestNotifier
     /// flag that indicates whether queue is empty or not
     std::atomic<bool> queueNotEmpty;
 
-    /// mutex that protects queue
+    /// mutex that protects queue (not held while callbacks run)
     std::mutex queueMutex;
 
+    /// signaled when a message is queued
+    std::condition_variable queueCondition;
+
     /// dedicated thread where ZeroMQ is runnig at
     std::thread mZeromqThread;
 
     /// States whether zeromq thread is running
     std::atomic<bool> mThreadRunning;
 
+    /// pipe written by destructor to wake up zeromq thread
+    int mShutdownPipe[2];
+
     /// ZeroMQ thread loop
     void zeromqLoop();
 
-    /// Receives data from ZeroMQ socket
-    /// \return received data
-    std::string receiveData();
+    /// Receives data from ZeroMQ socket, if any
+    /// \param data 	received data
+    /// \return 	false if nothing to receive
+    bool receiveData(std::string &data);
 
     /// Sends acknowledgement - data received
     void notifyReceived();
@@ -80,11 +90,16 @@ class RequestNotifier
     /// \param callback callback function that receives as parameter pointer to ptree (user needs to be aware of message structure)
     void bind(std::string name, std::function<void(std::unique_ptr<boost::property_tree::ptree>)> callback);
 
-    /// disconnects sockets
+    /// stops zeromq thread and disconnects sockets
     ~RequestNotifier();
 
     /// checks whether there are new messages, if so invokes apropriate callbacks
     void processRequests();
+
+    /// waits until there are new messages, or timeout
+    /// \param timeout 	maximum time to wait
+    /// \return 	true if there are new messages to process
+    bool waitForRequests(std::chrono::milliseconds timeout);
 };
 
 } // namespace Monitoring
@@ -0,0 +1,143 @@
+///
+/// \file SnapshotChannel.h
+///
+
+#ifndef ALICEO2_GUI_SNAPSHOTCHANNEL_H
+#define ALICEO2_GUI_SNAPSHOTCHANNEL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "GUI/JsonWriter.h"
+#include "GUI/Publisher.h"
+#include "GUI/RequestNotifier.h"
+
+namespace AliceO2
+{
+/// ALICE O2 Monitoring system
+namespace GUI
+{
+
+/// Publishes the state of many objects (e.g. modules shown in a dashboard) as a periodic full snapshot,
+/// and in between as deltas listing only fields changed. Each message has a sequence number, incremented by one
+/// for each message of the channel: a client seeing a gap requests a snapshot through RequestNotifier.
+///
+/// Messages (JSON, on the channel topic):
+///   {"name":"<topic>","type":"snapshot","seq":N,"objects":{"<object>":{"<field>":value,...},...}}
+///   {"name":"<topic>","type":"delta","seq":N,"changed":{"<object>":{"<field>":value,...},...},"removed":["<object>",...]}
+/// A delta applies to the state of message N-1: objects removed first, then fields changed. Nothing is sent when nothing changed.
+/// Snapshot request (to RequestNotifier): {"name":"<requestName>"}
+class SnapshotChannel
+{
+  private:
+    /// where messages are published
+    Publisher &mPublisher;
+
+    /// topic of channel messages
+    std::string mTopic;
+
+    /// current state: JSON-encoded values, by object and field
+    std::map<std::string, std::map<std::string, std::string>> mObjects;
+
+    /// fields changed since last message, by object
+    std::map<std::string, std::set<std::string>> mChanged;
+
+    /// objects removed since last message
+    std::set<std::string> mRemoved;
+
+    /// encoder of values set
+    JsonWriter mValue;
+
+    /// sequence number of last message
+    uint64_t mSequence;
+
+    /// deltas sent since last snapshot
+    int mDeltasSinceSnapshot;
+
+    /// a snapshot is sent every mSnapshotInterval messages
+    int mSnapshotInterval;
+
+    /// set when a client requested a snapshot
+    bool mSnapshotRequested;
+
+    /// time of last message
+    std::chrono::steady_clock::time_point mLastMessage;
+
+    /// mutex that protects state
+    std::mutex mStateMutex;
+
+    /// serializes publication (sequence numbers sent in order)
+    std::mutex mPublishMutex;
+
+    /// time between messages, in microseconds
+    std::atomic<long> mPeriod;
+
+    /// signaled on snapshot request, or on shutdown
+    std::condition_variable mCondition;
+
+    /// dedicated thread publishing messages
+    std::thread mPublishThread;
+
+    /// States whether thread should keep running
+    bool mThreadRunning;
+
+    /// Thread loop
+    void publishLoop();
+
+    /// records new encoded value of a field
+    void setEncoded(const std::string &object, const std::string &field, const std::string &json);
+
+    /// writes current state, or changes, as message
+    void writeSnapshot(JsonWriter &json);
+    void writeDelta(JsonWriter &json);
+  public:
+    /// Starts publishing
+    /// \param publisher 	publisher used to send messages (must exist as long as channel)
+    /// \param topic 	topic of channel messages
+    /// \param messagesPerSecond 	maximum rate of messages (deltas are accumulated in between)
+    /// \param snapshotInterval 	a full snapshot is sent every snapshotInterval messages
+    SnapshotChannel(Publisher &publisher, const std::string &topic, double messagesPerSecond = 10, int snapshotInterval = 100);
+
+    /// Stops publishing
+    ~SnapshotChannel();
+
+    /// Serves snapshot requests received with given name
+    /// \param notifier 	where requests arrive (callback executed in RequestNotifier::processRequests)
+    /// \param requestName 	request name, e.g. "snapshot"
+    void bind(RequestNotifier &notifier, const std::string &requestName);
+
+    /// Sets a field of an object. Published in next delta if value changed.
+    void set(const std::string &object, const std::string &field, const std::string &value);
+    void set(const std::string &object, const std::string &field, const char *value);
+    void set(const std::string &object, const std::string &field, int value);
+    void set(const std::string &object, const std::string &field, long long value);
+    void set(const std::string &object, const std::string &field, double value);
+    void set(const std::string &object, const std::string &field, bool value);
+
+    /// Sets a field of an object with an already JSON-encoded value
+    void setRaw(const std::string &object, const std::string &field, const std::string &json);
+
+    /// Removes an object and all its fields
+    void remove(const std::string &object);
+
+    /// Requests a full snapshot as next message (e.g. new client connected).
+    /// Served at once, unless a message was sent less than a period ago: requests can not exceed the channel rate.
+    void requestSnapshot();
+
+    /// Publishes changes (or snapshot, when due) now
+    void publish();
+
+    /// Sequence number of last message published
+    uint64_t getSequence();
+};
+
+} // namespace GUI
+} // namespace AliceO2
+
+#endif // ALICEO2_GUI_SNAPSHOTCHANNEL_H
@@ -0,0 +1,139 @@
+///
+/// \file Coalescer.cxx
+///
+
+#include "GUI/Coalescer.h"
+#include "GUI/JsonWriter.h"
+
+#include <chrono>
+
+/// ALICE O2
+namespace AliceO2
+{
+/// ALICE O2 GUI
+namespace GUI
+{
+
+Coalescer::Coalescer(Publisher &publisher, double framesPerSecond, Mode mode):
+  mPublisher(publisher),
+  mMode(mode),
+  mDropped(0),
+  mPublished(0),
+  mThreadRunning(true)
+{
+  mFramePeriod = 1000000;
+  setFrameRate(framesPerSecond);
+  mFlushThread = std::thread(&Coalescer::flushLoop, this);
+}
+
+Coalescer::~Coalescer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mPendingMutex);
+    mThreadRunning = false;
+  }
+  mCondition.notify_one();
+  if (mFlushThread.joinable()) {
+    mFlushThread.join();
+  }
+  flush();
+}
+
+void Coalescer::setFrameRate(double framesPerSecond)
+{
+  if (framesPerSecond <= 0) {
+    return;
+  }
+  mFramePeriod = (long)(1000000 / framesPerSecond);
+}
+
+void Coalescer::update(const std::string &key, std::string &&message, const std::string &topic)
+{
+  std::lock_guard<std::mutex> lock(mPendingMutex);
+  std::map<std::string, std::string> &keys = mPending[topic];
+  auto search = keys.find(key);
+  if (search != keys.end()) {
+    // previous message not published yet: replaced
+    search->second = std::move(message);
+    mDropped++;
+  } else {
+    keys.insert(std::make_pair(key, std::move(message)));
+  }
+}
+
+void Coalescer::update(const std::string &key, const std::string &message, const std::string &topic)
+{
+  update(key, std::string(message), topic);
+}
+
+void Coalescer::flush()
+{
+  std::lock_guard<std::mutex> flushLock(mFlushMutex);
+
+  // take pending messages, so that producers are not blocked while publishing
+  std::map<std::string, std::map<std::string, std::string>> frame;
+  {
+    std::lock_guard<std::mutex> lock(mPendingMutex);
+    frame.swap(mPending);
+  }
+
+  for (auto &topic : frame) {
+    if (mMode == Mode::Snapshot) {
+      JsonWriter json(256);
+      json.beginObject();
+      for (auto &k : topic.second) {
+        json.key(k.first).raw(k.second);
+      }
+      json.endObject();
+      if (mPublisher.publish(topic.first, json.release())) {
+        mPublished++;
+      } else {
+        mDropped += topic.second.size();
+      }
+      continue;
+    }
+    for (auto &k : topic.second) {
+      if (mPublisher.publish(topic.first, std::move(k.second))) {
+        mPublished++;
+      } else {
+        mDropped++;
+      }
+    }
+  }
+}
+
+void Coalescer::flushLoop()
+{
+  auto nextFrame = std::chrono::steady_clock::now();
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mPendingMutex);
+      nextFrame += std::chrono::microseconds(mFramePeriod);
+      auto now = std::chrono::steady_clock::now();
+      if (nextFrame < now) {
+        // late (e.g. long flush): do not try to catch up
+        nextFrame = now;
+      }
+      mCondition.wait_until(lock, nextFrame, [this, &nextFrame] {
+        return (!mThreadRunning) || (std::chrono::steady_clock::now() >= nextFrame);
+      });
+      if (!mThreadRunning) {
+        break;
+      }
+    }
+    flush();
+  }
+}
+
+uint64_t Coalescer::getDropped()
+{
+  return mDropped;
+}
+
+uint64_t Coalescer::getPublished()
+{
+  return mPublished;
+}
+
+} // namespace GUI
+} // namespace AliceO2
@@ -0,0 +1,309 @@
+///
+/// \file JsonWriter.cxx
+///
+
+#include "GUI/JsonWriter.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/// ALICE O2
+namespace AliceO2
+{
+/// ALICE O2 GUI
+namespace GUI
+{
+
+JsonWriter::JsonWriter(size_t capacity):
+  mAfterKey(false)
+{
+  mBuffer.reserve(capacity);
+  mHasElements.reserve(16);
+}
+
+void JsonWriter::clear()
+{
+  mBuffer.clear();
+  mHasElements.clear();
+  mAfterKey = false;
+}
+
+void JsonWriter::separate()
+{
+  if (mAfterKey) {
+    mAfterKey = false;
+    return;
+  }
+  if (!mHasElements.empty()) {
+    if (mHasElements.back()) {
+      mBuffer.push_back(',');
+    }
+    mHasElements.back() = true;
+  }
+}
+
+void JsonWriter::appendString(const char *s, size_t length)
+{
+  static const char hex[] = "0123456789abcdef";
+  mBuffer.push_back('"');
+  size_t start = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = s[i];
+    if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+      continue;
+    }
+    // copy characters not needing escape in one go
+    mBuffer.append(s + start, i - start);
+    start = i + 1;
+    switch (c) {
+      case '"': mBuffer.append("\\\""); break;
+      case '\\': mBuffer.append("\\\\"); break;
+      case '\b': mBuffer.append("\\b"); break;
+      case '\f': mBuffer.append("\\f"); break;
+      case '\n': mBuffer.append("\\n"); break;
+      case '\r': mBuffer.append("\\r"); break;
+      case '\t': mBuffer.append("\\t"); break;
+      default:
+        mBuffer.append("\\u00");
+        mBuffer.push_back(hex[c >> 4]);
+        mBuffer.push_back(hex[c & 0xF]);
+    }
+  }
+  mBuffer.append(s + start, length - start);
+  mBuffer.push_back('"');
+}
+
+void JsonWriter::appendUnsigned(unsigned long long v)
+{
+  char digits[20];
+  int n = sizeof(digits);
+  do {
+    digits[--n] = '0' + (v % 10);
+    v /= 10;
+  } while (v);
+  mBuffer.append(digits + n, sizeof(digits) - n);
+}
+
+JsonWriter &JsonWriter::beginObject()
+{
+  separate();
+  mBuffer.push_back('{');
+  mHasElements.push_back(false);
+  return *this;
+}
+
+JsonWriter &JsonWriter::endObject()
+{
+  mBuffer.push_back('}');
+  if (!mHasElements.empty()) {
+    mHasElements.pop_back();
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::beginArray()
+{
+  separate();
+  mBuffer.push_back('[');
+  mHasElements.push_back(false);
+  return *this;
+}
+
+JsonWriter &JsonWriter::endArray()
+{
+  mBuffer.push_back(']');
+  if (!mHasElements.empty()) {
+    mHasElements.pop_back();
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::key(const char *name)
+{
+  separate();
+  appendString(name, strlen(name));
+  mBuffer.push_back(':');
+  mAfterKey = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::key(const std::string &name)
+{
+  separate();
+  appendString(name.data(), name.size());
+  mBuffer.push_back(':');
+  mAfterKey = true;
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(const char *s)
+{
+  if (s == nullptr) {
+    return null();
+  }
+  separate();
+  appendString(s, strlen(s));
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(const std::string &s)
+{
+  separate();
+  appendString(s.data(), s.size());
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(bool b)
+{
+  separate();
+  mBuffer.append(b ? "true" : "false");
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(int v)
+{
+  return value((long long)v);
+}
+
+JsonWriter &JsonWriter::value(long v)
+{
+  return value((long long)v);
+}
+
+JsonWriter &JsonWriter::value(long long v)
+{
+  separate();
+  if (v < 0) {
+    mBuffer.push_back('-');
+    // negate as unsigned, valid for the minimum value too
+    appendUnsigned(0ULL - (unsigned long long)v);
+  } else {
+    appendUnsigned(v);
+  }
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(unsigned int v)
+{
+  return value((unsigned long long)v);
+}
+
+JsonWriter &JsonWriter::value(unsigned long v)
+{
+  return value((unsigned long long)v);
+}
+
+JsonWriter &JsonWriter::value(unsigned long long v)
+{
+  separate();
+  appendUnsigned(v);
+  return *this;
+}
+
+JsonWriter &JsonWriter::value(double v)
+{
+  if (!std::isfinite(v)) {
+    return null();
+  }
+  separate();
+  // integral values (e.g. counters stored as double) written without printf
+  if ((v == std::floor(v)) && (std::fabs(v) < 9007199254740992.0)) {
+    if (v < 0) {
+      mBuffer.push_back('-');
+    }
+    appendUnsigned((unsigned long long)std::fabs(v));
+    return *this;
+  }
+  // shortest of 15 or 17 significant digits reading back to the same value
+  char s[32];
+  int n = snprintf(s, sizeof(s), "%.15g", v);
+  if (strtod(s, nullptr) != v) {
+    n = snprintf(s, sizeof(s), "%.17g", v);
+  }
+  for (int i = 0; i < n; i++) {
+    // decimal separator of current locale
+    if (s[i] == ',') {
+      s[i] = '.';
+    }
+  }
+  mBuffer.append(s, n);
+  return *this;
+}
+
+JsonWriter &JsonWriter::null()
+{
+  separate();
+  mBuffer.append("null");
+  return *this;
+}
+
+void JsonWriter::appendTree(const boost::property_tree::ptree &tree)
+{
+  if (tree.empty()) {
+    appendString(tree.data().data(), tree.data().size());
+    return;
+  }
+  // children without names make an array
+  bool isArray = true;
+  for (const auto &child : tree) {
+    if (!child.first.empty()) {
+      isArray = false;
+      break;
+    }
+  }
+  mBuffer.push_back(isArray ? '[' : '{');
+  bool first = true;
+  for (const auto &child : tree) {
+    if (!first) {
+      mBuffer.push_back(',');
+    }
+    first = false;
+    if (!isArray) {
+      appendString(child.first.data(), child.first.size());
+      mBuffer.push_back(':');
+    }
+    appendTree(child.second);
+  }
+  mBuffer.push_back(isArray ? ']' : '}');
+}
+
+JsonWriter &JsonWriter::value(const boost::property_tree::ptree &tree)
+{
+  separate();
+  appendTree(tree);
+  return *this;
+}
+
+JsonWriter &JsonWriter::raw(const std::string &json)
+{
+  separate();
+  mBuffer.append(json);
+  return *this;
+}
+
+const std::string &JsonWriter::str() const
+{
+  return mBuffer;
+}
+
+const char *JsonWriter::data() const
+{
+  return mBuffer.data();
+}
+
+size_t JsonWriter::size() const
+{
+  return mBuffer.size();
+}
+
+std::string JsonWriter::release()
+{
+  std::string message = std::move(mBuffer);
+  clear();
+  return message;
+}
+
+} // namespace GUI
+} // namespace AliceO2
@@ -4,12 +4,11 @@
 ///
 
 #include "GUI/Publisher.h"
+#include "GUI/JsonWriter.h"
 #include "GuiInfoLogger.h"
 
 #include <iostream>
-#include <sstream>
-
-#include <boost/property_tree/json_parser.hpp>
+#include <vector>
 
 /// ALICE O2
 namespace AliceO2
@@ -18,10 +17,20 @@ namespace AliceO2
 namespace GUI
 {
 
+/// Releases a message buffer once ZeroMQ has sent it
+static void freeMessage(void *, void *hint)
+{
+  delete static_cast<std::string*>(hint);
+}
+
 Publisher::Publisher(const std::string &_url):
   context(1),
   socket(context, ZMQ_PUB),
-  url(_url)
+  url(_url),
+  mDefaultHighWaterMark(1000),
+  mDefaultPolicy(DropPolicy::DropNewest),
+  mPending(0),
+  mThreadRunning(true)
 {
   try {
     socket.bind(url.c_str());
@@ -29,28 +38,136 @@ Publisher::Publisher(const std::string &_url):
     GuiInfoLogger::GetInstance() << "GUI Publisher : Cannot bind socket: " << url << AliceO2::InfoLogger::InfoLogger::endm;
   }
   GuiInfoLogger::GetInstance() << "GUI Publisher : Socket bound: " << url << AliceO2::InfoLogger::InfoLogger::endm;
+  mSenderThread = std::thread(&Publisher::senderLoop, this);
 }
 
 Publisher::~Publisher()
 {
+  {
+    std::lock_guard<std::mutex> lock(mTopicsMutex);
+    mThreadRunning = false;
+  }
+  mTopicsCondition.notify_one();
+  if (mSenderThread.joinable()) {
+    mSenderThread.join();
+  }
   socket.unbind(url.c_str());
 }
 
-bool Publisher::publish(const std::string &message)
+void Publisher::setTopic(const std::string &topic, size_t highWaterMark, DropPolicy policy)
+{
+  std::lock_guard<std::mutex> lock(mTopicsMutex);
+  Topic &t = mTopics[topic];
+  t.highWaterMark = highWaterMark;
+  t.policy = policy;
+}
+
+uint64_t Publisher::getDropped(const std::string &topic)
+{
+  std::lock_guard<std::mutex> lock(mTopicsMutex);
+  auto search = mTopics.find(topic);
+  if (search == mTopics.end()) {
+    return 0;
+  }
+  return search->second.dropped;
+}
+
+bool Publisher::enqueue(const std::string &topic, std::string &&message)
+{
+  {
+    std::lock_guard<std::mutex> lock(mTopicsMutex);
+    auto search = mTopics.find(topic);
+    if (search == mTopics.end()) {
+      search = mTopics.insert(std::make_pair(topic, Topic{{}, mDefaultHighWaterMark, mDefaultPolicy, 0})).first;
+    }
+    Topic &t = search->second;
+    if (t.messages.size() >= t.highWaterMark) {
+      t.dropped++;
+      if ((t.policy == DropPolicy::DropNewest) || (t.messages.empty())) {
+        return false;
+      }
+      t.messages.pop_front();
+      mPending--;
+    }
+    t.messages.push_back(std::move(message));
+    mPending++;
+  }
+  mTopicsCondition.notify_one();
+  return true;
+}
+
+void Publisher::send(const std::string &topic, std::string &&message)
+{
+  // buffer is owned by ZeroMQ until sent
+  std::string *buffer = new std::string(std::move(message));
+  zmq::message_t zmqMessage(&(*buffer)[0], buffer->size(), freeMessage, buffer);
+  try {
+    // always two frames (topic, possibly empty, then body): subscribers parse all messages the same way
+    zmq::message_t zmqTopic(topic.data(), topic.size());
+    socket.send(zmqTopic, ZMQ_SNDMORE);
+    socket.send(zmqMessage);
+  } catch (std::exception &e) {
+    GuiInfoLogger::GetInstance() << "GUI Publisher : Cannot send message: " << e.what() << AliceO2::InfoLogger::InfoLogger::endm;
+  }
+}
+
+void Publisher::senderLoop()
 {
-  zmq::message_t zmqMessage(message.size());
-  memcpy(zmqMessage.data(), message.data(), message.size());
-  if (socket.send(zmqMessage)) {
-    return true;
+  std::vector<std::pair<const std::string*, std::string>> batch;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mTopicsMutex);
+      mTopicsCondition.wait(lock, [this] { return (mPending > 0) || (!mThreadRunning); });
+      if ((mPending == 0) && (!mThreadRunning)) {
+        break;
+      }
+      // one message of each topic, so that a busy topic does not delay the others.
+      // topics are never removed from the map, name pointers stay valid.
+      for (auto &t : mTopics) {
+        if (!t.second.messages.empty()) {
+          batch.push_back(std::make_pair(&t.first, std::move(t.second.messages.front())));
+          t.second.messages.pop_front();
+          mPending--;
+        }
+      }
+    }
+    for (auto &m : batch) {
+      send(*m.first, std::move(m.second));
+    }
+    batch.clear();
   }
-  return false;
+}
+
+bool Publisher::publish(const std::string &message)
+{
+  return enqueue("", std::string(message));
+}
+
+bool Publisher::publish(std::string &&message)
+{
+  return enqueue("", std::move(message));
 }
 
 bool Publisher::publish(const boost::property_tree::ptree &message)
 {
-  std::ostringstream buffer;
-  boost::property_tree::write_json(buffer, message, false);
-  return publish(buffer.str());
+  return publish("", message);
+}
+
+bool Publisher::publish(const std::string &topic, const std::string &message)
+{
+  return enqueue(topic, std::string(message));
+}
+
+bool Publisher::publish(const std::string &topic, std::string &&message)
+{
+  return enqueue(topic, std::move(message));
+}
+
+bool Publisher::publish(const std::string &topic, const boost::property_tree::ptree &message)
+{
+  JsonWriter json(256);
+  json.value(message);
+  return enqueue(topic, json.release());
 }
 
 } // namespace GUI
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <sstream>
 #include <chrono>
+#include <unistd.h>
 
 //#include <boost/property_tree/ptree.hpp>
 //#include <boost/property_tree/json_parser.hpp>
@@ -26,6 +27,12 @@ RequestNotifier::RequestNotifier(const std::string &_url):
   }
   GuiInfoLogger::GetInstance() << "GUI RequestNotifier : Socket bound: " << url << AliceO2::InfoLogger::InfoLogger::endm;
 
+  if (pipe(mShutdownPipe)) {
+    GuiInfoLogger::GetInstance() << "GUI RequestNotifier : Cannot create pipe, shutdown will be delayed" << AliceO2::InfoLogger::InfoLogger::endm;
+    mShutdownPipe[0] = -1;
+    mShutdownPipe[1] = -1;
+  }
+
   queueNotEmpty = false;
   mThreadRunning = true;
   mZeromqThread = std::thread(&RequestNotifier::zeromqLoop, this);
@@ -34,10 +41,20 @@ RequestNotifier::RequestNotifier(const std::string &_url):
 RequestNotifier::~RequestNotifier()
 {
   mThreadRunning = false;
-  socket.unbind(url.c_str());
+  if (mShutdownPipe[1] >= 0) {
+    char c = 0;
+    if (write(mShutdownPipe[1], &c, 1) != 1) {
+      GuiInfoLogger::GetInstance() << "GUI RequestNotifier : Cannot wake up thread" << AliceO2::InfoLogger::InfoLogger::endm;
+    }
+  }
   if (mZeromqThread.joinable()) {
     mZeromqThread.join();
   }
+  socket.unbind(url.c_str());
+  if (mShutdownPipe[0] >= 0) {
+    close(mShutdownPipe[0]);
+    close(mShutdownPipe[1]);
+  }
 }
 
 void RequestNotifier::bind(std::string name, std::function<void(std::unique_ptr<boost::property_tree::ptree>)> callback)
@@ -47,35 +64,70 @@ void RequestNotifier::bind(std::string name, std::function<void(std::unique_ptr<
 
 void RequestNotifier::processRequests()
 {
-  if (queueNotEmpty) {
+  if (!queueNotEmpty) {
+    return;
+  }
+  // take all queued messages, callbacks are invoked without lock so that zeromq thread is not blocked
+  std::queue<std::pair<std::string, std::unique_ptr<boost::property_tree::ptree>>> received;
+  {
     std::lock_guard<std::mutex> lock(queueMutex);
-    for (;;) {
-       if (queue.empty()) {
-         break;
-       }
-       std::string key = std::get<0>(queue.front());
-       auto search = callbacks.find(key);
-       if(search != callbacks.end()) {
-         search->second(std::move(std::get<1>(queue.front())));
-       }
-       queue.pop();
+    received.swap(queue);
+    queueNotEmpty = false;
+  }
+  while (!received.empty()) {
+    auto search = callbacks.find(received.front().first);
+    if (search != callbacks.end()) {
+      search->second(std::move(received.front().second));
     }
+    received.pop();
   }
-  queueNotEmpty = false;
+}
+
+bool RequestNotifier::waitForRequests(std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(queueMutex);
+  return queueCondition.wait_for(lock, timeout, [this] { return !queue.empty(); });
 }
 
 void RequestNotifier::zeromqLoop()
 {
-  for (;;) {
-    std::string received = receiveData();
-    std::unique_ptr<boost::property_tree::ptree> parsed = std::make_unique<boost::property_tree::ptree>(parseJson(received));
-    notifyReceived();
-    {
-      std::lock_guard<std::mutex> lock(queueMutex);
-      queue.push(std::make_pair(parsed->get<std::string>("name"), std::move(parsed)));
-      queueNotEmpty = true;
+  zmq_pollitem_t items[2];
+  items[0].socket = static_cast<void*>(socket);
+  items[0].fd = 0;
+  items[0].events = ZMQ_POLLIN;
+  items[1].socket = nullptr;
+  items[1].fd = mShutdownPipe[0];
+  items[1].events = ZMQ_POLLIN;
+  int nItems = (mShutdownPipe[0] >= 0) ? 2 : 1;
+  // without shutdown pipe, check periodically if thread should stop
+  long timeout = (mShutdownPipe[0] >= 0) ? -1 : 100;
+
+  while (mThreadRunning) {
+    items[0].revents = 0;
+    items[1].revents = 0;
+    if (zmq_poll(items, nItems, timeout) < 0) {
+      if (zmq_errno() == EINTR) {
+        continue;
+      }
+      GuiInfoLogger::GetInstance() << "GUI RequestNotifier : Poll failed: " << zmq_strerror(zmq_errno()) << AliceO2::InfoLogger::InfoLogger::endm;
+      break;
+    }
+    if (items[1].revents & ZMQ_POLLIN) {
+      break;
+    }
+    std::string received;
+    while (receiveData(received)) {
+      // reply first (REP socket), client does not wait for parsing
+      notifyReceived();
+      std::unique_ptr<boost::property_tree::ptree> parsed = std::make_unique<boost::property_tree::ptree>(parseJson(received));
+      std::string name = parsed->get<std::string>("name", "");
+      {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push(std::make_pair(name, std::move(parsed)));
+        queueNotEmpty = true;
+      }
+      queueCondition.notify_all();
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
   }
 }
 
@@ -92,10 +144,18 @@ boost::property_tree::ptree RequestNotifier::parseJson(std::string json) {
   return parsed;
 }
 
-std::string RequestNotifier::receiveData() {
+bool RequestNotifier::receiveData(std::string &data) {
   zmq::message_t request;
-  socket.recv(&request); /// loop blocks in here!!!
-  return std::string(static_cast<char*>(request.data()), request.size());
+  try {
+    if (!socket.recv(&request, ZMQ_DONTWAIT)) {
+      return false;
+    }
+  } catch (zmq::error_t &e) {
+    GuiInfoLogger::GetInstance() << "GUI RequestNotifier : Cannot receive: " << e.what() << AliceO2::InfoLogger::InfoLogger::endm;
+    return false;
+  }
+  data.assign(static_cast<char*>(request.data()), request.size());
+  return true;
 }
 
 void RequestNotifier::notifyReceived()
@@ -103,7 +163,11 @@ void RequestNotifier::notifyReceived()
   std::string message = "{\"received\": true }";
   zmq::message_t reply (message.size());
   memcpy (reply.data(), message.data(), message.size());
-  socket.send (reply);
+  try {
+    socket.send (reply);
+  } catch (zmq::error_t &e) {
+    GuiInfoLogger::GetInstance() << "GUI RequestNotifier : Cannot reply: " << e.what() << AliceO2::InfoLogger::InfoLogger::endm;
+  }
 }
 
 }
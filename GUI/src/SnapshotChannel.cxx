@@ -0,0 +1,231 @@
+///
+/// \file SnapshotChannel.cxx
+///
+
+#include "GUI/SnapshotChannel.h"
+
+/// ALICE O2
+namespace AliceO2
+{
+/// ALICE O2 GUI
+namespace GUI
+{
+
+SnapshotChannel::SnapshotChannel(Publisher &publisher, const std::string &topic, double messagesPerSecond, int snapshotInterval):
+  mPublisher(publisher),
+  mTopic(topic),
+  mValue(64),
+  mSequence(0),
+  mDeltasSinceSnapshot(0),
+  mSnapshotInterval(snapshotInterval),
+  mThreadRunning(true)
+{
+  // first message is a snapshot
+  mSnapshotRequested = true;
+  mPeriod = (messagesPerSecond > 0) ? (long)(1000000 / messagesPerSecond) : 100000;
+  mPublishThread = std::thread(&SnapshotChannel::publishLoop, this);
+}
+
+SnapshotChannel::~SnapshotChannel()
+{
+  {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    mThreadRunning = false;
+  }
+  mCondition.notify_one();
+  if (mPublishThread.joinable()) {
+    mPublishThread.join();
+  }
+}
+
+void SnapshotChannel::bind(RequestNotifier &notifier, const std::string &requestName)
+{
+  notifier.bind(requestName, [this](std::unique_ptr<boost::property_tree::ptree>) {
+    requestSnapshot();
+  });
+}
+
+void SnapshotChannel::setEncoded(const std::string &object, const std::string &field, const std::string &json)
+{
+  std::string &value = mObjects[object][field];
+  if (value == json) {
+    return;
+  }
+  value = json;
+  // if object was removed in this period, it stays in removed list: client drops old fields first
+  mChanged[object].insert(field);
+}
+
+void SnapshotChannel::setRaw(const std::string &object, const std::string &field, const std::string &json)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  setEncoded(object, field, json);
+}
+
+void SnapshotChannel::set(const std::string &object, const std::string &field, const std::string &value)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  mValue.clear();
+  mValue.value(value);
+  setEncoded(object, field, mValue.str());
+}
+
+void SnapshotChannel::set(const std::string &object, const std::string &field, const char *value)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  mValue.clear();
+  mValue.value(value);
+  setEncoded(object, field, mValue.str());
+}
+
+void SnapshotChannel::set(const std::string &object, const std::string &field, int value)
+{
+  set(object, field, (long long)value);
+}
+
+void SnapshotChannel::set(const std::string &object, const std::string &field, long long value)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  mValue.clear();
+  mValue.value(value);
+  setEncoded(object, field, mValue.str());
+}
+
+void SnapshotChannel::set(const std::string &object, const std::string &field, double value)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  mValue.clear();
+  mValue.value(value);
+  setEncoded(object, field, mValue.str());
+}
+
+void SnapshotChannel::set(const std::string &object, const std::string &field, bool value)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  mValue.clear();
+  mValue.value(value);
+  setEncoded(object, field, mValue.str());
+}
+
+void SnapshotChannel::remove(const std::string &object)
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  if (mObjects.erase(object)) {
+    mChanged.erase(object);
+    mRemoved.insert(object);
+  }
+}
+
+void SnapshotChannel::requestSnapshot()
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  mSnapshotRequested = true;
+  mCondition.notify_one();
+}
+
+uint64_t SnapshotChannel::getSequence()
+{
+  std::lock_guard<std::mutex> lock(mStateMutex);
+  return mSequence;
+}
+
+void SnapshotChannel::writeSnapshot(JsonWriter &json)
+{
+  json.beginObject();
+  json.key("name").value(mTopic);
+  json.key("type").value("snapshot");
+  json.key("seq").value((unsigned long long)mSequence);
+  json.key("objects").beginObject();
+  for (const auto &object : mObjects) {
+    json.key(object.first).beginObject();
+    for (const auto &field : object.second) {
+      json.key(field.first).raw(field.second);
+    }
+    json.endObject();
+  }
+  json.endObject();
+  json.endObject();
+}
+
+void SnapshotChannel::writeDelta(JsonWriter &json)
+{
+  json.beginObject();
+  json.key("name").value(mTopic);
+  json.key("type").value("delta");
+  json.key("seq").value((unsigned long long)mSequence);
+  json.key("changed").beginObject();
+  for (const auto &object : mChanged) {
+    const std::map<std::string, std::string> &fields = mObjects[object.first];
+    json.key(object.first).beginObject();
+    for (const auto &field : object.second) {
+      json.key(field).raw(fields.at(field));
+    }
+    json.endObject();
+  }
+  json.endObject();
+  json.key("removed").beginArray();
+  for (const auto &object : mRemoved) {
+    json.value(object);
+  }
+  json.endArray();
+  json.endObject();
+}
+
+void SnapshotChannel::publish()
+{
+  std::lock_guard<std::mutex> publishLock(mPublishMutex);
+  JsonWriter json(1024);
+  {
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    bool snapshot = mSnapshotRequested || (mDeltasSinceSnapshot + 1 >= mSnapshotInterval);
+    if ((!snapshot) && (mChanged.empty()) && (mRemoved.empty())) {
+      return;
+    }
+    mSnapshotRequested = false;
+    mLastMessage = std::chrono::steady_clock::now();
+    mSequence++;
+    if (snapshot) {
+      writeSnapshot(json);
+      mDeltasSinceSnapshot = 0;
+    } else {
+      writeDelta(json);
+      mDeltasSinceSnapshot++;
+    }
+    mChanged.clear();
+    mRemoved.clear();
+  }
+  // a message dropped by publisher shows as a gap on client side, which then requests a snapshot
+  mPublisher.publish(mTopic, json.release());
+}
+
+void SnapshotChannel::publishLoop()
+{
+  auto nextMessage = std::chrono::steady_clock::now();
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mStateMutex);
+      std::chrono::microseconds period(mPeriod);
+      nextMessage += period;
+      if (nextMessage < mLastMessage + period) {
+        // a snapshot was served early
+        nextMessage = mLastMessage + period;
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (nextMessage < now) {
+        nextMessage = now;
+      }
+      // snapshot requests are served without waiting end of period, if last message is older than a period
+      mCondition.wait_until(lock, nextMessage, [this, &nextMessage, period] {
+        auto now = std::chrono::steady_clock::now();
+        return (!mThreadRunning) || (now >= nextMessage) || ((mSnapshotRequested) && (now >= mLastMessage + period));
+      });
+      if (!mThreadRunning) {
+        break;
+      }
+    }
+    publish();
+  }
+}
+
+} // namespace GUI
+} // namespace AliceO2
@@ -0,0 +1,139 @@
+///
+/// \file benchmarkJsonWriter.cxx
+///
+/// Compares the cost of encoding a status message in JSON with:
+/// - boost::property_tree and write_json (as Publisher did before JsonWriter)
+/// - JsonWriter from the same ptree
+/// - JsonWriter directly, reusing its buffer
+/// Results (nanoseconds per message) are written in JSON format.
+///
+/// usage: benchmarkJsonWriter [-n messages] [-f fields]
+///
+
+#include "GUI/JsonWriter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include <boost/property_tree/json_parser.hpp>
+
+using namespace AliceO2::GUI;
+
+/// status message of a widget, as published at high rate
+static const char *stateNames[] = {"RUNNING", "READY", "STOPPED", "ERROR \"x\""};
+
+static void fillTree(boost::property_tree::ptree &tree, int iteration, int nFields)
+{
+  tree.put("name", "status");
+  tree.put("iteration", iteration);
+  for (int i = 0; i < nFields; i++) {
+    std::string key = "module" + std::to_string(i);
+    tree.put(key + ".state", stateNames[(iteration + i) % 4]);
+    tree.put(key + ".events", 1000000LL * i + iteration);
+    tree.put(key + ".rate", 0.5 * i + iteration);
+  }
+}
+
+static void fillWriter(JsonWriter &json, int iteration, int nFields)
+{
+  json.beginObject();
+  json.key("name").value("status");
+  json.key("iteration").value(iteration);
+  for (int i = 0; i < nFields; i++) {
+    json.key("module" + std::to_string(i)).beginObject();
+    json.key("state").value(stateNames[(iteration + i) % 4]);
+    json.key("events").value(1000000LL * i + iteration);
+    json.key("rate").value(0.5 * i + iteration);
+    json.endObject();
+  }
+  json.endObject();
+}
+
+int main(int argc, char *argv[])
+{
+  int nMessages = 100000;
+  int nFields = 10;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:")) != -1) {
+    switch (opt) {
+      case 'n': nMessages = atoi(optarg); break;
+      case 'f': nFields = atoi(optarg); break;
+      default:
+        std::cout << "usage: " << argv[0] << " [-n messages] [-f fields]" << std::endl;
+        return 1;
+    }
+  }
+  if ((nMessages <= 0) || (nFields < 0)) {
+    std::cout << "wrong parameters" << std::endl;
+    return 1;
+  }
+
+  size_t totalSize = 0; // keeps results used
+  bool identical = true;
+
+  // ptree and write_json, new stream for each message
+  auto t0 = std::chrono::steady_clock::now();
+  for (int k = 0; k < nMessages; k++) {
+    boost::property_tree::ptree tree;
+    fillTree(tree, k, nFields);
+    std::ostringstream buffer;
+    boost::property_tree::write_json(buffer, tree, false);
+    totalSize += buffer.str().size();
+  }
+
+  // same ptree, encoded with JsonWriter
+  auto t1 = std::chrono::steady_clock::now();
+  JsonWriter json;
+  for (int k = 0; k < nMessages; k++) {
+    boost::property_tree::ptree tree;
+    fillTree(tree, k, nFields);
+    json.clear();
+    json.value(tree);
+    totalSize += json.size();
+  }
+
+  // JsonWriter only, buffer reused
+  auto t2 = std::chrono::steady_clock::now();
+  for (int k = 0; k < nMessages; k++) {
+    json.clear();
+    fillWriter(json, k, nFields);
+    totalSize += json.size();
+  }
+  auto t3 = std::chrono::steady_clock::now();
+
+  // both paths give the same document (write_json adds a newline)
+  {
+    boost::property_tree::ptree tree;
+    fillTree(tree, 1, nFields);
+    std::ostringstream buffer;
+    boost::property_tree::write_json(buffer, tree, false);
+    json.clear();
+    json.value(tree);
+    identical = (buffer.str() == json.str() + "\n");
+  }
+
+  auto nsPerMessage = [nMessages](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration<double, std::nano>(b - a).count() / nMessages;
+  };
+
+  printf("{\n");
+  printf("  \"benchmark\": \"jsonWriter\",\n");
+  printf("  \"messages\": %d,\n", nMessages);
+  printf("  \"fields\": %d,\n", nFields);
+  printf("  \"messageBytes\": %d,\n", (int)json.size());
+  printf("  \"identicalOutput\": %s,\n", identical ? "true" : "false");
+  printf("  \"nanosecondsPerMessage\": {\n");
+  printf("    \"ptreeWriteJson\": %.1f,\n", nsPerMessage(t0, t1));
+  printf("    \"ptreeJsonWriter\": %.1f,\n", nsPerMessage(t1, t2));
+  printf("    \"jsonWriter\": %.1f\n", nsPerMessage(t2, t3));
+  printf("  },\n");
+  printf("  \"totalBytes\": %lu\n", (unsigned long)totalSize);
+  printf("}\n");
+  return identical ? 0 : 1;
+}
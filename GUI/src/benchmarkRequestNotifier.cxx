@@ -0,0 +1,136 @@
+///
+/// \file benchmarkRequestNotifier.cxx
+///
+/// Measures request handling latency of RequestNotifier.
+/// A client sends requests one after the other (REQ socket), a user thread waits for them
+/// and processes them as they arrive. For each request, are measured:
+/// - acknowledge latency: from request sent to acknowledge received by client
+/// - callback latency: from request sent to callback invoked
+/// Results (latency percentiles, in microseconds) are written in JSON format.
+///
+/// usage: benchmarkRequestNotifier [-n requests] [-u url]
+///
+
+#include "GUI/RequestNotifier.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace AliceO2::GUI;
+
+// get value at given percentile (0-100) of sorted samples
+static double getPercentile(const std::vector<double> &v, double p)
+{
+  if (v.size() == 0) {
+    return 0;
+  }
+  size_t ix = (size_t)((p / 100.0) * (v.size() - 1) + 0.5);
+  if (ix >= v.size()) {
+    ix = v.size() - 1;
+  }
+  return v[ix];
+}
+
+static double now()
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void printLatencies(const char *name, std::vector<double> &v, bool last)
+{
+  std::sort(v.begin(), v.end());
+  double sum = 0;
+  for (auto l : v) {
+    sum += l;
+  }
+  printf("  \"%s\": {\n", name);
+  printf("    \"mean\": %.1f,\n", (v.size() > 0) ? sum / v.size() : 0);
+  printf("    \"min\": %.1f,\n", getPercentile(v, 0));
+  printf("    \"p50\": %.1f,\n", getPercentile(v, 50));
+  printf("    \"p99\": %.1f,\n", getPercentile(v, 99));
+  printf("    \"max\": %.1f\n", getPercentile(v, 100));
+  printf("  }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char *argv[])
+{
+  int nRequests = 1000;
+  std::string url = "tcp://127.0.0.1:3002";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:u:")) != -1) {
+    switch (opt) {
+      case 'n': nRequests = atoi(optarg); break;
+      case 'u': url = optarg; break;
+      default:
+        printf("usage: %s [-n requests] [-u url]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (nRequests <= 0) {
+    printf("wrong parameters\n");
+    return 1;
+  }
+
+  std::vector<double> ackLatencies;
+  std::vector<double> callbackLatencies;
+  ackLatencies.reserve(nRequests);
+  callbackLatencies.reserve(nRequests);
+  std::atomic<int> nProcessed(0);
+  double t0 = 0;
+  double duration = 0;
+  {
+    RequestNotifier notifier(url);
+    notifier.bind("bench", [&](std::unique_ptr<boost::property_tree::ptree> message) {
+      callbackLatencies.push_back(now() - message->get<double>("sent"));
+      nProcessed++;
+    });
+
+    // user thread, processing requests as soon as they arrive
+    std::atomic<bool> userRunning(true);
+    std::thread user([&] {
+      while (userRunning) {
+        if (notifier.waitForRequests(std::chrono::milliseconds(100))) {
+          notifier.processRequests();
+        }
+      }
+    });
+
+    zmq::context_t context(1);
+    zmq::socket_t client(context, ZMQ_REQ);
+    client.connect(url.c_str());
+    t0 = now();
+    for (int i = 0; i < nRequests; i++) {
+      char request[128];
+      double sent = now();
+      snprintf(request, sizeof(request), "{\"name\":\"bench\",\"sent\":%.3f}", sent);
+      client.send(request, strlen(request));
+      zmq::message_t reply;
+      client.recv(&reply);
+      ackLatencies.push_back(now() - sent);
+    }
+    duration = (now() - t0) / 1000000.0;
+
+    // wait for last callbacks
+    for (int i = 0; (i < 1000) && (nProcessed < nRequests); i++) {
+      usleep(1000);
+    }
+    userRunning = false;
+    user.join();
+  }
+
+  printf("{\n");
+  printf("  \"benchmark\": \"requestNotifier\",\n");
+  printf("  \"requests\": %d,\n", nRequests);
+  printf("  \"processed\": %d,\n", (int)callbackLatencies.size());
+  printf("  \"durationSeconds\": %.6f,\n", duration);
+  printf("  \"requestsPerSecond\": %.1f,\n", (duration > 0) ? nRequests / duration : 0);
+  printLatencies("ackLatencyMicroseconds", ackLatencies, false);
+  printLatencies("callbackLatencyMicroseconds", callbackLatencies, true);
+  printf("}\n");
+  return ((int)callbackLatencies.size() == nRequests) ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+///
+/// \file testJsonWriter.cxx
+///
+
+#include "GUI/JsonWriter.h"
+
+#include <clocale>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+#include <vector>
+#include <boost/property_tree/json_parser.hpp>
+
+#define BOOST_TEST_MODULE JsonWriter test
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using AliceO2::GUI::JsonWriter;
+using boost::property_tree::ptree;
+
+namespace
+{
+
+/// parses writer output with boost::property_tree, as clients of Publisher do
+ptree parse(const JsonWriter &json)
+{
+  std::istringstream s(json.str());
+  ptree tree;
+  boost::property_tree::read_json(s, tree);
+  return tree;
+}
+
+/// writes doubles, and checks they read back to the same values
+void checkDoubles(const std::vector<double> &values)
+{
+  JsonWriter json;
+  json.beginObject().key("values").beginArray();
+  for (double v : values) {
+    json.value(v);
+  }
+  json.endArray().endObject();
+
+  ptree tree = parse(json);
+  const ptree &array = tree.get_child("values");
+  BOOST_REQUIRE_EQUAL(array.size(), values.size());
+  size_t i = 0;
+  for (const auto &child : array) {
+    const std::string &s = child.second.data();
+    BOOST_CHECK_MESSAGE(s.find(',') == std::string::npos, "decimal comma in " << s);
+    BOOST_CHECK_MESSAGE(s.size() <= 24, "too many digits in " << s);
+    // C locale parsing, whatever the current locale
+    std::istringstream is(s);
+    is.imbue(std::locale::classic());
+    double v = 0;
+    is >> v;
+    BOOST_CHECK_MESSAGE(v == values[i], "read " << s << " for value " << i);
+    i++;
+  }
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(structure)
+{
+  JsonWriter json;
+  json.beginObject()
+    .key("name").value("status")
+    .key("count").value(42)
+    .key("flag").value(true)
+    .key("empty").beginArray().endArray()
+    .key("list").beginArray().value(1).value("two").beginObject().key("three").value(3u).endObject().endArray()
+    .key("missing").null()
+    .endObject();
+  BOOST_CHECK_EQUAL(json.str(),
+    "{\"name\":\"status\",\"count\":42,\"flag\":true,\"empty\":[],"
+    "\"list\":[1,\"two\",{\"three\":3}],\"missing\":null}");
+
+  ptree tree = parse(json);
+  BOOST_CHECK_EQUAL(tree.get<std::string>("name"), "status");
+  BOOST_CHECK_EQUAL(tree.get<int>("count"), 42);
+  BOOST_CHECK_EQUAL(tree.get<bool>("flag"), true);
+  BOOST_CHECK_EQUAL(tree.get_child("list").size(), 3u);
+
+  // buffer reused for next message
+  json.clear();
+  json.beginArray().value(1).endArray();
+  BOOST_CHECK_EQUAL(json.str(), "[1]");
+
+  // ptree written as write_json does (all values as strings)
+  JsonWriter fromTree;
+  fromTree.value(tree);
+  ptree tree2 = parse(fromTree);
+  BOOST_CHECK(tree2 == tree);
+}
+
+BOOST_AUTO_TEST_CASE(escaping)
+{
+  std::string s;
+  for (int c = 0; c < 0x20; c++) {
+    s.push_back((char)c);
+  }
+  s += "quote\" backslash\\ slash/ utf8 \xc3\xa9 end";
+
+  JsonWriter json;
+  json.beginObject().key(s).value(s).endObject();
+  const std::string &out = json.str();
+
+  // control characters as \u00XX, except those with a short escape
+  BOOST_CHECK(out.find("\\u0000") != std::string::npos);
+  BOOST_CHECK(out.find("\\u0001") != std::string::npos);
+  BOOST_CHECK(out.find("\\u001f") != std::string::npos);
+  BOOST_CHECK(out.find("\\n") != std::string::npos);
+  BOOST_CHECK(out.find("\\t") != std::string::npos);
+  BOOST_CHECK(out.find("\\\"") != std::string::npos);
+  BOOST_CHECK(out.find("\\\\") != std::string::npos);
+  for (char c : out) {
+    BOOST_CHECK((unsigned char)c >= 0x20);
+  }
+
+  // key and value read back unchanged
+  ptree tree = parse(json);
+  BOOST_REQUIRE_EQUAL(tree.size(), 1u);
+  BOOST_CHECK(tree.begin()->first == s);
+  BOOST_CHECK(tree.begin()->second.data() == s);
+}
+
+BOOST_AUTO_TEST_CASE(integers)
+{
+  JsonWriter json;
+  json.beginObject()
+    .key("min").value((long long)INT64_MIN)
+    .key("max").value((long long)INT64_MAX)
+    .key("umax").value((unsigned long long)UINT64_MAX)
+    .key("intMin").value((int)INT32_MIN)
+    .key("zero").value(0L)
+    .endObject();
+  BOOST_CHECK(json.str().find("-9223372036854775808") != std::string::npos);
+
+  ptree tree = parse(json);
+  BOOST_CHECK_EQUAL(tree.get<long long>("min"), INT64_MIN);
+  BOOST_CHECK_EQUAL(tree.get<long long>("max"), INT64_MAX);
+  BOOST_CHECK_EQUAL(tree.get<unsigned long long>("umax"), UINT64_MAX);
+  BOOST_CHECK_EQUAL(tree.get<int>("intMin"), INT32_MIN);
+  BOOST_CHECK_EQUAL(tree.get<int>("zero"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(doubles)
+{
+  // 15 digits enough for some, 17 needed for others (e.g. 0.1+0.2)
+  std::vector<double> values = {0.1, 0.5, -2.5, 1.0 / 3, 0.1 + 0.2, 123456.789, 1e-300, 1.7976931348623157e308,
+    std::numeric_limits<double>::denorm_min(), std::nextafter(1.0, 2.0), 3.0, -1e15, 9007199254740993.0, 1e20};
+  checkDoubles(values);
+
+  JsonWriter json;
+  json.value(0.1);
+  BOOST_CHECK_EQUAL(json.str(), "0.1");
+  json.clear();
+  json.value(0.1 + 0.2);
+  BOOST_CHECK_EQUAL(json.str(), "0.30000000000000004");
+  json.clear();
+  json.value(-3.0);
+  BOOST_CHECK_EQUAL(json.str(), "-3");
+
+  // not representable in JSON
+  json.clear();
+  json.beginObject()
+    .key("nan").value(std::nan(""))
+    .key("inf").value(std::numeric_limits<double>::infinity())
+    .key("minusInf").value(-std::numeric_limits<double>::infinity())
+    .endObject();
+  BOOST_CHECK_EQUAL(json.str(), "{\"nan\":null,\"inf\":null,\"minusInf\":null}");
+  ptree tree = parse(json);
+  BOOST_CHECK_EQUAL(tree.get<std::string>("nan"), "null");
+}
+
+BOOST_AUTO_TEST_CASE(doublesWithDecimalComma)
+{
+  // numbers written in C locale, even when current locale uses a decimal comma
+  const char *locales[] = {"de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "de_DE", "fr_FR"};
+  const char *found = nullptr;
+  for (const char *l : locales) {
+    if (setlocale(LC_NUMERIC, l) != nullptr) {
+      found = l;
+      break;
+    }
+  }
+  if (found == nullptr) {
+    BOOST_TEST_MESSAGE("no locale with decimal comma available, test skipped");
+    return;
+  }
+  BOOST_TEST_MESSAGE("using locale " << found);
+  checkDoubles({0.1, -2.5, 1.0 / 3, 0.1 + 0.2, 123456.789, 1e-300});
+  setlocale(LC_NUMERIC, "C");
+}
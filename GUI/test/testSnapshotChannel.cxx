@@ -0,0 +1,246 @@
+///
+/// \file testSnapshotChannel.cxx
+///
+
+#include "GUI/SnapshotChannel.h"
+
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <boost/property_tree/json_parser.hpp>
+
+#define BOOST_TEST_MODULE SnapshotChannel test
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using AliceO2::GUI::Publisher;
+using AliceO2::GUI::SnapshotChannel;
+using boost::property_tree::ptree;
+
+namespace
+{
+
+/// objects, by name, with their fields (values as read by boost::property_tree)
+typedef std::map<std::string, std::map<std::string, std::string>> State;
+
+/// A dashboard client, rebuilding channel state from snapshots and deltas
+class Client
+{
+  public:
+    zmq::socket_t socket;
+    State objects;
+    uint64_t sequence;
+    bool hasSnapshot;
+
+    Client(zmq::context_t &context, const std::string &url, const std::string &topic):
+      socket(context, ZMQ_SUB),
+      sequence(0),
+      hasSnapshot(false)
+    {
+      socket.setsockopt(ZMQ_SUBSCRIBE, topic.data(), topic.size());
+      socket.connect(url.c_str());
+    }
+
+    /// receives next message of the channel
+    /// \return 	false if nothing received within timeout
+    bool receive(ptree &message, long timeoutMs)
+    {
+      zmq::pollitem_t items[] = {{(void *)socket, 0, ZMQ_POLLIN, 0}};
+      if (zmq::poll(items, 1, timeoutMs) <= 0) {
+        return false;
+      }
+      zmq::message_t topic;
+      zmq::message_t body;
+      socket.recv(&topic);
+      BOOST_REQUIRE(topic.more());
+      socket.recv(&body);
+      std::istringstream s(std::string(static_cast<const char *>(body.data()), body.size()));
+      message.clear();
+      boost::property_tree::read_json(s, message);
+      return true;
+    }
+
+    /// applies a message to local state
+    /// \return 	false if message does not follow the previous one (a snapshot is then needed)
+    bool apply(const ptree &message)
+    {
+      uint64_t seq = message.get<uint64_t>("seq");
+      if (message.get<std::string>("type") == "snapshot") {
+        objects.clear();
+        for (const auto &object : message.get_child("objects")) {
+          std::map<std::string, std::string> &fields = objects[object.first];
+          for (const auto &field : object.second) {
+            fields[field.first] = field.second.data();
+          }
+        }
+        sequence = seq;
+        hasSnapshot = true;
+        return true;
+      }
+      if ((!hasSnapshot) || (seq != sequence + 1)) {
+        hasSnapshot = false;
+        return false;
+      }
+      // objects removed first, then fields changed
+      for (const auto &object : message.get_child("removed")) {
+        objects.erase(object.second.data());
+      }
+      for (const auto &object : message.get_child("changed")) {
+        std::map<std::string, std::string> &fields = objects[object.first];
+        for (const auto &field : object.second) {
+          fields[field.first] = field.second.data();
+        }
+      }
+      sequence = seq;
+      return true;
+    }
+
+    /// gets a snapshot: requested from channel and published at once
+    void synchronize(SnapshotChannel &channel)
+    {
+      channel.requestSnapshot();
+      channel.publish();
+      ptree message;
+      while (receive(message, 1000)) {
+        if ((message.get<std::string>("type") == "snapshot") && (message.get<uint64_t>("seq") == channel.getSequence())) {
+          apply(message);
+          return;
+        }
+      }
+      BOOST_FAIL("no snapshot received");
+    }
+};
+
+/// a channel publishes on its own endpoint
+std::string endpoint(const std::string &name)
+{
+  return "ipc:///tmp/" + name + "." + std::to_string(getpid());
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(deltas)
+{
+  const std::string url = endpoint("testSnapshotChannel");
+  const int snapshotInterval = 4;
+  Publisher publisher(url);
+  zmq::context_t context(1);
+  Client client(context, url, "states");
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  // low rate: messages sent only by publish() calls of the test
+  SnapshotChannel channel(publisher, "states", 0.1, snapshotInterval);
+  State model;
+  for (int i = 0; i < 5; i++) {
+    std::string object = "/mod" + std::to_string(i);
+    channel.set(object, "state", "STANDBY");
+    model[object]["state"] = "STANDBY";
+  }
+  client.synchronize(channel);
+  BOOST_CHECK(client.objects == model);
+
+  // nothing changed: nothing sent
+  uint64_t sequence = channel.getSequence();
+  channel.set("/mod0", "state", "STANDBY");
+  channel.publish();
+  BOOST_CHECK_EQUAL(channel.getSequence(), sequence);
+  ptree message;
+  BOOST_CHECK(!client.receive(message, 200));
+
+  int deltasSinceSnapshot = 0;
+  for (int round = 0; round < 16; round++) {
+    for (int i = 0; i < 4; i++) {
+      std::string object = "/mod" + std::to_string(i);
+      channel.set(object, "events", round * 10 + i);
+      model[object]["events"] = std::to_string(round * 10 + i);
+    }
+    // removed and set again in the same period: fields set before removal must not come back
+    std::string recreated = "/mod" + std::to_string(round % 3);
+    channel.set(recreated, "old", "value");
+    channel.remove(recreated);
+    model.erase(recreated);
+    channel.set(recreated, "state", "RECREATED" + std::to_string(round));
+    model[recreated]["state"] = "RECREATED" + std::to_string(round);
+    // removed for good, and created
+    if (round == 5) {
+      channel.remove("/mod4");
+      model.erase("/mod4");
+    }
+    if (round == 6) {
+      channel.set("/new", "ratio", 0.5);
+      model["/new"]["ratio"] = "0.5";
+    }
+    channel.publish();
+
+    BOOST_REQUIRE(client.receive(message, 1000));
+    uint64_t seq = message.get<uint64_t>("seq");
+    BOOST_CHECK_EQUAL(seq, sequence + 1);
+    BOOST_CHECK_EQUAL(seq, channel.getSequence());
+    sequence = seq;
+
+    // a snapshot every snapshotInterval messages
+    std::string type = message.get<std::string>("type");
+    if (deltasSinceSnapshot + 1 >= snapshotInterval) {
+      BOOST_CHECK_EQUAL(type, "snapshot");
+      deltasSinceSnapshot = 0;
+    } else {
+      BOOST_CHECK_EQUAL(type, "delta");
+      deltasSinceSnapshot++;
+    }
+
+    // message lost: next delta does not apply, client requests a snapshot
+    if (round == 9) {
+      BOOST_CHECK_EQUAL(type, "delta");
+      continue;
+    }
+    if (!client.apply(message)) {
+      BOOST_CHECK_EQUAL(round, 10);
+      client.synchronize(channel);
+      sequence = channel.getSequence();
+      deltasSinceSnapshot = 0;
+    }
+    BOOST_CHECK_MESSAGE(client.objects == model, "state differs after message " << seq);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(snapshotRateLimit)
+{
+  const std::string url = endpoint("testSnapshotChannelRate");
+  Publisher publisher(url);
+  zmq::context_t context(1);
+  Client client(context, url, "states");
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  // 5 messages per second
+  SnapshotChannel channel(publisher, "states", 5, 100);
+  channel.set("/mod0", "state", "RUNNING");
+  ptree message;
+  while (client.receive(message, 500)) {
+  }
+
+  // idle channel: request served at once
+  auto start = std::chrono::steady_clock::now();
+  channel.requestSnapshot();
+  BOOST_REQUIRE(client.receive(message, 1000));
+  auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  BOOST_CHECK_EQUAL(message.get<std::string>("type"), "snapshot");
+  BOOST_CHECK_LT(delay.count(), 100);
+
+  // requests flood: not more messages than the channel rate
+  int nMessages = 0;
+  start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+    channel.requestSnapshot();
+    if (client.receive(message, 10)) {
+      BOOST_CHECK_EQUAL(message.get<std::string>("type"), "snapshot");
+      nMessages++;
+    }
+  }
+  BOOST_TEST_MESSAGE(nMessages << " snapshots in 1 second");
+  BOOST_CHECK_GE(nMessages, 3);
+  BOOST_CHECK_LE(nMessages, 6);
+}